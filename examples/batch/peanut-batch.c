@@ -0,0 +1,807 @@
+/**
+ * MIT License
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Runs a large number of independent Peanut-GB sessions in parallel.
+ * Each session is advanced frame by frame on a pool of worker threads.
+ * Every worker owns a queue of sessions, and steals sessions from the
+ * queues of other workers once its own queue is empty. The aggregate number
+ * of frames per second of all sessions is printed at the end.
+ *
+ * Sessions may also replay input movies recorded with peanut_movie.h, so that
+ * many recordings are checked against their frame hashes in parallel.
+ */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* Required for pthread_setaffinity_np(). */
+# define _GNU_SOURCE
+#endif
+#ifndef _POSIX_C_SOURCE
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+/* The LCD is only used to check the hashed frames of movies, which are the
+ * only frames that are drawn. Sessions without a movie do not draw at all.
+ * Disable it to remove support for movies. */
+#ifndef ENABLE_LCD
+# define ENABLE_LCD 1
+#endif
+
+/* Sound is disabled for this project. */
+#ifndef ENABLE_SOUND
+# define ENABLE_SOUND 0
+#endif
+
+/* Import emulator library. */
+#include "../../peanut_gb.h"
+#include "../../peanut_rom.h"
+#include "../../peanut_movie.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Size of a cache line on most hosts. Each session and queue is aligned to
+ * this so that workers never write to the same cache line. */
+#define CACHE_LINE_SIZE		64
+#define CACHE_LINE_ROUND(x)	\
+	((((x) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE) * CACHE_LINE_SIZE)
+
+/* Game ROM shared read-only by all sessions that play it. The ROM is mapped
+ * into memory, so it is also shared with other processes playing it. */
+struct rom_s
+{
+	const char *file_name;
+	struct peanut_rom_s rom;
+
+	/* Movie replayed by every session playing the ROM, or NULL. */
+	const char *movie_file;
+};
+
+struct session_s
+{
+	struct gb_s gb;
+
+	const struct rom_s *rom;
+	uint8_t *cart_ram;
+	size_t save_size;
+
+	/* Set by gb_error(). The session is no longer run. */
+	bool failed;
+	enum gb_error_e error;
+	uint16_t error_addr;
+
+	/* Set whilst the session is run, for gb_error() to return to. */
+	jmp_buf error_jmp;
+
+	/* Movie replayed by the session, if has_movie is set. The session
+	 * finishes at the end of the movie, or at the first frame that does
+	 * not match it. */
+	struct peanut_movie_s movie;
+	bool has_movie;
+	bool finished;
+};
+
+/* Queue of indexes of sessions that remain to be run in the current epoch.
+ * The owning worker takes from the bottom, whilst other workers steal from
+ * the top. */
+struct queue_s
+{
+	pthread_mutex_t lock;
+	unsigned int *items;
+	unsigned int top;
+	unsigned int bottom;
+};
+
+struct worker_s
+{
+	struct pool_s *pool;
+	pthread_t thread;
+	unsigned int id;
+
+	/* Sessions that this worker allocated. These are queued to this worker
+	 * at the start of every epoch. */
+	unsigned int first_session;
+	unsigned int num_sessions;
+
+	/* Statistics. */
+	unsigned long long frames_run;
+	unsigned long long stolen;
+
+	/* Set if initialising the sessions of this worker failed. */
+	bool init_failed;
+};
+
+struct pool_s
+{
+	struct session_s **sessions;
+	unsigned int num_sessions;
+	const struct rom_s *roms;
+	unsigned int num_roms;
+
+	/* Number of frames each session is run for in each epoch. */
+	unsigned int frames_per_epoch;
+	bool pin_threads;
+
+	struct worker_s *workers;
+	struct queue_s *queues;
+	size_t queue_stride;
+	unsigned int num_workers;
+
+	/* Workers wait for the generation to change before starting an epoch,
+	 * and the main thread waits for running to reach zero. */
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	unsigned int generation;
+	unsigned int running;
+	bool quit;
+};
+
+/**
+ * Returns a byte from the ROM file at the given address.
+ */
+static uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct session_s * const s = gb->direct.priv;
+	return s->rom->rom.data[addr];
+}
+
+/**
+ * Returns a byte from the cartridge RAM at the given address.
+ */
+static uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct session_s * const s = gb->direct.priv;
+	return s->cart_ram[addr];
+}
+
+/**
+ * Writes a given byte to the cartridge RAM at the given address.
+ */
+static void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		const uint8_t val)
+{
+	const struct session_s * const s = gb->direct.priv;
+	s->cart_ram[addr] = val;
+}
+
+/**
+ * Records the error of a session, so that it is no longer run, and returns to
+ * run_session(). Peanut-GB does not continue after calling gb_error(), so this
+ * function must not return. Other sessions are unaffected.
+ */
+static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err,
+		const uint16_t addr)
+{
+	struct session_s *s = gb->direct.priv;
+
+	s->failed = true;
+	s->error = gb_err;
+	s->error_addr = addr;
+	longjmp(s->error_jmp, 1);
+}
+
+#if ENABLE_LCD
+/**
+ * Adds each line drawn to the hash of the movie frame being checked.
+ */
+static void lcd_draw_line(struct gb_s *gb, const uint8_t *pixels,
+		const uint_fast8_t line)
+{
+	struct session_s *s = gb->direct.priv;
+	peanut_movie_hash_line(&s->movie, pixels, line);
+}
+#endif
+
+static double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static struct queue_s *get_queue(struct pool_s *pool, unsigned int worker)
+{
+	return (struct queue_s *)((uint8_t *)pool->queues +
+			worker * pool->queue_stride);
+}
+
+/**
+ * Takes a session from the bottom of the queue of the given worker.
+ * Returns -1 if the queue is empty.
+ */
+static int queue_pop(struct queue_s *q)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&q->lock);
+	if(q->bottom > q->top)
+		ret = (int)q->items[--q->bottom];
+	pthread_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+/**
+ * Takes a session from the top of the queue of another worker.
+ * Returns -1 if the queue is empty.
+ */
+static int queue_steal(struct queue_s *q)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&q->lock);
+	if(q->bottom > q->top)
+		ret = (int)q->items[q->top++];
+	pthread_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+/**
+ * Allocates and initialises the sessions owned by a worker. This is done on
+ * the worker thread so that the memory of each session is first touched, and
+ * therefore allocated by the operating system, on the NUMA node of the worker
+ * that mostly runs it.
+ */
+static int init_sessions(struct worker_s *w)
+{
+	struct pool_s *pool = w->pool;
+
+	for(unsigned int i = w->first_session;
+			i < w->first_session + w->num_sessions; i++)
+	{
+		struct session_s *s;
+		void *mem;
+		enum gb_init_error_e ret;
+
+		if(posix_memalign(&mem, CACHE_LINE_SIZE,
+				CACHE_LINE_ROUND(sizeof(struct session_s))) != 0)
+			return -1;
+
+		s = mem;
+		memset(s, 0, sizeof(*s));
+		s->rom = &pool->roms[i % pool->num_roms];
+		pool->sessions[i] = s;
+
+		ret = gb_init(&s->gb, &gb_rom_read, &gb_cart_ram_read,
+				&gb_cart_ram_write, &gb_error, s);
+		if(ret != GB_INIT_NO_ERROR)
+		{
+			fprintf(stderr, "%s: Peanut-GB failed to initialise: %d\n",
+					s->rom->file_name, ret);
+			return -1;
+		}
+
+		if(gb_get_save_size_s(&s->gb, &s->save_size) != 0)
+			s->save_size = 0;
+
+		if(s->save_size > 0)
+		{
+			if(posix_memalign(&mem, CACHE_LINE_SIZE,
+					CACHE_LINE_ROUND(s->save_size)) != 0)
+				return -1;
+
+			s->cart_ram = mem;
+			memset(s->cart_ram, 0xFF, s->save_size);
+		}
+
+		peanut_rom_attach(&s->rom->rom, &s->gb, s->cart_ram,
+				s->save_size);
+
+#if ENABLE_LCD
+		if(s->rom->movie_file == NULL)
+			continue;
+
+		if(peanut_movie_load(&s->movie, &s->gb,
+				s->rom->movie_file) != 0)
+		{
+			fprintf(stderr, "%s: unable to load movie %s\n",
+					s->rom->file_name, s->rom->movie_file);
+			return -1;
+		}
+
+		/* Only the frames that are checked are drawn. */
+		s->has_movie = true;
+		gb_init_lcd(&s->gb, lcd_draw_line);
+		gb_set_render_policy(&s->gb, 0);
+#endif
+	}
+
+	return 0;
+}
+
+static void pin_thread(unsigned int id)
+{
+#if defined(__linux__)
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+
+	if(cpus <= 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(id % (unsigned long)cpus, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void) id;
+#endif
+}
+
+/**
+ * Runs a session for the frames of one epoch, or until it fails or finishes
+ * its movie.
+ */
+static void run_session(struct worker_s *w, struct session_s *s)
+{
+	const unsigned int frames = w->pool->frames_per_epoch;
+
+	/* Emulation of the session is abandoned if gb_error() is called. */
+	if(setjmp(s->error_jmp) != 0)
+		return;
+
+	for(unsigned int f = 0; f < frames; f++)
+	{
+		int ret = 0;
+
+		if(s->has_movie)
+			ret = peanut_movie_play_frame(&s->movie, &s->gb);
+		else
+			gb_run_frame(&s->gb);
+
+		/* The movie has ended, and no frame was run. */
+		if(ret > 0)
+		{
+			s->finished = true;
+			return;
+		}
+
+		w->frames_run++;
+
+		/* The frame did not match the movie. */
+		if(ret < 0)
+		{
+			s->finished = true;
+			return;
+		}
+	}
+}
+
+/**
+ * Runs the sessions of one epoch, first from the queue of this worker and
+ * then by stealing from other workers.
+ */
+static void run_epoch(struct worker_s *w)
+{
+	struct pool_s *pool = w->pool;
+	struct queue_s *own = get_queue(pool, w->id);
+
+	/* Queue the sessions owned by this worker. */
+	pthread_mutex_lock(&own->lock);
+	own->top = 0;
+	own->bottom = 0;
+	for(unsigned int i = 0; i < w->num_sessions; i++)
+	{
+		unsigned int idx = w->first_session + i;
+
+		if(!pool->sessions[idx]->failed &&
+				!pool->sessions[idx]->finished)
+			own->items[own->bottom++] = idx;
+	}
+	pthread_mutex_unlock(&own->lock);
+
+	for(;;)
+	{
+		int idx = queue_pop(own);
+
+		if(idx < 0)
+		{
+			/* Steal from the other workers in turn. */
+			for(unsigned int v = 1; v < pool->num_workers; v++)
+			{
+				unsigned int victim =
+					(w->id + v) % pool->num_workers;
+
+				idx = queue_steal(get_queue(pool, victim));
+				if(idx >= 0)
+				{
+					w->stolen++;
+					break;
+				}
+			}
+		}
+
+		/* Sessions are not queued again during an epoch, so once every
+		 * queue is empty this worker has nothing left to do. */
+		if(idx < 0)
+			break;
+
+		run_session(w, pool->sessions[idx]);
+	}
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker_s *w = arg;
+	struct pool_s *pool = w->pool;
+	unsigned int generation = 0;
+
+	if(pool->pin_threads)
+		pin_thread(w->id);
+
+	w->init_failed = (init_sessions(w) != 0);
+
+	for(;;)
+	{
+		pthread_mutex_lock(&pool->lock);
+		if(--pool->running == 0)
+			pthread_cond_signal(&pool->done_cond);
+
+		while(pool->generation == generation && !pool->quit)
+			pthread_cond_wait(&pool->start_cond, &pool->lock);
+
+		generation = pool->generation;
+		if(pool->quit)
+		{
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		run_epoch(w);
+	}
+
+	return NULL;
+}
+
+/**
+ * Starts an epoch on all workers if start is true, and waits for all workers
+ * to finish.
+ */
+static void pool_sync(struct pool_s *pool, bool start)
+{
+	pthread_mutex_lock(&pool->lock);
+
+	if(start)
+	{
+		pool->running = pool->num_workers;
+		pool->generation++;
+		pthread_cond_broadcast(&pool->start_cond);
+	}
+
+	while(pool->running != 0)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Returns true if no session remains to be run.
+ */
+static bool pool_done(const struct pool_s *pool)
+{
+	for(unsigned int i = 0; i < pool->num_sessions; i++)
+	{
+		const struct session_s *s = pool->sessions[i];
+
+		if(!s->failed && !s->finished)
+			return false;
+	}
+
+	return true;
+}
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-j THREADS] [-n SESSIONS] [-f FRAMES] [-e FRAMES]"
+		" [-m MOVIE]... [-p] ROM...\n"
+		"  -j  Number of worker threads (default: online CPUs)\n"
+		"  -n  Number of sessions (default: 4 per thread)\n"
+		"  -f  Frames to run each session for (default: 3600, or\n"
+		"      until the end of each movie if every ROM has one)\n"
+		"  -e  Frames to run each session for between\n"
+		"      synchronisation points, or 0 to run every frame\n"
+		"      without synchronising (default: 0)\n"
+		"  -m  Movie to replay and check, given once for each ROM\n"
+		"      in order\n"
+		"  -p  Pin each worker thread to a CPU\n"
+		"Sessions are assigned the given ROMs in turn.\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct pool_s pool;
+	struct rom_s *roms;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	long sessions = 0;
+	long frames = -1;
+	long epoch_frames = 0;
+	const char **movies;
+	unsigned int num_movies = 0;
+	unsigned int failed = 0, matched = 0;
+	double start, duration;
+	unsigned long long total_frames = 0;
+	int opt;
+	int ret = EXIT_SUCCESS;
+
+	memset(&pool, 0, sizeof(pool));
+
+	/* There cannot be more movies than arguments. */
+	movies = calloc(argc, sizeof(*movies));
+	if(movies == NULL)
+	{
+		printf("%d: %s\n", __LINE__, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	while((opt = getopt(argc, argv, "j:n:f:e:m:ph")) != -1)
+	{
+		switch(opt)
+		{
+		case 'j':
+			threads = strtol(optarg, NULL, 10);
+			break;
+
+		case 'n':
+			sessions = strtol(optarg, NULL, 10);
+			break;
+
+		case 'f':
+			frames = strtol(optarg, NULL, 10);
+			break;
+
+		case 'e':
+			epoch_frames = strtol(optarg, NULL, 10);
+			break;
+
+		case 'm':
+#if ENABLE_LCD
+			movies[num_movies++] = optarg;
+			break;
+#else
+			fprintf(stderr, "Movies require ENABLE_LCD\n");
+			exit(EXIT_FAILURE);
+#endif
+
+		case 'p':
+			pool.pin_threads = true;
+			break;
+
+		default:
+			print_usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(optind >= argc || threads <= 0 || frames == 0 || frames < -1 ||
+			epoch_frames < 0 || sessions < 0 ||
+			num_movies > (unsigned int)(argc - optind))
+	{
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Sessions replaying movies finish on their own. */
+	if(frames < 0)
+		frames = num_movies == (unsigned int)(argc - optind) ?
+			LONG_MAX : 3600;
+
+	/* Without synchronisation points, the whole run is a single epoch, so
+	 * that workers only wait for each other once every session is done. */
+	if(epoch_frames == 0 || epoch_frames > frames)
+		epoch_frames = frames;
+
+	if(epoch_frames > UINT_MAX)
+		epoch_frames = UINT_MAX;
+
+	if(sessions == 0)
+		sessions = threads * 4;
+
+	/* There is no point having more workers than sessions. */
+	if(threads > sessions)
+		threads = sessions;
+
+	/* Open each ROM once; sessions playing the same ROM share it. */
+	pool.num_roms = argc - optind;
+	roms = calloc(pool.num_roms, sizeof(*roms));
+	if(roms == NULL)
+	{
+		printf("%d: %s\n", __LINE__, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for(unsigned int i = 0; i < pool.num_roms; i++)
+	{
+		enum peanut_rom_error_e rom_ret;
+
+		roms[i].file_name = argv[optind + i];
+		roms[i].movie_file = i < num_movies ? movies[i] : NULL;
+		rom_ret = peanut_rom_open(&roms[i].rom, roms[i].file_name);
+		if(rom_ret != PEANUT_ROM_NO_ERROR)
+		{
+			fprintf(stderr, "%s: unable to open ROM: %d\n",
+					roms[i].file_name, rom_ret);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pool.roms = roms;
+	pool.num_sessions = (unsigned int)sessions;
+	pool.num_workers = (unsigned int)threads;
+	pool.frames_per_epoch = (unsigned int)epoch_frames;
+	pool.sessions = calloc(pool.num_sessions, sizeof(*pool.sessions));
+	pool.workers = calloc(pool.num_workers, sizeof(*pool.workers));
+	pool.queue_stride = CACHE_LINE_ROUND(sizeof(struct queue_s));
+	if(pool.sessions == NULL || pool.workers == NULL ||
+		posix_memalign((void **)&pool.queues, CACHE_LINE_SIZE,
+				pool.queue_stride * pool.num_workers) != 0)
+	{
+		printf("%d: %s\n", __LINE__, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.start_cond, NULL);
+	pthread_cond_init(&pool.done_cond, NULL);
+	pool.running = pool.num_workers;
+
+	/* Give each worker a contiguous range of sessions. */
+	for(unsigned int i = 0; i < pool.num_workers; i++)
+	{
+		struct worker_s *w = &pool.workers[i];
+		struct queue_s *q = get_queue(&pool, i);
+		unsigned int first = (unsigned int)
+			((unsigned long long)pool.num_sessions * i /
+			pool.num_workers);
+		unsigned int end = (unsigned int)
+			((unsigned long long)pool.num_sessions * (i + 1) /
+			pool.num_workers);
+
+		w->pool = &pool;
+		w->id = i;
+		w->first_session = first;
+		w->num_sessions = end - first;
+
+		pthread_mutex_init(&q->lock, NULL);
+		q->items = malloc(w->num_sessions * sizeof(*q->items));
+		q->top = q->bottom = 0;
+		if(q->items == NULL)
+		{
+			printf("%d: %s\n", __LINE__, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for(unsigned int i = 0; i < pool.num_workers; i++)
+	{
+		if(pthread_create(&pool.workers[i].thread, NULL,
+				worker_thread, &pool.workers[i]) != 0)
+		{
+			fprintf(stderr, "Unable to create worker thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Wait for all sessions to be initialised. */
+	pool_sync(&pool, false);
+	for(unsigned int i = 0; i < pool.num_workers; i++)
+	{
+		if(pool.workers[i].init_failed)
+		{
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+	}
+
+	if(frames == LONG_MAX)
+		printf("Running %u sessions of %u ROM(s) until their movies "
+				"end on %u threads\n", pool.num_sessions,
+				pool.num_roms, pool.num_workers);
+	else
+		printf("Running %u sessions of %u ROM(s) for %ld frames on %u "
+				"threads\n", pool.num_sessions, pool.num_roms,
+				frames, pool.num_workers);
+
+	start = get_time();
+	for(long f = 0; f < frames && !pool_done(&pool); f += epoch_frames)
+	{
+		/* The last epoch may be shorter. */
+		if(frames - f < epoch_frames)
+			pool.frames_per_epoch = (unsigned int)(frames - f);
+
+		pool_sync(&pool, true);
+	}
+	duration = get_time() - start;
+
+	for(unsigned int i = 0; i < pool.num_workers; i++)
+	{
+		const struct worker_s *w = &pool.workers[i];
+
+		printf("Thread %u: %llu frames, %llu sessions stolen\n",
+				i, w->frames_run, w->stolen);
+		total_frames += w->frames_run;
+	}
+
+	for(unsigned int i = 0; i < pool.num_sessions; i++)
+	{
+		const struct session_s *s = pool.sessions[i];
+
+		if(s->failed)
+		{
+			fprintf(stderr, "Session %u (%s): error %d at %04X\n",
+					i, s->rom->file_name, s->error,
+					s->error_addr);
+			failed++;
+		}
+		else if(s->has_movie &&
+				s->movie.mismatch_frame != UINT32_MAX)
+		{
+			fprintf(stderr, "Session %u (%s): frame %lu does not "
+					"match %s\n", i, s->rom->file_name,
+					(unsigned long)s->movie.mismatch_frame,
+					s->rom->movie_file);
+			failed++;
+		}
+		else if(s->has_movie && s->finished)
+			matched++;
+	}
+
+	printf("%llu frames in %f seconds: %f FPS (%f FPS per session)\n",
+			total_frames, duration, total_frames / duration,
+			total_frames / duration / pool.num_sessions);
+
+	if(num_movies != 0)
+		printf("%u sessions matched their movies to the end\n",
+				matched);
+
+	if(failed != 0)
+	{
+		printf("%u sessions failed\n", failed);
+		ret = EXIT_FAILURE;
+	}
+
+out:
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = true;
+	pthread_cond_broadcast(&pool.start_cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	for(unsigned int i = 0; i < pool.num_workers; i++)
+	{
+		pthread_join(pool.workers[i].thread, NULL);
+		free(get_queue(&pool, i)->items);
+	}
+
+	for(unsigned int i = 0; i < pool.num_sessions; i++)
+	{
+		if(pool.sessions[i] == NULL)
+			continue;
+
+		if(pool.sessions[i]->has_movie)
+			peanut_movie_free(&pool.sessions[i]->movie);
+
+		free(pool.sessions[i]->cart_ram);
+		free(pool.sessions[i]);
+	}
+
+	for(unsigned int i = 0; i < pool.num_roms; i++)
+		peanut_rom_close(&roms[i].rom);
+
+	free(roms);
+	free(movies);
+	free(pool.queues);
+	free(pool.workers);
+	free(pool.sessions);
+
+	return ret;
+}
@@ -0,0 +1,850 @@
+/**
+ * MIT License
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Benchmark suite for Peanut-GB.
+ * Runs a fixed set of workloads, being the test ROMs embedded in the test
+ * folder and any ROMs given on the command line, in a number of
+ * configurations. Each workload is warmed up, then the time taken by every
+ * frame is measured with a monotonic clock. The median, 99th percentile and
+ * mean frame times are printed, and optionally written as JSON so that
+ * results can be compared between commits.
+ *
+ * With --lockstep, many contexts of each workload are also run with the LCD
+ * off, both one by one with gb_run_frame() and with peanut_lockstep.h, for
+ * inputs that are the same, sometimes differ, or always differ between the
+ * contexts.
+ */
+#ifndef _POSIX_C_SOURCE
+/* Required for clock_gettime(). */
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#ifndef ENABLE_LCD
+# define ENABLE_LCD 1
+#endif
+
+/* Sound is disabled for this project. */
+#ifndef ENABLE_SOUND
+# define ENABLE_SOUND 0
+#endif
+
+/* Import emulator library. */
+#include "../../peanut_gb.h"
+#include "../../peanut_rom.h"
+#include "../../peanut_lockstep.h"
+#include "../../version.all"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Test ROMs used as the fixed workloads. */
+#include "../../test/cpu_instrs.h"
+#include "../../test/instr_timing.h"
+#include "../../test/dmg-acid2.gb.h"
+
+#define DEFAULT_FRAMES	3000
+#define DEFAULT_WARMUP	300
+/* Frames between merges of lockstep contexts. */
+#define LOCKSTEP_MERGE_INTERVAL	60
+
+struct workload_s
+{
+	const char *name;
+	const uint8_t *rom;
+	size_t rom_size;
+};
+
+/* Options that may be set at run time for each workload. */
+struct config_s
+{
+	const char *name;
+	bool lcd;
+	bool interlace;
+	bool frame_skip;
+	/* Passed to gb_set_render_policy(). */
+	uint8_t render_every;
+	/* Run each frame with gb_run_cycles() instead of gb_run_frame(). */
+	bool run_cycles;
+	/* Read ROM and cart RAM with the callbacks instead of
+	 * gb_init_rom_direct(). */
+	bool rom_callback;
+};
+
+struct result_s
+{
+	const char *workload;
+	const char *config;
+	unsigned long frames;
+	double total_s;
+	double fps;
+	double mean_us;
+	double median_us;
+	double p99_us;
+	double min_us;
+	double max_us;
+};
+
+/* Mean times per frame measured for --breakdown. The emulator is not timed
+ * internally, so the CPU, timers and LCD are not measured apart. */
+struct breakdown_s
+{
+	const char *workload;
+	/* Whole frames, with the LCD disabled and enabled. */
+	double lcd_off_us;
+	double lcd_on_us;
+	/* Time spent in the front-end's lcd_draw_line(). */
+	double draw_us;
+};
+
+/* How the joypad input of lockstep contexts differs between contexts. */
+enum lockstep_input_e
+{
+	/* Every context is given the same input. */
+	LOCKSTEP_INPUT_SAME = 0,
+	/* Each context is given its own input on about one frame in 64. */
+	LOCKSTEP_INPUT_SOMETIMES,
+	/* Each context is given its own input on every frame. */
+	LOCKSTEP_INPUT_ALWAYS,
+
+	LOCKSTEP_INPUT_MAX
+};
+
+struct priv_t
+{
+	const uint8_t *rom;
+	uint8_t *cart_ram;
+
+	/* Time spent in lcd_draw_line() when it is timed. */
+	bool time_draw;
+	uint64_t draw_ns;
+
+	/* Frame buffer */
+	uint16_t fb[LCD_HEIGHT][LCD_WIDTH];
+};
+
+static const struct config_s configs[] = {
+	{ "lcd_off",		false,	false,	false,	1,	false,	false },
+	{ "lcd_off_callback",	false,	false,	false,	1,	false,	true },
+	{ "lcd",		true,	false,	false,	1,	false,	false },
+	{ "lcd_interlace",	true,	true,	false,	1,	false,	false },
+	{ "lcd_frame_skip",	true,	false,	true,	1,	false,	false },
+	{ "lcd_every_8",	true,	false,	false,	8,	false,	false },
+	{ "lcd_run_cycles",	true,	false,	false,	1,	true,	false }
+};
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Returns a byte from the ROM file at the given address.
+ */
+static uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->rom[addr];
+}
+
+/**
+ * Returns a byte from the cartridge RAM at the given address.
+ */
+static uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->cart_ram[addr];
+}
+
+/**
+ * Writes a given byte to the cartridge RAM at the given address.
+ */
+static void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		const uint8_t val)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	p->cart_ram[addr] = val;
+}
+
+/**
+ * Prints the error and exits. The workloads are not expected to cause errors,
+ * and Peanut-GB does not continue after calling gb_error(), so this function
+ * must not return.
+ */
+static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err,
+		const uint16_t addr)
+{
+	const char* gb_err_str[GB_INVALID_MAX] = {
+		"UNKNOWN",
+		"INVALID OPCODE",
+		"INVALID READ",
+		"INVALID WRITE",
+		"HALT FOREVER"
+	};
+
+	(void) gb;
+	fprintf(stderr, "Error %d occurred: %s at %04X\n. Exiting.\n",
+			gb_err, gb_err_str[gb_err], addr);
+	exit(EXIT_FAILURE);
+}
+
+#if ENABLE_LCD
+/**
+ * Draws scanline into framebuffer.
+ */
+static void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[160],
+		const uint_fast8_t line)
+{
+	struct priv_t *priv = gb->direct.priv;
+	const uint16_t palette[] = { 0x7FFF, 0x5294, 0x294A, 0x0000 };
+	uint64_t start = 0;
+
+	if(priv->time_draw)
+		start = get_time_ns();
+
+	for(unsigned int x = 0; x < LCD_WIDTH; x++)
+		priv->fb[line][x] = palette[pixels[x] & 3];
+
+	if(priv->time_draw)
+		priv->draw_ns += get_time_ns() - start;
+}
+#endif
+
+static int compare_u64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Prints the most executed opcodes, memory accesses by region, and other
+ * counters collected by the emulator when PEANUT_GB_PROFILE is enabled.
+ */
+static void print_profile(FILE *table, const struct gb_profile_s *p,
+		unsigned long frames)
+{
+	unsigned int top[8] = { 0 };
+	uint64_t instr = 0;
+
+	if(p == NULL)
+		return;
+
+	/* Selection of the most executed opcodes. */
+	for(unsigned int i = 0; i < 8; i++)
+	{
+		for(unsigned int op = 0; op < 0x100; op++)
+		{
+			bool used = false;
+
+			for(unsigned int j = 0; j < i; j++)
+				used |= (top[j] == op);
+
+			if(!used && (top[i] == op ||
+					p->opcode[op] > p->opcode[top[i]]))
+				top[i] = op;
+		}
+	}
+
+	for(unsigned int op = 0; op < 0x100; op++)
+		instr += p->opcode[op];
+
+	fprintf(table, "  Profile: %.0f instructions/frame, halted %.1f%%, "
+			"%.0f idle loop iterations/frame skipped, "
+			"%.2f OAM DMA/frame, lines drawn %llu skipped %llu\n",
+			(double)instr / frames,
+			p->cycles ? 100.0 * p->halt_cycles / p->cycles : 0.0,
+			(double)p->idle_iterations / frames,
+			(double)p->oam_dma / frames,
+			(unsigned long long)p->lines_drawn,
+			(unsigned long long)p->lines_skipped);
+
+	fprintf(table, "  Top opcodes:");
+	for(unsigned int i = 0; i < 8; i++)
+	{
+		fprintf(table, " %02X %.1f%%", top[i],
+				instr ? 100.0 * p->opcode[top[i]] / instr : 0.0);
+	}
+	fprintf(table, "\n");
+
+	fprintf(table, "  Reads/writes per frame:");
+	for(unsigned int r = 0; r < GB_PROFILE_REGION_MAX; r++)
+	{
+		fprintf(table, " %s %.0f/%.0f", gb_profile_region_name(r),
+				(double)p->read[r] / frames,
+				(double)p->write[r] / frames);
+	}
+	fprintf(table, "\n");
+}
+
+/**
+ * Plays a workload in the given configuration, and measures each frame.
+ *
+ * \param frame_ns	Buffer of frames entries that receives the time of each
+ *			frame in nanoseconds, sorted.
+ * \param draw_ns	If not NULL, lcd_draw_line() is timed and the total time
+ *			spent in it is written here. The profiling counters of
+ *			the measured frames are then also printed to table if
+ *			PEANUT_GB_PROFILE is enabled.
+ * \returns	0 on success.
+ */
+static int run_workload(const struct workload_s *w, const struct config_s *c,
+		unsigned long frames, unsigned long warmup, uint64_t *frame_ns,
+		uint64_t *draw_ns, struct result_s *res, FILE *table)
+{
+	struct gb_s gb;
+	struct priv_t *priv;
+	enum gb_init_error_e ret;
+	size_t save_size;
+	uint64_t total = 0;
+
+	priv = calloc(1, sizeof(*priv));
+	if(priv == NULL)
+		return -1;
+
+	priv->rom = w->rom;
+	ret = gb_init(&gb, &gb_rom_read, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, priv);
+	if(ret != GB_INIT_NO_ERROR)
+	{
+		fprintf(stderr, "%s: Peanut-GB failed to initialise: %d\n",
+				w->name, ret);
+		free(priv);
+		return -1;
+	}
+
+	if(gb_get_save_size_s(&gb, &save_size) != 0)
+		save_size = 0;
+
+	priv->cart_ram = calloc(1, save_size + 1);
+	if(priv->cart_ram == NULL)
+	{
+		free(priv);
+		return -1;
+	}
+
+	if(!c->rom_callback)
+		gb_init_rom_direct(&gb, w->rom, w->rom_size, priv->cart_ram,
+				save_size);
+
+#if ENABLE_LCD
+	if(c->lcd)
+		gb_init_lcd(&gb, &lcd_draw_line);
+
+	gb.direct.interlace = c->interlace;
+	gb.direct.frame_skip = c->frame_skip;
+	gb_set_render_policy(&gb, c->render_every);
+#endif
+
+	for(unsigned long i = 0; i < warmup; i++)
+		gb_run_frame(&gb);
+
+	priv->time_draw = (draw_ns != NULL);
+	gb_reset_profile(&gb);
+	for(unsigned long i = 0; i < frames; i++)
+	{
+		uint64_t start = get_time_ns();
+		if(c->run_cycles)
+			gb_run_cycles(&gb, LCD_FRAME_CYCLES);
+		else
+			gb_run_frame(&gb);
+		frame_ns[i] = get_time_ns() - start;
+		total += frame_ns[i];
+	}
+
+	if(draw_ns != NULL)
+	{
+		*draw_ns = priv->draw_ns;
+		print_profile(table, gb_get_profile(&gb), frames);
+	}
+
+	qsort(frame_ns, frames, sizeof(*frame_ns), compare_u64);
+
+	res->workload = w->name;
+	res->config = c->name;
+	res->frames = frames;
+	res->total_s = total / 1e9;
+	res->fps = frames / res->total_s;
+	res->mean_us = total / 1e3 / frames;
+	res->median_us = frame_ns[frames / 2] / 1e3;
+	res->p99_us = frame_ns[(frames * 99) / 100] / 1e3;
+	res->min_us = frame_ns[0] / 1e3;
+	res->max_us = frame_ns[frames - 1] / 1e3;
+
+	free(priv->cart_ram);
+	free(priv);
+	return 0;
+}
+
+/**
+ * Returns a pseudo-random number for context i at frame f.
+ */
+static uint32_t lockstep_hash(uint32_t i, uint32_t f)
+{
+	uint32_t x = i * 2654435761u ^ f * 2246822519u;
+
+	x ^= x >> 15;
+	x *= 2246822519u;
+	x ^= x >> 13;
+	return x;
+}
+
+/**
+ * Returns the joypad input of context i for frame f. The input that is shared
+ * by the contexts changes every 16 frames.
+ */
+static uint8_t lockstep_joypad(enum lockstep_input_e input, unsigned i,
+		unsigned long f)
+{
+	uint32_t x = lockstep_hash(0, f / 16);
+
+	if(input == LOCKSTEP_INPUT_ALWAYS ||
+			(input == LOCKSTEP_INPUT_SOMETIMES &&
+			 (lockstep_hash(i + 1, f) & 63) == 0))
+		x = lockstep_hash(i + 1, f);
+
+	return (uint8_t)(x >> 24);
+}
+
+/**
+ * Plays count contexts of a workload with the LCD off, giving each the input
+ * from lockstep_joypad().
+ *
+ * \param run	If NULL, the contexts are run one by one with gb_run_frame().
+ *		Otherwise they are run with peanut_lockstep_run_frame(), and
+ *		the fraction of context frames that were actually run is
+ *		written here.
+ * \returns	Time taken by the measured frames in seconds, or a negative
+ *		value on error.
+ */
+static double run_lockstep(const struct workload_s *w, unsigned count,
+		unsigned long frames, unsigned long warmup,
+		enum lockstep_input_e input, double *run)
+{
+	struct gb_s *gb = calloc(count, sizeof(*gb));
+	struct gb_s **gbp = calloc(count, sizeof(*gbp));
+	struct priv_t *priv = calloc(count, sizeof(*priv));
+	struct peanut_lockstep_s ls;
+	size_t save_size;
+	uint64_t start;
+	double ret = -1;
+	unsigned i;
+
+	if(gb == NULL || gbp == NULL || priv == NULL)
+		goto out;
+
+	for(i = 0; i < count; i++)
+	{
+		priv[i].rom = w->rom;
+		if(gb_init(&gb[i], &gb_rom_read, &gb_cart_ram_read,
+				&gb_cart_ram_write, &gb_error, &priv[i]) !=
+				GB_INIT_NO_ERROR)
+			goto out;
+
+		if(gb_get_save_size_s(&gb[i], &save_size) != 0)
+			save_size = 0;
+
+		/* Cart RAM must be in memory for contexts to be grouped. */
+		priv[i].cart_ram = calloc(1, save_size + 1);
+		if(priv[i].cart_ram == NULL)
+			goto out;
+
+		gb_init_rom_direct(&gb[i], w->rom, w->rom_size,
+				priv[i].cart_ram, save_size);
+		gbp[i] = &gb[i];
+
+		for(unsigned long f = 0; f < warmup; f++)
+			gb_run_frame(&gb[i]);
+	}
+
+	if(run != NULL && peanut_lockstep_init(&ls, gbp, count,
+			LOCKSTEP_MERGE_INTERVAL) != 0)
+		goto out;
+
+	start = get_time_ns();
+	for(unsigned long f = 0; f < frames; f++)
+	{
+		for(i = 0; i < count; i++)
+			gb[i].direct.joypad = lockstep_joypad(input, i, f);
+
+		if(run != NULL)
+			peanut_lockstep_run_frame(&ls);
+		else
+		{
+			for(i = 0; i < count; i++)
+				gb_run_frame(&gb[i]);
+		}
+	}
+	ret = (get_time_ns() - start) / 1e9;
+
+	if(run != NULL)
+	{
+		*run = (double)ls.frames_run / ls.frames_total;
+		peanut_lockstep_free(&ls);
+	}
+
+out:
+	if(priv != NULL)
+	{
+		for(i = 0; i < count; i++)
+			free(priv[i].cart_ram);
+	}
+
+	free(priv);
+	free(gbp);
+	free(gb);
+	return ret;
+}
+
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for(; *s != '\0'; s++)
+	{
+		if(*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-f FRAMES] [-w FRAMES] [-j FILE] [-l LABEL] [-b]"
+		" [-k COUNT] [ROM...]\n"
+		"  -f, --frames     Frames measured for each run (default: %d)\n"
+		"  -w, --warmup     Warm-up frames before each run (default: %d)\n"
+		"  -j, --json       Write results as JSON to FILE, or - for\n"
+		"                   stdout\n"
+		"  -l, --label      Label stored in the JSON output, such as a\n"
+		"                   commit hash\n"
+		"  -b, --breakdown  Also print the time of each frame with the\n"
+		"                   LCD off and on, and the time spent in\n"
+		"                   lcd_draw_line\n"
+		"  -k, --lockstep   Also run COUNT contexts of each workload one\n"
+		"                   by one and in lockstep\n",
+		name, DEFAULT_FRAMES, DEFAULT_WARMUP);
+}
+
+/**
+ * Returns the short option for a command line argument, or '\0' if it is
+ * not a valid option.
+ */
+static char get_option(const char *arg)
+{
+	static const struct
+	{
+		char opt;
+		const char *name;
+	} options[] = {
+		{ 'f', "--frames" },
+		{ 'w', "--warmup" },
+		{ 'j', "--json" },
+		{ 'l', "--label" },
+		{ 'b', "--breakdown" },
+		{ 'k', "--lockstep" }
+	};
+
+	for(unsigned int i = 0; i < sizeof(options) / sizeof(*options); i++)
+	{
+		if(strcmp(arg, options[i].name) == 0 ||
+				(arg[1] == options[i].opt && arg[2] == '\0'))
+			return options[i].opt;
+	}
+
+	return '\0';
+}
+
+int main(int argc, char **argv)
+{
+	struct workload_s *workloads;
+	struct peanut_rom_s *roms;
+	struct result_s *results;
+	struct breakdown_s *breakdowns;
+	unsigned int num_workloads, num_roms, num_results = 0;
+	unsigned int num_breakdowns = 0;
+	const unsigned int num_configs = sizeof(configs) / sizeof(*configs);
+	unsigned long frames = DEFAULT_FRAMES;
+	unsigned long warmup = DEFAULT_WARMUP;
+	const char *json_file = NULL;
+	const char *label = "";
+	bool breakdown = false;
+	unsigned long lockstep = 0;
+	uint64_t *frame_ns;
+	FILE *json = NULL;
+	FILE *table = stdout;
+	int ret = EXIT_SUCCESS;
+	int i;
+
+	for(i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+	{
+		const char opt = get_option(argv[i]);
+
+		if(opt == 'b')
+		{
+			breakdown = true;
+			continue;
+		}
+
+		if(opt == '\0' || i + 1 >= argc)
+		{
+			print_usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+
+		switch(opt)
+		{
+		case 'f':
+			frames = strtoul(argv[++i], NULL, 10);
+			break;
+
+		case 'w':
+			warmup = strtoul(argv[++i], NULL, 10);
+			break;
+
+		case 'j':
+			json_file = argv[++i];
+			break;
+
+		case 'l':
+			label = argv[++i];
+			break;
+
+		case 'k':
+			lockstep = strtoul(argv[++i], NULL, 10);
+			break;
+
+		default:
+			print_usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(frames == 0)
+	{
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	num_roms = argc - i;
+	num_workloads = 3 + num_roms;
+	workloads = calloc(num_workloads, sizeof(*workloads));
+	roms = calloc(num_roms + 1, sizeof(*roms));
+	results = calloc(num_workloads * num_configs, sizeof(*results));
+	breakdowns = calloc(num_workloads, sizeof(*breakdowns));
+	frame_ns = malloc(frames * sizeof(*frame_ns));
+	if(workloads == NULL || roms == NULL || results == NULL ||
+			breakdowns == NULL || frame_ns == NULL)
+	{
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	workloads[0].name = "cpu_instrs";
+	workloads[0].rom = cpu_instrs_gb;
+	workloads[0].rom_size = cpu_instrs_gb_len;
+	workloads[1].name = "instr_timing";
+	workloads[1].rom = instr_timing_gb;
+	workloads[1].rom_size = instr_timing_gb_len;
+	workloads[2].name = "dmg-acid2";
+	workloads[2].rom = dmg_acid2_gb;
+	workloads[2].rom_size = dmg_acid2_gb_len;
+
+	for(unsigned int r = 0; r < num_roms; r++)
+	{
+		enum peanut_rom_error_e rom_ret;
+		struct workload_s *w = &workloads[3 + r];
+
+		rom_ret = peanut_rom_open(&roms[r], argv[i + r]);
+		if(rom_ret != PEANUT_ROM_NO_ERROR)
+		{
+			fprintf(stderr, "%s: unable to open ROM: %d\n",
+					argv[i + r], rom_ret);
+			exit(EXIT_FAILURE);
+		}
+
+		w->name = argv[i + r];
+		w->rom = roms[r].data;
+		w->rom_size = roms[r].size;
+	}
+
+	/* Keep stdout for JSON if it was requested there. */
+	if(json_file != NULL && strcmp(json_file, "-") == 0)
+		table = stderr;
+
+	fprintf(table, "%-24s %-16s %10s %10s %10s %10s\n", "Workload",
+			"Config", "FPS", "Median us", "P99 us", "Mean us");
+
+	for(unsigned int w = 0; w < num_workloads; w++)
+	{
+		double lcd_off_us = 0, lcd_us = 0;
+		const struct config_s *lcd_config = NULL;
+
+		for(unsigned int c = 0; c < num_configs; c++)
+		{
+			struct result_s *res = &results[num_results];
+
+			if(!ENABLE_LCD && configs[c].lcd)
+				continue;
+
+			if(run_workload(&workloads[w], &configs[c], frames,
+					warmup, frame_ns, NULL, res, table) != 0)
+			{
+				ret = EXIT_FAILURE;
+				goto out;
+			}
+
+			fprintf(table,
+					"%-24s %-16s %10.1f %10.2f %10.2f %10.2f\n",
+					res->workload, res->config, res->fps,
+					res->median_us, res->p99_us,
+					res->mean_us);
+			num_results++;
+
+			if(strcmp(configs[c].name, "lcd_off") == 0)
+				lcd_off_us = res->mean_us;
+			else if(strcmp(configs[c].name, "lcd") == 0)
+			{
+				lcd_us = res->mean_us;
+				lcd_config = &configs[c];
+			}
+		}
+
+		if(breakdown && lcd_config != NULL)
+		{
+			struct breakdown_s *b = &breakdowns[num_breakdowns++];
+			struct result_s res;
+			uint64_t draw_ns;
+
+			/* Time spent in the front-end is measured in a
+			 * separate run, so that the clock reads in
+			 * lcd_draw_line() do not slow the other results. */
+			if(run_workload(&workloads[w], lcd_config, frames,
+					warmup, frame_ns, &draw_ns, &res,
+					table) != 0)
+			{
+				ret = EXIT_FAILURE;
+				goto out;
+			}
+
+			b->workload = workloads[w].name;
+			b->lcd_off_us = lcd_off_us;
+			b->lcd_on_us = lcd_us;
+			b->draw_us = draw_ns / 1e3 / frames;
+
+			fprintf(table,
+					"  Breakdown per frame: LCD off %.2f us, "
+					"LCD on %.2f us, "
+					"lcd_draw_line %.2f us\n",
+					b->lcd_off_us, b->lcd_on_us, b->draw_us);
+		}
+
+		for(unsigned int in = 0; lockstep > 0 && in < LOCKSTEP_INPUT_MAX;
+				in++)
+		{
+			static const char *const input_names[] = {
+				"same", "sometimes differs", "always differs"
+			};
+			double alone_s, lockstep_s, run;
+
+			alone_s = run_lockstep(&workloads[w], lockstep, frames,
+					warmup, in, NULL);
+			lockstep_s = run_lockstep(&workloads[w], lockstep,
+					frames, warmup, in, &run);
+			if(alone_s < 0 || lockstep_s < 0)
+			{
+				ret = EXIT_FAILURE;
+				goto out;
+			}
+
+			fprintf(table,
+					"  Lockstep of %lu, input %s: one by one "
+					"%.3f s, lockstep %.3f s (%.2fx), "
+					"%.1f%% of frames run\n",
+					lockstep, input_names[in], alone_s,
+					lockstep_s, alone_s / lockstep_s,
+					100.0 * run);
+		}
+	}
+
+	if(json_file == NULL)
+		goto out;
+
+	if(strcmp(json_file, "-") == 0)
+		json = stdout;
+	else if((json = fopen(json_file, "w")) == NULL)
+	{
+		fprintf(stderr, "Unable to open %s\n", json_file);
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	fprintf(json, "{\n\t\"version\": \"%d.%d.%d\",\n\t\"label\": ",
+			PEANUTGB_VERSION_MAJOR, PEANUTGB_VERSION_MINOR,
+			PEANUTGB_VERSION_PATCH);
+	json_string(json, label);
+	fprintf(json, ",\n\t\"frames\": %lu,\n\t\"warmup\": %lu,\n"
+			"\t\"results\": [\n", frames, warmup);
+
+	for(unsigned int r = 0; r < num_results; r++)
+	{
+		const struct result_s *res = &results[r];
+
+		fprintf(json, "\t\t{ \"workload\": ");
+		json_string(json, res->workload);
+		fprintf(json, ", \"config\": ");
+		json_string(json, res->config);
+		fprintf(json, ", \"fps\": %.3f, \"total_s\": %.6f, "
+				"\"median_us\": %.3f, \"p99_us\": %.3f, "
+				"\"mean_us\": %.3f, \"min_us\": %.3f, "
+				"\"max_us\": %.3f }%s\n",
+				res->fps, res->total_s, res->median_us,
+				res->p99_us, res->mean_us, res->min_us,
+				res->max_us, r + 1 < num_results ? "," : "");
+	}
+
+	fprintf(json, "\t]");
+
+	if(num_breakdowns > 0)
+	{
+		fprintf(json, ",\n\t\"breakdown\": [\n");
+		for(unsigned int b = 0; b < num_breakdowns; b++)
+		{
+			const struct breakdown_s *bd = &breakdowns[b];
+
+			fprintf(json, "\t\t{ \"workload\": ");
+			json_string(json, bd->workload);
+			fprintf(json, ", \"lcd_off_us\": %.3f, "
+					"\"lcd_on_us\": %.3f, "
+					"\"draw_us\": %.3f }%s\n",
+					bd->lcd_off_us, bd->lcd_on_us, bd->draw_us,
+					b + 1 < num_breakdowns ? "," : "");
+		}
+		fprintf(json, "\t]");
+	}
+
+	fprintf(json, "\n}\n");
+
+	if(json != stdout)
+		fclose(json);
+
+out:
+	for(unsigned int r = 0; r < num_roms; r++)
+		peanut_rom_close(&roms[r]);
+
+	free(frame_ns);
+	free(breakdowns);
+	free(results);
+	free(roms);
+	free(workloads);
+	return ret;
+}
@@ -16,8 +16,8 @@
 
 /* Import emulator library. */
 #include "../../peanut_gb.h"
+#include "../../peanut_rom.h"
 
-#include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,8 +27,8 @@ const uint_fast32_t frames_per_run = 64 * 1024;
 
 struct priv_t
 {
-	/* Pointer to allocated memory holding GB file. */
-	uint8_t *rom;
+	/* GB file mapped into memory. */
+	struct peanut_rom_s rom;
 	/* Pointer to allocated memory holding save file. */
 	uint8_t *cart_ram;
 
@@ -42,7 +42,7 @@ struct priv_t
 static uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
 {
 	const struct priv_t * const p = gb->direct.priv;
-	return p->rom[addr];
+	return p->rom.data[addr];
 }
 
 /**
@@ -64,34 +64,6 @@ static void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
 	p->cart_ram[addr] = val;
 }
 
-/**
- * Returns a pointer to the allocated space containing the ROM. Must be freed.
- */
-static uint8_t *read_rom_to_ram(const char *file_name)
-{
-	FILE *rom_file = fopen(file_name, "rb");
-	size_t rom_size;
-	uint8_t *rom = NULL;
-
-	if(rom_file == NULL)
-		return NULL;
-
-	fseek(rom_file, 0, SEEK_END);
-	rom_size = ftell(rom_file);
-	rewind(rom_file);
-	rom = malloc(rom_size);
-
-	if(fread(rom, sizeof(uint8_t), rom_size, rom_file) != rom_size)
-	{
-		free(rom);
-		fclose(rom_file);
-		return NULL;
-	}
-
-	fclose(rom_file);
-	return rom;
-}
-
 /**
  * Ignore all errors.
  */
@@ -111,7 +83,7 @@ static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16
 
 	/* Free memory and then exit. */
 	free(priv->cart_ram);
-	free(priv->rom);
+	peanut_rom_close(&priv->rom);
 	exit(EXIT_FAILURE);
 }
 
@@ -161,11 +133,14 @@ int main(int argc, char **argv)
 		clock_t start_time;
 		uint_fast32_t frames = 0;
 		enum gb_init_error_e ret;
+		enum peanut_rom_error_e rom_ret;
+		size_t save_size;
 
-		/* Copy input ROM file to allocated memory. */
-		if((priv.rom = read_rom_to_ram(rom_file_name)) == NULL)
+		/* Map input ROM file into memory. */
+		rom_ret = peanut_rom_open(&priv.rom, rom_file_name);
+		if(rom_ret != PEANUT_ROM_NO_ERROR)
 		{
-			printf("%d: %s\n", __LINE__, strerror(errno));
+			fprintf(stderr, "Unable to open ROM: %d\n", rom_ret);
 			exit(EXIT_FAILURE);
 		}
 
@@ -181,7 +156,14 @@ int main(int argc, char **argv)
 		}
 
 		printf("Run %u: ", i);
-		priv.cart_ram = malloc(gb_get_save_size(&gb));
+		if(gb_get_save_size_s(&gb, &save_size) != 0)
+			save_size = 0;
+
+		priv.cart_ram = malloc(save_size);
+
+		/* The whole ROM is mapped into memory, so let Peanut-GB read
+		 * it directly instead of through the callbacks. */
+		peanut_rom_attach(&priv.rom, &gb, priv.cart_ram, save_size);
 
 #if ENABLE_LCD
 		gb_init_lcd(&gb, &lcd_draw_line);
@@ -206,7 +188,7 @@ int main(int argc, char **argv)
 		}
 
 		free(priv.cart_ram);
-		free(priv.rom);
+		peanut_rom_close(&priv.rom);
 	}
 
 	return EXIT_SUCCESS;
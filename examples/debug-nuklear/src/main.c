@@ -9,6 +9,10 @@
 uint8_t audio_read(uint16_t addr);
 void audio_write(uint16_t addr, uint8_t val);
 
+/* Count executed opcodes and memory accesses for the Profile window. */
+#ifndef PEANUT_GB_PROFILE
+# define PEANUT_GB_PROFILE 1
+#endif
 #include "../../../peanut_gb.h"
 
 #include "nuklear_proj.h"
@@ -857,6 +861,92 @@ static void render_peanut_gb(struct nk_context *ctx, struct gb_s *gb)
 	}
 	nk_end(ctx);
 
+#if PEANUT_GB_PROFILE
+	/* Profiling counters since they were last reset. */
+	if(nk_begin(ctx, "Profile", nk_rect(15, 490, 20 + LCD_WIDTH, 300),
+		NK_WINDOW_BORDER | NK_WINDOW_MOVABLE |
+		NK_WINDOW_SCALABLE | NK_WINDOW_TITLE |
+		NK_WINDOW_MINIMIZABLE))
+	{
+		const struct gb_profile_s *p = gb_get_profile(gb);
+		const double frames = (double)p->cycles / (154 * 456);
+		uint64_t instr = 0;
+		unsigned top[4] = { 0 };
+		char str[48];
+		int str_len;
+
+		for(unsigned op = 0; op < 0x100; op++)
+			instr += p->opcode[op];
+
+		/* Most executed opcodes. */
+		for(unsigned i = 0; i < SDL_arraysize(top); i++)
+		{
+			for(unsigned op = 0; op < 0x100; op++)
+			{
+				bool used = false;
+
+				for(unsigned j = 0; j < i; j++)
+					used |= (top[j] == op);
+
+				if(!used && (top[i] == op ||
+						p->opcode[op] > p->opcode[top[i]]))
+					top[i] = op;
+			}
+		}
+
+		nk_layout_row_dynamic(ctx, 16, 1);
+
+		if(nk_button_label(ctx, "Reset"))
+			gb_reset_profile(gb);
+
+		str_len = SDL_snprintf(str, sizeof(str), "Frames %.1f",
+			frames);
+		nk_text(ctx, str, str_len, NK_TEXT_LEFT);
+
+		str_len = SDL_snprintf(str, sizeof(str), "Instr/frame %.0f",
+			frames > 0 ? instr / frames : 0.0);
+		nk_text(ctx, str, str_len, NK_TEXT_LEFT);
+
+		str_len = SDL_snprintf(str, sizeof(str), "Halted %.1f%%",
+			p->cycles ? 100.0 * p->halt_cycles / p->cycles : 0.0);
+		nk_text(ctx, str, str_len, NK_TEXT_LEFT);
+
+		str_len = SDL_snprintf(str, sizeof(str),
+			"Idle loops skipped %" PRIu64, p->idle_iterations);
+		nk_text(ctx, str, str_len, NK_TEXT_LEFT);
+
+		str_len = SDL_snprintf(str, sizeof(str), "OAM DMA %" PRIu64,
+			p->oam_dma);
+		nk_text(ctx, str, str_len, NK_TEXT_LEFT);
+
+		str_len = SDL_snprintf(str, sizeof(str),
+			"Lines %" PRIu64 " drawn %" PRIu64 " skipped",
+			p->lines_drawn, p->lines_skipped);
+		nk_text(ctx, str, str_len, NK_TEXT_LEFT);
+
+		for(unsigned i = 0; i < SDL_arraysize(top); i++)
+		{
+			str_len = SDL_snprintf(str, sizeof(str),
+				"%02X %-12s %.1f%%", top[i], opstrs[top[i]],
+				instr ? 100.0 * p->opcode[top[i]] / instr : 0.0);
+			nk_text(ctx, str, str_len, NK_TEXT_LEFT);
+		}
+
+		/* Reads and writes of each memory region per frame. */
+		for(unsigned r = 0; r < GB_PROFILE_REGION_MAX; r++)
+		{
+			str_len = SDL_snprintf(str, sizeof(str),
+				"%-4s R %.0f W %.0f", gb_profile_region_name(r),
+				frames > 0 ? p->read[r] / frames : 0.0,
+				frames > 0 ? p->write[r] / frames : 0.0);
+			nk_text(ctx, str, str_len, NK_TEXT_LEFT);
+		}
+
+		print_window_pos(ctx);
+	}
+	nk_end(ctx);
+#endif
+
 	/* VRAM */
 	if(nk_begin(ctx, "VRAM Viewer",
 		nk_rect(200, 210, 270, 430),
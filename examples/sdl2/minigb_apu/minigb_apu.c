@@ -33,6 +33,18 @@
 
 #define MAX_CHAN_VOLUME		15
 
+/* Bits of the audio registers that always read as 1. */
+static const uint8_t ortab[AUDIO_MEM_SIZE] = {
+	0x80, 0x3f, 0x00, 0xff, 0xbf,
+	0xff, 0x3f, 0x00, 0xff, 0xbf,
+	0x7f, 0xff, 0x9f, 0xff, 0xbf,
+	0xff, 0xff, 0x00, 0x00, 0xbf,
+	0x00, 0x00, 0x70,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
 static void set_note_freq(struct chan *c)
 {
 	/* Lowest expected value of freq is 64. */
@@ -121,6 +133,7 @@ static void update_sweep(struct chan *c)
 }
 
 static void update_square(struct minigb_apu_ctx *ctx, audio_sample_t *samples,
+		const uint_fast16_t start, const uint_fast16_t end,
 		const bool ch2)
 {
 	struct chan *c = &ctx->chans[ch2];
@@ -130,7 +143,7 @@ static void update_square(struct minigb_apu_ctx *ctx, audio_sample_t *samples,
 
 	set_note_freq(c);
 
-	for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
+	for (uint_fast16_t i = start; i < end; i += 2) {
 		update_len(ctx, c);
 		if (!c->enabled)
 			return;
@@ -178,7 +191,8 @@ static uint8_t wave_sample(struct minigb_apu_ctx *ctx,
 	return volume ? (sample >> (volume - 1)) : 0;
 }
 
-static void update_wave(struct minigb_apu_ctx *ctx, audio_sample_t *samples)
+static void update_wave(struct minigb_apu_ctx *ctx, audio_sample_t *samples,
+		const uint_fast16_t start, const uint_fast16_t end)
 {
 	struct chan *c = &ctx->chans[2];
 
@@ -188,7 +202,7 @@ static void update_wave(struct minigb_apu_ctx *ctx, audio_sample_t *samples)
 	set_note_freq(c);
 	c->freq_inc *= 2;
 
-	for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
+	for (uint_fast16_t i = start; i < end; i += 2) {
 		update_len(ctx, c);
 		if (!c->enabled)
 			return;
@@ -222,7 +236,8 @@ static void update_wave(struct minigb_apu_ctx *ctx, audio_sample_t *samples)
 	}
 }
 
-static void update_noise(struct minigb_apu_ctx *ctx, audio_sample_t *samples)
+static void update_noise(struct minigb_apu_ctx *ctx, audio_sample_t *samples,
+		const uint_fast16_t start, const uint_fast16_t end)
 {
 	struct chan *c = &ctx->chans[3];
 
@@ -242,7 +257,7 @@ static void update_noise(struct minigb_apu_ctx *ctx, audio_sample_t *samples)
 		c->freq_inc = freq * (uint32_t)(FREQ_INC_REF / AUDIO_SAMPLE_RATE);
 	}
 
-	for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
+	for (uint_fast16_t i = start; i < end; i += 2) {
 		update_len(ctx, c);
 		if (!c->enabled)
 			return;
@@ -284,17 +299,46 @@ static void update_noise(struct minigb_apu_ctx *ctx, audio_sample_t *samples)
 	}
 }
 
+/**
+ * Renders the samples of the current frame from frame_pos up to end.
+ */
+static void render_frame(struct minigb_apu_ctx *ctx, const uint_fast16_t end)
+{
+	const uint_fast16_t start = ctx->frame_pos;
+
+	if (end <= start)
+		return;
+
+	memset(&ctx->frame[start], 0, (end - start) * sizeof(audio_sample_t));
+	update_square(ctx, ctx->frame, start, end, 0);
+	update_square(ctx, ctx->frame, start, end, 1);
+	update_wave(ctx, ctx->frame, start, end);
+	update_noise(ctx, ctx->frame, start, end);
+	ctx->frame_pos = end;
+}
+
+void minigb_apu_audio_sync(struct minigb_apu_ctx *ctx,
+		const uint_fast32_t frame_cycles)
+{
+	/* Stereo samples are rendered in pairs. */
+	uint_fast32_t end = (frame_cycles * AUDIO_SAMPLES /
+			(uint_fast32_t)SCREEN_REFRESH_CYCLES) * AUDIO_CHANNELS;
+
+	if (end > AUDIO_NSAMPLES)
+		end = AUDIO_NSAMPLES;
+
+	render_frame(ctx, end);
+}
+
 /**
  * SDL2 style audio callback function.
  */
 void minigb_apu_audio_callback(struct minigb_apu_ctx *ctx,
 		audio_sample_t *stream)
 {
-	memset(stream, 0, AUDIO_SAMPLES_TOTAL * sizeof(audio_sample_t));
-	update_square(ctx, stream, 0);
-	update_square(ctx, stream, 1);
-	update_wave(ctx, stream);
-	update_noise(ctx, stream);
+	render_frame(ctx, AUDIO_NSAMPLES);
+	memcpy(stream, ctx->frame, AUDIO_SAMPLES_TOTAL * sizeof(audio_sample_t));
+	ctx->frame_pos = 0;
 }
 
 static void chan_trigger(struct minigb_apu_ctx *ctx, uint_fast8_t i)
@@ -370,17 +414,6 @@ static void chan_trigger(struct minigb_apu_ctx *ctx, uint_fast8_t i)
  */
 uint8_t minigb_apu_audio_read(struct minigb_apu_ctx *ctx, const uint16_t addr)
 {
-	static const uint8_t ortab[] = {
-		0x80, 0x3f, 0x00, 0xff, 0xbf,
-		0xff, 0x3f, 0x00, 0xff, 0xbf,
-		0x7f, 0xff, 0x9f, 0xff, 0xbf,
-		0xff, 0xff, 0x00, 0x00, 0xbf,
-		0x00, 0x00, 0x70,
-		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-	};
-
 	return ctx->audio_mem[addr - AUDIO_ADDR_COMPENSATION] |
 		ortab[addr - AUDIO_ADDR_COMPENSATION];
 }
@@ -511,11 +544,137 @@ void minigb_apu_audio_write(struct minigb_apu_ctx *ctx,
 	}
 }
 
+#if MINIGB_APU_QUEUE
+/**
+ * Add an event to the queue, unless it is full.
+ */
+static void queue_push(struct minigb_apu_queue *q,
+		const uint_fast32_t frame_cycles, const uint16_t addr,
+		const uint8_t val)
+{
+	const uint32_t head = atomic_load_explicit(&q->head,
+			memory_order_relaxed);
+	struct minigb_apu_event *e;
+
+	if (head - atomic_load_explicit(&q->tail, memory_order_acquire) >=
+			MINIGB_APU_QUEUE_SIZE) {
+		q->dropped++;
+		return;
+	}
+
+	e = &q->events[head % MINIGB_APU_QUEUE_SIZE];
+	e->frame_cycles = frame_cycles;
+	e->addr = addr;
+	e->val = val;
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+}
+
+/**
+ * Record that channel i is turned on or off by the event about to be queued.
+ */
+static void queue_chan_event(struct minigb_apu_queue *q, uint_fast8_t i,
+		bool on)
+{
+	q->chan_event[i] = atomic_load_explicit(&q->head, memory_order_relaxed);
+	q->chan_on[i] = on;
+}
+
+void minigb_apu_queue_write(struct minigb_apu_ctx *ctx,
+		const uint_fast32_t frame_cycles, const uint16_t addr,
+		const uint8_t val)
+{
+	struct minigb_apu_queue *q = &ctx->queue;
+	const uint_fast8_t reg = addr - AUDIO_ADDR_COMPENSATION;
+
+	/* The registers are updated as in minigb_apu_audio_write(). */
+	if (addr == 0xFF26) {
+		q->regs[reg] = val & 0x80;
+		if ((val & 0x80) == 0) {
+			memset(q->regs, 0x00, 0xFF26 - AUDIO_ADDR_COMPENSATION);
+			for (uint_fast8_t i = 0; i < 4; i++)
+				queue_chan_event(q, i, false);
+		}
+	} else if (q->regs[0xFF26 - AUDIO_ADDR_COMPENSATION] != 0x00) {
+		q->regs[reg] = val;
+
+		if (addr == 0xFF1A)
+			queue_chan_event(q, 2, val & 0x80);
+		else if ((addr == 0xFF14 || addr == 0xFF19 || addr == 0xFF1E ||
+				addr == 0xFF23) && (val & 0x80))
+			queue_chan_event(q, reg / 5, true);
+	}
+
+	queue_push(q, frame_cycles, addr, val);
+}
+
+uint8_t minigb_apu_queue_read(struct minigb_apu_ctx *ctx, const uint16_t addr)
+{
+	struct minigb_apu_queue *q = &ctx->queue;
+	const uint_fast8_t reg = addr - AUDIO_ADDR_COMPENSATION;
+	uint32_t tail;
+	uint8_t status;
+
+	if (addr != 0xFF26)
+		return q->regs[reg] | ortab[reg];
+
+	/* The status is stored before tail by the audio thread, so it is at
+	 * least as recent as tail. */
+	tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	status = atomic_load_explicit(&q->status, memory_order_relaxed);
+
+	/* Channels changed by events that are still queued are reported as
+	 * they will be once the events are read. */
+	for (uint_fast8_t i = 0; i < 4; i++) {
+		if ((int32_t)(q->chan_event[i] - tail) < 0)
+			continue;
+
+		status &= ~(1 << i);
+		status |= q->chan_on[i] << i;
+	}
+
+	return q->regs[reg] | status | ortab[reg];
+}
+
+void minigb_apu_queue_end_frame(struct minigb_apu_ctx *ctx)
+{
+	queue_push(&ctx->queue, 0, 0, 0);
+}
+
+void minigb_apu_queue_callback(struct minigb_apu_ctx *ctx,
+		audio_sample_t *stream)
+{
+	struct minigb_apu_queue *q = &ctx->queue;
+	const uint32_t head = atomic_load_explicit(&q->head,
+			memory_order_acquire);
+	uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+	while (tail != head) {
+		const struct minigb_apu_event *e =
+			&q->events[tail % MINIGB_APU_QUEUE_SIZE];
+
+		tail++;
+		if (e->addr == 0)
+			break;
+
+		minigb_apu_audio_sync(ctx, e->frame_cycles);
+		minigb_apu_audio_write(ctx, e->addr, e->val);
+	}
+
+	minigb_apu_audio_callback(ctx, stream);
+
+	atomic_store_explicit(&q->status,
+			ctx->audio_mem[0xFF26 - AUDIO_ADDR_COMPENSATION] & 0x0F,
+			memory_order_relaxed);
+	atomic_store_explicit(&q->tail, tail, memory_order_release);
+}
+#endif
+
 void minigb_apu_audio_init(struct minigb_apu_ctx *ctx)
 {
 	/* Initialise channels and samples. */
 	memset(ctx->chans, 0, sizeof(ctx->chans));
 	ctx->chans[0].val = ctx->chans[1].val = -1;
+	ctx->frame_pos = 0;
 
 	/* Initialise IO registers. */
 	{
@@ -539,4 +698,16 @@ void minigb_apu_audio_init(struct minigb_apu_ctx *ctx)
 		for(uint_fast8_t i = 0; i < sizeof(wave_init); ++i)
 			minigb_apu_audio_write(ctx, 0xFF30 + i, wave_init[i]);
 	}
+
+#if MINIGB_APU_QUEUE
+	/* The queue starts empty with the initial registers. */
+	atomic_init(&ctx->queue.head, 0);
+	atomic_init(&ctx->queue.tail, 0);
+	atomic_init(&ctx->queue.status,
+			ctx->audio_mem[0xFF26 - AUDIO_ADDR_COMPENSATION] & 0x0F);
+	memcpy(ctx->queue.regs, ctx->audio_mem, sizeof(ctx->queue.regs));
+	for (uint_fast8_t i = 0; i < 4; i++)
+		ctx->queue.chan_event[i] = (uint32_t)-1;
+	ctx->queue.dropped = 0;
+#endif
 }
@@ -34,8 +34,10 @@ typedef int32_t audio_sample_t;
 #define SCREEN_REFRESH_CYCLES	70224.0
 #define VERTICAL_SYNC		(DMG_CLOCK_FREQ/SCREEN_REFRESH_CYCLES)
 
-/* Number of audio samples in each channel. */
-#define AUDIO_SAMPLES		((unsigned)(AUDIO_SAMPLE_RATE / VERTICAL_SYNC))
+/* Number of audio samples in each channel. This is
+ * AUDIO_SAMPLE_RATE / VERTICAL_SYNC rounded down, calculated with integers
+ * (70224 / 4194304 = 4389 / 262144) so that it may size the frame buffer. */
+#define AUDIO_SAMPLES		((unsigned)((AUDIO_SAMPLE_RATE * 4389ul) / 262144ul))
 /* Number of audio channels. The audio output is in interleaved stereo format.*/
 #define AUDIO_CHANNELS		2
 /* Number of audio samples output in each audio_callback call. */
@@ -44,6 +46,29 @@ typedef int32_t audio_sample_t;
 #define AUDIO_MEM_SIZE		(0xFF3F - 0xFF10 + 1)
 #define AUDIO_ADDR_COMPENSATION	0xFF10
 
+/* Queue register writes with the time at which they were made, so that audio
+ * may be rendered by minigb_apu_queue_callback() on another thread to the
+ * emulator. Requires C11 atomics. On by default where these are available,
+ * except for WebAssembly which has no audio thread. */
+#ifndef MINIGB_APU_QUEUE
+# if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && \
+	!defined(__STDC_NO_ATOMICS__) && !defined(__wasm__)
+#  define MINIGB_APU_QUEUE 1
+# else
+#  define MINIGB_APU_QUEUE 0
+# endif
+#endif
+
+/* Number of events held by the queue. About 100 register writes are made in
+ * a frame by most games. Must be a power of two. */
+#ifndef MINIGB_APU_QUEUE_SIZE
+# define MINIGB_APU_QUEUE_SIZE	4096
+#endif
+
+#if MINIGB_APU_QUEUE
+# include <stdatomic.h>
+#endif
+
 struct chan_len_ctr {
 	uint8_t load;
 	uint8_t enabled;
@@ -102,6 +127,37 @@ struct chan {
 	};
 };
 
+#if MINIGB_APU_QUEUE
+/* A register write, or the end of a frame if addr is 0. */
+struct minigb_apu_event {
+	uint32_t frame_cycles;
+	uint16_t addr;
+	uint8_t val;
+};
+
+struct minigb_apu_queue {
+	struct minigb_apu_event events[MINIGB_APU_QUEUE_SIZE];
+	/* Number of events ever written by the emulator thread, and read by
+	 * the audio thread. */
+	_Atomic uint32_t head;
+	_Atomic uint32_t tail;
+
+	/* Channel status bits of NR52 after the events before tail. */
+	_Atomic uint8_t status;
+
+	/* The following are only used by the emulator thread. */
+
+	/* Registers as written, for minigb_apu_queue_read(). */
+	uint8_t regs[AUDIO_MEM_SIZE];
+	/* Most recent event that turned each channel on or off, and whether it
+	 * was turned on. Used until the event is read by the audio thread. */
+	uint32_t chan_event[4];
+	uint8_t chan_on[4];
+	/* Number of events that were dropped because the queue was full. */
+	unsigned long dropped;
+};
+#endif
+
 struct minigb_apu_ctx {
 	struct chan chans[4];
 	int32_t vol_l, vol_r;
@@ -110,12 +166,25 @@ struct minigb_apu_ctx {
 	 * Memory holding audio registers between 0xFF10 and 0xFF3F inclusive.
 	 */
 	uint8_t audio_mem[AUDIO_MEM_SIZE];
+
+	/**
+	 * Samples of the current frame, and the number of them that were
+	 * already rendered by minigb_apu_audio_sync().
+	 */
+	audio_sample_t frame[AUDIO_SAMPLES_TOTAL];
+	uint_fast16_t frame_pos;
+
+#if MINIGB_APU_QUEUE
+	struct minigb_apu_queue queue;
+#endif
 };
 
 /**
  * Fill allocated buffer "stream" with AUDIO_SAMPLES_TOTAL number of 16-bit
  * signed samples (native endian order) in stereo interleaved format.
  * Each call corresponds to the time taken for each VSYNC in the Game Boy.
+ * Samples already rendered by minigb_apu_audio_sync() are included, and the
+ * next frame is started.
  *
  * \param ctx Library context. Must be initialised with audio_init().
  * \param stream Allocated pointer to store audio samples. Must be at least
@@ -124,6 +193,21 @@ struct minigb_apu_ctx {
 void minigb_apu_audio_callback(struct minigb_apu_ctx *ctx,
 		audio_sample_t *stream);
 
+/**
+ * Render the samples of the current frame up to the given point in time, so
+ * that a register read or write that follows takes effect at the matching
+ * sample instead of at the start of the frame. Samples are rendered in blocks
+ * between register accesses. Must be called from the same thread as
+ * minigb_apu_audio_callback(), which should then be called once for each
+ * frame.
+ *
+ * \param ctx Library context. Must be initialised with audio_init().
+ * \param frame_cycles Clock cycles since the start of the frame, such as
+ *	given by gb_get_frame_cycles().
+ */
+void minigb_apu_audio_sync(struct minigb_apu_ctx *ctx,
+		const uint_fast32_t frame_cycles);
+
 /**
  * Read audio register at given address "addr".
  * \param ctx Library context. Must be initialised with audio_init().
@@ -142,6 +226,60 @@ uint8_t minigb_apu_audio_read(struct minigb_apu_ctx *ctx, const uint16_t addr);
 void minigb_apu_audio_write(struct minigb_apu_ctx *ctx,
 		const uint16_t addr, const uint8_t val);
 
+#if MINIGB_APU_QUEUE
+/**
+ * Queue a write of "val" to the audio register at "addr", to be made by
+ * minigb_apu_queue_callback() when it renders the sample at "frame_cycles".
+ * Must only be called from the emulator thread. The write is dropped if the
+ * queue is full, which happens if the audio thread stops reading it.
+ *
+ * \param ctx Library context. Must be initialised with audio_init().
+ * \param frame_cycles Clock cycles since the start of the frame, such as
+ *	given by gb_get_frame_cycles().
+ * \param addr Address of register to write. Must be within 0xFF10 and
+ *	0xFF3F, inclusive.
+ * \param val Value to write to address.
+ */
+void minigb_apu_queue_write(struct minigb_apu_ctx *ctx,
+		const uint_fast32_t frame_cycles, const uint16_t addr,
+		const uint8_t val);
+
+/**
+ * Read the audio register at "addr" as seen by the emulator thread. Registers
+ * hold the values queued with minigb_apu_queue_write(). The channel status
+ * in NR52 includes queued writes, and channels that the audio thread has
+ * turned off since. Must only be called from the emulator thread.
+ *
+ * \param ctx Library context. Must be initialised with audio_init().
+ * \param addr Address of register to read. Must be within 0xFF10 and
+ *	0xFF3F, inclusive.
+ */
+uint8_t minigb_apu_queue_read(struct minigb_apu_ctx *ctx, const uint16_t addr);
+
+/**
+ * Mark the end of a frame in the queue. Must be called from the emulator
+ * thread after each frame, such as after gb_run_frame() returns.
+ *
+ * \param ctx Library context. Must be initialised with audio_init().
+ */
+void minigb_apu_queue_end_frame(struct minigb_apu_ctx *ctx);
+
+/**
+ * Fill "stream" with the samples of the oldest queued frame, in the same
+ * format as minigb_apu_audio_callback(). Each queued register write is made
+ * at its sample. May be called from an audio thread, such as the SDL audio
+ * callback, whilst the emulator thread queues the following frames. If no
+ * frame end is queued, the writes that are queued are made and the frame is
+ * rendered with the resulting registers.
+ *
+ * \param ctx Library context. Must be initialised with audio_init().
+ * \param stream Allocated pointer to store audio samples. Must be at least
+ *		AUDIO_SAMPLES_TOTAL in size.
+ */
+void minigb_apu_queue_callback(struct minigb_apu_ctx *ctx,
+		audio_sample_t *stream);
+#endif
+
 /**
  * Initialise audio driver.
  * \param ctx Library context.
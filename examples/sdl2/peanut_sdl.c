@@ -16,12 +16,20 @@
 #	include "blargg_apu/audio.h"
 #elif defined(ENABLE_SOUND_MINIGB)
 #	include "minigb_apu/minigb_apu.h"
+/* Audio is played by an SDL audio thread where the register writes can be
+ * queued for it, and is otherwise rendered after each frame. */
+#	if MINIGB_APU_QUEUE
+#		include <SDL.h>
+#	endif
 #endif
 
-uint8_t audio_read(uint16_t addr);
-void audio_write(uint16_t addr, uint8_t val);
-
 #include "../../peanut_gb.h"
+#include "../../peanut_rewind.h"
+
+/* Memory used to hold rewind history. Usually enough for several minutes. */
+#define REWIND_BUFFER_SIZE	(4 * 1024 * 1024)
+/* Store a full state once every second. */
+#define REWIND_KEYFRAME_INTERVAL	60
 
 struct priv_t
 {
@@ -37,9 +45,12 @@ struct priv_t
 	/* Colour palette for each BG, OBJ0, and OBJ1. */
 	uint16_t selected_palette[3][4];
 	uint16_t fb[LCD_HEIGHT][LCD_WIDTH];
-};
 
-static struct minigb_apu_ctx apu;
+#if defined(ENABLE_SOUND_MINIGB)
+	/* Audio processing unit used by this emulator context. */
+	struct minigb_apu_ctx apu;
+#endif
+};
 
 uint8_t *load_file(const char* file, size_t *datasize);
 static bool onkey(void *userdata, bool pressed, int key, int code, int modifiers);
@@ -47,6 +58,8 @@ static bool quit = false;
 uint32_t pixels[LCD_WIDTH * LCD_HEIGHT];
 static unsigned int fast_mode = 1;
 static unsigned int dump_bmp = 0;
+static bool rewinding = false;
+static struct peanut_rewind_s rewind_buf;
 static unsigned int selected_palette = 3;
 struct priv_t priv =
 {
@@ -88,20 +101,45 @@ uint8_t gb_bootrom_read(struct gb_s *gb, const uint_fast16_t addr)
 	return p->bootrom[addr];
 }
 
-uint8_t audio_read(uint16_t addr)
+#if defined(ENABLE_SOUND_MINIGB)
+uint8_t gb_audio_read(struct gb_s *gb, const uint_fast16_t addr)
 {
-	return minigb_apu_audio_read(&apu, addr);
+	struct priv_t * const p = gb->direct.priv;
+#if MINIGB_APU_QUEUE
+	return minigb_apu_queue_read(&p->apu, addr);
+#else
+	minigb_apu_audio_sync(&p->apu, gb_get_frame_cycles(gb));
+	return minigb_apu_audio_read(&p->apu, addr);
+#endif
 }
 
-void audio_write(uint16_t addr, uint8_t val)
+void gb_audio_write(struct gb_s *gb, const uint_fast16_t addr,
+		    const uint8_t val)
 {
-	minigb_apu_audio_write(&apu, addr, val);
+	struct priv_t * const p = gb->direct.priv;
+#if MINIGB_APU_QUEUE
+	/* The write is made by the audio thread when it renders the sample
+	 * at this point of the frame. */
+	minigb_apu_queue_write(&p->apu, gb_get_frame_cycles(gb), addr, val);
+#else
+	/* Samples up to this write are rendered with the previous register
+	 * values, so that the write is heard at the right time. */
+	minigb_apu_audio_sync(&p->apu, gb_get_frame_cycles(gb));
+	minigb_apu_audio_write(&p->apu, addr, val);
+#endif
 }
 
 void audio_callback(void *ptr, uint8_t *data, int len)
 {
-	minigb_apu_audio_callback(&apu, (void *)data);
+	struct priv_t * const p = ptr;
+	(void) len;
+#if MINIGB_APU_QUEUE
+	minigb_apu_queue_callback(&p->apu, (void *)data);
+#else
+	minigb_apu_audio_callback(&p->apu, (void *)data);
+#endif
 }
+#endif
 
 void read_cart_ram_file(const char *save_file_name, uint8_t **dest,
 			const size_t len)
@@ -628,6 +666,13 @@ int main(int argc, char **argv)
 	char *rom_file_name = NULL;
 	char *save_file_name = NULL;
 	int ret = EXIT_SUCCESS;
+#if defined(ENABLE_SOUND_MINIGB)
+# if MINIGB_APU_QUEUE
+	SDL_AudioDeviceID audio_dev;
+# else
+	static audio_sample_t audio_stream[AUDIO_SAMPLES_TOTAL];
+# endif
+#endif
 
 	/* Initialise frontend implementation, in this case, JS. */
 	JS_createCanvas(LCD_WIDTH, LCD_HEIGHT, "2d");
@@ -811,30 +856,42 @@ int main(int argc, char **argv)
 #endif
 	}
 
-#if ENABLE_SOUND == 0
-	// Sound is disabled, so do nothing.
-#elif defined(ENABLE_SOUND_BLARGG)
+#if defined(ENABLE_SOUND_BLARGG)
 	audio_init(&dev);
 #elif defined(ENABLE_SOUND_MINIGB)
 	{
-		// SDL_AudioSpec want, have;
+		minigb_apu_audio_init(&priv.apu);
+		gb_init_audio(&gb, &gb_audio_read, &gb_audio_write);
+
+#if MINIGB_APU_QUEUE
+		SDL_AudioSpec want, have;
 
-		// want.freq = AUDIO_SAMPLE_RATE;
-		// want.format   = AUDIO_S16,
-		// want.channels = 2;
-		// want.samples = AUDIO_SAMPLES;
-		// want.callback = audio_callback;
-		// want.userdata = NULL;
+		if(SDL_InitSubSystem(SDL_INIT_AUDIO) < 0)
+		{
+			fprintf(stderr, "SDL could not initialise audio: %s\n",
+				SDL_GetError());
+			exit(EXIT_FAILURE);
+		}
 
-		// printf("Audio driver: %s\n", SDL_GetAudioDeviceName(0, 0));
+		SDL_zero(want);
+		want.freq = AUDIO_SAMPLE_RATE;
+		want.format   = AUDIO_S16SYS;
+		want.channels = AUDIO_CHANNELS;
+		want.samples = AUDIO_SAMPLES;
+		want.callback = audio_callback;
+		want.userdata = &priv;
 
-		// if((dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0)) == 0)
-		// {
-		// 	fprintf(stderr, "SDL could not open audio device\n");
-		// 	exit(EXIT_FAILURE);
-		// }
+		printf("Audio driver: %s\n", SDL_GetCurrentAudioDriver());
+
+		if((audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0)) == 0)
+		{
+			fprintf(stderr, "SDL could not open audio device: %s\n",
+				SDL_GetError());
+			exit(EXIT_FAILURE);
+		}
 
-		minigb_apu_audio_init(&apu);
+		SDL_PauseAudioDevice(audio_dev, 0);
+#endif
 	}
 #endif
 
@@ -875,6 +932,12 @@ int main(int argc, char **argv)
 		JS_setTitle(title_str);
 	}
 
+	/* Rewind is optional, so continue without it if there is not enough
+	 * memory. */
+	if(peanut_rewind_init(&rewind_buf, REWIND_BUFFER_SIZE,
+			REWIND_KEYFRAME_INTERVAL) < 0)
+		printf("Unable to allocate rewind buffer; rewind disabled\n");
+
 	JS_requestAnimationFrame();
 
 	auto_assign_palette(&priv, gb_colour_hash(&gb));
@@ -888,9 +951,29 @@ int main(int argc, char **argv)
 		 * delay to cap at 60 fps. */
 		old_ticks = JS_performanceNow();
 
+		/* Go back two frames and then run one, so that the screen is
+		 * redrawn at the previous frame. Cart RAM is not rewound. */
+		if(rewinding && peanut_rewind_step_back(&rewind_buf, &gb) == 0)
+			peanut_rewind_step_back(&rewind_buf, &gb);
+
 		/* Execute CPU cycles until the screen has to be redrawn. */
 		gb_run_frame(&gb);
 
+#if defined(ENABLE_SOUND_MINIGB)
+# if MINIGB_APU_QUEUE
+		/* The audio thread renders up to here when it reaches this
+		 * frame. */
+		minigb_apu_queue_end_frame(&priv.apu);
+# else
+		/* Render the rest of the frame, so that the next frame starts
+		 * from the first sample. */
+		audio_callback(&priv, (uint8_t *)audio_stream, 0);
+# endif
+#endif
+
+		if(rewind_buf.ring != NULL)
+			peanut_rewind_push(&rewind_buf, &gb);
+
 		/* Tick the internal RTC when 1 second has passed. */
 		rtc_timer += target_speed_ms / (double) fast_mode;
 
@@ -989,10 +1072,13 @@ int main(int argc, char **argv)
 
 #ifdef ENABLE_SOUND_BLARGG
 	audio_cleanup();
+#elif defined(ENABLE_SOUND_MINIGB) && MINIGB_APU_QUEUE
+	SDL_CloseAudioDevice(audio_dev);
 #endif
 
 	/* Record save file. */
 	write_cart_ram_file(save_file_name, &priv.cart_ram, priv.save_size);
+	peanut_rewind_free(&rewind_buf);
 
 out:
 	free(priv.rom);
@@ -1158,6 +1244,11 @@ static bool onkey(void *userdata, bool pressed, int key, int code, int modifiers
 
 		case DOM_PK_R:
 			gb_reset(gb);
+			peanut_rewind_clear(&rewind_buf);
+			break;
+
+		case DOM_PK_TAB:
+			rewinding = true;
 			break;
 #if ENABLE_LCD
 
@@ -1239,6 +1330,10 @@ static bool onkey(void *userdata, bool pressed, int key, int code, int modifiers
 		case DOM_PK_SPACE:
 			fast_mode = 1;
 			break;
+
+		case DOM_PK_TAB:
+			rewinding = false;
+			break;
 		}
     }
 
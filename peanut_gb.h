@@ -41,6 +41,7 @@
 # define __has_include(x) 0
 #endif
 
+#include <stddef.h>	/* Required for offsetof */
 #include <stdlib.h>	/* Required for abort */
 #include <stdbool.h>	/* Required for bool types */
 #include <stdint.h>	/* Required for int types */
@@ -76,9 +77,11 @@
 
 /** Definitions for compile-time setting of features. **/
 /**
- * Sound support must be provided by an external library. When audio_read() and
- * audio_write() functions are provided, define ENABLE_SOUND to a non-zero value
- * before including peanut_gb.h in order for these functions to be used.
+ * Sound support must be provided by an external library. Audio callbacks may be
+ * set for each emulator context with gb_init_audio(). Alternatively, when the
+ * global audio_read() and audio_write() functions are provided, define
+ * ENABLE_SOUND to a non-zero value before including peanut_gb.h in order for
+ * these functions to be used by default.
  */
 #ifndef ENABLE_SOUND
 # define ENABLE_SOUND 0
@@ -100,6 +103,94 @@
 # define PEANUT_GB_HIGH_LCD_ACCURACY 1
 #endif
 
+/* Skip calling lcd_draw_line for lines that would be drawn exactly as they
+ * were in the previous frame. VRAM, OAM and the registers used to draw each
+ * line are tracked to detect this. Only enable this if the front-end keeps the
+ * previously drawn lines in its frame buffer. Off by default. */
+#ifndef PEANUT_GB_SKIP_UNCHANGED_LINES
+# define PEANUT_GB_SKIP_UNCHANGED_LINES 0
+#endif
+
+/* Keep a cache of the 384 tiles in VRAM decoded to one byte per pixel, which
+ * is used when drawing the background and window. The cache uses 24 KiB of
+ * memory within the emulator context. Off by default. */
+#ifndef PEANUT_GB_TILE_CACHE
+# define PEANUT_GB_TILE_CACHE 0
+#endif
+
+/* Collect counters of executed opcodes, memory accesses, OAM DMA transfers,
+ * drawn lines and halted cycles, which are obtained with gb_get_profile().
+ * This slows down emulation, so is off by default. */
+#ifndef PEANUT_GB_PROFILE
+# define PEANUT_GB_PROFILE 0
+#endif
+
+/* Skip the iterations of idle loops that only wait for LY, STAT or IF to
+ * change, instead of executing them instruction by instruction. The result of
+ * emulation is not changed, although gb_run_until() may check its predicate
+ * less often within these loops. On by default. */
+#ifndef PEANUT_GB_IDLE_SKIP
+# define PEANUT_GB_IDLE_SKIP 1
+#endif
+
+/* Inline the interpreter into gb_run_frame(), so that the loop running each
+ * frame does not call a function for every instruction. This adds a second
+ * copy of the interpreter to the code, which is about 22 KiB on x86-64, so is
+ * off by default. */
+#ifndef PEANUT_GB_INLINE_CPU
+# define PEANUT_GB_INLINE_CPU 0
+#endif
+
+/* Cache the instruction bytes fetched from ROM through the gb_rom_read
+ * callback, so that executing code from ROM does not call the callback for
+ * every opcode and immediate. Entries are found by their offset in the ROM, so
+ * they remain valid when ROM banks are switched. Code in RAM, and ROM that is
+ * in the memory map after gb_init_rom_direct(), is not cached. The gb_rom_read
+ * callback must always return the same value for an address. Adds 32 KiB to
+ * struct gb_s, so is off by default. */
+#ifndef PEANUT_GB_DECODE_CACHE
+# define PEANUT_GB_DECODE_CACHE 0
+#endif
+
+/* Emulate the 160 machine cycles taken by OAM DMA transfers. During a
+ * transfer, the CPU may only access HRAM and the IO registers; other reads
+ * return 0xFF and other writes are ignored. Otherwise, transfers complete
+ * instantly. Off by default. */
+#ifndef PEANUT_GB_OAM_DMA_TIMING
+# define PEANUT_GB_OAM_DMA_TIMING 0
+#endif
+
+/* WRAM, VRAM and OAM are held by the front-end instead of within struct gb_s,
+ * and are set with gb_init_memory() before calling gb_init(). This allows
+ * them to be placed in memory chosen by the front-end. Off by default. */
+#ifndef PEANUT_GB_EXTERNAL_MEMORY
+# define PEANUT_GB_EXTERNAL_MEMORY 0
+#endif
+
+/* Allow contexts to be forked with gb_fork(), which shares WRAM, VRAM and
+ * cart RAM with the parent context until they are written. Forked contexts
+ * check for shared memory when it is accessed outside of the memory map.
+ * On by default. */
+#ifndef PEANUT_GB_FORK
+# define PEANUT_GB_FORK 1
+#endif
+
+/* Allow the lines drawn by the LCD to be queued with gb_init_lcd_queue(), to
+ * be rendered later with gb_render_line(), possibly by another thread, whilst
+ * emulation continues. VRAM and OAM writes check for queued lines. Off by
+ * default. */
+#ifndef PEANUT_GB_LCD_QUEUE
+# define PEANUT_GB_LCD_QUEUE 0
+#endif
+
+/* Keep a bitmap of the pages of cart RAM written since it was last cleared,
+ * obtained with gb_get_cart_ram_dirty(), so that front-ends may save only the
+ * changed parts of the cart RAM. Cart RAM given to gb_init_rom_direct() is
+ * only mapped for writing once its page is dirty. On by default. */
+#ifndef PEANUT_GB_CART_RAM_DIRTY
+# define PEANUT_GB_CART_RAM_DIRTY 1
+#endif
+
 /* Use intrinsic functions. This may produce smaller and faster code. */
 #ifndef PEANUT_GB_USE_INTRINSICS
 # define PEANUT_GB_USE_INTRINSICS 1
@@ -143,6 +234,15 @@
 #define WRAM_BANK_SIZE  0x1000
 #define CRAM_BANK_SIZE  0x2000
 #define VRAM_BANK_SIZE  0x2000
+/* Cart RAM is shared by forked contexts in pages of 4 KiB, up to the 128 KiB
+ * used by MBC5. */
+#define FORK_PAGE_SIZE		0x1000
+#define FORK_CART_RAM_PAGES	(0x20000 / FORK_PAGE_SIZE)
+/* Each bit returned by gb_get_cart_ram_dirty() covers a page of 4 KiB of
+ * cart RAM, so the 128 KiB used by MBC5 fits in 32 bits. */
+#define CART_RAM_DIRTY_PAGE_SIZE	0x1000
+/* Number of entries in the decode cache. Must be a power of two. */
+#define DECODE_CACHE_SIZE	0x1000
 
 /* DIV Register is incremented at rate of 16384Hz.
  * 4194304 / 16384 = 256 clock cycles for one increment. */
@@ -152,6 +252,9 @@
  * 4194304 / (8192 / 8) = 4096 clock cycles for sending 1 byte. */
 #define SERIAL_CYCLES       4096
 
+/* OAM DMA copies one byte every machine cycle. */
+#define OAM_DMA_CYCLES      (OAM_SIZE * 4)
+
 /* Calculating VSYNC. */
 #define DMG_CLOCK_FREQ      4194304.0
 #define SCREEN_REFRESH_CYCLES 70224.0
@@ -221,6 +324,7 @@
 #define VRAM_BMAP_2         (0x9C00 - VRAM_ADDR)
 #define VRAM_TILES_3        (0x8000 - VRAM_ADDR + VRAM_BANK_SIZE)
 #define VRAM_TILES_4        (0x8800 - VRAM_ADDR + VRAM_BANK_SIZE)
+#define VRAM_NUM_TILES      384
 
 /* Interrupt jump addresses */
 #define VBLANK_INTR_ADDR    0x0040
@@ -296,6 +400,18 @@
 # endif
 #endif /* !defined(PGB_LIKELY) */
 
+/* Forces a function to be inlined, for hot loops that would otherwise pay for
+ * a function call on each iteration. */
+#if !defined(PGB_ALWAYS_INLINE)
+# if defined(__GNUC__)
+#  define PGB_ALWAYS_INLINE inline __attribute__((always_inline))
+# elif defined(_MSC_VER)
+#  define PGB_ALWAYS_INLINE __forceinline
+# else
+#  define PGB_ALWAYS_INLINE inline
+# endif
+#endif /* !defined(PGB_ALWAYS_INLINE) */
+
 #if PEANUT_GB_USE_INTRINSICS
 /* If using MSVC, only enable intrinsics for x86 platforms*/
 # if defined(_MSC_VER) && __has_include("intrin.h") && \
@@ -311,6 +427,17 @@
 #  define PGB_INTRIN_SBC(x,y,cin,res) __builtin_sub_overflow(x,y+cin,&res)
 #  define PGB_INTRIN_ADC(x,y,cin,res) __builtin_add_overflow(x,y+cin,&res)
 # endif
+
+/* Vector instructions used to decode and palette map tiles when drawing the
+ * background and window. */
+# if defined(__SSE2__) || defined(_M_AMD64) || defined(_M_X64) || \
+	(defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define PGB_INTRIN_SSE2 1
+# elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define PGB_INTRIN_NEON 1
+# endif
 #endif /* PEANUT_GB_USE_INTRINSICS */
 
 #if defined(PGB_INTRIN_SBC)
@@ -494,6 +621,16 @@ struct count_s
 	uint_fast16_t serial_count;	/* Serial Counter */
 	uint_fast32_t rtc_count;	/* RTC Counter */
 	uint_fast32_t lcd_off_count;	/* Cycles LCD has been disabled */
+#if PEANUT_GB_OAM_DMA_TIMING
+	uint_fast16_t oam_dma_count;	/* Cycles left of OAM DMA transfer */
+#endif
+
+	/* Cycles that have passed but have not yet been applied to the
+	 * counters above. */
+	uint_fast32_t pending_cycles;
+	/* Cycles after the last counter update at which the next event (LCD
+	 * mode change, TIMA overflow or serial transfer) occurs. */
+	uint_fast32_t next_event;
 };
 
 #if ENABLE_LCD
@@ -556,6 +693,96 @@ enum gb_serial_rx_ret_e
 	GB_SERIAL_RX_NO_CONNECTION = 1
 };
 
+/**
+ * Pixel formats of a frame buffer set with gb_init_lcd_framebuffer(). The
+ * values of each pixel are taken from the given palette, so any 16-bit or
+ * 32-bit colour layout may be used with the RGB565 and RGBA8888 formats.
+ */
+enum gb_pixel_format_e
+{
+	/* One byte per pixel holding the same value that is given to
+	 * lcd_draw_line. No palette is used. */
+	GB_PIXEL_FORMAT_INDEXED8 = 0,
+	/* uint16_t per pixel. */
+	GB_PIXEL_FORMAT_RGB565,
+	/* uint32_t per pixel. */
+	GB_PIXEL_FORMAT_RGBA8888,
+
+	GB_PIXEL_FORMAT_INVALID_MAX
+};
+
+/**
+ * Registers used to draw a line, captured when the LCD starts drawing it. A
+ * line is rendered from these and the current VRAM and OAM by
+ * gb_render_line().
+ */
+struct gb_lcd_line_s
+{
+	uint8_t ly;
+	uint8_t lcdc;
+	uint8_t scy;
+	uint8_t scx;
+	uint8_t wx;
+	/* Line of the window that is drawn, if draw_window is set. */
+	uint8_t window_line;
+	bool draw_window;
+	uint8_t bg_palette[4];
+	uint8_t sp_palette[8];
+};
+
+/**
+ * Memory regions counted separately by the profiling counters.
+ */
+enum gb_profile_region_e
+{
+	GB_PROFILE_REGION_ROM0 = 0,	/* 0x0000 - 0x3FFF */
+	GB_PROFILE_REGION_ROMX,		/* 0x4000 - 0x7FFF */
+	GB_PROFILE_REGION_VRAM,		/* 0x8000 - 0x9FFF */
+	GB_PROFILE_REGION_CART_RAM,	/* 0xA000 - 0xBFFF */
+	GB_PROFILE_REGION_WRAM,		/* 0xC000 - 0xDFFF */
+	GB_PROFILE_REGION_ECHO,		/* 0xE000 - 0xFDFF */
+	GB_PROFILE_REGION_OAM,		/* 0xFE00 - 0xFEFF */
+	GB_PROFILE_REGION_IO,		/* 0xFF00 - 0xFF7F and 0xFFFF */
+	GB_PROFILE_REGION_HRAM,		/* 0xFF80 - 0xFFFE */
+
+	GB_PROFILE_REGION_MAX
+};
+
+/**
+ * Profiling counters, collected when PEANUT_GB_PROFILE is enabled. Counters
+ * are cleared by gb_init() and gb_reset_profile().
+ */
+struct gb_profile_s
+{
+	/* Number of times each opcode was executed, and each opcode of the
+	 * 0xCB prefixed table. */
+	uint64_t opcode[0x100];
+	uint64_t cb_opcode[0x100];
+
+	/* Reads and writes of each region of memory, including the reads
+	 * made by OAM DMA. */
+	uint64_t read[GB_PROFILE_REGION_MAX];
+	uint64_t write[GB_PROFILE_REGION_MAX];
+
+	/* Number of OAM DMA transfers. */
+	uint64_t oam_dma;
+
+	/* Lines that were drawn, and lines that were not drawn due to frame
+	 * skip, interlacing or PEANUT_GB_SKIP_UNCHANGED_LINES. */
+	uint64_t lines_drawn;
+	uint64_t lines_skipped;
+
+	/* Clock cycles that were emulated, and how many of them were spent
+	 * halted. */
+	uint64_t cycles;
+	uint64_t halt_cycles;
+
+	/* Iterations of idle loops that were skipped by PEANUT_GB_IDLE_SKIP.
+	 * Their instructions are counted in opcode, but their memory reads
+	 * are not counted in read. */
+	uint64_t idle_iterations;
+};
+
 union cart_rtc
 {
 	struct
@@ -617,10 +844,20 @@ struct gb_s
 	/* Transmit one byte and return the received byte. */
 	void (*gb_serial_tx)(struct gb_s*, const uint8_t tx);
 	enum gb_serial_rx_ret_e (*gb_serial_rx)(struct gb_s*, uint8_t* rx);
+	/* Data used by the serial functions, so that helpers such as
+	 * peanut_link.h may leave direct.priv to the front-end. Set to NULL by
+	 * gb_init(). */
+	void *serial_priv;
 
 	/* Read byte from boot ROM at given address. */
 	uint8_t (*gb_bootrom_read)(struct gb_s*, const uint_fast16_t addr);
 
+	/* Read and write APU registers between 0xFF10 and 0xFF3F. Set with
+	 * gb_init_audio(). */
+	uint8_t (*gb_audio_read)(struct gb_s*, const uint_fast16_t addr);
+	void (*gb_audio_write)(struct gb_s*, const uint_fast16_t addr,
+			       const uint8_t val);
+
 	struct
 	{
 		bool gb_halt	: 1;
@@ -651,6 +888,65 @@ struct gb_s
 	uint8_t enable_cart_ram;
 	/* Cartridge ROM/RAM mode select. */
 	uint8_t cart_mode_select;
+	/* Handle reads of switchable ROM banks and cart RAM, and writes to the
+	 * MBC registers and cart RAM, that are not in the memory map. Chosen
+	 * by gb_init() for the MBC of the cartridge. */
+	uint8_t (*read_mbc)(struct gb_s *gb, uint_fast16_t addr);
+	void (*write_mbc)(struct gb_s *gb, uint_fast16_t addr, uint8_t val);
+
+	/* ROM and cart RAM held in memory by the front-end. Set with
+	 * gb_init_rom_direct(). Pointers are NULL when the gb_rom_read and
+	 * gb_cart_ram_read/write callbacks must be used instead. */
+	struct
+	{
+		const uint8_t *rom;
+		size_t rom_size;
+		uint8_t *cart_ram;
+		size_t cart_ram_size;
+	} cart_direct;
+
+	/* Memory map of the 16 pages of 4 KiB in the address space. Each entry
+	 * points to the host memory backing that page, or is NULL if accesses
+	 * to the page must be handled by __gb_read_unmapped() or
+	 * __gb_write_unmapped(). Rebuilt with __gb_update_mem_map() whenever
+	 * the banks or boot ROM mapping change. */
+	struct
+	{
+		const uint8_t *read[0x10];
+		uint8_t *write[0x10];
+	} mem_map;
+
+#if PEANUT_GB_DECODE_CACHE
+	/* Instruction bytes read through the gb_rom_read callback. Each entry
+	 * holds the three bytes from a ROM offset, which is enough for any
+	 * opcode and its immediates. The offset of an empty entry is
+	 * UINT32_MAX. */
+	struct
+	{
+		uint32_t offset;
+		uint8_t bytes[3];
+	} decode_cache[DECODE_CACHE_SIZE];
+#endif
+
+#if PEANUT_GB_CART_RAM_DIRTY
+	/* Pages of cart RAM written since gb_clear_cart_ram_dirty(). */
+	uint_fast32_t cart_ram_dirty;
+#endif
+
+#if PEANUT_GB_FORK
+	/* Memory of the parent context set with gb_fork() that is still shared
+	 * with this context. Each entry is set to NULL once the memory is
+	 * copied into this context, which must be done before it is written or
+	 * accessed outside of the memory map. shared is set whilst any entry
+	 * might not be NULL. */
+	struct
+	{
+		const uint8_t *vram;
+		const uint8_t *wram[WRAM_SIZE / FORK_PAGE_SIZE];
+		const uint8_t *cart_ram[FORK_CART_RAM_PAGES];
+		bool shared;
+	} fork;
+#endif
 
 	union cart_rtc rtc_latched, rtc_real;
 
@@ -658,10 +954,23 @@ struct gb_s
 	//struct gb_registers_s gb_reg;
 	struct count_s counter;
 
-	/* TODO: Allow implementation to allocate WRAM, VRAM and Frame Buffer. */
+#if PEANUT_GB_PROFILE
+	/* Obtained with gb_get_profile(). */
+	struct gb_profile_s profile;
+#endif
+
+	/* gb_fork() copies the members around wram, vram and oam, so they must
+	 * be kept together in this order. */
+#if PEANUT_GB_EXTERNAL_MEMORY
+	/* Set with gb_init_memory(). */
+	uint8_t *wram;
+	uint8_t *vram;
+	uint8_t *oam;
+#else
 	uint8_t wram[WRAM_SIZE];
 	uint8_t vram[VRAM_SIZE];
 	uint8_t oam[OAM_SIZE];
+#endif
 	uint8_t hram_io[HRAM_IO_SIZE];
 
 	struct
@@ -689,6 +998,15 @@ struct gb_s
 				const uint8_t *pixels,
 				const uint_fast8_t line);
 
+		/* Frame buffer set with gb_init_lcd_framebuffer(), which is
+		 * used instead of lcd_draw_line when not NULL. */
+		void *fb;
+		size_t fb_pitch;
+		enum gb_pixel_format_e fb_format;
+		/* Pixel value of each shade of OBJ0, OBJ1 and BG, indexed by
+		 * the layer and shade bits of the pixel. */
+		uint32_t fb_palette[12];
+
 		/* Palettes */
 		uint8_t bg_palette[4];
 		uint8_t sp_palette[8];
@@ -699,6 +1017,55 @@ struct gb_s
 		/* Only support 30fps frame skip. */
 		bool frame_skip_count : 1;
 		bool interlace_count : 1;
+
+		/* Set with gb_set_render_policy(). One frame is drawn every
+		 * render_every frames, or only frames requested with
+		 * gb_request_frame() are drawn if zero. */
+		uint8_t render_every;
+		uint8_t render_count;
+		bool frame_requested;
+		/* Set when the current frame is not drawn at all. */
+		bool frame_hidden;
+
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+		/* Set when OAM changes, so that the sprites drawn on each line
+		 * must be sorted again. This is not a bit-field, as it is
+		 * written by gb_render_line(). */
+		bool sprites_dirty;
+		/* Up to 10 sprites drawn on each line, from the highest
+		 * priority, and the sprite height that they were sorted for. */
+		uint8_t line_sprites[LCD_HEIGHT][MAX_SPRITES_LINE];
+		uint8_t line_sprites_count[LCD_HEIGHT];
+		uint8_t line_sprites_height;
+#endif
+
+#if PEANUT_GB_LCD_QUEUE
+		/* Set with gb_init_lcd_queue(). When lcd_queue_line is not
+		 * NULL, it is given each line instead of the line being
+		 * rendered, and lcd_sync is called before VRAM or OAM is
+		 * changed whilst lines are queued. */
+		void (*lcd_queue_line)(struct gb_s *gb,
+				const struct gb_lcd_line_s *line);
+		void (*lcd_sync)(struct gb_s *gb);
+		/* Set when a line was queued since lcd_sync was last called. */
+		bool lines_queued;
+#endif
+
+#if PEANUT_GB_TILE_CACHE
+		/* Tiles decoded to one colour index per pixel, and whether
+		 * each tile must be decoded again before it is used. */
+		uint8_t tile_cache[VRAM_NUM_TILES][8][8];
+		bool tile_dirty[VRAM_NUM_TILES];
+#endif
+
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+		/* Incremented whenever VRAM or OAM changes. */
+		uint_fast32_t mem_version;
+		/* mem_version and the registers used when each line was last
+		 * drawn. */
+		uint_fast32_t line_version[LCD_HEIGHT];
+		uint8_t line_regs[LCD_HEIGHT][9];
+#endif
 	} display;
 
 	/**
@@ -766,6 +1133,11 @@ struct gb_s
 #define IO_BOOT	0x50
 #define IO_IE	0xFF
 
+/* VRAM writes must be handled by __gb_write_unmapped() when they are tracked
+ * by the LCD renderer. */
+#define PEANUT_GB_TRACK_VRAM_WRITES					\
+	(ENABLE_LCD && (PEANUT_GB_SKIP_UNCHANGED_LINES || PEANUT_GB_TILE_CACHE))
+
 #define IO_TAC_RATE_MASK	0x3
 #define IO_TAC_ENABLE_MASK	0x4
 
@@ -776,1021 +1148,2648 @@ struct gb_s
 #define IO_STAT_MODE_LCD_DRAW		3
 #define IO_STAT_MODE_VBLANK_OR_TRANSFER_MASK 0x1
 
+/* Number of cycles for each TIMA increment, indexed by the TAC clock select. */
+static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
+
+/* Adds to a profiling counter. The arguments are not evaluated when
+ * PEANUT_GB_PROFILE is disabled. */
+#if PEANUT_GB_PROFILE
+# define PGB_PROFILE_ADD(gb, counter, n)	((gb)->profile.counter += (n))
+
 /**
- * Internal function used to read bytes.
- * addr is host platform endian.
+ * Internal function used to find the memory region counted by the profiling
+ * counters for an address.
  */
-uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
+static enum gb_profile_region_e __gb_profile_region(uint_fast16_t addr)
 {
-	switch(PEANUT_GB_GET_MSN16(addr))
-	{
-	case 0x0:
-		/* IO_BOOT is only set to 1 if gb->gb_bootrom_read was not NULL
-		 * on reset. */
-		if(gb->hram_io[IO_BOOT] == 0 && addr < 0x0100)
-		{
-			return gb->gb_bootrom_read(gb, addr);
-		}
-
-		/* Fallthrough */
-	case 0x1:
-	case 0x2:
-	case 0x3:
-		return gb->gb_rom_read(gb, addr);
-
-	case 0x4:
-	case 0x5:
-	case 0x6:
-	case 0x7:
-		if(gb->mbc == 1 && gb->cart_mode_select)
-			return gb->gb_rom_read(gb,
-					       addr + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE);
-		else
-			return gb->gb_rom_read(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
-
-	case 0x8:
-	case 0x9:
-		return gb->vram[addr - VRAM_ADDR];
-
-	case 0xA:
-	case 0xB:
-		if(gb->mbc == 3 && gb->cart_ram_bank >= 0x08)
-		{
-			return gb->rtc_latched.bytes[gb->cart_ram_bank - 0x08];
-		}
-		else if(gb->cart_ram && gb->enable_cart_ram)
-		{
-			if(gb->mbc == 2)
-			{
-				/* Only 9 bits are available in address. */
-				addr &= 0x1FF;
-				return gb->gb_cart_ram_read(gb, addr);
-			}
-			else if((gb->cart_mode_select || gb->mbc != 1) &&
-					gb->cart_ram_bank < gb->num_ram_banks)
-			{
-				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR +
-							    (gb->cart_ram_bank * CRAM_BANK_SIZE));
-			}
-			else
-				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR);
-		}
-
-		return 0xFF;
-
-	case 0xC:
-	case 0xD:
-		return gb->wram[addr - WRAM_0_ADDR];
+	static const uint8_t page_region[0x10] = {
+		GB_PROFILE_REGION_ROM0, GB_PROFILE_REGION_ROM0,
+		GB_PROFILE_REGION_ROM0, GB_PROFILE_REGION_ROM0,
+		GB_PROFILE_REGION_ROMX, GB_PROFILE_REGION_ROMX,
+		GB_PROFILE_REGION_ROMX, GB_PROFILE_REGION_ROMX,
+		GB_PROFILE_REGION_VRAM, GB_PROFILE_REGION_VRAM,
+		GB_PROFILE_REGION_CART_RAM, GB_PROFILE_REGION_CART_RAM,
+		GB_PROFILE_REGION_WRAM, GB_PROFILE_REGION_WRAM,
+		GB_PROFILE_REGION_ECHO, GB_PROFILE_REGION_ECHO
+	};
 
-	case 0xE:
-		return gb->wram[addr - ECHO_ADDR];
+	if(addr < 0xFE00)
+		return (enum gb_profile_region_e)page_region[addr >> 12];
+	else if(addr < 0xFF00)
+		return GB_PROFILE_REGION_OAM;
+	else if(addr >= HRAM_ADDR && addr < INTR_EN_ADDR)
+		return GB_PROFILE_REGION_HRAM;
 
-	case 0xF:
-		if(addr < OAM_ADDR)
-			return gb->wram[addr - ECHO_ADDR];
+	return GB_PROFILE_REGION_IO;
+}
+#else
+# define PGB_PROFILE_ADD(gb, counter, n)	((void) 0)
+#endif
 
-		if(addr < UNUSED_ADDR)
-			return gb->oam[addr - OAM_ADDR];
+/* Defined below. Used to bring the timers up to date when they are accessed. */
+void __gb_update_next_event(struct gb_s *gb);
+uint_fast32_t __gb_sync_counters(struct gb_s *gb);
 
-		/* Unusable memory area. Reading from this area returns 0xFF.*/
-		if(addr < IO_ADDR)
-			return 0xFF;
+/**
+ * Internal function used to find the offset within cart_direct.cart_ram of the
+ * cart RAM bank selected at 0xA000.
+ *
+ * \returns	Offset of the bank, or -1 if the bank is not held in
+ *		cart_direct.cart_ram, such as when the RTC registers, MBC2
+ *		RAM or disabled cart RAM are selected, which always use the
+ *		callbacks.
+ */
+int_fast32_t __gb_cart_ram_bank_offset(const struct gb_s *gb)
+{
+	uint_fast32_t offset;
 
-		/* APU registers. */
-		if((addr >= 0xFF10) && (addr <= 0xFF3F))
-		{
-#if ENABLE_SOUND
-			return audio_read(addr);
-#else
-			static const uint8_t ortab[] = {
-				0x80, 0x3f, 0x00, 0xff, 0xbf,
-				0xff, 0x3f, 0x00, 0xff, 0xbf,
-				0x7f, 0xff, 0x9f, 0xff, 0xbf,
-				0xff, 0xff, 0x00, 0x00, 0xbf,
-				0x00, 0x00, 0x70,
-				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-				0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-				0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-			};
-			return gb->hram_io[addr - IO_ADDR] | ortab[addr - IO_ADDR];
-#endif
-		}
+	if(gb->cart_direct.cart_ram == NULL || !gb->cart_ram ||
+			!gb->enable_cart_ram || gb->mbc == 2 ||
+			(gb->mbc == 3 && gb->cart_ram_bank >= 0x08))
+		return -1;
 
-		/* HRAM */
-		if(addr >= IO_ADDR)
-			return gb->hram_io[addr - IO_ADDR];
-	}
+	if((gb->cart_mode_select || gb->mbc != 1) &&
+			gb->cart_ram_bank < gb->num_ram_banks)
+		offset = gb->cart_ram_bank * CRAM_BANK_SIZE;
+	else
+		offset = 0;
 
+	if(offset + CRAM_BANK_SIZE > gb->cart_direct.cart_ram_size)
+		return -1;
 
-	/* Return address that caused read error. */
-	(gb->gb_error)(gb, GB_INVALID_READ, addr);
-	PGB_UNREACHABLE();
+	return offset;
 }
 
 /**
- * Internal function used to write bytes.
+ * Internal function used to rebuild the memory map. Must be called whenever
+ * selected_rom_bank, cart_ram_bank, enable_cart_ram, cart_mode_select or the
+ * boot ROM mapping are changed.
  */
-void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+void __gb_update_mem_map(struct gb_s *gb)
 {
-	switch(PEANUT_GB_GET_MSN16(addr))
+	int_fast32_t cart_ram_offset;
+	uint_fast32_t offset;
+	uint_fast8_t page;
+
+	for(page = 0x0; page <= 0xF; page++)
 	{
-	case 0x0:
-	case 0x1:
-		/* Set RAM enable bit. MBC2 is handled in fall-through. */
-		if(gb->mbc > 0 && gb->mbc != 2 && gb->cart_ram)
+		gb->mem_map.read[page] = NULL;
+		gb->mem_map.write[page] = NULL;
+	}
+
+#if PEANUT_GB_OAM_DMA_TIMING
+	/* All accesses are checked during an OAM DMA transfer. */
+	if(gb->counter.oam_dma_count != 0)
+		return;
+#endif
+
+	/* VRAM, WRAM and echo RAM. */
+	for(page = 0x8; page <= 0x9; page++)
+	{
+#if PEANUT_GB_FORK
+		/* Memory shared with the parent context is only read. */
+		if(gb->fork.vram != NULL)
 		{
-			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
-			return;
+			gb->mem_map.read[page] = gb->fork.vram +
+				(page - 0x8) * 0x1000;
+			continue;
 		}
+#endif
+		gb->mem_map.read[page] = gb->vram + (page - 0x8) * 0x1000;
+#if ENABLE_LCD && PEANUT_GB_LCD_QUEUE
+		/* Queued lines are rendered before VRAM is written. */
+		if(gb->display.lines_queued)
+			continue;
+#endif
+#if !PEANUT_GB_TRACK_VRAM_WRITES
+		gb->mem_map.write[page] = gb->vram + (page - 0x8) * 0x1000;
+#endif
+	}
 
-	/* Intentional fall through. */
-	case 0x2:
-		if(gb->mbc == 5)
+	for(page = 0xC; page <= 0xE; page++)
+	{
+#if PEANUT_GB_FORK
+		if(gb->fork.wram[(page - 0xC) & 1] != NULL)
 		{
-			gb->selected_rom_bank = (gb->selected_rom_bank & 0x100) | val;
-			gb->selected_rom_bank =
-				gb->selected_rom_bank & gb->num_rom_banks_mask;
-			return;
+			gb->mem_map.read[page] = gb->fork.wram[(page - 0xC) & 1];
+			continue;
 		}
+#endif
+		gb->mem_map.read[page] = gb->wram + ((page - 0xC) & 1) * 0x1000;
+		gb->mem_map.write[page] = gb->wram + ((page - 0xC) & 1) * 0x1000;
+	}
 
-	/* Intentional fall through. */
-	case 0x3:
-		if(gb->mbc == 1)
-		{
-			//selected_rom_bank = val & 0x7;
-			gb->selected_rom_bank = (val & 0x1F) | (gb->selected_rom_bank & 0x60);
+	/* Page 0xF holds OAM, IO and HRAM, which are always handled by
+	 * __gb_read_unmapped() and __gb_write_unmapped(). */
 
-			if((gb->selected_rom_bank & 0x1F) == 0x00)
-				gb->selected_rom_bank++;
-		}
-		else if(gb->mbc == 2)
-		{
-			/* If bit 8 is 1, then set ROM bank number. */
-			if(addr & 0x100)
-			{
-				gb->selected_rom_bank = val & 0x0F;
-				/* Setting ROM bank to 0, sets it to 1. */
-				if(!gb->selected_rom_bank)
-					gb->selected_rom_bank++;
-			}
-			/* Otherwise set whether RAM is enabled or not. */
-			else
-			{
-				gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
-				return;
-			}
-		}
-		else if(gb->mbc == 3)
-		{
-			gb->selected_rom_bank = val;
-			if(!gb->cart_is_mbc3O)
-				gb->selected_rom_bank = val & 0x7F;
+	if(gb->cart_direct.rom != NULL)
+	{
+		/* The first page is left unmapped whilst the boot ROM is
+		 * enabled. */
+		for(page = (gb->hram_io[IO_BOOT] == 0) ? 0x1 : 0x0;
+				page <= 0x3; page++)
+			gb->mem_map.read[page] = gb->cart_direct.rom + page * 0x1000;
 
-			if(!gb->selected_rom_bank)
-				gb->selected_rom_bank++;
+		if(gb->mbc == 1 && gb->cart_mode_select)
+			offset = (gb->selected_rom_bank & 0x1F) * ROM_BANK_SIZE;
+		else
+			offset = gb->selected_rom_bank * ROM_BANK_SIZE;
+
+		/* Banks that are not within the ROM image are left to the
+		 * gb_rom_read callback. */
+		if(offset + ROM_BANK_SIZE <= gb->cart_direct.rom_size)
+		{
+			for(page = 0x4; page <= 0x7; page++)
+				gb->mem_map.read[page] = gb->cart_direct.rom +
+					offset + (page - 0x4) * 0x1000;
 		}
-		else if(gb->mbc == 5)
-			gb->selected_rom_bank = (val & 0x01) << 8 | (gb->selected_rom_bank & 0xFF);
+	}
 
-		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
+	cart_ram_offset = __gb_cart_ram_bank_offset(gb);
+	if(cart_ram_offset < 0)
 		return;
 
-	case 0x4:
-	case 0x5:
-		if(gb->mbc == 1)
-		{
-			gb->cart_ram_bank = (val & 3);
-			gb->selected_rom_bank = ((val & 3) << 5) | (gb->selected_rom_bank & 0x1F);
-			gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
-		}
-		else if(gb->mbc == 3)
+	for(page = 0xA; page <= 0xB; page++)
+	{
+		const uint_fast32_t p_offset = cart_ram_offset +
+			(page - 0xA) * 0x1000;
+		uint8_t *p = gb->cart_direct.cart_ram + p_offset;
+#if PEANUT_GB_FORK
+		const uint_fast32_t i = p_offset / FORK_PAGE_SIZE;
+
+		if(i < FORK_CART_RAM_PAGES &&
+				gb->fork.cart_ram[i] != NULL)
 		{
-			gb->cart_ram_bank = val;
-			/* If not using MBC3, only the first 4 cart RAM banks are useable.
-			 * If cart RAM bank 0x8-0xC are selected, then the corresponding
-			 * RTC register is selected instead of cart RAM. */
-			if(!gb->cart_is_mbc3O && gb->cart_ram_bank < 0x8)
-				gb->cart_ram_bank &= 0x3;
+			gb->mem_map.read[page] = gb->fork.cart_ram[i];
+			continue;
 		}
+#endif
+		gb->mem_map.read[page] = p;
+#if PEANUT_GB_CART_RAM_DIRTY
+		/* Clean pages are marked dirty by __gb_write_unmapped() when
+		 * they are first written. */
+		if(!(gb->cart_ram_dirty &
+				((uint_fast32_t)1 << (p_offset / CART_RAM_DIRTY_PAGE_SIZE))))
+			continue;
+#endif
+		gb->mem_map.write[page] = p;
+	}
+}
 
-		else if(gb->mbc == 5)
-			gb->cart_ram_bank = (val & 0x0F);
-
+#if ENABLE_LCD && PEANUT_GB_LCD_QUEUE
+/**
+ * Internal function used to wait for the queued lines to be rendered, before
+ * VRAM or OAM is changed.
+ */
+void __gb_lcd_sync(struct gb_s *gb)
+{
+	if(!gb->display.lines_queued)
 		return;
 
-	case 0x6:
-	case 0x7:
-		val &= 1;
-		if(gb->mbc == 3 && val && gb->cart_mode_select == 0)
-			memcpy(&gb->rtc_latched.bytes, &gb->rtc_real.bytes, sizeof(gb->rtc_latched.bytes));
+	gb->display.lcd_sync(gb);
+	gb->display.lines_queued = false;
+	__gb_update_mem_map(gb);
+}
+#endif
 
-		/* Set banking mode select. */
-		gb->cart_mode_select = val;
-		return;
+#if PEANUT_GB_OAM_DMA_TIMING
+/**
+ * Internal function used to check whether an OAM DMA transfer is in progress.
+ * The transfer is ended if its cycles have passed.
+ */
+bool __gb_oam_dma_active(struct gb_s *gb)
+{
+	if(gb->counter.oam_dma_count == 0)
+		return false;
 
-	case 0x8:
-	case 0x9:
-		gb->vram[addr - VRAM_ADDR] = val;
-		return;
-
-	case 0xA:
-	case 0xB:
-		if(gb->mbc == 3 && gb->cart_ram_bank >= 0x08)
-		{
-			const uint8_t rtc_reg_mask[5] = {
-				0x3F, 0x3F, 0x1F, 0xFF, 0xC1
-			};
-			uint8_t reg = gb->cart_ram_bank - 0x08;
-			//if(reg == 0) gb->counter.rtc_count = 0;
+	if(gb->counter.pending_cycles >= gb->counter.oam_dma_count)
+		__gb_sync_counters(gb);
 
-			gb->rtc_real.bytes[reg] = val & rtc_reg_mask[reg];
-		}
-		/* Do not write to RAM if unavailable or disabled. */
-		else if(gb->cart_ram && gb->enable_cart_ram)
-		{
-			if(gb->mbc == 2)
-			{
-				/* Only 9 bits are available in address. */
-				addr &= 0x1FF;
-				/* Data is only 4 bits wide in MBC2 RAM. */
-				val &= 0x0F;
-				/* Upper nibble is set to high. */
-				val |= 0xF0;
-				gb->gb_cart_ram_write(gb, addr, val);
-			}
-			/* If cart has RAM, use this. If MBC1, only the first
-			 * RAM bank can be written to if the advanced banking
-			 * mode is selected. */
-			else if(((gb->mbc == 1 && gb->cart_mode_select) || gb->mbc != 1) &&
-					gb->cart_ram_bank < gb->num_ram_banks)
-			{
-				gb->gb_cart_ram_write(gb,
-					addr - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE), val);
-			}
-			else if(gb->num_ram_banks)
-				gb->gb_cart_ram_write(gb, addr - CART_RAM_ADDR, val);
-		}
+	return gb->counter.oam_dma_count != 0;
+}
+#endif
 
+#if PEANUT_GB_FORK
+/**
+ * Internal function used to copy memory shared with the parent context into
+ * the context. Nothing is done if the memory is no longer shared.
+ *
+ * \param own	Memory of the context.
+ * \param shared	Entry of gb->fork for the memory. Set to NULL.
+ * \param len	Size of the memory in bytes.
+ */
+void __gb_fork_copy(uint8_t *own, const uint8_t **shared, size_t len)
+{
+	if(*shared == NULL)
 		return;
 
-	case 0xC:
-		gb->wram[addr - WRAM_0_ADDR] = val;
-		return;
+	memcpy(own, *shared, len);
+	*shared = NULL;
+}
 
-	case 0xD:
-		gb->wram[addr - WRAM_1_ADDR + WRAM_BANK_SIZE] = val;
-		return;
+/**
+ * Internal function used to copy a page of shared cart RAM into a forked
+ * context. Nothing is done if the page is no longer shared.
+ *
+ * \param i	Page of cart RAM, of FORK_PAGE_SIZE bytes.
+ */
+void __gb_fork_copy_cart_ram(struct gb_s *gb, const uint_fast32_t i)
+{
+	const size_t offset = i * FORK_PAGE_SIZE;
+	size_t len;
 
-	case 0xE:
-		gb->wram[addr - ECHO_ADDR] = val;
+	if(i >= FORK_CART_RAM_PAGES || gb->fork.cart_ram[i] == NULL)
 		return;
 
-	case 0xF:
-		if(addr < OAM_ADDR)
-		{
-			gb->wram[addr - ECHO_ADDR] = val;
-			return;
-		}
+	len = gb->cart_direct.cart_ram_size - offset;
+	if(len > FORK_PAGE_SIZE)
+		len = FORK_PAGE_SIZE;
 
-		if(addr < UNUSED_ADDR)
-		{
-			gb->oam[addr - OAM_ADDR] = val;
-			return;
-		}
+	__gb_fork_copy(gb->cart_direct.cart_ram + offset,
+			&gb->fork.cart_ram[i], len);
+}
 
-		/* Unusable memory area. */
-		if(addr < IO_ADDR)
-			return;
+/**
+ * Internal function used to find the offset in cart RAM that is accessed at
+ * addr, in the same way as __gb_read_unmapped() and __gb_write_unmapped().
+ *
+ * \returns	Offset in cart RAM, or -1 if cart RAM is not accessed, such as
+ *		when it is disabled or the RTC registers are selected.
+ */
+int_fast32_t __gb_fork_cart_ram_offset(const struct gb_s *gb,
+		const uint_fast16_t addr)
+{
+	if(!gb->cart_ram || !gb->enable_cart_ram ||
+			(gb->mbc == 3 && gb->cart_ram_bank >= 0x08))
+		return -1;
 
-		if(HRAM_ADDR <= addr && addr < INTR_EN_ADDR)
-		{
-			gb->hram_io[addr - IO_ADDR] = val;
-			return;
-		}
+	if(gb->mbc == 2)
+		return addr & 0x1FF;
 
-		if((addr >= 0xFF10) && (addr <= 0xFF3F))
-		{
-#if ENABLE_SOUND
-			audio_write(addr, val);
-#else
-			gb->hram_io[addr - IO_ADDR] = val;
-#endif
-			return;
-		}
+	if((gb->cart_mode_select || gb->mbc != 1) &&
+			gb->cart_ram_bank < gb->num_ram_banks)
+		return addr - CART_RAM_ADDR + gb->cart_ram_bank * CRAM_BANK_SIZE;
 
-		/* IO and Interrupts. */
-		switch(PEANUT_GB_GET_LSB16(addr))
-		{
-		/* Joypad */
-		case 0x00:
-			/* Only bits 5 and 4 are R/W.
-			 * The lower bits are overwritten later, and the two most
-			 * significant bits are unused. */
-			gb->hram_io[IO_JOYP] = val;
+	return addr - CART_RAM_ADDR;
+}
 
-			/* Direction keys selected */
-			if((gb->hram_io[IO_JOYP] & 0x10) == 0)
-				gb->hram_io[IO_JOYP] |= (gb->direct.joypad >> 4);
-			/* Button keys selected */
-			else
-				gb->hram_io[IO_JOYP] |= (gb->direct.joypad & 0x0F);
+/**
+ * Internal function used to copy the shared memory at addr into a forked
+ * context before it is accessed outside of the memory map. Only the page
+ * being accessed is copied.
+ */
+void __gb_fork_own(struct gb_s *gb, const uint_fast16_t addr)
+{
+	switch(PEANUT_GB_GET_MSN16(addr))
+	{
+	case 0x8:
+	case 0x9:
+		__gb_fork_copy(gb->vram, &gb->fork.vram, VRAM_SIZE);
+		break;
 
-			return;
+	case 0xA:
+	case 0xB:
+	{
+		const int_fast32_t offset = __gb_fork_cart_ram_offset(gb, addr);
 
-		/* Serial */
-		case 0x01:
-			gb->hram_io[IO_SB] = val;
+		if(offset < 0)
 			return;
 
-		case 0x02:
-			gb->hram_io[IO_SC] = val;
-			return;
+		__gb_fork_copy_cart_ram(gb, offset / FORK_PAGE_SIZE);
+		break;
+	}
 
-		/* Timer Registers */
-		case 0x04:
-			gb->hram_io[IO_DIV] = 0x00;
-			return;
+	case 0xC:
+	case 0xE:
+		__gb_fork_copy(gb->wram, &gb->fork.wram[0], FORK_PAGE_SIZE);
+		break;
 
-		case 0x05:
-			gb->hram_io[IO_TIMA] = val;
-			return;
+	case 0xD:
+	case 0xF:
+		__gb_fork_copy(gb->wram + FORK_PAGE_SIZE, &gb->fork.wram[1],
+				FORK_PAGE_SIZE);
+		break;
 
-		case 0x06:
-			gb->hram_io[IO_TMA] = val;
-			return;
+	default:
+		return;
+	}
 
-		case 0x07:
-			gb->hram_io[IO_TAC] = val;
-			return;
+	__gb_update_mem_map(gb);
+}
+#endif
 
-		/* Interrupt Flag Register */
-		case 0x0F:
-			gb->hram_io[IO_IF] = (val | 0xE0);
-			return;
+/**
+ * Internal function used to find the address given to the cart RAM callbacks
+ * for addr in the selected cart RAM bank. The first bank is used if the
+ * selected bank does not exist.
+ */
+uint_fast32_t __gb_cart_ram_addr(const struct gb_s *gb, uint_fast16_t addr)
+{
+	if(gb->cart_ram_bank < gb->num_ram_banks)
+		return addr - CART_RAM_ADDR + gb->cart_ram_bank * CRAM_BANK_SIZE;
 
-		/* LCD Registers */
-		case 0x40:
-		{
-			uint8_t lcd_enabled;
+	return addr - CART_RAM_ADDR;
+}
 
-			/* Check if LCD is already enabled. */
-			lcd_enabled = (gb->hram_io[IO_LCDC] & LCDC_ENABLE);
+/**
+ * Internal functions used to read switchable ROM banks through the gb_rom_read
+ * callback, and cart RAM through the gb_cart_ram_read callback or the RTC.
+ * gb_init() chooses the function for the MBC of the cartridge, so that the MBC
+ * type is not checked on every read.
+ */
+/* Also used for MBC5, which only differs in its registers. */
+uint8_t __gb_read_mbc0(struct gb_s *gb, uint_fast16_t addr)
+{
+	if(addr < VRAM_ADDR)
+		return gb->gb_rom_read(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
 
-			gb->hram_io[IO_LCDC] = val;
+	if(gb->cart_ram && gb->enable_cart_ram)
+		return gb->gb_cart_ram_read(gb, __gb_cart_ram_addr(gb, addr));
 
-			/* Check if LCD is going to be switched on. */
-			if (!lcd_enabled && (val & LCDC_ENABLE))
-			{
-				gb->lcd_blank = true;
-			}
-			/* Check if LCD is being switched off. */
-			else if (lcd_enabled && !(val & LCDC_ENABLE))
-			{
-				/* Peanut-GB will happily turn off LCD outside
-				 * of VBLANK even though this damages real
-				 * hardware. */
+	return 0xFF;
+}
 
-				/* Set LCD to Mode 0. */
-				gb->hram_io[IO_STAT] =
-					(gb->hram_io[IO_STAT] & ~STAT_MODE) |
-					IO_STAT_MODE_HBLANK;
-				/* LY fixed to 0 when LCD turned off. */
-				gb->hram_io[IO_LY] = 0;
-				/* Keep track of lcd_count to correctly track
-				 * passing time. */
-				gb->counter.lcd_off_count += gb->counter.lcd_count;
-				/* Reset LCD timer, since the LCD starts from
-				 * the beginning on power on. */
-				gb->counter.lcd_count = 0;
-			}
-			return;
-		}
+uint8_t __gb_read_mbc1(struct gb_s *gb, uint_fast16_t addr)
+{
+	if(addr < VRAM_ADDR)
+	{
+		if(gb->cart_mode_select)
+			return gb->gb_rom_read(gb,
+					       addr + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE);
 
-		case 0x41:
-			gb->hram_io[IO_STAT] = (val & STAT_USER_BITS) | (gb->hram_io[IO_STAT] & STAT_MODE) | 0x80;
-			return;
+		return gb->gb_rom_read(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
+	}
 
-		case 0x42:
-			gb->hram_io[IO_SCY] = val;
-			return;
+	if(!gb->cart_ram || !gb->enable_cart_ram)
+		return 0xFF;
 
-		case 0x43:
-			gb->hram_io[IO_SCX] = val;
-			return;
+	/* Only the first RAM bank is used in the default banking mode. */
+	if(gb->cart_mode_select)
+		return gb->gb_cart_ram_read(gb, __gb_cart_ram_addr(gb, addr));
 
-		/* LY (0xFF44) is read only. */
-		case 0x45:
-			gb->hram_io[IO_LYC] = val;
-			return;
+	return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR);
+}
 
-		/* DMA Register */
-		case 0x46:
-		{
-			uint16_t dma_addr;
-			uint16_t i;
+uint8_t __gb_read_mbc2(struct gb_s *gb, uint_fast16_t addr)
+{
+	if(addr < VRAM_ADDR)
+		return gb->gb_rom_read(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
 
-			dma_addr = (uint_fast16_t)val << 8;
-			gb->hram_io[IO_DMA] = val;
+	/* Only 9 bits are available in address. */
+	if(gb->cart_ram && gb->enable_cart_ram)
+		return gb->gb_cart_ram_read(gb, addr & 0x1FF);
 
-			for(i = 0; i < OAM_SIZE; i++)
-			{
-				gb->oam[i] = __gb_read(gb, dma_addr + i);
-			}
+	return 0xFF;
+}
 
-			return;
-		}
+uint8_t __gb_read_mbc3(struct gb_s *gb, uint_fast16_t addr)
+{
+	if(addr < VRAM_ADDR)
+		return gb->gb_rom_read(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
 
-		/* DMG Palette Registers */
-		case 0x47:
-			gb->hram_io[IO_BGP] = val;
-			gb->display.bg_palette[0] = (gb->hram_io[IO_BGP] & 0x03);
-			gb->display.bg_palette[1] = (gb->hram_io[IO_BGP] >> 2) & 0x03;
-			gb->display.bg_palette[2] = (gb->hram_io[IO_BGP] >> 4) & 0x03;
-			gb->display.bg_palette[3] = (gb->hram_io[IO_BGP] >> 6) & 0x03;
-			return;
+	if(gb->cart_ram_bank >= 0x08)
+		return gb->rtc_latched.bytes[gb->cart_ram_bank - 0x08];
 
-		case 0x48:
-			gb->hram_io[IO_OBP0] = val;
-			gb->display.sp_palette[0] = (gb->hram_io[IO_OBP0] & 0x03);
-			gb->display.sp_palette[1] = (gb->hram_io[IO_OBP0] >> 2) & 0x03;
-			gb->display.sp_palette[2] = (gb->hram_io[IO_OBP0] >> 4) & 0x03;
-			gb->display.sp_palette[3] = (gb->hram_io[IO_OBP0] >> 6) & 0x03;
-			return;
+	if(gb->cart_ram && gb->enable_cart_ram)
+		return gb->gb_cart_ram_read(gb, __gb_cart_ram_addr(gb, addr));
 
-		case 0x49:
-			gb->hram_io[IO_OBP1] = val;
-			gb->display.sp_palette[4] = (gb->hram_io[IO_OBP1] & 0x03);
-			gb->display.sp_palette[5] = (gb->hram_io[IO_OBP1] >> 2) & 0x03;
-			gb->display.sp_palette[6] = (gb->hram_io[IO_OBP1] >> 4) & 0x03;
-			gb->display.sp_palette[7] = (gb->hram_io[IO_OBP1] >> 6) & 0x03;
-			return;
+	return 0xFF;
+}
 
-		/* Window Position Registers */
-		case 0x4A:
-			gb->hram_io[IO_WY] = val;
-			return;
+/**
+ * Internal function used to read bytes from pages that are not in the memory
+ * map, such as IO registers or ROM accessed through the gb_rom_read callback.
+ * addr is host platform endian.
+ */
+uint8_t __gb_read_unmapped(struct gb_s *gb, uint16_t addr)
+{
+#if PEANUT_GB_OAM_DMA_TIMING
+	if(addr < IO_ADDR && __gb_oam_dma_active(gb))
+		return 0xFF;
+#endif
+#if PEANUT_GB_FORK
+	if(gb->fork.shared && addr < OAM_ADDR)
+		__gb_fork_own(gb, addr);
+#endif
 
-		case 0x4B:
-			gb->hram_io[IO_WX] = val;
-			return;
+	switch(PEANUT_GB_GET_MSN16(addr))
+	{
+	case 0x0:
+		/* IO_BOOT is only set to 1 if gb->gb_bootrom_read was not NULL
+		 * on reset. */
+		if(gb->hram_io[IO_BOOT] == 0 && addr < 0x0100)
+		{
+			return gb->gb_bootrom_read(gb, addr);
+		}
 
-		/* Turn off boot ROM */
-		case 0x50:
-			gb->hram_io[IO_BOOT] = 0x01;
-			return;
+		/* Fallthrough */
+	case 0x1:
+	case 0x2:
+	case 0x3:
+		if(gb->cart_direct.rom != NULL)
+			return gb->cart_direct.rom[addr];
 
-		/* Interrupt Enable Register */
-		case 0xFF:
-			gb->hram_io[IO_IE] = val;
+		return gb->gb_rom_read(gb, addr);
+
+	case 0x4:
+	case 0x5:
+	case 0x6:
+	case 0x7:
+		return gb->read_mbc(gb, addr);
+
+	case 0x8:
+	case 0x9:
+		return gb->vram[addr - VRAM_ADDR];
+
+	case 0xA:
+	case 0xB:
+		return gb->read_mbc(gb, addr);
+
+	case 0xC:
+	case 0xD:
+		return gb->wram[addr - WRAM_0_ADDR];
+
+	case 0xE:
+		return gb->wram[addr - ECHO_ADDR];
+
+	case 0xF:
+		if(addr < OAM_ADDR)
+			return gb->wram[addr - ECHO_ADDR];
+
+		if(addr < UNUSED_ADDR)
+			return gb->oam[addr - OAM_ADDR];
+
+		/* Unusable memory area. Reading from this area returns 0xFF.*/
+		if(addr < IO_ADDR)
+			return 0xFF;
+
+		/* APU registers. */
+		if((addr >= 0xFF10) && (addr <= 0xFF3F))
+		{
+			static const uint8_t ortab[] = {
+				0x80, 0x3f, 0x00, 0xff, 0xbf,
+				0xff, 0x3f, 0x00, 0xff, 0xbf,
+				0x7f, 0xff, 0x9f, 0xff, 0xbf,
+				0xff, 0xff, 0x00, 0x00, 0xbf,
+				0x00, 0x00, 0x70,
+				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+				0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+				0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+			};
+
+			if(gb->gb_audio_read != NULL)
+				return gb->gb_audio_read(gb, addr);
+
+			return gb->hram_io[addr - IO_ADDR] | ortab[addr - 0xFF10];
+		}
+
+		/* DIV and TIMA are updated lazily. */
+		if(addr == 0xFF04 || addr == 0xFF05)
+			__gb_sync_counters(gb);
+
+		/* HRAM */
+		if(addr >= IO_ADDR)
+			return gb->hram_io[addr - IO_ADDR];
+	}
+
+
+	/* Return address that caused read error. */
+	(gb->gb_error)(gb, GB_INVALID_READ, addr);
+	PGB_UNREACHABLE();
+}
+
+/**
+ * Internal function used to read bytes.
+ * addr is host platform endian.
+ */
+uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
+{
+	const uint8_t *page = gb->mem_map.read[PEANUT_GB_GET_MSN16(addr)];
+
+	PGB_PROFILE_ADD(gb, read[__gb_profile_region(addr)], 1);
+
+	if(PGB_LIKELY(page != NULL))
+		return page[addr & 0x0FFF];
+
+	return __gb_read_unmapped(gb, addr);
+}
+
+/**
+ * Internal function used to read bytes without counting them in the profiling
+ * counters, such as when looking ahead at code that is not yet executed.
+ */
+uint8_t __gb_peek(struct gb_s *gb, uint16_t addr)
+{
+	const uint8_t *page = gb->mem_map.read[PEANUT_GB_GET_MSN16(addr)];
+
+	if(PGB_LIKELY(page != NULL))
+		return page[addr & 0x0FFF];
+
+	return __gb_read_unmapped(gb, addr);
+}
+
+/**
+ * Internal function used to write cart RAM with the gb_cart_ram_write
+ * callback.
+ */
+void __gb_cart_ram_write(struct gb_s *gb, uint_fast32_t addr, uint8_t val)
+{
+#if PEANUT_GB_CART_RAM_DIRTY
+	gb->cart_ram_dirty |=
+		(uint_fast32_t)1 << (addr / CART_RAM_DIRTY_PAGE_SIZE);
+#endif
+	gb->gb_cart_ram_write(gb, addr, val);
+}
+
+/**
+ * Internal functions used to handle writes to the MBC registers in ROM address
+ * space, and to cart RAM through the gb_cart_ram_write callback or the RTC.
+ * gb_init() chooses the function for the MBC of the cartridge, so that the MBC
+ * type is not checked on every write.
+ */
+void __gb_write_mbc0(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+{
+	switch(PEANUT_GB_GET_MSN16(addr))
+	{
+	case 0x0:
+	case 0x1:
+	case 0x2:
+	case 0x3:
+		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
+		return;
+
+	case 0x6:
+	case 0x7:
+		gb->cart_mode_select = val & 1;
+		return;
+
+	case 0xA:
+	case 0xB:
+		if(gb->cart_ram && gb->enable_cart_ram)
+			__gb_cart_ram_write(gb, __gb_cart_ram_addr(gb, addr), val);
+
+		return;
+	}
+}
+
+void __gb_write_mbc1(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+{
+	switch(PEANUT_GB_GET_MSN16(addr))
+	{
+	case 0x0:
+	case 0x1:
+		if(gb->cart_ram)
+		{
+			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
 			return;
 		}
+
+	/* Intentional fall through. */
+	case 0x2:
+	case 0x3:
+		gb->selected_rom_bank = (val & 0x1F) | (gb->selected_rom_bank & 0x60);
+
+		if((gb->selected_rom_bank & 0x1F) == 0x00)
+			gb->selected_rom_bank++;
+
+		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
+		return;
+
+	case 0x4:
+	case 0x5:
+		gb->cart_ram_bank = (val & 3);
+		gb->selected_rom_bank = ((val & 3) << 5) | (gb->selected_rom_bank & 0x1F);
+		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
+		return;
+
+	case 0x6:
+	case 0x7:
+		gb->cart_mode_select = val & 1;
+		return;
+
+	case 0xA:
+	case 0xB:
+		if(!gb->cart_ram || !gb->enable_cart_ram)
+			return;
+
+		/* Only the first RAM bank is used in the default banking
+		 * mode. */
+		if(gb->cart_mode_select)
+			__gb_cart_ram_write(gb, __gb_cart_ram_addr(gb, addr), val);
+		else
+			__gb_cart_ram_write(gb, addr - CART_RAM_ADDR, val);
+
+		return;
 	}
+}
 
-	/* Invalid writes are ignored. */
-	return;
+void __gb_write_mbc2(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+{
+	switch(PEANUT_GB_GET_MSN16(addr))
+	{
+	case 0x0:
+	case 0x1:
+	case 0x2:
+	case 0x3:
+		/* If bit 8 is 1, then set ROM bank number. */
+		if(addr & 0x100)
+		{
+			gb->selected_rom_bank = val & 0x0F;
+			/* Setting ROM bank to 0, sets it to 1. */
+			if(!gb->selected_rom_bank)
+				gb->selected_rom_bank++;
+
+			gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
+		}
+		/* Otherwise set whether RAM is enabled or not. */
+		else
+			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
+
+		return;
+
+	case 0x6:
+	case 0x7:
+		gb->cart_mode_select = val & 1;
+		return;
+
+	case 0xA:
+	case 0xB:
+		if(!gb->cart_ram || !gb->enable_cart_ram)
+			return;
+
+		/* Only 9 bits are available in address. Data is only 4 bits
+		 * wide, and the upper nibble is set to high. */
+		__gb_cart_ram_write(gb, addr & 0x1FF, (val & 0x0F) | 0xF0);
+		return;
+	}
 }
 
-uint8_t __gb_execute_cb(struct gb_s *gb)
+void __gb_write_mbc3(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 {
-	uint8_t inst_cycles;
-	uint8_t cbop = __gb_read(gb, gb->cpu_reg.pc.reg++);
-	uint8_t r = (cbop & 0x7);
-	uint8_t b = (cbop >> 3) & 0x7;
-	uint8_t d = (cbop >> 3) & 0x1;
-	uint8_t val;
-	uint8_t writeback = 1;
+	switch(PEANUT_GB_GET_MSN16(addr))
+	{
+	case 0x0:
+	case 0x1:
+		if(gb->cart_ram)
+		{
+			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
+			return;
+		}
 
-	inst_cycles = 8;
-	/* Add an additional 8 cycles to these sets of instructions. */
-	switch(cbop & 0xC7)
+	/* Intentional fall through. */
+	case 0x2:
+	case 0x3:
+		gb->selected_rom_bank = val;
+		if(!gb->cart_is_mbc3O)
+			gb->selected_rom_bank = val & 0x7F;
+
+		if(!gb->selected_rom_bank)
+			gb->selected_rom_bank++;
+
+		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
+		return;
+
+	case 0x4:
+	case 0x5:
+		/* Values above 0x0C select nothing. */
+		if(val > 0x0C)
+			return;
+
+		gb->cart_ram_bank = val;
+		/* If not using MBC3, only the first 4 cart RAM banks are useable.
+		 * If cart RAM bank 0x8-0xC are selected, then the corresponding
+		 * RTC register is selected instead of cart RAM. */
+		if(!gb->cart_is_mbc3O && gb->cart_ram_bank < 0x8)
+			gb->cart_ram_bank &= 0x3;
+
+		return;
+
+	case 0x6:
+	case 0x7:
+		val &= 1;
+		if(val && gb->cart_mode_select == 0)
+		{
+			/* The RTC is updated lazily. */
+			__gb_sync_counters(gb);
+			memcpy(&gb->rtc_latched.bytes, &gb->rtc_real.bytes, sizeof(gb->rtc_latched.bytes));
+		}
+
+		/* Set banking mode select. */
+		gb->cart_mode_select = val;
+		return;
+
+	case 0xA:
+	case 0xB:
+		if(gb->cart_ram_bank >= 0x08)
+		{
+			const uint8_t rtc_reg_mask[5] = {
+				0x3F, 0x3F, 0x1F, 0xFF, 0xC1
+			};
+			uint8_t reg = gb->cart_ram_bank - 0x08;
+
+			__gb_sync_counters(gb);
+
+			gb->rtc_real.bytes[reg] = val & rtc_reg_mask[reg];
+		}
+		else if(gb->cart_ram && gb->enable_cart_ram)
+			__gb_cart_ram_write(gb, __gb_cart_ram_addr(gb, addr), val);
+
+		return;
+	}
+}
+
+void __gb_write_mbc5(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+{
+	switch(PEANUT_GB_GET_MSN16(addr))
 	{
-	case 0x06:
-	case 0x86:
-    	case 0xC6:
-		inst_cycles += 8;
-    	break;
-    	case 0x46:
-		inst_cycles += 4;
-    	break;
+	case 0x0:
+	case 0x1:
+		if(gb->cart_ram)
+		{
+			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
+			return;
+		}
+
+	/* Intentional fall through. */
+	case 0x2:
+		gb->selected_rom_bank = (gb->selected_rom_bank & 0x100) | val;
+		gb->selected_rom_bank =
+			gb->selected_rom_bank & gb->num_rom_banks_mask;
+		return;
+
+	case 0x3:
+		gb->selected_rom_bank = (val & 0x01) << 8 | (gb->selected_rom_bank & 0xFF);
+		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
+		return;
+
+	case 0x4:
+	case 0x5:
+		gb->cart_ram_bank = (val & 0x0F);
+		return;
+
+	case 0x6:
+	case 0x7:
+		gb->cart_mode_select = val & 1;
+		return;
+
+	case 0xA:
+	case 0xB:
+		if(gb->cart_ram && gb->enable_cart_ram)
+			__gb_cart_ram_write(gb, __gb_cart_ram_addr(gb, addr), val);
+
+		return;
+	}
+}
+
+/**
+ * Internal function used to write bytes to pages that are not in the memory
+ * map, such as IO registers or the MBC registers.
+ */
+void __gb_write_unmapped(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+{
+#if PEANUT_GB_OAM_DMA_TIMING
+	if(addr < IO_ADDR && __gb_oam_dma_active(gb))
+		return;
+#endif
+#if PEANUT_GB_FORK
+	if(gb->fork.shared && addr < OAM_ADDR)
+	{
+		uint8_t *page;
+
+		__gb_fork_own(gb, addr);
+
+		/* Copied cart RAM may now be in the memory map. */
+		page = gb->mem_map.write[PEANUT_GB_GET_MSN16(addr)];
+		if(page != NULL)
+		{
+			page[addr & 0x0FFF] = val;
+			return;
+		}
+	}
+#endif
+
+	switch(PEANUT_GB_GET_MSN16(addr))
+	{
+	case 0x0:
+	case 0x1:
+	case 0x2:
+	case 0x3:
+	case 0x4:
+	case 0x5:
+	case 0x6:
+	case 0x7:
+		gb->write_mbc(gb, addr, val);
+		__gb_update_mem_map(gb);
+		return;
+
+	case 0x8:
+	case 0x9:
+#if ENABLE_LCD && PEANUT_GB_LCD_QUEUE
+		__gb_lcd_sync(gb);
+#endif
+#if ENABLE_LCD && PEANUT_GB_SKIP_UNCHANGED_LINES
+		if(gb->vram[addr - VRAM_ADDR] != val)
+			gb->display.mem_version++;
+#endif
+#if ENABLE_LCD && PEANUT_GB_TILE_CACHE
+		if(addr - VRAM_ADDR < VRAM_NUM_TILES * 0x10)
+			gb->display.tile_dirty[(addr - VRAM_ADDR) >> 4] = true;
+#endif
+		gb->vram[addr - VRAM_ADDR] = val;
+		return;
+
+	case 0xA:
+	case 0xB:
+#if PEANUT_GB_CART_RAM_DIRTY
+	{
+		/* Cart RAM held in cart_direct is only written here when its
+		 * page is clean, which is then mapped for writing. */
+		const int_fast32_t bank = __gb_cart_ram_bank_offset(gb);
+
+		if(bank >= 0)
+		{
+			const uint_fast32_t offset = bank + addr - CART_RAM_ADDR;
+
+			gb->cart_ram_dirty |= (uint_fast32_t)1 <<
+				(offset / CART_RAM_DIRTY_PAGE_SIZE);
+			gb->cart_direct.cart_ram[offset] = val;
+			__gb_update_mem_map(gb);
+			return;
+		}
+	}
+#endif
+		/* Cart RAM writes do not change the memory map. */
+		gb->write_mbc(gb, addr, val);
+		return;
+
+	case 0xC:
+		gb->wram[addr - WRAM_0_ADDR] = val;
+		return;
+
+	case 0xD:
+		gb->wram[addr - WRAM_1_ADDR + WRAM_BANK_SIZE] = val;
+		return;
+
+	case 0xE:
+		gb->wram[addr - ECHO_ADDR] = val;
+		return;
+
+	case 0xF:
+		if(addr < OAM_ADDR)
+		{
+			gb->wram[addr - ECHO_ADDR] = val;
+			return;
+		}
+
+		if(addr < UNUSED_ADDR)
+		{
+#if ENABLE_LCD && PEANUT_GB_LCD_QUEUE
+			__gb_lcd_sync(gb);
+#endif
+#if ENABLE_LCD && PEANUT_GB_SKIP_UNCHANGED_LINES
+			if(gb->oam[addr - OAM_ADDR] != val)
+				gb->display.mem_version++;
+#endif
+#if ENABLE_LCD && PEANUT_GB_HIGH_LCD_ACCURACY
+			gb->display.sprites_dirty = true;
+#endif
+			gb->oam[addr - OAM_ADDR] = val;
+			return;
+		}
+
+		/* Unusable memory area. */
+		if(addr < IO_ADDR)
+			return;
+
+		if(HRAM_ADDR <= addr && addr < INTR_EN_ADDR)
+		{
+			gb->hram_io[addr - IO_ADDR] = val;
+			return;
+		}
+
+		if((addr >= 0xFF10) && (addr <= 0xFF3F))
+		{
+			if(gb->gb_audio_write != NULL)
+				gb->gb_audio_write(gb, addr, val);
+			else
+				gb->hram_io[addr - IO_ADDR] = val;
+
+			return;
+		}
+
+		/* IO and Interrupts. */
+		switch(PEANUT_GB_GET_LSB16(addr))
+		{
+		/* Joypad */
+		case 0x00:
+			/* Only bits 5 and 4 are R/W.
+			 * The lower bits are overwritten later, and the two most
+			 * significant bits are unused. */
+			gb->hram_io[IO_JOYP] = val;
+
+			/* Direction keys selected */
+			if((gb->hram_io[IO_JOYP] & 0x10) == 0)
+				gb->hram_io[IO_JOYP] |= (gb->direct.joypad >> 4);
+			/* Button keys selected */
+			else
+				gb->hram_io[IO_JOYP] |= (gb->direct.joypad & 0x0F);
+
+			return;
+
+		/* Serial */
+		case 0x01:
+			gb->hram_io[IO_SB] = val;
+			return;
+
+		case 0x02:
+			__gb_sync_counters(gb);
+			gb->hram_io[IO_SC] = val;
+			__gb_update_next_event(gb);
+			return;
+
+		/* Timer Registers */
+		case 0x04:
+			__gb_sync_counters(gb);
+			gb->hram_io[IO_DIV] = 0x00;
+			return;
+
+		case 0x05:
+			__gb_sync_counters(gb);
+			gb->hram_io[IO_TIMA] = val;
+			__gb_update_next_event(gb);
+			return;
+
+		case 0x06:
+			gb->hram_io[IO_TMA] = val;
+			return;
+
+		case 0x07:
+			__gb_sync_counters(gb);
+			gb->hram_io[IO_TAC] = val;
+			__gb_update_next_event(gb);
+			return;
+
+		/* Interrupt Flag Register */
+		case 0x0F:
+			gb->hram_io[IO_IF] = (val | 0xE0);
+			return;
+
+		/* LCD Registers */
+		case 0x40:
+		{
+			uint8_t lcd_enabled;
+
+			__gb_sync_counters(gb);
+
+			/* Check if LCD is already enabled. */
+			lcd_enabled = (gb->hram_io[IO_LCDC] & LCDC_ENABLE);
+
+			gb->hram_io[IO_LCDC] = val;
+
+			/* Check if LCD is going to be switched on. */
+			if (!lcd_enabled && (val & LCDC_ENABLE))
+			{
+				gb->lcd_blank = true;
+			}
+			/* Check if LCD is being switched off. */
+			else if (lcd_enabled && !(val & LCDC_ENABLE))
+			{
+				/* Peanut-GB will happily turn off LCD outside
+				 * of VBLANK even though this damages real
+				 * hardware. */
+
+				/* Set LCD to Mode 0. */
+				gb->hram_io[IO_STAT] =
+					(gb->hram_io[IO_STAT] & ~STAT_MODE) |
+					IO_STAT_MODE_HBLANK;
+				/* LY fixed to 0 when LCD turned off. */
+				gb->hram_io[IO_LY] = 0;
+				/* Keep track of lcd_count to correctly track
+				 * passing time. */
+				gb->counter.lcd_off_count += gb->counter.lcd_count;
+				/* Reset LCD timer, since the LCD starts from
+				 * the beginning on power on. */
+				gb->counter.lcd_count = 0;
+			}
+
+			__gb_update_next_event(gb);
+			return;
+		}
+
+		case 0x41:
+			gb->hram_io[IO_STAT] = (val & STAT_USER_BITS) | (gb->hram_io[IO_STAT] & STAT_MODE) | 0x80;
+			return;
+
+		case 0x42:
+			gb->hram_io[IO_SCY] = val;
+			return;
+
+		case 0x43:
+			gb->hram_io[IO_SCX] = val;
+			return;
+
+		/* LY (0xFF44) is read only. */
+		case 0x45:
+			gb->hram_io[IO_LYC] = val;
+			return;
+
+		/* DMA Register */
+		case 0x46:
+		{
+			const uint16_t dma_addr = (uint_fast16_t)val << 8;
+
+			gb->hram_io[IO_DMA] = val;
+			PGB_PROFILE_ADD(gb, oam_dma, 1);
+
+#if PEANUT_GB_OAM_DMA_TIMING
+			/* Starting a transfer restarts the one in progress. The
+			 * bytes are copied by __gb_sync_counters() as the
+			 * transfer's cycles pass. */
+			(void) dma_addr;
+			__gb_sync_counters(gb);
+			gb->counter.oam_dma_count = OAM_DMA_CYCLES;
+			__gb_update_mem_map(gb);
+#else
+			const uint8_t *src;
+
+#if ENABLE_LCD && PEANUT_GB_LCD_QUEUE
+			__gb_lcd_sync(gb);
+#endif
+
+			/* The source is always within a single page, so is
+			 * copied at once when the page is mapped. */
+			src = gb->mem_map.read[PEANUT_GB_GET_MSN16(dma_addr)];
+			if(src != NULL)
+			{
+				src += dma_addr & 0x0FFF;
+				PGB_PROFILE_ADD(gb,
+					read[__gb_profile_region(dma_addr)],
+					OAM_SIZE);
+#if ENABLE_LCD && PEANUT_GB_SKIP_UNCHANGED_LINES
+				if(memcmp(gb->oam, src, OAM_SIZE) != 0)
+					gb->display.mem_version++;
+#endif
+				memcpy(gb->oam, src, OAM_SIZE);
+			}
+			else
+			{
+				for(uint_fast16_t i = 0; i < OAM_SIZE; i++)
+				{
+#if ENABLE_LCD && PEANUT_GB_SKIP_UNCHANGED_LINES
+					uint8_t v = __gb_read(gb, dma_addr + i);
+					if(gb->oam[i] != v)
+						gb->display.mem_version++;
+					gb->oam[i] = v;
+#else
+					gb->oam[i] = __gb_read(gb, dma_addr + i);
+#endif
+				}
+			}
+
+#if ENABLE_LCD && PEANUT_GB_HIGH_LCD_ACCURACY
+			gb->display.sprites_dirty = true;
+#endif
+#endif
+			return;
+		}
+
+		/* DMG Palette Registers */
+		case 0x47:
+			gb->hram_io[IO_BGP] = val;
+			gb->display.bg_palette[0] = (gb->hram_io[IO_BGP] & 0x03);
+			gb->display.bg_palette[1] = (gb->hram_io[IO_BGP] >> 2) & 0x03;
+			gb->display.bg_palette[2] = (gb->hram_io[IO_BGP] >> 4) & 0x03;
+			gb->display.bg_palette[3] = (gb->hram_io[IO_BGP] >> 6) & 0x03;
+			return;
+
+		case 0x48:
+			gb->hram_io[IO_OBP0] = val;
+			gb->display.sp_palette[0] = (gb->hram_io[IO_OBP0] & 0x03);
+			gb->display.sp_palette[1] = (gb->hram_io[IO_OBP0] >> 2) & 0x03;
+			gb->display.sp_palette[2] = (gb->hram_io[IO_OBP0] >> 4) & 0x03;
+			gb->display.sp_palette[3] = (gb->hram_io[IO_OBP0] >> 6) & 0x03;
+			return;
+
+		case 0x49:
+			gb->hram_io[IO_OBP1] = val;
+			gb->display.sp_palette[4] = (gb->hram_io[IO_OBP1] & 0x03);
+			gb->display.sp_palette[5] = (gb->hram_io[IO_OBP1] >> 2) & 0x03;
+			gb->display.sp_palette[6] = (gb->hram_io[IO_OBP1] >> 4) & 0x03;
+			gb->display.sp_palette[7] = (gb->hram_io[IO_OBP1] >> 6) & 0x03;
+			return;
+
+		/* Window Position Registers */
+		case 0x4A:
+			gb->hram_io[IO_WY] = val;
+			return;
+
+		case 0x4B:
+			gb->hram_io[IO_WX] = val;
+			return;
+
+		/* Turn off boot ROM */
+		case 0x50:
+			gb->hram_io[IO_BOOT] = 0x01;
+			__gb_update_mem_map(gb);
+			return;
+
+		/* Interrupt Enable Register */
+		case 0xFF:
+			gb->hram_io[IO_IE] = val;
+			return;
+		}
+	}
+
+	/* Invalid writes are ignored. */
+	return;
+}
+
+/**
+ * Internal function used to write bytes.
+ */
+void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+{
+	uint8_t *page = gb->mem_map.write[PEANUT_GB_GET_MSN16(addr)];
+
+	PGB_PROFILE_ADD(gb, write[__gb_profile_region(addr)], 1);
+
+	if(PGB_LIKELY(page != NULL))
+	{
+		page[addr & 0x0FFF] = val;
+		return;
+	}
+
+	__gb_write_unmapped(gb, addr, val);
+}
+
+#if PEANUT_GB_DECODE_CACHE
+/**
+ * Internal function used to find the bytes of the instruction at PC in the
+ * decode cache. They are read into the cache if they are not already there.
+ *
+ * \returns	The bytes of the instruction, or NULL if they must be read with
+ *		__gb_read() because they are not in ROM that may be cached.
+ */
+const uint8_t *__gb_decode_cache_fetch(struct gb_s *gb)
+{
+	const uint_fast16_t pc = gb->cpu_reg.pc.reg;
+	uint_fast32_t offset, i;
+
+	/* Only called for pages that are not in the memory map. The last two
+	 * bytes of each ROM bank are not cached, as the instruction may
+	 * continue into the next bank or VRAM. */
+	if(pc >= VRAM_ADDR || (pc & 0x3FFF) > 0x3FFD)
+		return NULL;
+
+	/* The boot ROM is not cached. */
+	if(gb->hram_io[IO_BOOT] == 0 && pc < 0x0100)
+		return NULL;
+
+#if PEANUT_GB_OAM_DMA_TIMING
+	/* ROM is not readable during OAM DMA. */
+	if(gb->counter.oam_dma_count != 0)
+		return NULL;
+#endif
+
+	/* Find the offset given to the gb_rom_read callback. */
+	offset = pc;
+	if(pc >= ROM_BANK_SIZE)
+	{
+		if(gb->mbc == 1 && gb->cart_mode_select)
+			offset += ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE;
+		else
+			offset += (gb->selected_rom_bank - 1) * ROM_BANK_SIZE;
+	}
+
+	/* Mix in the page number, so that the same address in different banks
+	 * does not use the same entry. */
+	i = (offset ^ (offset >> 12)) & (DECODE_CACHE_SIZE - 1);
+
+	if(gb->decode_cache[i].offset != (uint32_t)offset)
+	{
+		gb->decode_cache[i].bytes[0] = __gb_read_unmapped(gb, pc);
+		gb->decode_cache[i].bytes[1] = __gb_read_unmapped(gb, pc + 1);
+		gb->decode_cache[i].bytes[2] = __gb_read_unmapped(gb, pc + 2);
+		gb->decode_cache[i].offset = (uint32_t)offset;
+	}
+
+	return gb->decode_cache[i].bytes;
+}
+
+/* Fetches the next byte of the instruction being executed. fetch holds the
+ * bytes of the instruction from __gb_decode_cache_fetch(). */
+# define PGB_FETCH()							\
+	(fetch != NULL ?						\
+	 (PGB_PROFILE_ADD(gb,						\
+		read[__gb_profile_region(gb->cpu_reg.pc.reg)], 1),	\
+	  gb->cpu_reg.pc.reg++, *fetch++) :				\
+	 __gb_read(gb, gb->cpu_reg.pc.reg++))
+#else
+# define PGB_FETCH()	__gb_read(gb, gb->cpu_reg.pc.reg++)
+#endif
+
+/**
+ * Internal function used to execute the CB prefixed opcode cbop.
+ */
+uint8_t __gb_execute_cb(struct gb_s *gb, uint8_t cbop)
+{
+	uint8_t inst_cycles;
+	uint8_t r = (cbop & 0x7);
+	uint8_t b = (cbop >> 3) & 0x7;
+	uint8_t d = (cbop >> 3) & 0x1;
+	uint8_t val;
+	uint8_t writeback = 1;
+
+	PGB_PROFILE_ADD(gb, cb_opcode[cbop], 1);
+
+	inst_cycles = 8;
+	/* Add an additional 8 cycles to these sets of instructions. */
+	switch(cbop & 0xC7)
+	{
+	case 0x06:
+	case 0x86:
+    	case 0xC6:
+		inst_cycles += 8;
+    	break;
+    	case 0x46:
+		inst_cycles += 4;
+    	break;
+	}
+
+	switch(r)
+	{
+	case 0:
+		val = gb->cpu_reg.bc.bytes.b;
+		break;
+
+	case 1:
+		val = gb->cpu_reg.bc.bytes.c;
+		break;
+
+	case 2:
+		val = gb->cpu_reg.de.bytes.d;
+		break;
+
+	case 3:
+		val = gb->cpu_reg.de.bytes.e;
+		break;
+
+	case 4:
+		val = gb->cpu_reg.hl.bytes.h;
+		break;
+
+	case 5:
+		val = gb->cpu_reg.hl.bytes.l;
+		break;
+
+	case 6:
+		val = __gb_read(gb, gb->cpu_reg.hl.reg);
+		break;
+
+	/* Only values 0-7 are possible here, so we make the final case
+	 * default to satisfy -Wmaybe-uninitialized warning. */
+	default:
+		val = gb->cpu_reg.a;
+		break;
+	}
+
+	switch(cbop >> 6)
+	{
+	case 0x0:
+		cbop = (cbop >> 4) & 0x3;
+
+		switch(cbop)
+		{
+		case 0x0: /* RdC R */
+		case 0x1: /* Rd R */
+			if(d) /* RRC R / RR R */
+			{
+				uint8_t temp = val;
+				val = (val >> 1);
+				val |= cbop ? (gb->cpu_reg.f.f_bits.c << 7) : (temp << 7);
+				gb->cpu_reg.f.reg = 0;
+				gb->cpu_reg.f.f_bits.z = (val == 0x00);
+				gb->cpu_reg.f.f_bits.c = (temp & 0x01);
+			}
+			else /* RLC R / RL R */
+			{
+				uint8_t temp = val;
+				val = (val << 1);
+				val |= cbop ? gb->cpu_reg.f.f_bits.c : (temp >> 7);
+				gb->cpu_reg.f.reg = 0;
+				gb->cpu_reg.f.f_bits.z = (val == 0x00);
+				gb->cpu_reg.f.f_bits.c = (temp >> 7);
+			}
+
+			break;
+
+		case 0x2:
+			if(d) /* SRA R */
+			{
+				gb->cpu_reg.f.reg = 0;
+				gb->cpu_reg.f.f_bits.c = val & 0x01;
+				val = (val >> 1) | (val & 0x80);
+				gb->cpu_reg.f.f_bits.z = (val == 0x00);
+			}
+			else /* SLA R */
+			{
+				gb->cpu_reg.f.reg = 0;
+				gb->cpu_reg.f.f_bits.c = (val >> 7);
+				val = val << 1;
+				gb->cpu_reg.f.f_bits.z = (val == 0x00);
+			}
+
+			break;
+
+		case 0x3:
+			if(d) /* SRL R */
+			{
+				gb->cpu_reg.f.reg = 0;
+				gb->cpu_reg.f.f_bits.c = val & 0x01;
+				val = val >> 1;
+				gb->cpu_reg.f.f_bits.z = (val == 0x00);
+			}
+			else /* SWAP R */
+			{
+				uint8_t temp = (val >> 4) & 0x0F;
+				temp |= (val << 4) & 0xF0;
+				val = temp;
+				gb->cpu_reg.f.reg = 0;
+				gb->cpu_reg.f.f_bits.z = (val == 0x00);
+			}
+
+			break;
+		}
+
+		break;
+
+	case 0x1: /* BIT B, R */
+		gb->cpu_reg.f.f_bits.z = !((val >> b) & 0x1);
+		gb->cpu_reg.f.f_bits.n = 0;
+		gb->cpu_reg.f.f_bits.h = 1;
+		writeback = 0;
+		break;
+
+	case 0x2: /* RES B, R */
+		val &= (0xFE << b) | (0xFF >> (8 - b));
+		break;
+
+	case 0x3: /* SET B, R */
+		val |= (0x1 << b);
+		break;
+	}
+
+	if(writeback)
+	{
+		switch(r)
+		{
+		case 0:
+			gb->cpu_reg.bc.bytes.b = val;
+			break;
+
+		case 1:
+			gb->cpu_reg.bc.bytes.c = val;
+			break;
+
+		case 2:
+			gb->cpu_reg.de.bytes.d = val;
+			break;
+
+		case 3:
+			gb->cpu_reg.de.bytes.e = val;
+			break;
+
+		case 4:
+			gb->cpu_reg.hl.bytes.h = val;
+			break;
+
+		case 5:
+			gb->cpu_reg.hl.bytes.l = val;
+			break;
+
+		case 6:
+			__gb_write(gb, gb->cpu_reg.hl.reg, val);
+			break;
+
+		case 7:
+			gb->cpu_reg.a = val;
+			break;
+		}
+	}
+	return inst_cycles;
+}
+
+#if ENABLE_LCD
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+/**
+ * Internal function used to sort the sprites into the lines that they are
+ * drawn on. Each line keeps the 10 sprites with the lowest X position, using
+ * the lowest OAM index where X positions are equal, sorted from the highest
+ * priority. Called before drawing a line whenever OAM or the sprite size has
+ * changed.
+ *
+ * \param height	Height of the sprites, which is 8 or 16.
+ */
+void __gb_sort_line_sprites(struct gb_s *gb, uint8_t height)
+{
+	memset(gb->display.line_sprites_count, 0,
+			sizeof(gb->display.line_sprites_count));
+
+	for(uint_fast8_t s = 0; s < NUM_SPRITES; s++)
+	{
+		/* Sprite Y position is that of the bottom of a tall sprite. */
+		const int_fast16_t top = gb->oam[4 * s + 0] - 16;
+		const uint8_t x = gb->oam[4 * s + 1];
+		int_fast16_t ly = top < 0 ? 0 : top;
+		int_fast16_t end = top + height;
+
+		if(end > LCD_HEIGHT)
+			end = LCD_HEIGHT;
+
+		for(; ly < end; ly++)
+		{
+			uint8_t *line = gb->display.line_sprites[ly];
+			uint8_t count = gb->display.line_sprites_count[ly];
+			uint8_t place;
+
+			/* Sprites are added in OAM order, so the new sprite goes
+			 * after those with an equal X position. */
+			for(place = count; place != 0; place--)
+			{
+				if(gb->oam[4 * line[place - 1] + 1] <= x)
+					break;
+			}
+
+			if(place >= MAX_SPRITES_LINE)
+				continue;
+
+			if(count < MAX_SPRITES_LINE)
+				count++;
+
+			memmove(&line[place + 1], &line[place],
+					count - place - 1);
+			line[place] = s;
+			gb->display.line_sprites_count[ly] = count;
+		}
+	}
+
+	gb->display.sprites_dirty = false;
+	gb->display.line_sprites_height = height;
+}
+#endif
+
+/**
+ * Internal function used to decode rows of consecutive tiles and apply a
+ * palette to them. Vector instructions are used when available.
+ *
+ * \param out	Receives 8 pixels for each tile, from the leftmost pixel.
+ * \param t1	Low bitplane of each tile row.
+ * \param t2	High bitplane of each tile row.
+ * \param tiles	Number of tiles to decode. Must be a multiple of 2.
+ * \param pal	Pixel value for each of the four colours.
+ */
+void __gb_decode_tile_rows(uint8_t *out, const uint8_t *t1,
+		const uint8_t *t2, uint_fast8_t tiles, const uint8_t pal[4])
+{
+#if defined(PGB_INTRIN_SSE2)
+	/* Bit of the bitplane that is used for each pixel. */
+	const __m128i bit = _mm_set_epi8(
+			0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+			0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80);
+	const __m128i p0 = _mm_set1_epi8(pal[0]);
+	const __m128i p1 = _mm_set1_epi8(pal[1]);
+	const __m128i p2 = _mm_set1_epi8(pal[2]);
+	const __m128i p3 = _mm_set1_epi8(pal[3]);
+	uint_fast8_t i;
+
+	for(i = 0; i < tiles; i += 2)
+	{
+		__m128i lo = _mm_cvtsi32_si128(t1[i] | (t1[i + 1] << 8));
+		__m128i hi = _mm_cvtsi32_si128(t2[i] | (t2[i + 1] << 8));
+		__m128i l, h, c;
+
+		/* Repeat the byte of each tile across 8 lanes. */
+		lo = _mm_unpacklo_epi8(lo, lo);
+		lo = _mm_unpacklo_epi16(lo, lo);
+		lo = _mm_unpacklo_epi32(lo, lo);
+		hi = _mm_unpacklo_epi8(hi, hi);
+		hi = _mm_unpacklo_epi16(hi, hi);
+		hi = _mm_unpacklo_epi32(hi, hi);
+
+		/* All ones in lanes where the bit is set. */
+		l = _mm_cmpeq_epi8(_mm_and_si128(lo, bit), bit);
+		h = _mm_cmpeq_epi8(_mm_and_si128(hi, bit), bit);
+
+		/* Select the palette entry from the two bits. */
+		c = _mm_or_si128(
+			_mm_andnot_si128(h, _mm_or_si128(
+				_mm_andnot_si128(l, p0), _mm_and_si128(l, p1))),
+			_mm_and_si128(h, _mm_or_si128(
+				_mm_andnot_si128(l, p2), _mm_and_si128(l, p3))));
+		_mm_storeu_si128((__m128i *)(out + i * 8), c);
+	}
+#elif defined(PGB_INTRIN_NEON)
+	const uint8_t bits[8] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+	const uint8_t pal8[8] = { pal[0], pal[1], pal[2], pal[3], 0, 0, 0, 0 };
+	const uint8x8_t bit = vld1_u8(bits);
+	const uint8x8_t p = vld1_u8(pal8);
+	uint_fast8_t i;
+
+	for(i = 0; i < tiles; i++)
+	{
+		uint8x8_t l = vand_u8(vtst_u8(vdup_n_u8(t1[i]), bit),
+				vdup_n_u8(1));
+		uint8x8_t h = vand_u8(vtst_u8(vdup_n_u8(t2[i]), bit),
+				vdup_n_u8(2));
+
+		vst1_u8(out + i * 8, vtbl1_u8(p, vorr_u8(l, h)));
+	}
+#else
+	/* Decode 8 pixels at a time within a 64-bit integer. The least
+	 * significant byte of each value is the leftmost pixel. */
+	const uint64_t ones = 0x0101010101010101;
+	const uint64_t p0 = pal[0] * ones, p1 = pal[1] * ones;
+	const uint64_t p2 = pal[2] * ones, p3 = pal[3] * ones;
+	uint_fast8_t i;
+
+	for(i = 0; i < tiles; i++)
+	{
+		/* Move bit 7 - n of each bitplane to byte n, and set the byte
+		 * to 0xFF if the bit is set. */
+		uint64_t l = (t1[i] * ones) & 0x0102040810204080;
+		uint64_t h = (t2[i] * ones) & 0x0102040810204080;
+		uint64_t c;
+		uint_fast8_t b;
+
+		l = (((l + 0x7F7F7F7F7F7F7F7F) >> 7) & ones) * 0xFF;
+		h = (((h + 0x7F7F7F7F7F7F7F7F) >> 7) & ones) * 0xFF;
+
+		c = (~h & ((~l & p0) | (l & p1))) | (h & ((~l & p2) | (l & p3)));
+
+		/* The bytes are stored one at a time so that the order does
+		 * not depend on the endianness of the host. Compilers merge
+		 * them into a single store on little endian hosts. */
+		for(b = 0; b < 8; b++)
+			out[i * 8 + b] = (uint8_t)(c >> (b * 8));
+	}
+#endif
+}
+
+#if PEANUT_GB_TILE_CACHE
+/**
+ * Internal function used to replace colour indices with their palette entry.
+ *
+ * \param buf	Colour indices from 0 to 3, replaced with pixel values.
+ * \param len	Length of buf. Must be a multiple of 16.
+ * \param pal	Pixel value for each of the four colours.
+ */
+void __gb_apply_palette(uint8_t *buf, size_t len, const uint8_t pal[4])
+{
+#if defined(PGB_INTRIN_SSE2)
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i two = _mm_set1_epi8(2);
+	const __m128i p0 = _mm_set1_epi8(pal[0]);
+	const __m128i p1 = _mm_set1_epi8(pal[1]);
+	const __m128i p2 = _mm_set1_epi8(pal[2]);
+	const __m128i p3 = _mm_set1_epi8(pal[3]);
+	size_t i;
+
+	for(i = 0; i < len; i += 16)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i l = _mm_cmpeq_epi8(_mm_and_si128(c, one), one);
+		__m128i h = _mm_cmpeq_epi8(_mm_and_si128(c, two), two);
+
+		c = _mm_or_si128(
+			_mm_andnot_si128(h, _mm_or_si128(
+				_mm_andnot_si128(l, p0), _mm_and_si128(l, p1))),
+			_mm_and_si128(h, _mm_or_si128(
+				_mm_andnot_si128(l, p2), _mm_and_si128(l, p3))));
+		_mm_storeu_si128((__m128i *)(buf + i), c);
+	}
+#elif defined(PGB_INTRIN_NEON)
+	const uint8_t pal8[8] = { pal[0], pal[1], pal[2], pal[3], 0, 0, 0, 0 };
+	const uint8x8_t p = vld1_u8(pal8);
+	size_t i;
+
+	for(i = 0; i < len; i += 8)
+		vst1_u8(buf + i, vtbl1_u8(p, vld1_u8(buf + i)));
+#else
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		buf[i] = pal[buf[i]];
+#endif
+}
+
+/**
+ * Internal function used to get a row of a decoded tile, decoding the tile
+ * first if it was modified since it was last used.
+ *
+ * \param tile	Tile number, where tile 0 is at 0x8000.
+ * \param py	Row of the tile, from 0 to 7.
+ * \returns	8 colour indices, from the leftmost pixel.
+ */
+const uint8_t *__gb_get_tile_row(struct gb_s *gb, uint_fast16_t tile,
+		uint_fast8_t py)
+{
+	if(gb->display.tile_dirty[tile])
+	{
+		const uint8_t *data = &gb->vram[VRAM_TILES_1 + tile * 0x10];
+		uint_fast8_t y, x;
+
+		for(y = 0; y < 8; y++)
+		{
+			uint8_t t1 = data[2 * y];
+			uint8_t t2 = data[2 * y + 1];
+
+			for(x = 0; x < 8; x++)
+			{
+				gb->display.tile_cache[tile][y][x] =
+					((t1 >> (7 - x)) & 1) |
+					(((t2 >> (7 - x)) & 1) << 1);
+			}
+		}
+
+		gb->display.tile_dirty[tile] = false;
+	}
+
+	return gb->display.tile_cache[tile][py];
+}
+
+/* Tile number of a background or window map entry. */
+#define PGB_MAP_TILE(lcdc, idx)						\
+	(((lcdc) & LCDC_TILE_SELECT) ?					\
+	 (uint_fast16_t)(idx) : (uint_fast16_t)(256 + (int8_t)(idx)))
+#endif
+
+/**
+ * Internal function used to render a line from the registers captured when
+ * the line was drawn, and the current VRAM and OAM. The registers within the
+ * emulator context are not used, so that the line may be rendered after
+ * emulation has continued.
+ */
+void __gb_render_line(struct gb_s *gb, const struct gb_lcd_line_s *regs)
+{
+	uint8_t line_buf[LCD_WIDTH];
+	uint8_t *pixels = line_buf;
+
+	/* Indexed frame buffers are drawn to directly. */
+	if(gb->display.fb != NULL &&
+			gb->display.fb_format == GB_PIXEL_FORMAT_INDEXED8)
+	{
+		pixels = (uint8_t *)gb->display.fb +
+			regs->ly * gb->display.fb_pitch;
+	}
+
+	memset(pixels, 0, LCD_WIDTH);
+
+	/* Background palette, including the layer bits. */
+	uint8_t bg_pal[4];
+
+	for(uint_fast8_t i = 0; i < 4; i++)
+	{
+		bg_pal[i] = regs->bg_palette[i];
+#if PEANUT_GB_12_COLOUR
+		bg_pal[i] |= LCD_PALETTE_BG;
+#endif
+	}
+
+#if PEANUT_GB_TILE_CACHE
+	/* If background is enabled, draw it from the tile cache. */
+	if(regs->lcdc & LCDC_BG_ENABLE)
+	{
+		uint8_t line[22 * 8];
+		uint8_t bg_y, bg_x, py;
+		uint16_t bg_map;
+		uint_fast8_t i;
+
+		bg_y = regs->ly + regs->scy;
+		bg_map =
+			((regs->lcdc & LCDC_BG_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (bg_y >> 3) * 0x20;
+		py = bg_y & 0x07;
+		bg_x = regs->scx;
+
+		for(i = 0; i < 22; i++)
+		{
+			uint8_t idx = gb->vram[bg_map + (((bg_x >> 3) + i) & 0x1F)];
+			memcpy(line + i * 8, __gb_get_tile_row(gb,
+					PGB_MAP_TILE(regs->lcdc, idx), py), 8);
+		}
+
+		__gb_apply_palette(line, sizeof(line), bg_pal);
+		memcpy(pixels, line + (bg_x & 0x07), LCD_WIDTH);
+	}
+
+	/* Draw window from the tile cache. */
+	if(regs->draw_window)
+	{
+		uint8_t line[22 * 8];
+		uint16_t win_line;
+		uint8_t disp_x, win_x, py;
+		uint_fast8_t i;
+
+		win_line = (regs->lcdc & LCDC_WINDOW_MAP) ?
+				    VRAM_BMAP_2 : VRAM_BMAP_1;
+		win_line += (regs->window_line >> 3) * 0x20;
+		py = regs->window_line & 0x07;
+
+		disp_x = regs->wx < 7 ? 0 : regs->wx - 7;
+		win_x = disp_x - regs->wx + 7;
+
+		for(i = 0; i < 22; i++)
+		{
+			uint8_t idx = gb->vram[win_line + i];
+			memcpy(line + i * 8, __gb_get_tile_row(gb,
+					PGB_MAP_TILE(regs->lcdc, idx), py), 8);
+		}
+
+		__gb_apply_palette(line, sizeof(line), bg_pal);
+		memcpy(pixels + disp_x, line + win_x, LCD_WIDTH - disp_x);
+	}
+#else
+	/* If background is enabled, draw it. */
+	if(regs->lcdc & LCDC_BG_ENABLE)
+	{
+		/* Enough tiles to cover the line when it is not aligned to a
+		 * tile, rounded up to an even number. */
+		uint8_t t1[22], t2[22], line[22 * 8];
+		uint8_t bg_y, bg_x, py;
+		uint16_t bg_map;
+		uint_fast8_t i;
+
+		/* Calculate current background line to draw. */
+		bg_y = regs->ly + regs->scy;
+
+		/* Get selected background map address for the current line.
+		 * 0x20 (32) is the width of a background tile, and the bit
+		 * shift is to calculate the address. */
+		bg_map =
+			((regs->lcdc & LCDC_BG_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (bg_y >> 3) * 0x20;
+
+		/* Y coordinate of tile pixel to draw. */
+		py = (bg_y & 0x07);
+		bg_x = regs->scx;
+
+		/* Fetch the row of each tile, wrapping around the map. */
+		for(i = 0; i < 22; i++)
+		{
+			uint8_t idx = gb->vram[bg_map + (((bg_x >> 3) + i) & 0x1F)];
+			uint16_t tile;
+
+			/* Select addressing mode. */
+			if(regs->lcdc & LCDC_TILE_SELECT)
+				tile = VRAM_TILES_1 + idx * 0x10;
+			else
+				tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+
+			tile += 2 * py;
+			t1[i] = gb->vram[tile];
+			t2[i] = gb->vram[tile + 1];
+		}
+
+		__gb_decode_tile_rows(line, t1, t2, 22, bg_pal);
+		memcpy(pixels, line + (bg_x & 0x07), LCD_WIDTH);
 	}
 
-	switch(r)
+	/* draw window */
+	if(regs->draw_window)
 	{
-	case 0:
-		val = gb->cpu_reg.bc.bytes.b;
-		break;
-
-	case 1:
-		val = gb->cpu_reg.bc.bytes.c;
-		break;
+		uint8_t t1[22], t2[22], line[22 * 8];
+		uint16_t win_line;
+		uint8_t disp_x, win_x, py;
+		uint_fast8_t i;
 
-	case 2:
-		val = gb->cpu_reg.de.bytes.d;
-		break;
+		/* Calculate Window Map Address. */
+		win_line = (regs->lcdc & LCDC_WINDOW_MAP) ?
+				    VRAM_BMAP_2 : VRAM_BMAP_1;
+		win_line += (regs->window_line >> 3) * 0x20;
+		py = regs->window_line & 0x07;
 
-	case 3:
-		val = gb->cpu_reg.de.bytes.e;
-		break;
+		/* First pixel of the window on the line, and the X
+		 * coordinate within the window that it shows. */
+		disp_x = regs->wx < 7 ? 0 : regs->wx - 7;
+		win_x = disp_x - regs->wx + 7;
 
-	case 4:
-		val = gb->cpu_reg.hl.bytes.h;
-		break;
+		for(i = 0; i < 22; i++)
+		{
+			uint8_t idx = gb->vram[win_line + i];
+			uint16_t tile;
 
-	case 5:
-		val = gb->cpu_reg.hl.bytes.l;
-		break;
+			if(regs->lcdc & LCDC_TILE_SELECT)
+				tile = VRAM_TILES_1 + idx * 0x10;
+			else
+				tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
 
-	case 6:
-		val = __gb_read(gb, gb->cpu_reg.hl.reg);
-		break;
+			tile += 2 * py;
+			t1[i] = gb->vram[tile];
+			t2[i] = gb->vram[tile + 1];
+		}
 
-	/* Only values 0-7 are possible here, so we make the final case
-	 * default to satisfy -Wmaybe-uninitialized warning. */
-	default:
-		val = gb->cpu_reg.a;
-		break;
+		__gb_decode_tile_rows(line, t1, t2, 22, bg_pal);
+		memcpy(pixels + disp_x, line + win_x, LCD_WIDTH - disp_x);
 	}
+#endif
 
-	switch(cbop >> 6)
+	// draw sprites
+	if(regs->lcdc & LCDC_OBJ_ENABLE)
 	{
-	case 0x0:
-		cbop = (cbop >> 4) & 0x3;
+		uint8_t sprite_number;
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+		/* The sprites on each line, limited to the maximum number of
+		 * sprites that the Game Boy is able to render on each line (10
+		 * sprites), are only sorted again when OAM or the sprite size
+		 * changes. */
+		const uint8_t height =
+			(regs->lcdc & LCDC_OBJ_SIZE) ? 16 : 8;
+		const uint8_t *sprites_to_render;
+
+		if(gb->display.sprites_dirty ||
+				gb->display.line_sprites_height != height)
+			__gb_sort_line_sprites(gb, height);
+
+		sprites_to_render =
+			gb->display.line_sprites[regs->ly];
+#endif
 
-		switch(cbop)
+		/* Render each sprite, from low priority to high priority. */
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+		/* Render the top ten prioritised sprites on this scanline. */
+		for(sprite_number =
+				gb->display.line_sprites_count[regs->ly] - 1;
+				sprite_number != 0xFF;
+				sprite_number--)
 		{
-		case 0x0: /* RdC R */
-		case 0x1: /* Rd R */
-			if(d) /* RRC R / RR R */
+			uint8_t s = sprites_to_render[sprite_number];
+#else
+		for (sprite_number = NUM_SPRITES - 1;
+			sprite_number != 0xFF;
+			sprite_number--)
+		{
+			uint8_t s = sprite_number;
+#endif
+			uint8_t py, t1, t2, dir, start, end, shift, disp_x;
+			/* Sprite Y position. */
+			uint8_t OY = gb->oam[4 * s + 0];
+			/* Sprite X position. */
+			uint8_t OX = gb->oam[4 * s + 1];
+			/* Sprite Tile/Pattern Number. */
+			uint8_t OT = gb->oam[4 * s + 2]
+				     & (regs->lcdc & LCDC_OBJ_SIZE ? 0xFE : 0xFF);
+			/* Additional attributes. */
+			uint8_t OF = gb->oam[4 * s + 3];
+
+#if !PEANUT_GB_HIGH_LCD_ACCURACY
+			/* If sprite isn't on this line, continue. */
+			if(regs->ly +
+					(regs->lcdc & LCDC_OBJ_SIZE ? 0 : 8) >= OY ||
+					regs->ly + 16 < OY)
+				continue;
+#endif
+
+			/* Continue if sprite not visible. */
+			if(OX == 0 || OX >= 168)
+				continue;
+
+			// y flip
+			py = regs->ly - OY + 16;
+
+			if(OF & OBJ_FLIP_Y)
+				py = (regs->lcdc & LCDC_OBJ_SIZE ? 15 : 7) - py;
+
+			// fetch the tile
+			t1 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py];
+			t2 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py + 1];
+
+			// handle x flip
+			if(OF & OBJ_FLIP_X)
 			{
-				uint8_t temp = val;
-				val = (val >> 1);
-				val |= cbop ? (gb->cpu_reg.f.f_bits.c << 7) : (temp << 7);
-				gb->cpu_reg.f.reg = 0;
-				gb->cpu_reg.f.f_bits.z = (val == 0x00);
-				gb->cpu_reg.f.f_bits.c = (temp & 0x01);
+				dir = 1;
+				start = (OX < 8 ? 0 : OX - 8);
+				end = MIN(OX, LCD_WIDTH);
+				shift = 8 - OX + start;
 			}
-			else /* RLC R / RL R */
+			else
 			{
-				uint8_t temp = val;
-				val = (val << 1);
-				val |= cbop ? gb->cpu_reg.f.f_bits.c : (temp >> 7);
-				gb->cpu_reg.f.reg = 0;
-				gb->cpu_reg.f.f_bits.z = (val == 0x00);
-				gb->cpu_reg.f.f_bits.c = (temp >> 7);
+				dir = (uint8_t)-1;
+				start = MIN(OX, LCD_WIDTH) - 1;
+				end = (OX < 8 ? 0 : OX - 8) - 1;
+				shift = OX - (start + 1);
 			}
 
-			break;
+			// copy tile
+			t1 >>= shift;
+			t2 >>= shift;
 
-		case 0x2:
-			if(d) /* SRA R */
-			{
-				gb->cpu_reg.f.reg = 0;
-				gb->cpu_reg.f.f_bits.c = val & 0x01;
-				val = (val >> 1) | (val & 0x80);
-				gb->cpu_reg.f.f_bits.z = (val == 0x00);
-			}
-			else /* SLA R */
+			/* TODO: Put for loop within the to if statements
+			 * because the BG priority bit will be the same for
+			 * all the pixels in the tile. */
+			for(disp_x = start; disp_x != end; disp_x += dir)
 			{
-				gb->cpu_reg.f.reg = 0;
-				gb->cpu_reg.f.f_bits.c = (val >> 7);
-				val = val << 1;
-				gb->cpu_reg.f.f_bits.z = (val == 0x00);
+				uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
+				// check transparency / sprite overlap / background overlap
+
+				if(c && !(OF & OBJ_PRIORITY && !((pixels[disp_x] & 0x3) == regs->bg_palette[0])))
+				{
+					/* Set pixel colour. */
+					pixels[disp_x] = (OF & OBJ_PALETTE)
+						? regs->sp_palette[c + 4]
+						: regs->sp_palette[c];
+#if PEANUT_GB_12_COLOUR
+					/* Set pixel palette (OBJ0 or OBJ1). */
+					pixels[disp_x] |= (OF & OBJ_PALETTE);
+#endif
+				}
+
+				t1 = t1 >> 1;
+				t2 = t2 >> 1;
 			}
+		}
+	}
 
-			break;
+	if(gb->display.fb == NULL)
+	{
+		gb->display.lcd_draw_line(gb, pixels, regs->ly);
+		return;
+	}
 
-		case 0x3:
-			if(d) /* SRL R */
+	/* Resolve the palette of each pixel into the frame buffer. */
+	{
+		void *row = (uint8_t *)gb->display.fb +
+			regs->ly * gb->display.fb_pitch;
+		const uint32_t *pal = gb->display.fb_palette;
+		uint_fast8_t x;
+
+		switch(gb->display.fb_format)
+		{
+		case GB_PIXEL_FORMAT_RGB565:
+			for(x = 0; x < LCD_WIDTH; x++)
 			{
-				gb->cpu_reg.f.reg = 0;
-				gb->cpu_reg.f.f_bits.c = val & 0x01;
-				val = val >> 1;
-				gb->cpu_reg.f.f_bits.z = (val == 0x00);
+				((uint16_t *)row)[x] = pal[((pixels[x] >> 2) & 0x0C) |
+					(pixels[x] & LCD_COLOUR)];
 			}
-			else /* SWAP R */
+			break;
+
+		case GB_PIXEL_FORMAT_RGBA8888:
+			for(x = 0; x < LCD_WIDTH; x++)
 			{
-				uint8_t temp = (val >> 4) & 0x0F;
-				temp |= (val << 4) & 0xF0;
-				val = temp;
-				gb->cpu_reg.f.reg = 0;
-				gb->cpu_reg.f.f_bits.z = (val == 0x00);
+				((uint32_t *)row)[x] = pal[((pixels[x] >> 2) & 0x0C) |
+					(pixels[x] & LCD_COLOUR)];
 			}
+			break;
 
+		default:
+			/* Already drawn. */
 			break;
 		}
+	}
+}
 
-		break;
 
-	case 0x1: /* BIT B, R */
-		gb->cpu_reg.f.f_bits.z = !((val >> b) & 0x1);
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h = 1;
-		writeback = 0;
-		break;
+/**
+ * Internal function used to choose whether the frame that the LCD is starting
+ * is drawn, following the policy set with gb_set_render_policy(). A requested
+ * frame is drawn even if it would be skipped by direct.frame_skip.
+ */
+void __gb_start_frame(struct gb_s *gb)
+{
+	if(gb->display.frame_requested)
+	{
+		gb->display.frame_requested = false;
+		gb->display.frame_hidden = false;
+		gb->display.frame_skip_count = true;
+		gb->display.render_count = 0;
+		return;
+	}
+
+	if(gb->display.render_every == 0)
+	{
+		gb->display.frame_hidden = true;
+		return;
+	}
+
+	if(++gb->display.render_count >= gb->display.render_every)
+		gb->display.render_count = 0;
+
+	gb->display.frame_hidden = gb->display.render_count != 0;
+}
+
+/**
+ * Internal function used to draw the line that the LCD has started drawing,
+ * or to give it to lcd_queue_line when lines are queued.
+ */
+void __gb_draw_line(struct gb_s *gb)
+{
+	struct gb_lcd_line_s regs;
+
+	/* If LCD not initialised by front-end, don't render anything. */
+	if(gb->display.lcd_draw_line == NULL && gb->display.fb == NULL)
+		return;
+
+	if(gb->direct.frame_skip && !gb->display.frame_skip_count)
+	{
+		PGB_PROFILE_ADD(gb, lines_skipped, 1);
+		return;
+	}
+
+	regs.ly = gb->hram_io[IO_LY];
+	regs.lcdc = gb->hram_io[IO_LCDC];
+	regs.scy = gb->hram_io[IO_SCY];
+	regs.scx = gb->hram_io[IO_SCX];
+	regs.wx = gb->hram_io[IO_WX];
+	regs.window_line = gb->display.window_clear;
+	regs.draw_window = (regs.lcdc & LCDC_WINDOW_ENABLE) &&
+		regs.ly >= gb->display.WY && regs.wx <= 166;
+
+	/* The window line is advanced even if this line is not drawn. */
+	if(regs.draw_window)
+		gb->display.window_clear++;
+
+	/* If interlaced mode is activated, check if we need to draw the current
+	 * line. */
+	if(gb->direct.interlace)
+	{
+		if((!gb->display.interlace_count && (regs.ly & 1) == 0) ||
+				(gb->display.interlace_count && (regs.ly & 1) == 1))
+		{
+			PGB_PROFILE_ADD(gb, lines_skipped, 1);
+			return;
+		}
+	}
+
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+	{
+		const uint8_t ly = regs.ly;
+		const uint8_t line_regs[9] = {
+			regs.lcdc, regs.scy, regs.scx, regs.wx,
+			gb->hram_io[IO_BGP], gb->hram_io[IO_OBP0],
+			gb->hram_io[IO_OBP1], gb->display.WY,
+			regs.window_line
+		};
+
+		if(gb->display.line_version[ly] == gb->display.mem_version &&
+				memcmp(gb->display.line_regs[ly], line_regs,
+					sizeof(line_regs)) == 0)
+		{
+			PGB_PROFILE_ADD(gb, lines_skipped, 1);
+			return;
+		}
+
+		gb->display.line_version[ly] = gb->display.mem_version;
+		memcpy(gb->display.line_regs[ly], line_regs, sizeof(line_regs));
+	}
+#endif
+
+	PGB_PROFILE_ADD(gb, lines_drawn, 1);
+
+	memcpy(regs.bg_palette, gb->display.bg_palette,
+			sizeof(regs.bg_palette));
+	memcpy(regs.sp_palette, gb->display.sp_palette,
+			sizeof(regs.sp_palette));
+
+#if PEANUT_GB_LCD_QUEUE
+	if(gb->display.lcd_queue_line != NULL)
+	{
+		/* VRAM writes are handled by __gb_write_unmapped() until the
+		 * queued lines are rendered. */
+		if(!gb->display.lines_queued)
+		{
+			gb->display.lines_queued = true;
+			__gb_update_mem_map(gb);
+		}
+
+		gb->display.lcd_queue_line(gb, &regs);
+		return;
+	}
+#endif
+
+	__gb_render_line(gb, &regs);
+}
+
+#if PEANUT_GB_TILE_CACHE
+# undef PGB_MAP_TILE
+#endif
+#endif
+
+/**
+ * Internal function used to calculate the number of cycles until the next
+ * event that must be handled by __gb_sync_counters(). These events are the LCD
+ * mode changes, TIMA overflow and serial transfer. The DIV register and the RTC
+ * are updated lazily.
+ */
+void __gb_update_next_event(struct gb_s *gb)
+{
+	/* Limit the number of cycles that are batched so that the 16-bit
+	 * counters cannot overflow. */
+	int_fast32_t next = 0x4000;
+
+	if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
+	{
+		int_fast32_t serial_cycles;
+
+		/* A new transfer calls gb_serial_tx on the next update. */
+		if(gb->counter.serial_count == 0 && gb->gb_serial_tx != NULL)
+			serial_cycles = 0;
+		else
+			serial_cycles = SERIAL_CYCLES - gb->counter.serial_count;
 
-	case 0x2: /* RES B, R */
-		val &= (0xFE << b) | (0xFF >> (8 - b));
-		break;
+		if(serial_cycles < next)
+			next = serial_cycles;
+	}
 
-	case 0x3: /* SET B, R */
-		val |= (0x1 << b);
-		break;
+	if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
+	{
+		int_fast32_t tima_cycles =
+			(0x100 - gb->hram_io[IO_TIMA]) *
+			TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK] -
+			gb->counter.tima_count;
+
+		if(tima_cycles < next)
+			next = tima_cycles;
 	}
 
-	if(writeback)
+	if(gb->hram_io[IO_LCDC] & LCDC_ENABLE)
 	{
-		switch(r)
+		int_fast32_t lcd_cycles;
+
+		switch(gb->hram_io[IO_STAT] & STAT_MODE)
 		{
-		case 0:
-			gb->cpu_reg.bc.bytes.b = val;
+		case IO_STAT_MODE_OAM_SCAN:
+			lcd_cycles = LCD_MODE2_OAM_SCAN_END;
 			break;
 
-		case 1:
-			gb->cpu_reg.bc.bytes.c = val;
+		case IO_STAT_MODE_LCD_DRAW:
+			lcd_cycles = LCD_MODE3_LCD_DRAW_END;
 			break;
 
-		case 2:
-			gb->cpu_reg.de.bytes.d = val;
+		default:
+			lcd_cycles = LCD_LINE_CYCLES;
 			break;
+		}
 
-		case 3:
-			gb->cpu_reg.de.bytes.e = val;
-			break;
+		lcd_cycles -= gb->counter.lcd_count;
 
-		case 4:
-			gb->cpu_reg.hl.bytes.h = val;
-			break;
+		if(lcd_cycles < next)
+			next = lcd_cycles;
+	}
+	else
+	{
+		int_fast32_t lcd_off_cycles =
+			LCD_FRAME_CYCLES - gb->counter.lcd_off_count;
 
-		case 5:
-			gb->cpu_reg.hl.bytes.l = val;
-			break;
+		if(lcd_off_cycles < next)
+			next = lcd_off_cycles;
+	}
 
-		case 6:
-			__gb_write(gb, gb->cpu_reg.hl.reg, val);
-			break;
+	/* Events that are already due are handled after the current
+	 * instruction. */
+	if(next < 0)
+		next = 0;
 
-		case 7:
-			gb->cpu_reg.a = val;
-			break;
-		}
-	}
-	return inst_cycles;
+	gb->counter.next_event = next;
 }
 
-#if ENABLE_LCD
-struct sprite_data {
-	uint8_t sprite_number;
-	uint8_t x;
-};
-
-#if PEANUT_GB_HIGH_LCD_ACCURACY
-static int compare_sprites(const struct sprite_data *const sd1, const struct sprite_data *const sd2)
+/**
+ * Internal function used to schedule the next event after the counters were
+ * updated, and find the number of cycles to skip if the CPU is halted.
+ * Whilst halted, nothing happens until the next event, so the CPU skips
+ * directly to it.
+ */
+uint_fast32_t __gb_halt_cycles(struct gb_s *gb, const bool halted_forever)
 {
-	int x_res;
+	__gb_update_next_event(gb);
 
-	x_res = (int)sd1->x - (int)sd2->x;
-	if(x_res != 0)
-		return x_res;
+	if(halted_forever)
+		return 0;
 
-	return (int)sd1->sprite_number - (int)sd2->sprite_number;
+	return gb->counter.next_event != 0 ? gb->counter.next_event : 4;
 }
-#endif
 
-void __gb_draw_line(struct gb_s *gb)
+#if PEANUT_GB_OAM_DMA_TIMING
+/**
+ * Internal function used to copy the bytes from "start" up to "end" of the
+ * OAM DMA transfer in progress. One byte is copied every 4 cycles.
+ */
+void __gb_oam_dma_copy(struct gb_s *gb, uint_fast16_t start,
+		uint_fast16_t end)
 {
-	uint8_t pixels[160] = {0};
+	const uint16_t dma_addr = (uint_fast16_t)gb->hram_io[IO_DMA] << 8;
+	const uint_fast16_t count = gb->counter.oam_dma_count;
 
-	/* If LCD not initialised by front-end, don't render anything. */
-	if(gb->display.lcd_draw_line == NULL)
+	if(start == end)
 		return;
 
-	if(gb->direct.frame_skip && !gb->display.frame_skip_count)
-		return;
+#if ENABLE_LCD && PEANUT_GB_LCD_QUEUE
+	__gb_lcd_sync(gb);
+#endif
 
-	/* If interlaced mode is activated, check if we need to draw the current
-	 * line. */
-	if(gb->direct.interlace)
+	/* The source is read as if no transfer were in progress. The CPU can
+	 * not write to it whilst the transfer is in progress. */
+	gb->counter.oam_dma_count = 0;
+	for(uint_fast16_t i = start; i < end; i++)
 	{
-		if((!gb->display.interlace_count
-				&& (gb->hram_io[IO_LY] & 1) == 0)
-				|| (gb->display.interlace_count
-				    && (gb->hram_io[IO_LY] & 1) == 1))
-		{
-			/* Compensate for missing window draw if required. */
-			if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
-					&& gb->hram_io[IO_LY] >= gb->display.WY
-					&& gb->hram_io[IO_WX] <= 166)
-				gb->display.window_clear++;
-
-			return;
-		}
+		uint8_t v = __gb_read(gb, dma_addr + i);
+#if ENABLE_LCD && PEANUT_GB_SKIP_UNCHANGED_LINES
+		if(gb->oam[i] != v)
+			gb->display.mem_version++;
+#endif
+		gb->oam[i] = v;
 	}
+	gb->counter.oam_dma_count = count;
 
-	/* If background is enabled, draw it. */
-	if(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
-	{
-		uint8_t bg_y, disp_x, bg_x, idx, py, px, t1, t2;
-		uint16_t bg_map, tile;
-
-		/* Calculate current background line to draw. Constant because
-		 * this function draws only this one line each time it is
-		 * called. */
-		bg_y = gb->hram_io[IO_LY] + gb->hram_io[IO_SCY];
+#if ENABLE_LCD && PEANUT_GB_HIGH_LCD_ACCURACY
+	gb->display.sprites_dirty = true;
+#endif
+}
+#endif
 
-		/* Get selected background map address for first tile
-		 * corresponding to current line.
-		 * 0x20 (32) is the width of a background tile, and the bit
-		 * shift is to calculate the address. */
-		bg_map =
-			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
-			 VRAM_BMAP_2 : VRAM_BMAP_1)
-			+ (bg_y >> 3) * 0x20;
+/**
+ * Internal function used to apply the cycles that have passed since the last
+ * update to the DIV, RTC, serial, TIMA and LCD counters.
+ * Must be called before accessing any of these counters or the registers that
+ * depend on them.
+ *
+ * \returns	Number of cycles to skip on the next update if the CPU is halted,
+ *		being the cycles until the next event, or 0 if the CPU is
+ *		halted forever and the end of the frame was reached.
+ */
+uint_fast32_t __gb_sync_counters(struct gb_s *gb)
+{
+	const uint_fast32_t cycles = gb->counter.pending_cycles;
+	bool halted_forever = false;
 
-		/* The displays (what the player sees) X coordinate, drawn right
-		 * to left. */
-		disp_x = LCD_WIDTH - 1;
+	gb->counter.pending_cycles = 0;
 
-		/* The X coordinate to begin drawing the background at. */
-		bg_x = disp_x + gb->hram_io[IO_SCX];
+#if PEANUT_GB_OAM_DMA_TIMING
+	if(gb->counter.oam_dma_count != 0)
+	{
+		const uint_fast16_t count = gb->counter.oam_dma_count;
+		const uint_fast16_t left =
+			cycles >= count ? 0 : count - (uint_fast16_t)cycles;
+
+		__gb_oam_dma_copy(gb, (OAM_DMA_CYCLES - count) / 4,
+				(OAM_DMA_CYCLES - left) / 4);
+		gb->counter.oam_dma_count = left;
+		if(left == 0)
+			__gb_update_mem_map(gb);
+	}
+#endif
 
-		/* Get tile index for current background tile. */
-		idx = gb->vram[bg_map + (bg_x >> 3)];
-		/* Y coordinate of tile pixel to draw. */
-		py = (bg_y & 0x07);
-		/* X coordinate of tile pixel to draw. */
-		px = 7 - (bg_x & 0x07);
+	/* DIV register timing */
+	gb->counter.div_count += cycles;
+	while(gb->counter.div_count >= DIV_CYCLES)
+	{
+		gb->hram_io[IO_DIV]++;
+		gb->counter.div_count -= DIV_CYCLES;
+	}
 
-		/* Select addressing mode. */
-		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-			tile = VRAM_TILES_1 + idx * 0x10;
-		else
-			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+	/* Check for RTC tick. */
+	if(gb->mbc == 3 && (gb->rtc_real.reg.high & 0x40) == 0)
+	{
+		gb->counter.rtc_count += cycles;
+		while(PGB_UNLIKELY(gb->counter.rtc_count >= RTC_CYCLES))
+		{
+			gb->counter.rtc_count -= RTC_CYCLES;
 
-		tile += 2 * py;
+			/* Detect invalid rollover. */
+			if(PGB_UNLIKELY(gb->rtc_real.reg.sec == 63))
+			{
+				gb->rtc_real.reg.sec = 0;
+				continue;
+			}
 
-		/* fetch first tile */
-		t1 = gb->vram[tile] >> px;
-		t2 = gb->vram[tile + 1] >> px;
+			if(++gb->rtc_real.reg.sec != 60)
+				continue;
 
-		for(; disp_x != 0xFF; disp_x--)
-		{
-			uint8_t c;
+			gb->rtc_real.reg.sec = 0;
+			if(gb->rtc_real.reg.min == 63)
+			{
+				gb->rtc_real.reg.min = 0;
+				continue;
+			}
+			if(++gb->rtc_real.reg.min != 60)
+				continue;
 
-			if(px == 8)
+			gb->rtc_real.reg.min = 0;
+			if(gb->rtc_real.reg.hour == 31)
 			{
-				/* fetch next tile */
-				px = 0;
-				bg_x = disp_x + gb->hram_io[IO_SCX];
-				idx = gb->vram[bg_map + (bg_x >> 3)];
-
-				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-					tile = VRAM_TILES_1 + idx * 0x10;
-				else
-					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
-
-				tile += 2 * py;
-				t1 = gb->vram[tile];
-				t2 = gb->vram[tile + 1];
+				gb->rtc_real.reg.hour = 0;
+				continue;
 			}
+			if(++gb->rtc_real.reg.hour != 24)
+				continue;
 
-			/* copy background */
-			c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-			pixels[disp_x] = gb->display.bg_palette[c];
-#if PEANUT_GB_12_COLOUR
-			pixels[disp_x] |= LCD_PALETTE_BG;
-#endif
-			t1 = t1 >> 1;
-			t2 = t2 >> 1;
-			px++;
+			gb->rtc_real.reg.hour = 0;
+			if(++gb->rtc_real.reg.yday != 0)
+				continue;
+
+			if(gb->rtc_real.reg.high & 1)  /* Bit 8 of days*/
+				gb->rtc_real.reg.high |= 0x80; /* Overflow bit */
+
+			gb->rtc_real.reg.high ^= 1;
 		}
 	}
 
-	/* draw window */
-	if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
-			&& gb->hram_io[IO_LY] >= gb->display.WY
-			&& gb->hram_io[IO_WX] <= 166)
+	/* Check serial transmission. */
+	if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
 	{
-		uint16_t win_line, tile;
-		uint8_t disp_x, win_x, py, px, idx, t1, t2, end;
-
-		/* Calculate Window Map Address. */
-		win_line = (gb->hram_io[IO_LCDC] & LCDC_WINDOW_MAP) ?
-				    VRAM_BMAP_2 : VRAM_BMAP_1;
-		win_line += (gb->display.window_clear >> 3) * 0x20;
-
-		disp_x = LCD_WIDTH - 1;
-		win_x = disp_x - gb->hram_io[IO_WX] + 7;
+		/* If new transfer, call TX function. */
+		if(gb->counter.serial_count == 0 &&
+			gb->gb_serial_tx != NULL)
+			(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
 
-		// look up tile
-		py = gb->display.window_clear & 0x07;
-		px = 7 - (win_x & 0x07);
-		idx = gb->vram[win_line + (win_x >> 3)];
+		gb->counter.serial_count += cycles;
 
-		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-			tile = VRAM_TILES_1 + idx * 0x10;
-		else
-			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+		/* If it's time to receive byte, call RX function. */
+		if(gb->counter.serial_count >= SERIAL_CYCLES)
+		{
+			/* If RX can be done, do it. */
+			/* If RX failed, do not change SB if using external
+			 * clock, or set to 0xFF if using internal clock. */
+			uint8_t rx;
+
+			if(gb->gb_serial_rx != NULL &&
+				(gb->gb_serial_rx(gb, &rx) ==
+					GB_SERIAL_RX_SUCCESS))
+			{
+				gb->hram_io[IO_SB] = rx;
 
-		tile += 2 * py;
+				/* Inform game of serial TX/RX completion. */
+				gb->hram_io[IO_SC] &= 0x01;
+				gb->hram_io[IO_IF] |= SERIAL_INTR;
+			}
+			else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
+			{
+				/* If using internal clock, and console is not
+				 * attached to any external peripheral, shifted
+				 * bits are replaced with logic 1. */
+				gb->hram_io[IO_SB] = 0xFF;
+
+				/* Inform game of serial TX/RX completion. */
+				gb->hram_io[IO_SC] &= 0x01;
+				gb->hram_io[IO_IF] |= SERIAL_INTR;
+			}
+			else
+			{
+				/* If using external clock, and console is not
+				 * attached to any external peripheral, bits are
+				 * not shifted, so SB is not modified. */
+			}
 
-		// fetch first tile
-		t1 = gb->vram[tile] >> px;
-		t2 = gb->vram[tile + 1] >> px;
+			gb->counter.serial_count = 0;
+		}
+	}
 
-		// loop & copy window
-		end = (gb->hram_io[IO_WX] < 7 ? 0 : gb->hram_io[IO_WX] - 7) - 1;
+	/* TIMA register timing */
+	/* TODO: Change tac_enable to struct of TAC timer control bits. */
+	if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
+	{
+		gb->counter.tima_count += cycles;
 
-		for(; disp_x != end; disp_x--)
+		while(gb->counter.tima_count >=
+			TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
 		{
-			uint8_t c;
+			gb->counter.tima_count -=
+				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
 
-			if(px == 8)
+			if(++gb->hram_io[IO_TIMA] == 0)
 			{
-				// fetch next tile
-				px = 0;
-				win_x = disp_x - gb->hram_io[IO_WX] + 7;
-				idx = gb->vram[win_line + (win_x >> 3)];
-
-				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-					tile = VRAM_TILES_1 + idx * 0x10;
-				else
-					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
-
-				tile += 2 * py;
-				t1 = gb->vram[tile];
-				t2 = gb->vram[tile + 1];
+				gb->hram_io[IO_IF] |= TIMER_INTR;
+				/* On overflow, set TMA to TIMA. */
+				gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
 			}
+		}
+	}
 
-			// copy window
-			c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-			pixels[disp_x] = gb->display.bg_palette[c];
-#if PEANUT_GB_12_COLOUR
-			pixels[disp_x] |= LCD_PALETTE_BG;
-#endif
-			t1 = t1 >> 1;
-			t2 = t2 >> 1;
-			px++;
+	/* If LCD is off, don't update LCD state or increase the LCD
+	 * ticks. Instead, keep track of the amount of time that is
+	 * being passed. */
+	if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
+	{
+		gb->counter.lcd_off_count += cycles;
+		if(gb->counter.lcd_off_count >= LCD_FRAME_CYCLES)
+		{
+			gb->counter.lcd_off_count -= LCD_FRAME_CYCLES;
+			gb->gb_frame = true;
+
+			/* If halted forever, then return on each frame. */
+			if(gb->gb_halt && !gb->hram_io[IO_IE])
+				halted_forever = true;
 		}
 
-		gb->display.window_clear++; // advance window line
+		return __gb_halt_cycles(gb, halted_forever);
 	}
 
-	// draw sprites
-	if(gb->hram_io[IO_LCDC] & LCDC_OBJ_ENABLE)
+	/* LCD Timing */
+	gb->counter.lcd_count += cycles;
+
+	/* New Scanline. HBlank -> VBlank or OAM Scan */
+	if(gb->counter.lcd_count >= LCD_LINE_CYCLES)
 	{
-		uint8_t sprite_number;
-#if PEANUT_GB_HIGH_LCD_ACCURACY
-		uint8_t number_of_sprites = 0;
+		gb->counter.lcd_count -= LCD_LINE_CYCLES;
 
-		struct sprite_data sprites_to_render[MAX_SPRITES_LINE];
+		/* Next line */
+		gb->hram_io[IO_LY] = gb->hram_io[IO_LY] + 1;
+		if (gb->hram_io[IO_LY] == LCD_VERT_LINES)
+			gb->hram_io[IO_LY] = 0;
 
-		/* Record number of sprites on the line being rendered, limited
-		 * to the maximum number sprites that the Game Boy is able to
-		 * render on each line (10 sprites). */
-		for(sprite_number = 0;
-				sprite_number < NUM_SPRITES;
-				sprite_number++)
+		/* LYC Update */
+		if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
 		{
-			/* Sprite Y position. */
-			uint8_t OY = gb->oam[4 * sprite_number + 0];
-			/* Sprite X position. */
-			uint8_t OX = gb->oam[4 * sprite_number + 1];
+			gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
 
-			/* If sprite isn't on this line, continue. */
-			if (gb->hram_io[IO_LY] +
-				(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY
-					|| gb->hram_io[IO_LY] + 16 < OY)
-				continue;
+			if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
+				gb->hram_io[IO_IF] |= LCDC_INTR;
+		}
+		else
+			gb->hram_io[IO_STAT] &= 0xFB;
 
-			struct sprite_data current;
+		/* Check if LCD should be in Mode 1 (VBLANK) state */
+		if(gb->hram_io[IO_LY] == LCD_HEIGHT)
+		{
+			gb->hram_io[IO_STAT] =
+				(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
+			gb->gb_frame = true;
+			gb->hram_io[IO_IF] |= VBLANK_INTR;
+			gb->lcd_blank = false;
 
-			current.sprite_number = sprite_number;
-			current.x = OX;
+			if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
+				gb->hram_io[IO_IF] |= LCDC_INTR;
 
-			uint8_t place;
-			for (place = number_of_sprites; place != 0; place--)
+#if ENABLE_LCD
+			/* If frame skip is activated, check if we need to draw
+			 * the frame or skip it. */
+			if(gb->direct.frame_skip)
 			{
-				if(compare_sprites(&sprites_to_render[place - 1], &current) < 0)
-					break;
+				gb->display.frame_skip_count =
+					!gb->display.frame_skip_count;
 			}
-			if(place >= MAX_SPRITES_LINE)
-				continue;
-			memmove(
-				&sprites_to_render[place + 1],
-				&sprites_to_render[place],
-				(MAX_SPRITES_LINE - place - 1) * sizeof(current)
-			);
-			if(number_of_sprites < MAX_SPRITES_LINE)
-				number_of_sprites++;
-			sprites_to_render[place] = current;
-		}
-#endif
 
-		/* Render each sprite, from low priority to high priority. */
-#if PEANUT_GB_HIGH_LCD_ACCURACY
-		/* Render the top ten prioritised sprites on this scanline. */
-		for(sprite_number = number_of_sprites - 1;
-				sprite_number != 0xFF;
-				sprite_number--)
-		{
-			uint8_t s = sprites_to_render[sprite_number].sprite_number;
-#else
-		for (sprite_number = NUM_SPRITES - 1;
-			sprite_number != 0xFF;
-			sprite_number--)
-		{
-			uint8_t s = sprite_number;
+			/* If interlaced is activated, change which lines get
+			 * updated. Also, only update lines on frames that are
+			 * actually drawn when frame skip is enabled. */
+			if(gb->direct.interlace &&
+					(!gb->direct.frame_skip ||
+					 gb->display.frame_skip_count))
+			{
+				gb->display.interlace_count =
+					!gb->display.interlace_count;
+			}
 #endif
-			uint8_t py, t1, t2, dir, start, end, shift, disp_x;
-			/* Sprite Y position. */
-			uint8_t OY = gb->oam[4 * s + 0];
-			/* Sprite X position. */
-			uint8_t OX = gb->oam[4 * s + 1];
-			/* Sprite Tile/Pattern Number. */
-			uint8_t OT = gb->oam[4 * s + 2]
-				     & (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0xFE : 0xFF);
-			/* Additional attributes. */
-			uint8_t OF = gb->oam[4 * s + 3];
-
-#if !PEANUT_GB_HIGH_LCD_ACCURACY
-			/* If sprite isn't on this line, continue. */
-			if(gb->hram_io[IO_LY] +
-					(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY ||
-					gb->hram_io[IO_LY] + 16 < OY)
-				continue;
+			/* If halted forever, then return on VBLANK. */
+			if(gb->gb_halt && !gb->hram_io[IO_IE])
+				halted_forever = true;
+		}
+		/* Start of normal Line (not in VBLANK) */
+		else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
+		{
+			if(gb->hram_io[IO_LY] == 0)
+			{
+				/* Clear Screen */
+				gb->display.WY = gb->hram_io[IO_WY];
+				gb->display.window_clear = 0;
+#if ENABLE_LCD
+				__gb_start_frame(gb);
 #endif
+			}
 
-			/* Continue if sprite not visible. */
-			if(OX == 0 || OX >= 168)
-				continue;
-
-			// y flip
-			py = gb->hram_io[IO_LY] - OY + 16;
+			/* OAM Search occurs at the start of the line. */
+			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_OAM_SCAN;
+			gb->counter.lcd_count = 0;
 
-			if(OF & OBJ_FLIP_Y)
-				py = (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 15 : 7) - py;
+			if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
+				gb->hram_io[IO_IF] |= LCDC_INTR;
+		}
+	}
+	/* Go from Mode 3 (LCD Draw) to Mode 0 (HBLANK). */
+	else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW &&
+			gb->counter.lcd_count >= LCD_MODE3_LCD_DRAW_END)
+	{
+		gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
 
-			// fetch the tile
-			t1 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py];
-			t2 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py + 1];
+		if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
+			gb->hram_io[IO_IF] |= LCDC_INTR;
+	}
+	/* Go from Mode 2 (OAM Scan) to Mode 3 (LCD Draw). */
+	else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN &&
+			gb->counter.lcd_count >= LCD_MODE2_OAM_SCAN_END)
+	{
+		gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_LCD_DRAW;
+#if ENABLE_LCD
+		if(PGB_UNLIKELY(gb->display.frame_hidden))
+			PGB_PROFILE_ADD(gb, lines_skipped, 1);
+		else if(!gb->lcd_blank)
+		{
+#if PEANUT_GB_FORK
+			/* The renderer reads VRAM directly. */
+			if(PGB_UNLIKELY(gb->fork.vram != NULL))
+				__gb_fork_own(gb, VRAM_ADDR);
+#endif
+			__gb_draw_line(gb);
+		}
+#endif
+	}
 
-			// handle x flip
-			if(OF & OBJ_FLIP_X)
-			{
-				dir = 1;
-				start = (OX < 8 ? 0 : OX - 8);
-				end = MIN(OX, LCD_WIDTH);
-				shift = 8 - OX + start;
-			}
-			else
-			{
-				dir = (uint8_t)-1;
-				start = MIN(OX, LCD_WIDTH) - 1;
-				end = (OX < 8 ? 0 : OX - 8) - 1;
-				shift = OX - (start + 1);
-			}
+	return __gb_halt_cycles(gb, halted_forever);
+}
 
-			// copy tile
-			t1 >>= shift;
-			t2 >>= shift;
+#if PEANUT_GB_IDLE_SKIP
+/**
+ * Internal function used to detect idle loops after a relative jump of -6 was
+ * taken, of the form:
+ *
+ *	loop:	LDH A, (LY/STAT/IF)	; F0 44, F0 41 or F0 0F
+ *		CP imm or AND imm	; FE xx or E6 xx
+ *		JR NZ/Z, loop		; 20 FA or 28 FA
+ *
+ * These registers only change on events, so every iteration of the loop
+ * before the next event reads the same value as the last iteration, and
+ * leaves the CPU in the same state. These iterations are skipped by only
+ * counting their cycles.
+ *
+ * \param jr_cycles	Cycles of the jump that was just executed, which are
+ *			not yet added to the pending cycles.
+ * \returns	Number of cycles of the loop iterations that were skipped.
+ */
+uint_fast32_t __gb_skip_idle_loop(struct gb_s *gb, uint_fast32_t jr_cycles)
+{
+	/* LDH A, (imm) + CP/AND imm + JR taken. */
+	const uint_fast32_t loop_cycles = 12 + 8 + 12;
+	const uint_fast16_t pc = gb->cpu_reg.pc.reg;
+	uint_fast32_t remaining, iterations;
+	uint8_t reg, op;
+
+	/* An interrupt is taken on the next instruction instead. */
+	if(gb->gb_ime && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR))
+		return 0;
 
-			/* TODO: Put for loop within the to if statements
-			 * because the BG priority bit will be the same for
-			 * all the pixels in the tile. */
-			for(disp_x = start; disp_x != end; disp_x += dir)
-			{
-				uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-				// check transparency / sprite overlap / background overlap
+	/* The loop is read without __gb_read(), so that these reads are not
+	 * counted by the profiling counters. */
+	if(__gb_peek(gb, pc) != 0xF0)
+		return 0;
 
-				if(c && !(OF & OBJ_PRIORITY && !((pixels[disp_x] & 0x3) == gb->display.bg_palette[0])))
-				{
-					/* Set pixel colour. */
-					pixels[disp_x] = (OF & OBJ_PALETTE)
-						? gb->display.sp_palette[c + 4]
-						: gb->display.sp_palette[c];
-#if PEANUT_GB_12_COLOUR
-					/* Set pixel palette (OBJ0 or OBJ1). */
-					pixels[disp_x] |= (OF & OBJ_PALETTE);
-#endif
-				}
+	reg = __gb_peek(gb, pc + 1);
+	if(reg != IO_LY && reg != IO_STAT && reg != IO_IF)
+		return 0;
 
-				t1 = t1 >> 1;
-				t2 = t2 >> 1;
-			}
-		}
+	/* The register may have changed after it was last read, by an event
+	 * within the last iteration. The loop must then run again. */
+	op = __gb_peek(gb, pc + 2);
+	if(op == 0xFE)
+	{
+		if(gb->cpu_reg.a != gb->hram_io[reg])
+			return 0;
+	}
+	else if(op == 0xE6)
+	{
+		if(gb->cpu_reg.a != (gb->hram_io[reg] & __gb_peek(gb, pc + 3)))
+			return 0;
 	}
+	else
+		return 0;
+
+	/* Iterations must end before the next event, so that it is handled
+	 * by the same instruction as it would have been. */
+	if(gb->counter.next_event <= gb->counter.pending_cycles + jr_cycles)
+		return 0;
 
-	gb->display.lcd_draw_line(gb, pixels, gb->hram_io[IO_LY]);
+	remaining = gb->counter.next_event - gb->counter.pending_cycles -
+		jr_cycles - 1;
+	iterations = remaining / loop_cycles;
+
+	PGB_PROFILE_ADD(gb, opcode[0xF0], iterations);
+	PGB_PROFILE_ADD(gb, opcode[op], iterations);
+	PGB_PROFILE_ADD(gb, opcode[__gb_peek(gb, pc + 4)], iterations);
+	PGB_PROFILE_ADD(gb, idle_iterations, iterations);
+
+	return iterations * loop_cycles;
 }
 #endif
 
 /**
- * Internal function used to step the CPU.
+ * Internal function used to execute one instruction. With
+ * PEANUT_GB_INLINE_CPU, it is inlined into gb_run_frame(), and
+ * __gb_step_cpu() calls a second copy of it.
+ *
+ * \returns	Number of cycles that were executed, including any cycles that
+ *		were skipped whilst halted.
  */
-void __gb_step_cpu(struct gb_s *gb)
+#if PEANUT_GB_INLINE_CPU
+static PGB_ALWAYS_INLINE uint_fast32_t __gb_execute(struct gb_s *gb)
+#else
+uint_fast32_t __gb_step_cpu(struct gb_s *gb)
+#endif
 {
 	uint8_t opcode;
-	uint_fast16_t inst_cycles;
+#if PEANUT_GB_DECODE_CACHE
+	const uint8_t *fetch;
+#endif
+	/* May be as large as a frame if the CPU is halted or idle. */
+	uint_fast32_t inst_cycles;
 	static const uint8_t op_cycles[0x100] =
 	{
 		/* *INDENT-OFF* */
@@ -1813,7 +3812,6 @@ void __gb_step_cpu(struct gb_s *gb)
 		12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
 		/* *INDENT-ON* */
 	};
-	static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
 
 	/* Handle interrupts */
 	/* If gb_halt is positive, then an interrupt must have occurred by the
@@ -1865,8 +3863,14 @@ void __gb_step_cpu(struct gb_s *gb)
 	}
 
 	/* Obtain opcode */
-	opcode = __gb_read(gb, gb->cpu_reg.pc.reg++);
+#if PEANUT_GB_DECODE_CACHE
+	fetch = NULL;
+	if(gb->mem_map.read[PEANUT_GB_GET_MSN16(gb->cpu_reg.pc.reg)] == NULL)
+		fetch = __gb_decode_cache_fetch(gb);
+#endif
+	opcode = PGB_FETCH();
 	inst_cycles = op_cycles[opcode];
+	PGB_PROFILE_ADD(gb, opcode[opcode], 1);
 
 	/* Execute opcode */
 	switch(opcode)
@@ -1875,8 +3879,8 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0x01: /* LD BC, imm */
-		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.bc.bytes.c = PGB_FETCH();
+		gb->cpu_reg.bc.bytes.b = PGB_FETCH();
 		break;
 
 	case 0x02: /* LD (BC), A */
@@ -1896,7 +3900,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0x06: /* LD B, imm */
-		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.bc.bytes.b = PGB_FETCH();
 		break;
 
 	case 0x07: /* RLCA */
@@ -1909,8 +3913,8 @@ void __gb_step_cpu(struct gb_s *gb)
 	{
 		uint8_t h, l;
 		uint16_t temp;
-		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		l = PGB_FETCH();
+		h = PGB_FETCH();
 		temp = PEANUT_GB_U8_TO_U16(h,l);
 		__gb_write(gb, temp++, gb->cpu_reg.sp.bytes.p);
 		__gb_write(gb, temp, gb->cpu_reg.sp.bytes.s);
@@ -1945,7 +3949,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0x0E: /* LD C, imm */
-		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.bc.bytes.c = PGB_FETCH();
 		break;
 
 	case 0x0F: /* RRCA */
@@ -1959,8 +3963,8 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0x11: /* LD DE, imm */
-		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.de.bytes.e = PGB_FETCH();
+		gb->cpu_reg.de.bytes.d = PGB_FETCH();
 		break;
 
 	case 0x12: /* LD (DE), A */
@@ -1980,7 +3984,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0x16: /* LD D, imm */
-		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.de.bytes.d = PGB_FETCH();
 		break;
 
 	case 0x17: /* RLA */
@@ -1994,7 +3998,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 	case 0x18: /* JR imm */
 	{
-		int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+		int8_t temp = (int8_t) PGB_FETCH();
 		gb->cpu_reg.pc.reg += temp;
 		break;
 	}
@@ -2027,7 +4031,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0x1E: /* LD E, imm */
-		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.de.bytes.e = PGB_FETCH();
 		break;
 
 	case 0x1F: /* RRA */
@@ -2042,9 +4046,13 @@ void __gb_step_cpu(struct gb_s *gb)
 	case 0x20: /* JR NZ, imm */
 		if(!gb->cpu_reg.f.f_bits.z)
 		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+			int8_t temp = (int8_t) PGB_FETCH();
 			gb->cpu_reg.pc.reg += temp;
 			inst_cycles += 4;
+#if PEANUT_GB_IDLE_SKIP
+			if(temp == -6)
+				inst_cycles += __gb_skip_idle_loop(gb, inst_cycles);
+#endif
 		}
 		else
 			gb->cpu_reg.pc.reg++;
@@ -2052,8 +4060,8 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0x21: /* LD HL, imm */
-		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.hl.bytes.l = PGB_FETCH();
+		gb->cpu_reg.hl.bytes.h = PGB_FETCH();
 		break;
 
 	case 0x22: /* LDI (HL), A */
@@ -2074,7 +4082,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0x26: /* LD H, imm */
-		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.hl.bytes.h = PGB_FETCH();
 		break;
 
 	case 0x27: /* DAA */
@@ -2112,9 +4120,13 @@ void __gb_step_cpu(struct gb_s *gb)
 	case 0x28: /* JR Z, imm */
 		if(gb->cpu_reg.f.f_bits.z)
 		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+			int8_t temp = (int8_t) PGB_FETCH();
 			gb->cpu_reg.pc.reg += temp;
 			inst_cycles += 4;
+#if PEANUT_GB_IDLE_SKIP
+			if(temp == -6)
+				inst_cycles += __gb_skip_idle_loop(gb, inst_cycles);
+#endif
 		}
 		else
 			gb->cpu_reg.pc.reg++;
@@ -2147,7 +4159,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0x2E: /* LD L, imm */
-		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.hl.bytes.l = PGB_FETCH();
 		break;
 
 	case 0x2F: /* CPL */
@@ -2159,7 +4171,7 @@ void __gb_step_cpu(struct gb_s *gb)
 	case 0x30: /* JR NC, imm */
 		if(!gb->cpu_reg.f.f_bits.c)
 		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+			int8_t temp = (int8_t) PGB_FETCH();
 			gb->cpu_reg.pc.reg += temp;
 			inst_cycles += 4;
 		}
@@ -2169,8 +4181,8 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0x31: /* LD SP, imm */
-		gb->cpu_reg.sp.bytes.p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.sp.bytes.s = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.sp.bytes.p = PGB_FETCH();
+		gb->cpu_reg.sp.bytes.s = PGB_FETCH();
 		break;
 
 	case 0x32: /* LD (HL), A */
@@ -2199,7 +4211,7 @@ void __gb_step_cpu(struct gb_s *gb)
 	}
 
 	case 0x36: /* LD (HL), imm */
-		__gb_write(gb, gb->cpu_reg.hl.reg, __gb_read(gb, gb->cpu_reg.pc.reg++));
+		__gb_write(gb, gb->cpu_reg.hl.reg, PGB_FETCH());
 		break;
 
 	case 0x37: /* SCF */
@@ -2211,7 +4223,7 @@ void __gb_step_cpu(struct gb_s *gb)
 	case 0x38: /* JR C, imm */
 		if(gb->cpu_reg.f.f_bits.c)
 		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+			int8_t temp = (int8_t) PGB_FETCH();
 			gb->cpu_reg.pc.reg += temp;
 			inst_cycles += 4;
 		}
@@ -2248,7 +4260,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0x3E: /* LD A, imm */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.a = PGB_FETCH();
 		break;
 
 	case 0x3F: /* CCF */
@@ -2468,67 +4480,17 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0x76: /* HALT */
-	{
-		int_fast16_t halt_cycles = INT_FAST16_MAX;
-
 		/* TODO: Emulate HALT bug? */
 		gb->gb_halt = true;
 
-		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
-		{
-			int serial_cycles = SERIAL_CYCLES -
-				gb->counter.serial_count;
-
-			if(serial_cycles < halt_cycles)
-				halt_cycles = serial_cycles;
-		}
-
-		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
-		{
-			int tac_cycles = TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK] -
-				gb->counter.tima_count;
-
-			if(tac_cycles < halt_cycles)
-				halt_cycles = tac_cycles;
-		}
-
-		if((gb->hram_io[IO_LCDC] & LCDC_ENABLE))
-		{
-			int lcd_cycles;
-
-			/* If LCD is in HBlank, calculate the number of cycles
-			 * until the end of HBlank and the start of mode 2 or
-			 * mode 1. */
-			if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_HBLANK)
-			{
-				lcd_cycles = LCD_MODE0_HBLANK_MAX_DRUATION - gb->counter.lcd_count;
-			}
-			else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN)
-			{
-				lcd_cycles = LCD_MODE3_LCD_DRAW_MIN_DURATION - gb->counter.lcd_count;
-			}
-			else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW)
-			{
-				lcd_cycles = LCD_MODE0_HBLANK_MAX_DRUATION - gb->counter.lcd_count;
-			}
-			else
-			{
-				/* VBlank */
-				lcd_cycles = LCD_LINE_CYCLES - gb->counter.lcd_count;
-			}
-
-			if(lcd_cycles < halt_cycles)
-				halt_cycles = lcd_cycles;
-		}
-
-		/* Some halt cycles may already be very high, so make sure we
-		 * don't underflow here. */
-		if(halt_cycles <= 0)
-			halt_cycles = 4;
+		/* The counters must be up to date to find the next event,
+		 * which is where the CPU is woken up at the earliest. */
+		inst_cycles = __gb_sync_counters(gb);
+		if(inst_cycles == 0)
+			inst_cycles = 4;
 
-		inst_cycles = (uint_fast16_t)halt_cycles;
+		PGB_PROFILE_ADD(gb, halt_cycles, inst_cycles);
 		break;
-	}
 
 	case 0x77: /* LD (HL), A */
 		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
@@ -2848,8 +4810,8 @@ void __gb_step_cpu(struct gb_s *gb)
 		if(!gb->cpu_reg.f.f_bits.z)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg);
+			c = PGB_FETCH();
+			p = PGB_FETCH();
 			gb->cpu_reg.pc.bytes.c = c;
 			gb->cpu_reg.pc.bytes.p = p;
 			inst_cycles += 4;
@@ -2862,8 +4824,8 @@ void __gb_step_cpu(struct gb_s *gb)
 	case 0xC3: /* JP imm */
 	{
 		uint8_t p, c;
-		c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		p = __gb_read(gb, gb->cpu_reg.pc.reg);
+		c = PGB_FETCH();
+		p = PGB_FETCH();
 		gb->cpu_reg.pc.bytes.c = c;
 		gb->cpu_reg.pc.bytes.p = p;
 		break;
@@ -2873,8 +4835,8 @@ void __gb_step_cpu(struct gb_s *gb)
 		if(!gb->cpu_reg.f.f_bits.z)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			c = PGB_FETCH();
+			p = PGB_FETCH();
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 			gb->cpu_reg.pc.bytes.c = c;
@@ -2893,7 +4855,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 	case 0xC6: /* ADD A, imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		uint8_t val = PGB_FETCH();
 		PGB_INSTR_ADC_R8(val, 0);
 		break;
 	}
@@ -2924,8 +4886,8 @@ void __gb_step_cpu(struct gb_s *gb)
 		if(gb->cpu_reg.f.f_bits.z)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg);
+			c = PGB_FETCH();
+			p = PGB_FETCH();
 			gb->cpu_reg.pc.bytes.c = c;
 			gb->cpu_reg.pc.bytes.p = p;
 			inst_cycles += 4;
@@ -2936,15 +4898,15 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0xCB: /* CB INST */
-		inst_cycles = __gb_execute_cb(gb);
+		inst_cycles = __gb_execute_cb(gb, PGB_FETCH());
 		break;
 
 	case 0xCC: /* CALL Z, imm */
 		if(gb->cpu_reg.f.f_bits.z)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			c = PGB_FETCH();
+			p = PGB_FETCH();
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 			gb->cpu_reg.pc.bytes.c = c;
@@ -2959,8 +4921,8 @@ void __gb_step_cpu(struct gb_s *gb)
 	case 0xCD: /* CALL imm */
 	{
 		uint8_t p, c;
-		c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		c = PGB_FETCH();
+		p = PGB_FETCH();
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.bytes.c = c;
@@ -2970,7 +4932,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 	case 0xCE: /* ADC A, imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		uint8_t val = PGB_FETCH();
 		PGB_INSTR_ADC_R8(val, gb->cpu_reg.f.f_bits.c);
 		break;
 	}
@@ -3000,8 +4962,8 @@ void __gb_step_cpu(struct gb_s *gb)
 		if(!gb->cpu_reg.f.f_bits.c)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg);
+			c = PGB_FETCH();
+			p = PGB_FETCH();
 			gb->cpu_reg.pc.bytes.c = c;
 			gb->cpu_reg.pc.bytes.p = p;
 			inst_cycles += 4;
@@ -3015,8 +4977,8 @@ void __gb_step_cpu(struct gb_s *gb)
 		if(!gb->cpu_reg.f.f_bits.c)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			c = PGB_FETCH();
+			p = PGB_FETCH();
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 			gb->cpu_reg.pc.bytes.c = c;
@@ -3035,7 +4997,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 	case 0xD6: /* SUB imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		uint8_t val = PGB_FETCH();
 		uint16_t temp = gb->cpu_reg.a - val;
 		gb->cpu_reg.f.f_bits.z = ((temp & 0xFF) == 0x00);
 		gb->cpu_reg.f.f_bits.n = 1;
@@ -3074,8 +5036,8 @@ void __gb_step_cpu(struct gb_s *gb)
 		if(gb->cpu_reg.f.f_bits.c)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg);
+			c = PGB_FETCH();
+			p = PGB_FETCH();
 			gb->cpu_reg.pc.bytes.c = c;
 			gb->cpu_reg.pc.bytes.p = p;
 			inst_cycles += 4;
@@ -3089,8 +5051,8 @@ void __gb_step_cpu(struct gb_s *gb)
 		if(gb->cpu_reg.f.f_bits.c)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			c = PGB_FETCH();
+			p = PGB_FETCH();
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 			gb->cpu_reg.pc.bytes.c = c;
@@ -3104,7 +5066,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 	case 0xDE: /* SBC A, imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		uint8_t val = PGB_FETCH();
 		PGB_INSTR_SBC_R8(val, gb->cpu_reg.f.f_bits.c);
 		break;
 	}
@@ -3116,7 +5078,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0xE0: /* LD (0xFF00+imm), A */
-		__gb_write(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++),
+		__gb_write(gb, 0xFF00 | PGB_FETCH(),
 			   gb->cpu_reg.a);
 		break;
 
@@ -3136,7 +5098,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 	case 0xE6: /* AND imm */
 	{
-		uint8_t temp = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		uint8_t temp = PGB_FETCH();
 		PGB_INSTR_AND_R8(temp);
 		break;
 	}
@@ -3149,7 +5111,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 	case 0xE8: /* ADD SP, imm */
 	{
-		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+		int8_t offset = (int8_t) PGB_FETCH();
 		gb->cpu_reg.f.reg = 0;
 		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
 		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF);
@@ -3165,15 +5127,15 @@ void __gb_step_cpu(struct gb_s *gb)
 	{
 		uint8_t h, l;
 		uint16_t addr;
-		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		l = PGB_FETCH();
+		h = PGB_FETCH();
 		addr = PEANUT_GB_U8_TO_U16(h, l);
 		__gb_write(gb, addr, gb->cpu_reg.a);
 		break;
 	}
 
 	case 0xEE: /* XOR imm */
-		PGB_INSTR_XOR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
+		PGB_INSTR_XOR_R8(PGB_FETCH());
 		break;
 
 	case 0xEF: /* RST 0x0028 */
@@ -3184,7 +5146,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 	case 0xF0: /* LD A, (0xFF00+imm) */
 		gb->cpu_reg.a =
-			__gb_read(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++));
+			__gb_read(gb, 0xFF00 | PGB_FETCH());
 		break;
 
 	case 0xF1: /* POP AF */
@@ -3214,7 +5176,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 
 	case 0xF6: /* OR imm */
-		PGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
+		PGB_INSTR_OR_R8(PGB_FETCH());
 		break;
 
 	case 0xF7: /* PUSH AF */
@@ -3226,7 +5188,7 @@ void __gb_step_cpu(struct gb_s *gb)
 	case 0xF8: /* LD HL, SP+/-imm */
 	{
 		/* Taken from SameBoy, which is released under MIT Licence. */
-		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+		int8_t offset = (int8_t) PGB_FETCH();
 		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
 		gb->cpu_reg.f.reg = 0;
 		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
@@ -3242,8 +5204,8 @@ void __gb_step_cpu(struct gb_s *gb)
 	{
 		uint8_t h, l;
 		uint16_t addr;
-		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		l = PGB_FETCH();
+		h = PGB_FETCH();
 		addr = PEANUT_GB_U8_TO_U16(h, l);
 		gb->cpu_reg.a = __gb_read(gb, addr);
 		break;
@@ -3255,7 +5217,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 	case 0xFE: /* CP imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		uint8_t val = PGB_FETCH();
 		PGB_INSTR_CP_R8(val);
 		break;
 	}
@@ -3272,268 +5234,94 @@ void __gb_step_cpu(struct gb_s *gb)
 		PGB_UNREACHABLE();
 	}
 
-	do
-	{
-		/* DIV register timing */
-		gb->counter.div_count += inst_cycles;
-		while(gb->counter.div_count >= DIV_CYCLES)
-		{
-			gb->hram_io[IO_DIV]++;
-			gb->counter.div_count -= DIV_CYCLES;
-		}
-
-		/* Check for RTC tick. */
-		if(gb->mbc == 3 && (gb->rtc_real.reg.high & 0x40) == 0)
-		{
-			gb->counter.rtc_count += inst_cycles;
-			while(PGB_UNLIKELY(gb->counter.rtc_count >= RTC_CYCLES))
-			{
-				gb->counter.rtc_count -= RTC_CYCLES;
-
-				/* Detect invalid rollover. */
-				if(PGB_UNLIKELY(gb->rtc_real.reg.sec == 63))
-				{
-					gb->rtc_real.reg.sec = 0;
-					continue;
-				}
-
-				if(++gb->rtc_real.reg.sec != 60)
-					continue;
-
-				gb->rtc_real.reg.sec = 0;
-				if(gb->rtc_real.reg.min == 63)
-				{
-					gb->rtc_real.reg.min = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.min != 60)
-					continue;
-
-				gb->rtc_real.reg.min = 0;
-				if(gb->rtc_real.reg.hour == 31)
-				{
-					gb->rtc_real.reg.hour = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.hour != 24)
-					continue;
-
-				gb->rtc_real.reg.hour = 0;
-				if(++gb->rtc_real.reg.yday != 0)
-					continue;
-
-				if(gb->rtc_real.reg.high & 1)  /* Bit 8 of days*/
-					gb->rtc_real.reg.high |= 0x80; /* Overflow bit */
-
-				gb->rtc_real.reg.high ^= 1;
-			}
-		}
-
-		/* Check serial transmission. */
-		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
-		{
-			/* If new transfer, call TX function. */
-			if(gb->counter.serial_count == 0 &&
-				gb->gb_serial_tx != NULL)
-				(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
-
-			gb->counter.serial_count += inst_cycles;
-
-			/* If it's time to receive byte, call RX function. */
-			if(gb->counter.serial_count >= SERIAL_CYCLES)
-			{
-				/* If RX can be done, do it. */
-				/* If RX failed, do not change SB if using external
-				 * clock, or set to 0xFF if using internal clock. */
-				uint8_t rx;
-
-				if(gb->gb_serial_rx != NULL &&
-					(gb->gb_serial_rx(gb, &rx) ==
-						GB_SERIAL_RX_SUCCESS))
-				{
-					gb->hram_io[IO_SB] = rx;
+	gb->counter.pending_cycles += inst_cycles;
+	PGB_PROFILE_ADD(gb, cycles, inst_cycles);
 
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
-				{
-					/* If using internal clock, and console is not
-					 * attached to any external peripheral, shifted
-					 * bits are replaced with logic 1. */
-					gb->hram_io[IO_SB] = 0xFF;
-
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else
-				{
-					/* If using external clock, and console is not
-					 * attached to any external peripheral, bits are
-					 * not shifted, so SB is not modified. */
-				}
+	/* The counters are only updated when the next event is due, or when
+	 * an IO register that depends on them is accessed. */
+	if(PGB_LIKELY(gb->counter.pending_cycles < gb->counter.next_event) &&
+			!gb->gb_halt)
+		return inst_cycles;
 
-				gb->counter.serial_count = 0;
-			}
-		}
+	/* If halted, loop until an interrupt occurs. */
+	{
+		uint_fast32_t total_cycles = inst_cycles;
 
-		/* TIMA register timing */
-		/* TODO: Change tac_enable to struct of TAC timer control bits. */
-		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
+		while(1)
 		{
-			gb->counter.tima_count += inst_cycles;
-
-			while(gb->counter.tima_count >=
-				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
-			{
-				gb->counter.tima_count -=
-					TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+			uint_fast32_t halt_cycles = __gb_sync_counters(gb);
 
-				if(++gb->hram_io[IO_TIMA] == 0)
-				{
-					gb->hram_io[IO_IF] |= TIMER_INTR;
-					/* On overflow, set TMA to TIMA. */
-					gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
-				}
-			}
-		}
+			if(!gb->gb_halt || halt_cycles == 0 ||
+					(gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) != 0)
+				break;
 
-		/* If LCD is off, don't update LCD state or increase the LCD
-		 * ticks. Instead, keep track of the amount of time that is
-		 * being passed. */
-		if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
-		{
-			gb->counter.lcd_off_count += inst_cycles;
-			if(gb->counter.lcd_off_count >= LCD_FRAME_CYCLES)
-			{
-				gb->counter.lcd_off_count -= LCD_FRAME_CYCLES;
-				gb->gb_frame = true;
-			}
-			continue;
+			gb->counter.pending_cycles = halt_cycles;
+			total_cycles += halt_cycles;
+			PGB_PROFILE_ADD(gb, cycles, halt_cycles);
+			PGB_PROFILE_ADD(gb, halt_cycles, halt_cycles);
 		}
 
-		/* LCD Timing */
-		gb->counter.lcd_count += inst_cycles;
-
-		/* New Scanline. HBlank -> VBlank or OAM Scan */
-		if(gb->counter.lcd_count >= LCD_LINE_CYCLES)
-		{
-			gb->counter.lcd_count -= LCD_LINE_CYCLES;
-
-			/* Next line */
-			gb->hram_io[IO_LY] = gb->hram_io[IO_LY] + 1;
-			if (gb->hram_io[IO_LY] == LCD_VERT_LINES)
-				gb->hram_io[IO_LY] = 0;
-
-			/* LYC Update */
-			if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
-			{
-				gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
-
-				if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
-			}
-			else
-				gb->hram_io[IO_STAT] &= 0xFB;
-
-			/* Check if LCD should be in Mode 1 (VBLANK) state */
-			if(gb->hram_io[IO_LY] == LCD_HEIGHT)
-			{
-				gb->hram_io[IO_STAT] =
-					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
-				gb->gb_frame = true;
-				gb->hram_io[IO_IF] |= VBLANK_INTR;
-				gb->lcd_blank = false;
+		return total_cycles;
+	}
+}
 
-				if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
+#if PEANUT_GB_INLINE_CPU
+uint_fast32_t __gb_step_cpu(struct gb_s *gb)
+{
+	return __gb_execute(gb);
+}
+#endif
 
-#if ENABLE_LCD
-				/* If frame skip is activated, check if we need to draw
-				 * the frame or skip it. */
-				if(gb->direct.frame_skip)
-				{
-					gb->display.frame_skip_count =
-						!gb->display.frame_skip_count;
-				}
+void gb_run_frame(struct gb_s *gb)
+{
+	gb->gb_frame = false;
 
-				/* If interlaced is activated, change which lines get
-				 * updated. Also, only update lines on frames that are
-				 * actually drawn when frame skip is enabled. */
-				if(gb->direct.interlace &&
-						(!gb->direct.frame_skip ||
-						 gb->display.frame_skip_count))
-				{
-					gb->display.interlace_count =
-						!gb->display.interlace_count;
-				}
+	while(!gb->gb_frame)
+	{
+#if PEANUT_GB_INLINE_CPU
+		__gb_execute(gb);
+#else
+		__gb_step_cpu(gb);
 #endif
-                                /* If halted forever, then return on VBLANK. */
-                                if(gb->gb_halt && !gb->hram_io[IO_IE])
-					break;
-			}
-			/* Start of normal Line (not in VBLANK) */
-			else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
-			{
-				if(gb->hram_io[IO_LY] == 0)
-				{
-					/* Clear Screen */
-					gb->display.WY = gb->hram_io[IO_WY];
-					gb->display.window_clear = 0;
-				}
+	}
+}
 
-				/* OAM Search occurs at the start of the line. */
-				gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_OAM_SCAN;
-				gb->counter.lcd_count = 0;
+uint_fast32_t gb_run_cycles(struct gb_s *gb, uint_fast32_t cycles)
+{
+	uint_fast32_t cycles_run = 0;
 
-				if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
+	while(cycles_run < cycles)
+		cycles_run += __gb_step_cpu(gb);
 
-				/* If halted immediately jump to next LCD mode.
-				 * From OAM Search to LCD Draw. */
-				//if(gb->counter.lcd_count < LCD_MODE2_OAM_SCAN_END)
-				//	inst_cycles = LCD_MODE2_OAM_SCAN_END - gb->counter.lcd_count;
-				inst_cycles = LCD_MODE2_OAM_SCAN_DURATION;
-			}
-		}
-		/* Go from Mode 3 (LCD Draw) to Mode 0 (HBLANK). */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW &&
-				gb->counter.lcd_count >= LCD_MODE3_LCD_DRAW_END)
-		{
-			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
+	return cycles_run;
+}
 
-			if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
-				gb->hram_io[IO_IF] |= LCDC_INTR;
+uint_fast32_t gb_run_until(struct gb_s *gb, bool (*predicate)(struct gb_s *))
+{
+	uint_fast32_t cycles_run = 0;
 
-			/* If halted immediately, jump from OAM Scan to LCD Draw. */
-			if (gb->counter.lcd_count < LCD_MODE0_HBLANK_MAX_DRUATION)
-				inst_cycles = LCD_MODE0_HBLANK_MAX_DRUATION - gb->counter.lcd_count;
-		}
-		/* Go from Mode 2 (OAM Scan) to Mode 3 (LCD Draw). */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN &&
-				gb->counter.lcd_count >= LCD_MODE2_OAM_SCAN_END)
-		{
-			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_LCD_DRAW;
-#if ENABLE_LCD
-			if(!gb->lcd_blank)
-				__gb_draw_line(gb);
-#endif
-			/* If halted immediately jump to next LCD mode. */
-			if (gb->counter.lcd_count < LCD_MODE3_LCD_DRAW_MIN_DURATION)
-				inst_cycles = LCD_MODE3_LCD_DRAW_MIN_DURATION - gb->counter.lcd_count;
-		}
-	} while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0);
-	/* If halted, loop until an interrupt occurs. */
+	do
+		cycles_run += __gb_step_cpu(gb);
+	while(!predicate(gb));
+
+	return cycles_run;
 }
 
-void gb_run_frame(struct gb_s *gb)
+uint_fast32_t gb_get_frame_cycles(const struct gb_s *gb)
 {
-	gb->gb_frame = false;
+	uint_fast32_t cycles = gb->counter.pending_cycles;
 
-	while(!gb->gb_frame)
-		__gb_step_cpu(gb);
+	if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
+		return cycles + gb->counter.lcd_off_count;
+
+	/* Frames end when VBLANK starts on line 144. */
+	if(gb->hram_io[IO_LY] >= LCD_HEIGHT)
+		cycles += (gb->hram_io[IO_LY] - LCD_HEIGHT) * LCD_LINE_CYCLES;
+	else
+		cycles += (gb->hram_io[IO_LY] + LCD_VERT_LINES - LCD_HEIGHT) *
+			LCD_LINE_CYCLES;
+
+	return cycles + gb->counter.lcd_count;
 }
 
 int gb_get_save_size_s(struct gb_s *gb, size_t *ram_size)
@@ -3594,6 +5382,183 @@ void gb_init_serial(struct gb_s *gb,
 {
 	gb->gb_serial_tx = gb_serial_tx;
 	gb->gb_serial_rx = gb_serial_rx;
+
+	/* A pending transfer now has to call gb_serial_tx. */
+	__gb_update_next_event(gb);
+}
+
+void gb_init_audio(struct gb_s *gb,
+		   uint8_t (*gb_audio_read)(struct gb_s*, const uint_fast16_t),
+		   void (*gb_audio_write)(struct gb_s*, const uint_fast16_t,
+			   const uint8_t))
+{
+	gb->gb_audio_read = gb_audio_read;
+	gb->gb_audio_write = gb_audio_write;
+}
+
+const struct gb_profile_s *gb_get_profile(const struct gb_s *gb)
+{
+#if PEANUT_GB_PROFILE
+	return &gb->profile;
+#else
+	(void) gb;
+	return NULL;
+#endif
+}
+
+void gb_reset_profile(struct gb_s *gb)
+{
+#if PEANUT_GB_PROFILE
+	memset(&gb->profile, 0, sizeof(gb->profile));
+#else
+	(void) gb;
+#endif
+}
+
+const char *gb_profile_region_name(enum gb_profile_region_e region)
+{
+	static const char *const names[GB_PROFILE_REGION_MAX] = {
+		"ROM0", "ROMX", "VRAM", "CART_RAM", "WRAM", "ECHO", "OAM",
+		"IO", "HRAM"
+	};
+
+	if(region >= GB_PROFILE_REGION_MAX)
+		return "INVALID";
+
+	return names[region];
+}
+
+#if ENABLE_SOUND
+/* Used by default when ENABLE_SOUND is set, so that front-ends providing the
+ * global audio_read() and audio_write() functions continue to work. */
+uint8_t __gb_audio_read_global(struct gb_s *gb, const uint_fast16_t addr)
+{
+	(void) gb;
+	return audio_read(addr);
+}
+
+void __gb_audio_write_global(struct gb_s *gb, const uint_fast16_t addr,
+			     const uint8_t val)
+{
+	(void) gb;
+	audio_write(addr, val);
+}
+#endif
+
+void gb_unshare(struct gb_s *gb)
+{
+#if PEANUT_GB_FORK
+	if(!gb->fork.shared)
+		return;
+
+	__gb_fork_copy(gb->vram, &gb->fork.vram, VRAM_SIZE);
+	__gb_fork_copy(gb->wram, &gb->fork.wram[0], FORK_PAGE_SIZE);
+	__gb_fork_copy(gb->wram + FORK_PAGE_SIZE, &gb->fork.wram[1],
+			FORK_PAGE_SIZE);
+	for(uint_fast8_t i = 0; i < FORK_CART_RAM_PAGES; i++)
+		__gb_fork_copy_cart_ram(gb, i);
+
+	gb->fork.shared = false;
+	__gb_update_mem_map(gb);
+#else
+	(void) gb;
+#endif
+}
+
+int gb_fork(const struct gb_s *parent, struct gb_s *child, uint8_t *cart_ram)
+{
+	uint8_t *parent_cart_ram = parent->cart_direct.cart_ram;
+	const size_t cart_ram_size = parent->cart_direct.cart_ram_size;
+
+	if(parent_cart_ram != NULL && cart_ram == NULL)
+		return -1;
+
+	/* Everything except the memory is copied. Members after oam are
+	 * copied from after the pointer to it if PEANUT_GB_EXTERNAL_MEMORY is
+	 * enabled, so that the child keeps its own memory. */
+	memcpy(child, parent, offsetof(struct gb_s, wram));
+	memcpy(child->oam, parent->oam, OAM_SIZE);
+	{
+		const size_t after_oam = offsetof(struct gb_s, oam) +
+			sizeof(child->oam);
+#if ENABLE_LCD && PEANUT_GB_TILE_CACHE
+		/* The tile cache is decoded again instead of being copied. */
+		const size_t cache = offsetof(struct gb_s, display.tile_cache);
+		const size_t after = offsetof(struct gb_s, display.tile_dirty) +
+			sizeof(child->display.tile_dirty);
+
+		memcpy((uint8_t *)child + after_oam,
+				(const uint8_t *)parent + after_oam,
+				cache - after_oam);
+		memcpy((uint8_t *)child + after, (const uint8_t *)parent + after,
+				sizeof(*child) - after);
+		memset(child->display.tile_dirty, true,
+				sizeof(child->display.tile_dirty));
+#else
+		memcpy((uint8_t *)child + after_oam,
+				(const uint8_t *)parent + after_oam,
+				sizeof(*child) - after_oam);
+#endif
+	}
+
+#if PEANUT_GB_FORK
+	/* Memory that the parent still shares with its own parent is shared
+	 * from there. */
+	child->fork.vram = parent->fork.vram != NULL ?
+		parent->fork.vram : parent->vram;
+
+	for(uint_fast8_t i = 0; i < WRAM_SIZE / FORK_PAGE_SIZE; i++)
+	{
+		child->fork.wram[i] = parent->fork.wram[i] != NULL ?
+			parent->fork.wram[i] : parent->wram + i * FORK_PAGE_SIZE;
+	}
+
+	for(uint_fast8_t i = 0; i < FORK_CART_RAM_PAGES; i++)
+	{
+		const size_t offset = i * FORK_PAGE_SIZE;
+
+		if(parent_cart_ram == NULL || offset >= cart_ram_size)
+			child->fork.cart_ram[i] = NULL;
+		else if(parent->fork.cart_ram[i] != NULL)
+			child->fork.cart_ram[i] = parent->fork.cart_ram[i];
+		else
+			child->fork.cart_ram[i] = parent_cart_ram + offset;
+	}
+
+	/* Cart RAM larger than the pages that may be shared is copied. */
+	if(parent_cart_ram != NULL &&
+			cart_ram_size > FORK_CART_RAM_PAGES * FORK_PAGE_SIZE)
+	{
+		const size_t shared = FORK_CART_RAM_PAGES * FORK_PAGE_SIZE;
+		memcpy(cart_ram + shared, parent_cart_ram + shared,
+				cart_ram_size - shared);
+	}
+
+	child->fork.shared = true;
+#else
+	memcpy(child->wram, parent->wram, WRAM_SIZE);
+	memcpy(child->vram, parent->vram, VRAM_SIZE);
+
+	if(parent_cart_ram != NULL)
+		memcpy(cart_ram, parent_cart_ram, cart_ram_size);
+#endif
+
+	if(parent_cart_ram != NULL)
+		child->cart_direct.cart_ram = cart_ram;
+
+#if PEANUT_GB_LCD_QUEUE
+	/* Lines queued by the parent are not rendered for the child. */
+	child->display.lines_queued = false;
+#endif
+
+	__gb_update_mem_map(child);
+
+#if ENABLE_LCD && PEANUT_GB_SKIP_UNCHANGED_LINES
+	/* The child may draw to a different frame buffer. */
+	child->display.mem_version++;
+#endif
+
+	return 0;
 }
 
 uint8_t gb_colour_hash(struct gb_s *gb)
@@ -3615,6 +5580,12 @@ uint8_t gb_colour_hash(struct gb_s *gb)
  */
 void gb_reset(struct gb_s *gb)
 {
+#if ENABLE_LCD && PEANUT_GB_LCD_QUEUE
+	__gb_lcd_sync(gb);
+#endif
+	/* Memory that is not cleared below must not change in the parent. */
+	gb_unshare(gb);
+
 	gb->gb_halt = false;
 	gb->gb_ime = true;
 
@@ -3623,6 +5594,15 @@ void gb_reset(struct gb_s *gb)
 	gb->cart_ram_bank = 0;
 	gb->enable_cart_ram = 0;
 	gb->cart_mode_select = 0;
+#if PEANUT_GB_OAM_DMA_TIMING
+	gb->counter.oam_dma_count = 0;
+#endif
+
+	/* Unmap the boot ROM area until IO_BOOT is set below. This also
+	 * makes sure that the memory map is valid before __gb_write() is
+	 * used. */
+	gb->hram_io[IO_BOOT] = 0x00;
+	__gb_update_mem_map(gb);
 
 	/* Use values as though the boot ROM was already executed. */
 	if(gb->gb_bootrom_read == NULL)
@@ -3667,6 +5647,7 @@ void gb_reset(struct gb_s *gb)
 	gb->counter.serial_count = 0;
 	gb->counter.rtc_count = 0;
 	gb->counter.lcd_off_count = 0;
+	gb->counter.pending_cycles = 0;
 
 	gb->direct.joypad = 0xFF;
 	gb->hram_io[IO_JOYP] = 0xCF;
@@ -3691,6 +5672,24 @@ void gb_reset(struct gb_s *gb)
 	gb->hram_io[IO_WX] = 0x00;
 	gb->hram_io[IO_IE] = 0x00;
 	gb->hram_io[IO_IF] = 0xE1;
+
+#if ENABLE_LCD && PEANUT_GB_SKIP_UNCHANGED_LINES
+	/* Draw every line of the next frame. */
+	gb->display.mem_version = 1;
+	memset(gb->display.line_version, 0,
+			sizeof(gb->display.line_version));
+#endif
+#if ENABLE_LCD && PEANUT_GB_TILE_CACHE
+	memset(gb->display.tile_dirty, true, sizeof(gb->display.tile_dirty));
+#endif
+#if ENABLE_LCD && PEANUT_GB_HIGH_LCD_ACCURACY
+	gb->display.sprites_dirty = true;
+#endif
+
+	/* Map the boot ROM area to the cartridge if the boot ROM is not
+	 * used. */
+	__gb_update_mem_map(gb);
+	__gb_update_next_event(gb);
 }
 
 enum gb_init_error_e gb_init(struct gb_s *gb,
@@ -3744,9 +5743,30 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 	 * automatically. */
 	gb->gb_serial_tx = NULL;
 	gb->gb_serial_rx = NULL;
+	gb->serial_priv = NULL;
 
 	gb->gb_bootrom_read = NULL;
 
+	/* APU registers are stored without any audio emulation unless audio
+	 * callbacks are set with gb_init_audio(). */
+#if ENABLE_SOUND
+	gb->gb_audio_read = __gb_audio_read_global;
+	gb->gb_audio_write = __gb_audio_write_global;
+#else
+	gb->gb_audio_read = NULL;
+	gb->gb_audio_write = NULL;
+#endif
+
+	/* ROM and cart RAM are accessed through the callbacks until
+	 * gb_init_rom_direct() is called. */
+	memset(&gb->cart_direct, 0, sizeof(gb->cart_direct));
+#if PEANUT_GB_FORK
+	memset(&gb->fork, 0, sizeof(gb->fork));
+#endif
+#if PEANUT_GB_DECODE_CACHE
+	memset(gb->decode_cache, 0xFF, sizeof(gb->decode_cache));
+#endif
+
 	/* Check valid ROM using checksum value. */
 	{
 		uint8_t x = 0;
@@ -3759,13 +5779,41 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 			return GB_INIT_INVALID_CHECKSUM;
 	}
 
-	/* Check if cartridge type is supported, and set MBC type. */
-	{
-		const uint8_t mbc_value = gb->gb_rom_read(gb, mbc_location);
+	/* Check if cartridge type is supported, and set MBC type. */
+	{
+		const uint8_t mbc_value = gb->gb_rom_read(gb, mbc_location);
+
+		if(mbc_value > sizeof(cart_mbc) - 1 ||
+				(gb->mbc = cart_mbc[mbc_value]) == -1)
+			return GB_INIT_CARTRIDGE_UNSUPPORTED;
+	}
+
+	switch(gb->mbc)
+	{
+	case 1:
+		gb->read_mbc = __gb_read_mbc1;
+		gb->write_mbc = __gb_write_mbc1;
+		break;
+
+	case 2:
+		gb->read_mbc = __gb_read_mbc2;
+		gb->write_mbc = __gb_write_mbc2;
+		break;
+
+	case 3:
+		gb->read_mbc = __gb_read_mbc3;
+		gb->write_mbc = __gb_write_mbc3;
+		break;
+
+	case 5:
+		gb->read_mbc = __gb_read_mbc0;
+		gb->write_mbc = __gb_write_mbc5;
+		break;
 
-		if(mbc_value > sizeof(cart_mbc) - 1 ||
-				(gb->mbc = cart_mbc[mbc_value]) == -1)
-			return GB_INIT_CARTRIDGE_UNSUPPORTED;
+	default:
+		gb->read_mbc = __gb_read_mbc0;
+		gb->write_mbc = __gb_write_mbc0;
+		break;
 	}
 
 	gb->num_rom_banks_mask = num_rom_banks_mask[gb->gb_rom_read(gb, bank_count_location)] - 1;
@@ -3789,9 +5837,35 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 	 * always has 512 half-bytes of RAM. Hence, gb->num_ram_banks must be
 	 * ignored for MBC2. */
 
+#if PEANUT_GB_CART_RAM_DIRTY
+	gb->cart_ram_dirty = 0;
+#endif
+
+	/* The RTC keeps running across a reset, so is only cleared here,
+	 * until set with gb_set_rtc(). */
+	memset(&gb->rtc_latched, 0, sizeof(gb->rtc_latched));
+	memset(&gb->rtc_real, 0, sizeof(gb->rtc_real));
+
 	gb->lcd_blank = false;
 	gb->display.lcd_draw_line = NULL;
+	gb->display.fb = NULL;
+	gb->direct.interlace = false;
+	gb->display.interlace_count = false;
+	gb->direct.frame_skip = false;
+	gb->display.frame_skip_count = false;
+	gb->display.window_clear = 0;
+	gb->display.WY = 0;
+	gb->display.render_every = 1;
+	gb->display.render_count = 0;
+	gb->display.frame_requested = false;
+	gb->display.frame_hidden = false;
+#if PEANUT_GB_LCD_QUEUE
+	gb->display.lcd_queue_line = NULL;
+	gb->display.lcd_sync = NULL;
+	gb->display.lines_queued = false;
+#endif
 
+	gb_reset_profile(gb);
 	gb_reset(gb);
 
 	return GB_INIT_NO_ERROR;
@@ -3828,6 +5902,7 @@ void gb_init_lcd(struct gb_s *gb,
 			const uint_fast8_t line))
 {
 	gb->display.lcd_draw_line = lcd_draw_line;
+	gb->display.fb = NULL;
 
 	gb->direct.interlace = false;
 	gb->display.interlace_count = false;
@@ -3837,8 +5912,139 @@ void gb_init_lcd(struct gb_s *gb,
 	gb->display.window_clear = 0;
 	gb->display.WY = 0;
 
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+	/* Draw every line of the next frame. */
+	gb->display.mem_version++;
+#endif
+
 	return;
 }
+
+void gb_init_lcd_framebuffer(struct gb_s *gb, void *fb, size_t pitch,
+		enum gb_pixel_format_e fmt, const void *palette)
+{
+	/* Shades of grey from white to black, for each layer. */
+	static const uint16_t default_rgb565[4] = {
+		0xFFFF, 0xAD55, 0x52AA, 0x0000
+	};
+	static const uint32_t default_rgba8888[4] = {
+		0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000
+	};
+	/* Only the first four shades are used without PEANUT_GB_12_COLOUR. */
+	const uint_fast8_t colours = PEANUT_GB_12_COLOUR ? 12 : 4;
+	uint_fast8_t i;
+
+	/* Only the output changes. The LCD carries on from its current
+	 * state, so that the palette may be changed mid-game. */
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+	gb->display.mem_version++;
+#endif
+
+	for(i = 0; i < colours; i++)
+	{
+		switch(fmt)
+		{
+		case GB_PIXEL_FORMAT_RGB565:
+			gb->display.fb_palette[i] = palette != NULL ?
+				((const uint16_t *)palette)[i] :
+				default_rgb565[i & 3];
+			break;
+
+		case GB_PIXEL_FORMAT_RGBA8888:
+			gb->display.fb_palette[i] = palette != NULL ?
+				((const uint32_t *)palette)[i] :
+				default_rgba8888[i & 3];
+			break;
+
+		default:
+			gb->display.fb_palette[i] = 0;
+			break;
+		}
+	}
+
+	gb->display.fb = fmt < GB_PIXEL_FORMAT_INVALID_MAX ? fb : NULL;
+	gb->display.fb_pitch = pitch;
+	gb->display.fb_format = fmt;
+}
+
+#if PEANUT_GB_LCD_QUEUE
+void gb_init_lcd_queue(struct gb_s *gb,
+		void (*lcd_queue_line)(struct gb_s *gb,
+			const struct gb_lcd_line_s *line),
+		void (*lcd_sync)(struct gb_s *gb))
+{
+	/* Lines queued with the previous callbacks are rendered first. */
+	__gb_lcd_sync(gb);
+
+	gb->display.lcd_queue_line = lcd_queue_line;
+	gb->display.lcd_sync = lcd_sync;
+}
+
+void gb_render_line(struct gb_s *gb, const struct gb_lcd_line_s *line)
+{
+	__gb_render_line(gb, line);
+}
+#endif
+
+void gb_set_render_policy(struct gb_s *gb, uint_fast8_t every_n_frames)
+{
+	gb->display.render_every = every_n_frames;
+	gb->display.render_count = 0;
+}
+
+void gb_request_frame(struct gb_s *gb)
+{
+	gb->display.frame_requested = true;
+}
+#endif
+
+void gb_init_rom_direct(struct gb_s *gb, const uint8_t *rom,
+		size_t rom_size, uint8_t *cart_ram, size_t cart_ram_size)
+{
+	/* Bank 0 is always read directly, so it must be complete. */
+	if(rom_size < ROM_BANK_SIZE)
+		rom = NULL;
+
+	gb->cart_direct.rom = rom;
+	gb->cart_direct.rom_size = rom_size;
+	gb->cart_direct.cart_ram = cart_ram;
+	gb->cart_direct.cart_ram_size = cart_ram_size;
+
+#if PEANUT_GB_FORK
+	/* The new cart RAM is not shared with a parent context. */
+	memset(gb->fork.cart_ram, 0, sizeof(gb->fork.cart_ram));
+#endif
+#if PEANUT_GB_DECODE_CACHE
+	/* Instructions cached from the previous ROM are discarded. */
+	memset(gb->decode_cache, 0xFF, sizeof(gb->decode_cache));
+#endif
+
+	__gb_update_mem_map(gb);
+}
+
+#if PEANUT_GB_CART_RAM_DIRTY
+uint_fast32_t gb_get_cart_ram_dirty(const struct gb_s *gb)
+{
+	return gb->cart_ram_dirty;
+}
+
+void gb_clear_cart_ram_dirty(struct gb_s *gb, uint_fast32_t pages)
+{
+	gb->cart_ram_dirty &= ~pages;
+
+	/* The cleared pages are no longer mapped for writing. */
+	__gb_update_mem_map(gb);
+}
+#endif
+
+#if PEANUT_GB_EXTERNAL_MEMORY
+void gb_init_memory(struct gb_s *gb, uint8_t *wram, uint8_t *vram,
+		uint8_t *oam)
+{
+	gb->wram = wram;
+	gb->vram = vram;
+	gb->oam = oam;
+}
 #endif
 
 void gb_set_bootrom(struct gb_s *gb,
@@ -3859,12 +6065,316 @@ void gb_tick_rtc(struct gb_s *gb)
 
 void gb_set_rtc(struct gb_s *gb, const struct tm * const time)
 {
+	__gb_sync_counters(gb);
 	gb->rtc_real.bytes[0] = time->tm_sec;
 	gb->rtc_real.bytes[1] = time->tm_min;
 	gb->rtc_real.bytes[2] = time->tm_hour;
 	gb->rtc_real.bytes[3] = time->tm_yday & 0xFF; /* Low 8 bits of day counter. */
 	gb->rtc_real.bytes[4] = time->tm_yday >> 8; /* High 1 bit of day counter. */
 }
+
+/* Save state layout. All multi-byte values are stored little endian. */
+#define PEANUT_GB_STATE_MAGIC		0x53424750 /* "PGBS" */
+#define PEANUT_GB_STATE_VERSION		2
+#define PEANUT_GB_STATE_HDR_SIZE	8
+#define PEANUT_GB_STATE_REG_SIZE	65
+#define PEANUT_GB_STATE_SIZE		(PEANUT_GB_STATE_HDR_SIZE +	\
+					 PEANUT_GB_STATE_REG_SIZE +	\
+					 WRAM_SIZE + VRAM_SIZE +	\
+					 OAM_SIZE + HRAM_IO_SIZE)
+
+#define PGB_STATE_PUT8(p, x)	(*(p)++ = (uint8_t)(x))
+#define PGB_STATE_PUT16(p, x)	do { PGB_STATE_PUT8(p, (x));		\
+				     PGB_STATE_PUT8(p, (x) >> 8); } while(0)
+#define PGB_STATE_PUT32(p, x)	do { PGB_STATE_PUT16(p, (x));		\
+				     PGB_STATE_PUT16(p, (x) >> 16); } while(0)
+#define PGB_STATE_GET8(p)	((uint_fast32_t)*(p)++)
+#define PGB_STATE_GET16(p)	((p) += 2, (uint_fast32_t)(p)[-2] |	\
+				 (uint_fast32_t)(p)[-1] << 8)
+#define PGB_STATE_GET32(p)	((p) += 4, (uint_fast32_t)(p)[-4] |	\
+				 (uint_fast32_t)(p)[-3] << 8 |		\
+				 (uint_fast32_t)(p)[-2] << 16 |		\
+				 (uint_fast32_t)(p)[-1] << 24)
+
+size_t gb_state_size(void)
+{
+	return PEANUT_GB_STATE_SIZE;
+}
+
+void gb_state_save(const struct gb_s *gb, void *buf)
+{
+	uint8_t *p = buf;
+
+	PGB_STATE_PUT32(p, PEANUT_GB_STATE_MAGIC);
+	PGB_STATE_PUT32(p, PEANUT_GB_STATE_VERSION);
+
+	/* CPU registers. */
+	PGB_STATE_PUT8(p, gb->cpu_reg.a);
+	PGB_STATE_PUT8(p, gb->cpu_reg.f.reg);
+	PGB_STATE_PUT16(p, gb->cpu_reg.bc.reg);
+	PGB_STATE_PUT16(p, gb->cpu_reg.de.reg);
+	PGB_STATE_PUT16(p, gb->cpu_reg.hl.reg);
+	PGB_STATE_PUT16(p, gb->cpu_reg.sp.reg);
+	PGB_STATE_PUT16(p, gb->cpu_reg.pc.reg);
+	PGB_STATE_PUT8(p, gb->gb_halt | gb->gb_ime << 1 |
+			gb->gb_frame << 2 | gb->lcd_blank << 3);
+
+	/* MBC and RTC. */
+	PGB_STATE_PUT16(p, gb->selected_rom_bank);
+	PGB_STATE_PUT8(p, gb->cart_ram_bank);
+	PGB_STATE_PUT8(p, gb->enable_cart_ram);
+	PGB_STATE_PUT8(p, gb->cart_mode_select);
+	memcpy(p, gb->rtc_latched.bytes, sizeof(gb->rtc_latched.bytes));
+	p += sizeof(gb->rtc_latched.bytes);
+	memcpy(p, gb->rtc_real.bytes, sizeof(gb->rtc_real.bytes));
+	p += sizeof(gb->rtc_real.bytes);
+
+	/* Counters. Cycles that are still pending are saved as they are, so
+	 * that saving a state never advances the emulation. */
+	PGB_STATE_PUT16(p, gb->counter.lcd_count);
+	PGB_STATE_PUT16(p, gb->counter.div_count);
+	PGB_STATE_PUT16(p, gb->counter.tima_count);
+	PGB_STATE_PUT16(p, gb->counter.serial_count);
+	PGB_STATE_PUT32(p, gb->counter.rtc_count);
+	PGB_STATE_PUT32(p, gb->counter.lcd_off_count);
+	PGB_STATE_PUT32(p, gb->counter.pending_cycles);
+	/* Cycles left of an OAM DMA transfer, which is always 0 without
+	 * PEANUT_GB_OAM_DMA_TIMING. */
+#if PEANUT_GB_OAM_DMA_TIMING
+	PGB_STATE_PUT16(p, gb->counter.oam_dma_count);
+#else
+	PGB_STATE_PUT16(p, 0);
+#endif
+
+	/* Display. */
+	memcpy(p, gb->display.bg_palette, sizeof(gb->display.bg_palette));
+	p += sizeof(gb->display.bg_palette);
+	memcpy(p, gb->display.sp_palette, sizeof(gb->display.sp_palette));
+	p += sizeof(gb->display.sp_palette);
+	PGB_STATE_PUT8(p, gb->display.window_clear);
+	PGB_STATE_PUT8(p, gb->display.WY);
+	PGB_STATE_PUT8(p, gb->display.frame_skip_count |
+			gb->display.interlace_count << 1);
+
+	/* Memory. */
+#if PEANUT_GB_FORK
+	/* Memory shared with the parent context is saved from there. */
+	for(uint_fast8_t i = 0; i < WRAM_SIZE / FORK_PAGE_SIZE; i++)
+	{
+		memcpy(p, gb->fork.wram[i] != NULL ? gb->fork.wram[i] :
+				gb->wram + i * FORK_PAGE_SIZE, FORK_PAGE_SIZE);
+		p += FORK_PAGE_SIZE;
+	}
+	memcpy(p, gb->fork.vram != NULL ? gb->fork.vram : gb->vram, VRAM_SIZE);
+	p += VRAM_SIZE;
+#else
+	memcpy(p, gb->wram, WRAM_SIZE);
+	p += WRAM_SIZE;
+	memcpy(p, gb->vram, VRAM_SIZE);
+	p += VRAM_SIZE;
+#endif
+	memcpy(p, gb->oam, OAM_SIZE);
+	p += OAM_SIZE;
+	memcpy(p, gb->hram_io, HRAM_IO_SIZE);
+}
+
+/**
+ * Internal function used to check that the values in a save state are within
+ * the ranges that the emulator can reach with the loaded cartridge, so that a
+ * corrupt state, or one saved from a different cartridge, cannot select a
+ * bank or RTC register that does not exist, or index past the end of a table.
+ *
+ * \param gb	Emulator context that the state is to be loaded into.
+ * \param p	Start of the state, after the magic and version.
+ * \returns	0 if the state may be loaded, otherwise -1.
+ */
+int __gb_state_check(const struct gb_s *gb, const uint8_t *p)
+{
+	const uint8_t rtc_reg_mask[5] = {
+		0x3F, 0x3F, 0x1F, 0xFF, 0xC1
+	};
+	uint_fast32_t val;
+	uint_fast8_t i;
+
+	/* CPU registers and flags. */
+	p += 13;
+
+	if(PGB_STATE_GET16(p) & ~(uint_fast32_t)gb->num_rom_banks_mask)
+		return -1;
+
+	/* No MBC selects a RAM bank above 0x0F. MBC3 selects RTC registers
+	 * with 0x08 to 0x0C. */
+	val = PGB_STATE_GET8(p);
+	if(val > (gb->mbc == 3 ? 0x0C : 0x0F))
+		return -1;
+
+	if(PGB_STATE_GET8(p) > 1)
+		return -1;
+
+	if(PGB_STATE_GET8(p) > 1)
+		return -1;
+
+	/* Latched and real RTC registers. */
+	for(i = 0; i < 10; i++)
+	{
+		if(PGB_STATE_GET8(p) & ~rtc_reg_mask[i % 5])
+			return -1;
+	}
+
+	if(PGB_STATE_GET16(p) >= LCD_LINE_CYCLES)
+		return -1;
+
+	if(PGB_STATE_GET16(p) >= DIV_CYCLES)
+		return -1;
+
+	/* Below the slowest timer period. */
+	if(PGB_STATE_GET16(p) >= TAC_CYCLES[0])
+		return -1;
+
+	if(PGB_STATE_GET16(p) >= SERIAL_CYCLES)
+		return -1;
+
+	if(PGB_STATE_GET32(p) >= RTC_CYCLES)
+		return -1;
+
+	/* Time from the line that was being drawn is added when the LCD is
+	 * switched off. */
+	if(PGB_STATE_GET32(p) >= LCD_FRAME_CYCLES + LCD_LINE_CYCLES)
+		return -1;
+
+	/* Counters are updated at least every 0x4000 cycles, plus the
+	 * instruction that reached the event. */
+	if(PGB_STATE_GET32(p) > 0x8000)
+		return -1;
+
+	if(PGB_STATE_GET16(p) > OAM_DMA_CYCLES)
+		return -1;
+
+	/* Background and object palettes hold a shade in each entry. */
+	for(i = 0; i < 12; i++)
+	{
+		if(PGB_STATE_GET8(p) > 3)
+			return -1;
+	}
+
+	/* Window line. */
+	if(PGB_STATE_GET8(p) > LCD_HEIGHT)
+		return -1;
+
+	/* WY and the frame skip and interlace flags. */
+	p += 2;
+
+	p += WRAM_SIZE + VRAM_SIZE + OAM_SIZE;
+	if(p[IO_LY] >= LCD_VERT_LINES)
+		return -1;
+
+	return 0;
+}
+
+int gb_state_load(struct gb_s *gb, const void *buf)
+{
+	const uint8_t *p = buf;
+	uint_fast32_t val;
+
+	if(PGB_STATE_GET32(p) != PEANUT_GB_STATE_MAGIC)
+		return -1;
+
+	if(PGB_STATE_GET32(p) != PEANUT_GB_STATE_VERSION)
+		return -1;
+
+	/* Nothing is changed if the state cannot be loaded. */
+	if(__gb_state_check(gb, p) != 0)
+		return -1;
+
+#if ENABLE_LCD && PEANUT_GB_LCD_QUEUE
+	__gb_lcd_sync(gb);
+#endif
+
+	gb->cpu_reg.a = PGB_STATE_GET8(p);
+	gb->cpu_reg.f.reg = PGB_STATE_GET8(p);
+	gb->cpu_reg.bc.reg = PGB_STATE_GET16(p);
+	gb->cpu_reg.de.reg = PGB_STATE_GET16(p);
+	gb->cpu_reg.hl.reg = PGB_STATE_GET16(p);
+	gb->cpu_reg.sp.reg = PGB_STATE_GET16(p);
+	gb->cpu_reg.pc.reg = PGB_STATE_GET16(p);
+	val = PGB_STATE_GET8(p);
+	gb->gb_halt = (val >> 0) & 1;
+	gb->gb_ime = (val >> 1) & 1;
+	gb->gb_frame = (val >> 2) & 1;
+	gb->lcd_blank = (val >> 3) & 1;
+
+	gb->selected_rom_bank = PGB_STATE_GET16(p);
+	gb->cart_ram_bank = PGB_STATE_GET8(p);
+	gb->enable_cart_ram = PGB_STATE_GET8(p);
+	gb->cart_mode_select = PGB_STATE_GET8(p);
+	memcpy(gb->rtc_latched.bytes, p, sizeof(gb->rtc_latched.bytes));
+	p += sizeof(gb->rtc_latched.bytes);
+	memcpy(gb->rtc_real.bytes, p, sizeof(gb->rtc_real.bytes));
+	p += sizeof(gb->rtc_real.bytes);
+
+	gb->counter.lcd_count = PGB_STATE_GET16(p);
+	gb->counter.div_count = PGB_STATE_GET16(p);
+	gb->counter.tima_count = PGB_STATE_GET16(p);
+	gb->counter.serial_count = PGB_STATE_GET16(p);
+	gb->counter.rtc_count = PGB_STATE_GET32(p);
+	gb->counter.lcd_off_count = PGB_STATE_GET32(p);
+	gb->counter.pending_cycles = PGB_STATE_GET32(p);
+	/* Without PEANUT_GB_OAM_DMA_TIMING, a transfer in progress
+	 * completes on loading. */
+	val = PGB_STATE_GET16(p);
+#if PEANUT_GB_OAM_DMA_TIMING
+	gb->counter.oam_dma_count = val;
+#endif
+
+	memcpy(gb->display.bg_palette, p, sizeof(gb->display.bg_palette));
+	p += sizeof(gb->display.bg_palette);
+	memcpy(gb->display.sp_palette, p, sizeof(gb->display.sp_palette));
+	p += sizeof(gb->display.sp_palette);
+	gb->display.window_clear = PGB_STATE_GET8(p);
+	gb->display.WY = PGB_STATE_GET8(p);
+	val = PGB_STATE_GET8(p);
+	gb->display.frame_skip_count = (val >> 0) & 1;
+	gb->display.interlace_count = (val >> 1) & 1;
+
+	memcpy(gb->wram, p, WRAM_SIZE);
+	p += WRAM_SIZE;
+	memcpy(gb->vram, p, VRAM_SIZE);
+	p += VRAM_SIZE;
+	memcpy(gb->oam, p, OAM_SIZE);
+	p += OAM_SIZE;
+	memcpy(gb->hram_io, p, HRAM_IO_SIZE);
+
+#if PEANUT_GB_FORK
+	/* WRAM and VRAM now belong to this context. Cart RAM is not in the
+	 * state, so remains shared. */
+	gb->fork.vram = NULL;
+	memset(gb->fork.wram, 0, sizeof(gb->fork.wram));
+#endif
+	/* The memory map and event schedule are derived from the state above,
+	 * so are rebuilt instead of being saved. */
+	__gb_update_mem_map(gb);
+	__gb_update_next_event(gb);
+
+#if ENABLE_LCD && PEANUT_GB_SKIP_UNCHANGED_LINES
+	/* The front-end frame buffer no longer matches the loaded state. */
+	gb->display.mem_version++;
+#endif
+#if ENABLE_LCD && PEANUT_GB_TILE_CACHE
+	memset(gb->display.tile_dirty, true, sizeof(gb->display.tile_dirty));
+#endif
+#if ENABLE_LCD && PEANUT_GB_HIGH_LCD_ACCURACY
+	gb->display.sprites_dirty = true;
+#endif
+
+	return 0;
+}
+
+#undef PGB_STATE_PUT8
+#undef PGB_STATE_PUT16
+#undef PGB_STATE_PUT32
+#undef PGB_STATE_GET8
+#undef PGB_STATE_GET16
+#undef PGB_STATE_GET32
 #endif // PEANUT_GB_HEADER_ONLY
 
 /** Function prototypes: Required functions **/
@@ -3901,13 +6411,104 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
  */
 void gb_run_frame(struct gb_s *gb);
 
+/**
+ * Executes the emulator for at least the given number of clock cycles. The
+ * emulator always completes the instruction that it is executing, so fewer
+ * than 24 cycles more may be run than requested. More are run when the last
+ * instruction skips ahead:
+ * - A HALT runs until the next interrupt that is enabled in IE, or to the end
+ *   of the frame if IE is 0.
+ * - With PEANUT_GB_IDLE_SKIP, a loop polling LY, STAT or IF is skipped up to
+ *   the next timer, serial or LCD event. That is at most 456 cycles, being a
+ *   line, when the LCD is on, or 16384 cycles when it is off.
+ * Useful for synchronising the emulator to audio or a link cable at a finer
+ * granularity than a frame.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param cycles	Number of clock cycles to execute. The DMG executes
+ *		4194304 cycles per second, and 70224 cycles per frame.
+ * \returns	Number of clock cycles actually executed.
+ */
+uint_fast32_t gb_run_cycles(struct gb_s *gb, uint_fast32_t cycles);
+
+/**
+ * Executes the emulator until the given predicate returns true. The predicate
+ * is checked after every instruction; at least one instruction is always
+ * executed. As with gb_run_cycles(), a HALT or a skipped idle loop is a single
+ * instruction, so the predicate is not checked within them.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param predicate	Function that returns true when emulation should stop.
+ *		Must not be NULL.
+ * \returns	Number of clock cycles executed.
+ */
+uint_fast32_t gb_run_until(struct gb_s *gb, bool (*predicate)(struct gb_s *));
+
+/**
+ * Returns the number of clock cycles since the start of the current frame,
+ * being the point at which gb_run_frame() last returned. This may be used
+ * within the audio and serial callbacks to time events within a frame.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	Clock cycles since the start of the frame. This is usually
+ *		below 70224, but may exceed it on frames where the LCD is
+ *		turned off or on.
+ */
+uint_fast32_t gb_get_frame_cycles(const struct gb_s *gb);
+
+/**
+ * Forks an emulator context, so that the child continues from the same state
+ * as the parent. WRAM, VRAM and cart RAM held with gb_init_rom_direct() are
+ * not copied, but shared with the parent until the child first writes to each
+ * 4 KiB page of them, so forking is cheap. The other members of struct gb_s,
+ * including the callbacks, priv and frame buffer, are copied and may be
+ * changed on the child afterwards. If PEANUT_GB_EXTERNAL_MEMORY is enabled,
+ * the child keeps the memory given to it with gb_init_memory().
+ *
+ * The parent must not be run, reset or loaded, and must not be freed, whilst
+ * any context forked from it, or from its forks, may still share its memory.
+ * Use gb_unshare() on a child to stop sharing memory with its parent. If
+ * PEANUT_GB_FORK is disabled, all of the memory is copied instead.
+ *
+ * Whilst memory is shared, the wram and vram members and the cart RAM of the
+ * child do not hold its contents, which are read from the parent. Front-ends
+ * must call gb_unshare() on the child before accessing them directly, for
+ * instance to write a battery save or to inspect memory.
+ *
+ * Cart RAM accessed through the gb_cart_ram_read and gb_cart_ram_write
+ * callbacks is held by the front-end, which must copy it for the child
+ * itself. If the parent uses gb_init_rom_direct() cart RAM, the cart RAM
+ * callbacks of the child must access cart_ram.
+ *
+ * \param parent	Emulator context to fork. Must not be NULL.
+ * \param child	Context to initialise as a fork of parent. Must not
+ *			be NULL or the same as parent.
+ * \param cart_ram	Cart RAM of the child, of the same size as the cart RAM
+ *			of the parent. Only used if the parent uses
+ *			gb_init_rom_direct() cart RAM, in which case its
+ *			contents are initialised lazily. May be NULL
+ *			otherwise.
+ * \returns	0 on success, or -1 if cart_ram is required but is NULL.
+ */
+int gb_fork(const struct gb_s *parent, struct gb_s *child, uint8_t *cart_ram);
+
+/**
+ * Copies any memory that a context forked with gb_fork() still shares with
+ * its parent, so that the parent may be run or freed. This is also done by
+ * gb_reset().
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ */
+void gb_unshare(struct gb_s *gb);
+
 /**
  * Internal function used to step the CPU. Used mainly for testing.
  * Use gb_run_frame() instead.
  *
  * \param	An initialised emulator context. Must not be NULL.
+ * \returns	Number of clock cycles executed.
  */
-void __gb_step_cpu(struct gb_s *gb);
+uint_fast32_t __gb_step_cpu(struct gb_s *gb);
 
 /** Function prototypes: Optional Functions **/
 /**
@@ -3937,6 +6538,88 @@ void gb_init_lcd(struct gb_s *gb,
 		void (*lcd_draw_line)(struct gb_s *gb,
 			const uint8_t *pixels,
 			const uint_fast8_t line));
+
+/**
+ * Initialises the display context of the emulator to draw each line directly
+ * into a frame buffer, instead of calling an lcd_draw_line function. Only
+ * available when ENABLE_LCD is defined to a non-zero value.
+ * This function can be called at any time, for example to change the palette.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param fb	Frame buffer of at least LCD_HEIGHT lines of LCD_WIDTH pixels.
+ *		Must not be NULL.
+ * \param pitch	Number of bytes between the start of each line in fb.
+ * \param fmt	Format of each pixel in fb.
+ * \param palette	Ignored for GB_PIXEL_FORMAT_INDEXED8. Otherwise, an
+ *		array of [3][4] uint16_t for GB_PIXEL_FORMAT_RGB565 or
+ *		uint32_t for GB_PIXEL_FORMAT_RGBA8888, holding the value of
+ *		each shade (white to black) of OBJ0, OBJ1 and BG in that order.
+ *		Only the first four values are used if PEANUT_GB_12_COLOUR is
+ *		disabled. If NULL, shades of grey are used.
+ */
+void gb_init_lcd_framebuffer(struct gb_s *gb, void *fb, size_t pitch,
+		enum gb_pixel_format_e fmt, const void *palette);
+
+#if PEANUT_GB_LCD_QUEUE
+/**
+ * Queues the lines drawn by the LCD instead of rendering them, so that they
+ * may be rendered with gb_render_line() whilst emulation continues, such as
+ * by another thread. The line is rendered into the frame buffer or with the
+ * lcd_draw_line function set by gb_init_lcd() or gb_init_lcd_framebuffer(),
+ * which must be called first. The output is the same as when lines are not
+ * queued.
+ *
+ * Queued lines are rendered from VRAM and OAM as they are when
+ * gb_render_line() is called, so lcd_sync is called before VRAM or OAM is
+ * changed. Whilst a line is being rendered, only the functions that run the
+ * emulation, such as gb_run_frame(), may be called on the context.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param lcd_queue_line Pointer to function that is given the registers used
+ *		to draw each line, which must be copied to be kept. Set to
+ *		NULL to render lines immediately again.
+ * \param lcd_sync Pointer to function that returns once every line given to
+ *		lcd_queue_line has been rendered. Must not be NULL if
+ *		lcd_queue_line is not NULL.
+ */
+void gb_init_lcd_queue(struct gb_s *gb,
+		void (*lcd_queue_line)(struct gb_s *gb,
+			const struct gb_lcd_line_s *line),
+		void (*lcd_sync)(struct gb_s *gb));
+
+/**
+ * Renders a line given to the lcd_queue_line function set with
+ * gb_init_lcd_queue().
+ *
+ * \param gb	Emulator context that queued the line. Must not be NULL.
+ * \param line	Registers given to lcd_queue_line.
+ */
+void gb_render_line(struct gb_s *gb, const struct gb_lcd_line_s *line);
+#endif
+
+/**
+ * Sets how often frames are drawn. On frames that are not drawn, the LCD
+ * callbacks are not called and no line is rendered, so emulation runs almost
+ * as fast as when ENABLE_LCD is disabled. Only available when ENABLE_LCD is
+ * defined to a non-zero value. The policy applies from the next frame, and
+ * all frames are drawn by default.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param every_n_frames	Draw one frame out of every_n_frames, starting
+ *		with the next frame. If 0, only frames requested with
+ *		gb_request_frame() are drawn.
+ */
+void gb_set_render_policy(struct gb_s *gb, uint_fast8_t every_n_frames);
+
+/**
+ * Draws the next frame that the LCD starts, even if it would be skipped by
+ * gb_set_render_policy() or direct.frame_skip. When called between calls to
+ * gb_run_frame(), the frame drawn is the one run by the next gb_run_frame().
+ * Interlacing still applies to the requested frame.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ */
+void gb_request_frame(struct gb_s *gb);
 #endif
 
 /**
@@ -3956,6 +6639,48 @@ void gb_init_serial(struct gb_s *gb,
 		    enum gb_serial_rx_ret_e (*gb_serial_rx)(struct gb_s*,
 			    uint8_t*));
 
+/**
+ * Sets the functions used to access the audio processing unit (APU) registers
+ * between 0xFF10 and 0xFF3F for this emulator context. This function is
+ * optional, and allows multiple emulator contexts to each have their own APU.
+ * If ENABLE_SOUND is set, the global audio_read() and audio_write() functions
+ * are used until this function is called.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param gb_audio_read Pointer to function that returns the value of an APU
+ *		register. If NULL, the register value last written is returned
+ *		with unused bits set.
+ * \param gb_audio_write Pointer to function that writes a value to an APU
+ *		register. If NULL, the value is stored in the context.
+ */
+void gb_init_audio(struct gb_s *gb,
+		   uint8_t (*gb_audio_read)(struct gb_s*, const uint_fast16_t),
+		   void (*gb_audio_write)(struct gb_s*, const uint_fast16_t,
+			   const uint8_t));
+
+/**
+ * Returns the profiling counters of the emulator context.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	Pointer to the counters within the context, or NULL if
+ *		PEANUT_GB_PROFILE is not enabled.
+ */
+const struct gb_profile_s *gb_get_profile(const struct gb_s *gb);
+
+/**
+ * Clears the profiling counters, for instance so that only a section of a
+ * game is measured. Does nothing if PEANUT_GB_PROFILE is not enabled.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ */
+void gb_reset_profile(struct gb_s *gb);
+
+/**
+ * Returns a short name of a memory region counted by the profiling counters,
+ * to be used when printing them.
+ */
+const char *gb_profile_region_name(enum gb_profile_region_e region);
+
 /**
  * Obtains the save size of the game (size of the Cart RAM). Required by the
  * frontend to allocate enough memory for the Cart RAM.
@@ -4016,6 +6741,63 @@ void gb_tick_rtc(struct gb_s *gb);
  */
 void gb_set_rtc(struct gb_s *gb, const struct tm * const time);
 
+/**
+ * Allows Peanut-GB to access the ROM and cart RAM directly in memory, instead
+ * of calling gb_rom_read, gb_cart_ram_read and gb_cart_ram_write for each
+ * access. This is much faster for front-ends that already hold the whole ROM
+ * in memory. Banks that are outside of the given sizes, MBC2 cart RAM and the
+ * RTC registers continue to use the callbacks given to gb_init().
+ * Should be called after gb_init(). Call again with NULL pointers to go back
+ * to using the callbacks.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param rom	Pointer to the ROM image. May be NULL to use gb_rom_read.
+ * \param rom_size	Size of the ROM image in bytes.
+ * \param cart_ram	Pointer to cart RAM. May be NULL to use gb_cart_ram_read
+ *		and gb_cart_ram_write.
+ * \param cart_ram_size	Size of cart RAM in bytes.
+ */
+void gb_init_rom_direct(struct gb_s *gb, const uint8_t *rom,
+		size_t rom_size, uint8_t *cart_ram, size_t cart_ram_size);
+
+#if PEANUT_GB_CART_RAM_DIRTY
+/**
+ * Returns the pages of cart RAM written since they were last cleared with
+ * gb_clear_cart_ram_dirty(). Bit n is set if any byte from
+ * n * CART_RAM_DIRTY_PAGE_SIZE to (n + 1) * CART_RAM_DIRTY_PAGE_SIZE - 1 was
+ * written, whether cart RAM is held with gb_init_rom_direct() or written with
+ * gb_cart_ram_write. Writes made by the front-end itself are not tracked.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	Bitmap of dirty pages.
+ */
+uint_fast32_t gb_get_cart_ram_dirty(const struct gb_s *gb);
+
+/**
+ * Marks pages of cart RAM as clean, for instance once they have been saved.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param pages	Bitmap of the pages to clear, as returned by
+ *		gb_get_cart_ram_dirty().
+ */
+void gb_clear_cart_ram_dirty(struct gb_s *gb, uint_fast32_t pages);
+#endif
+
+#if PEANUT_GB_EXTERNAL_MEMORY
+/**
+ * Sets the memory used for WRAM, VRAM and OAM when PEANUT_GB_EXTERNAL_MEMORY
+ * is enabled. Must be called before gb_init() and gb_fork(), and the memory
+ * must remain valid whilst the context is used.
+ *
+ * \param gb	Emulator context. Must not be NULL.
+ * \param wram	WRAM of WRAM_SIZE (8 KiB) bytes.
+ * \param vram	VRAM of VRAM_SIZE (8 KiB) bytes.
+ * \param oam	OAM of OAM_SIZE (160) bytes.
+ */
+void gb_init_memory(struct gb_s *gb, uint8_t *wram, uint8_t *vram,
+		uint8_t *oam);
+#endif
+
 /**
  * Use boot ROM on reset. gb_reset() must be called for this to take affect.
  * \param gb 	An initialised emulator context. Must not be NULL.
@@ -4024,6 +6806,36 @@ void gb_set_rtc(struct gb_s *gb, const struct tm * const time);
 void gb_set_bootrom(struct gb_s *gb,
 	uint8_t (*gb_bootrom_read)(struct gb_s*, const uint_fast16_t));
 
+/**
+ * Returns the size of the buffer required by gb_state_save() and
+ * gb_state_load(). The size is the same for all cartridges.
+ */
+size_t gb_state_size(void);
+
+/**
+ * Saves the state of the emulator to a buffer. The state is stored in a
+ * packed, versioned, little endian layout, so it may be loaded on a different
+ * host. Cart RAM is not included, as it is held by the front-end.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param buf	Buffer of at least gb_state_size() bytes.
+ */
+void gb_state_save(const struct gb_s *gb, void *buf);
+
+/**
+ * Restores the state of the emulator from a buffer written by
+ * gb_state_save(). The callbacks and front-end data in the emulator context
+ * are kept, so the state should only be loaded into a context that was
+ * initialised with the same ROM.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param buf	Buffer of at least gb_state_size() bytes.
+ * \returns	0 on success, or -1 if the buffer is not a compatible state,
+ *		or holds a value that the cartridge or emulator cannot reach,
+ *		in which case the emulator context is not changed.
+ */
+int gb_state_load(struct gb_s *gb, const void *buf);
+
 /* Undefine CPU Flag helper functions. */
 #undef PEANUT_GB_CPUFLAG_MASK_CARRY
 #undef PEANUT_GB_CPUFLAG_MASK_HALFC
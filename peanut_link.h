@@ -0,0 +1,727 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * Link cable between two emulator contexts, built on the serial functions and
+ * gb_run_cycles().
+ *
+ * Each context is attached to a port, and is run in slices of a fixed number
+ * of clock cycles called the latency. The bytes sent by each side are passed
+ * to the other side in messages holding the time of the slice that they were
+ * sent in, and are only seen by the other side once it has run to that time
+ * plus the latency. Either side may therefore run up to the latency ahead of
+ * the other, but no further, and the result of emulation does not depend on how
+ * the two sides are scheduled.
+ *
+ * A transfer completes when the side using the internal clock finds that the
+ * other side is waiting with the external clock. Both sides then receive the
+ * byte of the other. Otherwise the side using the internal clock receives
+ * 0xFF, as when no cable is connected. A side that starts waiting is only
+ * seen to wait after the latency, so games that clock transfers quickly
+ * receive more 0xFF bytes as the latency grows. The latency should be kept
+ * as short as the connection allows, such as a few lines when both sides are
+ * in the same process.
+ *
+ * Both contexts may be in the same process and connected by a pair of single
+ * producer, single consumer rings, with peanut_link_init(). They are then run
+ * from one thread with peanut_link_run_cycles(), or each from its own thread
+ * with peanut_link_port_run_cycles(). Otherwise, each side is run by its own
+ * process and connected to the other by TCP with peanut_link_listen() and
+ * peanut_link_connect(). The messages of each slice are then sent together,
+ * and time spent waiting on the network is hidden as long as the round trip
+ * is shorter than the latency. TCP is only available on POSIX systems, and
+ * strict ISO C modes need _POSIX_C_SOURCE to be defined to 200112L or later.
+ *
+ * Multiple threads require C11 atomics. The serial functions and serial_priv
+ * of each context are used by the link.
+ *
+ * peanut_gb.h must be included before this file.
+ */
+
+#ifndef PEANUT_LINK_H
+#define PEANUT_LINK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && \
+		!defined(__STDC_NO_ATOMICS__)
+# include <stdatomic.h>
+# define PEANUT_LINK_ATOMIC	_Atomic
+#else
+/* Both sides of a ring must be run from the same thread. */
+# define PEANUT_LINK_ATOMIC	volatile
+#endif
+
+/* Number of messages held by each ring. Must be a power of two. */
+#define PEANUT_LINK_RING_SIZE	1024
+
+/* Bounds of the latency in clock cycles. The upper bound keeps the messages
+ * sent in two slices within a ring. */
+#define PEANUT_LINK_MIN_LATENCY	64
+#define PEANUT_LINK_MAX_LATENCY	(1ul << 20)
+
+struct peanut_link_msg_s
+{
+	/* Start of the slice that the message was sent in. */
+	uint64_t time;
+	uint8_t type;
+	uint8_t byte;
+};
+
+struct peanut_link_ring_s
+{
+	struct peanut_link_msg_s msg[PEANUT_LINK_RING_SIZE];
+	/* head is only written by the sender, and tail by the receiver. */
+	PEANUT_LINK_ATOMIC unsigned head;
+	PEANUT_LINK_ATOMIC unsigned tail;
+};
+
+struct peanut_link_port_s
+{
+	struct gb_s *gb;
+
+	/* Rings to and from the other side when it is in the same process. */
+	struct peanut_link_ring_s *out;
+	struct peanut_link_ring_s *in;
+
+	/* Socket connected to the other side otherwise, or -1. Messages are
+	 * sent at the end of each slice, and received messages are buffered
+	 * until they are seen. */
+	int sock;
+	uint8_t send_buf[PEANUT_LINK_RING_SIZE * 10];
+	size_t send_len;
+	uint8_t recv_buf[PEANUT_LINK_RING_SIZE * 10];
+	size_t recv_pos;
+	size_t recv_len;
+
+	uint_fast32_t latency;
+
+	/* Start of the current slice, the time that the other side has run to,
+	 * and the time to run to. */
+	uint64_t time;
+	uint64_t peer_time;
+	uint64_t target;
+
+	/* Cycles that were run past the end of the previous slice. */
+	uint_fast32_t overrun;
+
+	/* Byte of the other side whilst it waits with the external clock, and
+	 * the byte that completes the transfer that this side waits on, or
+	 * -1. */
+	int_fast16_t peer_ready;
+	int_fast16_t clocked;
+
+	/* Byte of the current transfer, and whether the other side was told
+	 * that this side is waiting with it. */
+	uint8_t tx_byte;
+	bool ready_sent;
+};
+
+struct peanut_link_s
+{
+	struct peanut_link_port_s port[2];
+	struct peanut_link_ring_s ring[2];
+};
+
+#ifndef PEANUT_LINK_HEADER_ONLY
+
+#include <string.h>
+
+#if defined(_WIN32)
+# define WIN32_LEAN_AND_MEAN
+# include <windows.h>
+# define PEANUT_LINK_YIELD()	Sleep(0)
+#elif defined(__unix__) || defined(__APPLE__)
+# include <netdb.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <sched.h>
+# include <sys/socket.h>
+# include <unistd.h>
+# define PEANUT_LINK_YIELD()	sched_yield()
+# define PEANUT_LINK_SOCKETS	1
+#else
+# define PEANUT_LINK_YIELD()	((void) 0)
+#endif
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL	0
+#endif
+
+/* SC register, which is not defined by PEANUT_GB_HEADER_ONLY. */
+#define PEANUT_LINK_IO_SC	0x02
+
+/* Message types. Each message is sent over a socket as the type, the byte and
+ * the time in big endian. */
+#define PEANUT_LINK_MSG_SYNC	0
+#define PEANUT_LINK_MSG_READY	1
+#define PEANUT_LINK_MSG_CLOCK	2
+#define PEANUT_LINK_MSG_SIZE	10
+
+/* Sent by both sides when a socket is connected, followed by the latency. */
+#define PEANUT_LINK_MAGIC	0x5047424Cul
+
+/**
+ * Sends the buffered messages over the socket.
+ */
+static int __peanut_link_flush(struct peanut_link_port_s *p)
+{
+#if defined(PEANUT_LINK_SOCKETS)
+	size_t sent = 0;
+
+	while(sent < p->send_len)
+	{
+		ssize_t ret = send(p->sock, p->send_buf + sent,
+				p->send_len - sent, MSG_NOSIGNAL);
+
+		if(ret <= 0)
+			return -1;
+
+		sent += ret;
+	}
+#endif
+
+	p->send_len = 0;
+	return 0;
+}
+
+/**
+ * Sends a message to the other side, timed at the start of the current slice.
+ */
+static int __peanut_link_send(struct peanut_link_port_s *p, uint8_t type,
+		uint8_t byte)
+{
+	if(p->sock < 0)
+	{
+		struct peanut_link_ring_s *r = p->out;
+		const unsigned head = r->head;
+		struct peanut_link_msg_s *m;
+
+		/* The other side is at most a slice behind, so the ring only
+		 * fills if it has stopped running. */
+		while(head - r->tail >= PEANUT_LINK_RING_SIZE)
+			PEANUT_LINK_YIELD();
+
+		m = &r->msg[head & (PEANUT_LINK_RING_SIZE - 1)];
+		m->time = p->time;
+		m->type = type;
+		m->byte = byte;
+		r->head = head + 1;
+		return 0;
+	}
+
+	if(p->send_len + PEANUT_LINK_MSG_SIZE > sizeof(p->send_buf) &&
+			__peanut_link_flush(p) != 0)
+		return -1;
+
+	{
+		uint8_t *b = p->send_buf + p->send_len;
+
+		b[0] = type;
+		b[1] = byte;
+		for(uint_fast8_t i = 0; i < 8; i++)
+			b[2 + i] = (uint8_t)(p->time >> (56 - 8 * i));
+
+		p->send_len += PEANUT_LINK_MSG_SIZE;
+	}
+
+	return 0;
+}
+
+/**
+ * Gets the next message from the other side without removing it.
+ *
+ * \returns	true if a message was received.
+ */
+static bool __peanut_link_peek(struct peanut_link_port_s *p,
+		struct peanut_link_msg_s *m)
+{
+	const uint8_t *b;
+
+	if(p->sock < 0)
+	{
+		struct peanut_link_ring_s *r = p->in;
+		const unsigned tail = r->tail;
+
+		if(tail == r->head)
+			return false;
+
+		*m = r->msg[tail & (PEANUT_LINK_RING_SIZE - 1)];
+		return true;
+	}
+
+	if(p->recv_len - p->recv_pos < PEANUT_LINK_MSG_SIZE)
+		return false;
+
+	b = p->recv_buf + p->recv_pos;
+	m->type = b[0];
+	m->byte = b[1];
+	m->time = 0;
+	for(uint_fast8_t i = 0; i < 8; i++)
+		m->time = (m->time << 8) | b[2 + i];
+
+	return true;
+}
+
+static void __peanut_link_pop(struct peanut_link_port_s *p)
+{
+	if(p->sock < 0)
+		p->in->tail = p->in->tail + 1;
+	else
+		p->recv_pos += PEANUT_LINK_MSG_SIZE;
+}
+
+/**
+ * Waits for more messages from the other side.
+ */
+static int __peanut_link_wait(struct peanut_link_port_s *p)
+{
+#if defined(PEANUT_LINK_SOCKETS)
+	if(p->sock >= 0)
+	{
+		ssize_t ret;
+
+		memmove(p->recv_buf, p->recv_buf + p->recv_pos,
+				p->recv_len - p->recv_pos);
+		p->recv_len -= p->recv_pos;
+		p->recv_pos = 0;
+
+		ret = recv(p->sock, p->recv_buf + p->recv_len,
+				sizeof(p->recv_buf) - p->recv_len, 0);
+		if(ret <= 0)
+			return -1;
+
+		p->recv_len += ret;
+		return 0;
+	}
+#endif
+
+	PEANUT_LINK_YIELD();
+	return 0;
+}
+
+/**
+ * Sees the messages that were sent at least the latency before the current
+ * slice, waiting until the other side has run to the start of the slice.
+ */
+static int __peanut_link_receive(struct peanut_link_port_s *p)
+{
+	while(1)
+	{
+		struct peanut_link_msg_s m;
+
+		/* Messages sent later than those that may be seen are always
+		 * preceded by a sync message that ends the wait. */
+		while(__peanut_link_peek(p, &m))
+		{
+			if(m.type != PEANUT_LINK_MSG_SYNC &&
+					m.time + p->latency > p->time)
+				break;
+
+			switch(m.type)
+			{
+			case PEANUT_LINK_MSG_SYNC:
+				p->peer_time = m.time;
+				break;
+
+			case PEANUT_LINK_MSG_READY:
+				p->peer_ready = m.byte;
+				break;
+
+			case PEANUT_LINK_MSG_CLOCK:
+				if(p->ready_sent)
+					p->clocked = m.byte;
+				break;
+			}
+
+			__peanut_link_pop(p);
+		}
+
+		if(p->peer_time >= p->time)
+			return 0;
+
+		if(__peanut_link_wait(p) != 0)
+			return -1;
+	}
+}
+
+static void __peanut_link_serial_tx(struct gb_s *gb, const uint8_t tx)
+{
+	struct peanut_link_port_s *p = gb->serial_priv;
+
+	if(gb->hram_io[PEANUT_LINK_IO_SC] & SERIAL_SC_CLOCK_SRC)
+	{
+		p->tx_byte = tx;
+		p->ready_sent = false;
+		return;
+	}
+
+	/* This is called again whilst waiting with the external clock, so the
+	 * other side is only told again if the byte was changed. Errors are
+	 * found at the end of the slice. */
+	if(p->ready_sent && p->tx_byte == tx)
+		return;
+
+	p->tx_byte = tx;
+	p->ready_sent = true;
+	(void) __peanut_link_send(p, PEANUT_LINK_MSG_READY, tx);
+}
+
+static enum gb_serial_rx_ret_e __peanut_link_serial_rx(struct gb_s *gb,
+		uint8_t *rx)
+{
+	struct peanut_link_port_s *p = gb->serial_priv;
+
+	if(gb->hram_io[PEANUT_LINK_IO_SC] & SERIAL_SC_CLOCK_SRC)
+	{
+		if(p->peer_ready < 0)
+			return GB_SERIAL_RX_NO_CONNECTION;
+
+		/* The other side completes its transfer once it sees this. */
+		*rx = (uint8_t)p->peer_ready;
+		p->peer_ready = -1;
+		(void) __peanut_link_send(p, PEANUT_LINK_MSG_CLOCK, p->tx_byte);
+		return GB_SERIAL_RX_SUCCESS;
+	}
+
+	if(p->clocked < 0)
+		return GB_SERIAL_RX_NO_CONNECTION;
+
+	*rx = (uint8_t)p->clocked;
+	p->clocked = -1;
+	p->ready_sent = false;
+	return GB_SERIAL_RX_SUCCESS;
+}
+
+/**
+ * Runs one slice of a port.
+ */
+static int __peanut_link_run_slice(struct peanut_link_port_s *p)
+{
+	if(__peanut_link_receive(p) != 0)
+		return -1;
+
+	/* A slice may be skipped if a HALT ran past its end. */
+	if(p->overrun < p->latency)
+		p->overrun += gb_run_cycles(p->gb, p->latency - p->overrun);
+
+	p->overrun -= p->latency;
+	p->time += p->latency;
+
+	if(__peanut_link_send(p, PEANUT_LINK_MSG_SYNC, 0) != 0)
+		return -1;
+
+	return __peanut_link_flush(p);
+}
+
+static void __peanut_link_init_port(struct peanut_link_port_s *p,
+		struct gb_s *gb, uint_fast32_t latency)
+{
+	if(latency < PEANUT_LINK_MIN_LATENCY)
+		latency = PEANUT_LINK_MIN_LATENCY;
+	else if(latency > PEANUT_LINK_MAX_LATENCY)
+		latency = PEANUT_LINK_MAX_LATENCY;
+
+	memset(p, 0, sizeof(*p));
+	p->gb = gb;
+	p->sock = -1;
+	p->latency = latency;
+	p->peer_ready = -1;
+	p->clocked = -1;
+
+	gb->serial_priv = p;
+	gb_init_serial(gb, __peanut_link_serial_tx, __peanut_link_serial_rx);
+}
+
+/**
+ * Connects two contexts in the same process. The link uses the serial
+ * functions of both contexts until they are replaced with gb_init_serial().
+ *
+ * \param latency	Cycles that each side may run ahead of the other, and
+ *			after which each byte is seen by the other side. This
+ *			is kept between PEANUT_LINK_MIN_LATENCY and
+ *			PEANUT_LINK_MAX_LATENCY. 4096 cycles is the time taken
+ *			to send one byte.
+ */
+void peanut_link_init(struct peanut_link_s *link, struct gb_s *a,
+		struct gb_s *b, uint_fast32_t latency)
+{
+	__peanut_link_init_port(&link->port[0], a, latency);
+	__peanut_link_init_port(&link->port[1], b, latency);
+	memset(link->ring, 0, sizeof(link->ring));
+
+	link->port[0].out = &link->ring[0];
+	link->port[0].in = &link->ring[1];
+	link->port[1].out = &link->ring[1];
+	link->port[1].in = &link->ring[0];
+}
+
+/**
+ * Runs one side of a link for the given number of clock cycles, rounded to the
+ * latency. Waits for the other side whenever it is more than the latency
+ * behind, so each side of a link that is within one process must be run by
+ * its own thread.
+ *
+ * \returns	0 on success, or -1 if the connection to the other side was
+ *		lost.
+ */
+int peanut_link_port_run_cycles(struct peanut_link_port_s *p,
+		uint_fast32_t cycles)
+{
+	p->target += cycles;
+
+	while(p->time < p->target)
+	{
+		if(__peanut_link_run_slice(p) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Runs both contexts of a link initialised with peanut_link_init() for the
+ * given number of clock cycles from the calling thread, alternating between
+ * them every slice.
+ */
+void peanut_link_run_cycles(struct peanut_link_s *link, uint_fast32_t cycles)
+{
+	struct peanut_link_port_s *a = &link->port[0];
+	struct peanut_link_port_s *b = &link->port[1];
+
+	a->target += cycles;
+	b->target += cycles;
+
+	/* Each side is always at most one slice ahead of the other, so
+	 * neither side waits. */
+	while(a->time < a->target || b->time < b->target)
+	{
+		if(a->time < a->target)
+			(void) __peanut_link_run_slice(a);
+
+		if(b->time < b->target)
+			(void) __peanut_link_run_slice(b);
+	}
+}
+
+/**
+ * Runs both contexts of a link for one frame from the calling thread.
+ */
+void peanut_link_run_frame(struct peanut_link_s *link)
+{
+	peanut_link_run_cycles(link, (uint_fast32_t)SCREEN_REFRESH_CYCLES);
+}
+
+#if defined(PEANUT_LINK_SOCKETS)
+/**
+ * Checks that both sides of a socket use the same latency.
+ */
+static int __peanut_link_handshake(struct peanut_link_port_s *p)
+{
+	uint8_t hello[8], peer[8];
+	size_t got = 0;
+
+	for(uint_fast8_t i = 0; i < 4; i++)
+	{
+		hello[i] = (uint8_t)(PEANUT_LINK_MAGIC >> (24 - 8 * i));
+		hello[4 + i] = (uint8_t)(p->latency >> (24 - 8 * i));
+	}
+
+	memcpy(p->send_buf, hello, sizeof(hello));
+	p->send_len = sizeof(hello);
+	if(__peanut_link_flush(p) != 0)
+		return -1;
+
+	while(got < sizeof(peer))
+	{
+		ssize_t ret = recv(p->sock, peer + got, sizeof(peer) - got, 0);
+
+		if(ret <= 0)
+			return -1;
+
+		got += ret;
+	}
+
+	return memcmp(hello, peer, sizeof(hello)) == 0 ? 0 : -1;
+}
+
+/**
+ * Attaches a context to a connected socket.
+ */
+static int __peanut_link_attach(struct peanut_link_port_s *p,
+		struct gb_s *gb, int sock, uint_fast32_t latency)
+{
+	int one = 1;
+
+	__peanut_link_init_port(p, gb, latency);
+	p->sock = sock;
+
+	/* Messages are already batched for each slice. */
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if(__peanut_link_handshake(p) != 0)
+	{
+		close(sock);
+		p->sock = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Waits for the other side of a link to connect over TCP. Only available on
+ * POSIX systems.
+ *
+ * \param service	Port number or service name to listen on.
+ * \param latency	As given to peanut_link_init(). Must be the same on
+ *			both sides.
+ * \returns	0 on success, or -1 if the connection failed or the latency of
+ *		the other side differs.
+ */
+int peanut_link_listen(struct peanut_link_port_s *p, struct gb_s *gb,
+		const char *service, uint_fast32_t latency)
+{
+	struct addrinfo hints, *res;
+	int listener, sock = -1, one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET6;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if(getaddrinfo(NULL, service, &hints, &res) != 0)
+	{
+		hints.ai_family = AF_INET;
+		if(getaddrinfo(NULL, service, &hints, &res) != 0)
+			return -1;
+	}
+
+	listener = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if(listener >= 0)
+	{
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one,
+				sizeof(one));
+
+		if(bind(listener, res->ai_addr, res->ai_addrlen) == 0 &&
+				listen(listener, 1) == 0)
+			sock = accept(listener, NULL, NULL);
+
+		close(listener);
+	}
+
+	freeaddrinfo(res);
+
+	if(sock < 0)
+		return -1;
+
+	return __peanut_link_attach(p, gb, sock, latency);
+}
+
+/**
+ * Connects to the other side of a link over TCP, which must be waiting in
+ * peanut_link_listen(). Only available on POSIX systems.
+ *
+ * \param host	Host name or address of the other side.
+ * \param service	Port number or service name of the other side.
+ * \param latency	As given to peanut_link_init(). Must be the same on
+ *			both sides.
+ * \returns	0 on success, or -1 if the connection failed or the latency of
+ *		the other side differs.
+ */
+int peanut_link_connect(struct peanut_link_port_s *p, struct gb_s *gb,
+		const char *host, const char *service, uint_fast32_t latency)
+{
+	struct addrinfo hints, *res, *ai;
+	int sock = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if(getaddrinfo(host, service, &hints, &res) != 0)
+		return -1;
+
+	for(ai = res; ai != NULL && sock < 0; ai = ai->ai_next)
+	{
+		sock = socket(ai->ai_family, ai->ai_socktype,
+				ai->ai_protocol);
+		if(sock >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen) != 0)
+		{
+			close(sock);
+			sock = -1;
+		}
+	}
+
+	freeaddrinfo(res);
+
+	if(sock < 0)
+		return -1;
+
+	return __peanut_link_attach(p, gb, sock, latency);
+}
+
+/**
+ * Closes the connection of a port attached with peanut_link_listen() or
+ * peanut_link_connect(). The context acts as though no link cable is
+ * connected afterwards.
+ */
+void peanut_link_close(struct peanut_link_port_s *p)
+{
+	if(p->sock >= 0)
+		close(p->sock);
+
+	p->sock = -1;
+	p->gb->serial_priv = NULL;
+	gb_init_serial(p->gb, NULL, NULL);
+}
+#endif
+
+#undef PEANUT_LINK_YIELD
+#undef PEANUT_LINK_SOCKETS
+#undef PEANUT_LINK_IO_SC
+#undef PEANUT_LINK_MSG_SYNC
+#undef PEANUT_LINK_MSG_READY
+#undef PEANUT_LINK_MSG_CLOCK
+#undef PEANUT_LINK_MSG_SIZE
+#undef PEANUT_LINK_MAGIC
+
+#else
+
+void peanut_link_init(struct peanut_link_s *link, struct gb_s *a,
+		struct gb_s *b, uint_fast32_t latency);
+int peanut_link_port_run_cycles(struct peanut_link_port_s *p,
+		uint_fast32_t cycles);
+void peanut_link_run_cycles(struct peanut_link_s *link, uint_fast32_t cycles);
+void peanut_link_run_frame(struct peanut_link_s *link);
+int peanut_link_listen(struct peanut_link_port_s *p, struct gb_s *gb,
+		const char *service, uint_fast32_t latency);
+int peanut_link_connect(struct peanut_link_port_s *p, struct gb_s *gb,
+		const char *host, const char *service, uint_fast32_t latency);
+void peanut_link_close(struct peanut_link_port_s *p);
+
+#endif // PEANUT_LINK_HEADER_ONLY
+#endif // PEANUT_LINK_H
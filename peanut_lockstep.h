@@ -0,0 +1,387 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * Lockstep execution of many emulator contexts playing the same ROM, built on
+ * gb_state_save() and gb_state_load().
+ *
+ * Contexts that are in exactly the same state and are given the same joypad
+ * input will also be in the same state after the next frame. Such contexts
+ * are grouped together, and only one context of each group, the leader, is
+ * run. The others follow it without being run. When a follower is given a
+ * different input to its leader, it is given a copy of the leader's state and
+ * run on its own from then on. After each merge interval, contexts that have
+ * reached the same state again are grouped together once more.
+ *
+ * This is most useful when many copies of a game are run from the same start
+ * state with inputs that only occasionally differ, such as when training
+ * agents. When every context is given different inputs, the cost is that of
+ * saving and hashing the state of each context at each merge, and nothing is
+ * gained over running each context with gb_run_frame(). The --lockstep option
+ * of examples/benchmark/peanut-bench-suite.c measures both cases.
+ *
+ * The contexts of a group must be initialised in the same way with the same
+ * ROM. Cart RAM is compared and copied when it is held in memory with
+ * gb_init_rom_direct(); contexts with cart RAM that is only available through
+ * the callbacks are never grouped. Error, serial and LCD callbacks are only
+ * called for the leader.
+ *
+ * peanut_gb.h must be included before this file.
+ */
+
+#ifndef PEANUT_LOCKSTEP_H
+#define PEANUT_LOCKSTEP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct peanut_lockstep_s
+{
+	struct gb_s **gb;
+	unsigned count;
+
+	/* Index of the context that is run in place of each context. A context
+	 * that is run is its own leader. */
+	unsigned *leader;
+
+	/* Look for contexts to group every merge_interval frames. */
+	unsigned merge_interval;
+	unsigned since_merge;
+
+	/* State of each leader at the most recent merge, its hash, and an open
+	 * addressing table of leaders indexed by hash. */
+	size_t state_size;
+	uint8_t *states;
+	uint_fast32_t *hash;
+	unsigned *table;
+	unsigned table_mask;
+
+	/* Context whose state is held in split_state, or count if none. */
+	uint8_t *split_state;
+	unsigned split_from;
+
+	/* Number of frames that were run, and that were requested. */
+	unsigned long long frames_run;
+	unsigned long long frames_total;
+};
+
+#ifndef PEANUT_LOCKSTEP_HEADER_ONLY
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Marks an unused entry in the table of leaders. */
+#define PEANUT_LOCKSTEP_EMPTY	((unsigned)-1)
+
+/**
+ * Returns a hash of a state. Eight bytes are mixed at a time, as this is done
+ * for every leader at every merge.
+ */
+static uint_fast32_t __peanut_lockstep_hash(const uint8_t *p, size_t len)
+{
+	uint64_t h = 0xCBF29CE484222325u;
+
+	for(; len >= 8; len -= 8, p += 8)
+	{
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		h = (h ^ v) * 0x100000001B3u;
+		h ^= h >> 29;
+	}
+
+	for(; len > 0; len--, p++)
+		h = (h ^ *p) * 0x100000001B3u;
+
+	return (uint_fast32_t)(h ^ (h >> 32)) & 0xFFFFFFFF;
+}
+
+/**
+ * Returns true if the cart RAM of the two contexts is the same, or if neither
+ * has cart RAM.
+ */
+static bool __peanut_lockstep_cart_ram_equal(const struct gb_s *a,
+		const struct gb_s *b)
+{
+	if(a->cart_direct.cart_ram_size != b->cart_direct.cart_ram_size)
+		return false;
+
+	if(a->cart_direct.cart_ram == NULL || b->cart_direct.cart_ram == NULL)
+		return a->cart_direct.cart_ram == b->cart_direct.cart_ram;
+
+	return memcmp(a->cart_direct.cart_ram, b->cart_direct.cart_ram,
+			a->cart_direct.cart_ram_size) == 0;
+}
+
+/**
+ * Returns true if the whole state of the context is available to be compared,
+ * which is not the case when cart RAM is accessed through the callbacks.
+ */
+static bool __peanut_lockstep_can_group(const struct gb_s *gb)
+{
+	return !gb->cart_ram || gb->cart_direct.cart_ram != NULL;
+}
+
+/**
+ * Gives a follower its own copy of the state of its leader, so that it may be
+ * run on its own.
+ */
+static void __peanut_lockstep_split(struct peanut_lockstep_s *ls, unsigned i)
+{
+	const unsigned l = ls->leader[i];
+	const struct gb_s *leader = ls->gb[l];
+	struct gb_s *gb = ls->gb[i];
+
+	if(ls->split_from != l)
+	{
+		gb_state_save(leader, ls->split_state);
+		ls->split_from = l;
+	}
+
+	gb_state_load(gb, ls->split_state);
+
+	if(gb->cart_direct.cart_ram != NULL &&
+			leader->cart_direct.cart_ram != NULL)
+		memcpy(gb->cart_direct.cart_ram, leader->cart_direct.cart_ram,
+				gb->cart_direct.cart_ram_size);
+
+	ls->leader[i] = i;
+}
+
+/**
+ * Groups together contexts that are in the same state.
+ */
+static void __peanut_lockstep_merge(struct peanut_lockstep_s *ls)
+{
+	memset(ls->table, 0xFF, (ls->table_mask + 1) * sizeof(*ls->table));
+
+	for(unsigned i = 0; i < ls->count; i++)
+	{
+		uint8_t *state = ls->states + i * ls->state_size;
+		unsigned slot;
+
+		if(ls->leader[i] != i || !__peanut_lockstep_can_group(ls->gb[i]))
+			continue;
+
+		gb_state_save(ls->gb[i], state);
+		ls->hash[i] = __peanut_lockstep_hash(state, ls->state_size);
+
+		for(slot = ls->hash[i] & ls->table_mask;
+				ls->table[slot] != PEANUT_LOCKSTEP_EMPTY;
+				slot = (slot + 1) & ls->table_mask)
+		{
+			const unsigned l = ls->table[slot];
+
+			if(ls->hash[l] != ls->hash[i])
+				continue;
+
+			if(memcmp(ls->states + l * ls->state_size, state,
+					ls->state_size) != 0)
+				continue;
+
+			if(!__peanut_lockstep_cart_ram_equal(ls->gb[l],
+					ls->gb[i]))
+				continue;
+
+			ls->leader[i] = l;
+			break;
+		}
+
+		if(ls->leader[i] == i)
+			ls->table[slot] = i;
+	}
+
+	/* Followers of contexts that now follow another leader are moved to
+	 * that leader. A leader always has a lower index than its followers, so
+	 * a single pass is enough. */
+	for(unsigned i = 0; i < ls->count; i++)
+		ls->leader[i] = ls->leader[ls->leader[i]];
+
+	/* States of the leaders may have been replaced. */
+	ls->split_from = ls->count;
+	ls->since_merge = 0;
+}
+
+/**
+ * Initialises lockstep execution of a number of contexts. The contexts must
+ * be initialised, and remain owned by the caller. Contexts that are already
+ * in the same state are grouped together immediately.
+ *
+ * \param gb	Array of count initialised emulator contexts. The array must
+ *		remain valid until peanut_lockstep_free() is called.
+ * \param merge_interval	Look for contexts to group every merge_interval
+ *			frames. 0 is treated as 1.
+ * \returns	0 on success, or -1 if memory could not be allocated.
+ */
+int peanut_lockstep_init(struct peanut_lockstep_s *ls, struct gb_s **gb,
+		unsigned count, unsigned merge_interval)
+{
+	unsigned table_size = 1;
+
+	memset(ls, 0, sizeof(*ls));
+
+	/* Keep the table at most half full. */
+	while(table_size < count * 2)
+		table_size <<= 1;
+
+	ls->state_size = gb_state_size();
+	ls->leader = malloc(count * sizeof(*ls->leader));
+	ls->states = malloc(count * ls->state_size);
+	ls->hash = malloc(count * sizeof(*ls->hash));
+	ls->table = malloc(table_size * sizeof(*ls->table));
+	ls->split_state = malloc(ls->state_size);
+
+	if(ls->leader == NULL || ls->states == NULL || ls->hash == NULL ||
+			ls->table == NULL || ls->split_state == NULL)
+	{
+		free(ls->leader);
+		free(ls->states);
+		free(ls->hash);
+		free(ls->table);
+		free(ls->split_state);
+		memset(ls, 0, sizeof(*ls));
+		return -1;
+	}
+
+	ls->gb = gb;
+	ls->count = count;
+	ls->table_mask = table_size - 1;
+	ls->merge_interval = merge_interval == 0 ? 1 : merge_interval;
+
+	for(unsigned i = 0; i < count; i++)
+		ls->leader[i] = i;
+
+	__peanut_lockstep_merge(ls);
+	return 0;
+}
+
+/**
+ * Frees the memory allocated by peanut_lockstep_init(). Followers are not
+ * detached, so the state of their contexts is out of date.
+ */
+void peanut_lockstep_free(struct peanut_lockstep_s *ls)
+{
+	free(ls->leader);
+	free(ls->states);
+	free(ls->hash);
+	free(ls->table);
+	free(ls->split_state);
+	memset(ls, 0, sizeof(*ls));
+}
+
+/**
+ * Runs one frame of every context. The joypad input of each context is taken
+ * from its own gb->direct.joypad.
+ */
+void peanut_lockstep_run_frame(struct peanut_lockstep_s *ls)
+{
+	/* Followers are split off before any leader is run, as they need the
+	 * state of the leader from before this frame. */
+	for(unsigned i = 0; i < ls->count; i++)
+	{
+		const unsigned l = ls->leader[i];
+
+		if(l != i && ls->gb[i]->direct.joypad != ls->gb[l]->direct.joypad)
+			__peanut_lockstep_split(ls, i);
+	}
+
+	ls->split_from = ls->count;
+
+	for(unsigned i = 0; i < ls->count; i++)
+	{
+		if(ls->leader[i] != i)
+			continue;
+
+		gb_run_frame(ls->gb[i]);
+		ls->frames_run++;
+	}
+
+	ls->frames_total += ls->count;
+
+	if(++ls->since_merge >= ls->merge_interval)
+		__peanut_lockstep_merge(ls);
+}
+
+/**
+ * Returns the context that holds the current state of context i. This may be
+ * used to read the memory of a context without detaching it. The returned
+ * context must not be modified.
+ */
+const struct gb_s *peanut_lockstep_get(const struct peanut_lockstep_s *ls,
+		unsigned i)
+{
+	return ls->gb[ls->leader[i]];
+}
+
+/**
+ * Brings context i up to date and stops it following another context until
+ * the next merge. Must be called before the context is modified other than by
+ * setting its joypad input, such as before it is reset or a state is loaded.
+ */
+void peanut_lockstep_detach(struct peanut_lockstep_s *ls, unsigned i)
+{
+	/* Followers of context i must be split off first, as its state is
+	 * about to be changed by the caller. */
+	if(ls->leader[i] == i)
+	{
+		for(unsigned j = 0; j < ls->count; j++)
+		{
+			if(j != i && ls->leader[j] == i)
+				__peanut_lockstep_split(ls, j);
+		}
+	}
+	else
+		__peanut_lockstep_split(ls, i);
+
+	ls->split_from = ls->count;
+}
+
+/**
+ * Returns the number of contexts that are run each frame.
+ */
+unsigned peanut_lockstep_groups(const struct peanut_lockstep_s *ls)
+{
+	unsigned groups = 0;
+
+	for(unsigned i = 0; i < ls->count; i++)
+		groups += ls->leader[i] == i;
+
+	return groups;
+}
+
+#undef PEANUT_LOCKSTEP_EMPTY
+
+#else
+
+int peanut_lockstep_init(struct peanut_lockstep_s *ls, struct gb_s **gb,
+		unsigned count, unsigned merge_interval);
+void peanut_lockstep_free(struct peanut_lockstep_s *ls);
+void peanut_lockstep_run_frame(struct peanut_lockstep_s *ls);
+const struct gb_s *peanut_lockstep_get(const struct peanut_lockstep_s *ls,
+		unsigned i);
+void peanut_lockstep_detach(struct peanut_lockstep_s *ls, unsigned i);
+unsigned peanut_lockstep_groups(const struct peanut_lockstep_s *ls);
+
+#endif // PEANUT_LOCKSTEP_HEADER_ONLY
+#endif // PEANUT_LOCKSTEP_H
@@ -0,0 +1,468 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * Input movies for Peanut-GB, used to replay a recorded session and check
+ * that the emulator still draws the same frames.
+ *
+ * Whilst recording, the joypad state of each frame is stored as runs of
+ * frames with the same input, and every hash_interval frames the frame drawn
+ * is hashed with FNV-1a as its lines are given to lcd_draw_line. On replay,
+ * the same input is applied to each frame, and the hashes of the same frames
+ * are compared with the recorded ones. Only the hashed frames must be drawn,
+ * so replays may be run with gb_set_render_policy(gb, 0), which makes them
+ * almost as fast as when the LCD is disabled.
+ *
+ * The lcd_draw_line function of the front-end must call
+ * peanut_movie_hash_line() for each line, and every line must be drawn, so
+ * PEANUT_GB_SKIP_UNCHANGED_LINES must be disabled. Replays must start from
+ * the same state as the recording, such as straight after gb_init().
+ *
+ * peanut_gb.h must be included before this file.
+ */
+
+#ifndef PEANUT_MOVIE_H
+#define PEANUT_MOVIE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct peanut_movie_s
+{
+	/* Runs of frames with the same joypad state. Each run is the joypad
+	 * byte, followed by the little endian 16-bit number of frames. */
+	uint8_t *runs;
+	size_t runs_len;
+	size_t runs_cap;
+
+	/* Hash of every hash_interval-th frame, or none if 0. */
+	uint32_t hash_interval;
+	uint32_t *hashes;
+	size_t hash_count;
+	size_t hash_cap;
+
+	/* Number of frames recorded, and header and global checksums of the
+	 * ROM. */
+	uint32_t frames;
+	uint8_t key[4];
+
+	/* Replay position: the next frame, and the run that it is in. */
+	uint32_t frame;
+	size_t run;
+	uint_fast16_t run_frame;
+
+	/* Hash of the frame being drawn, if it is hashed. */
+	uint32_t hash;
+	bool hashing;
+
+	/* First frame that did not match whilst replaying, or UINT32_MAX. */
+	uint32_t mismatch_frame;
+};
+
+#ifndef PEANUT_MOVIE_HEADER_ONLY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Movie file layout. The header is followed by the runs and then by the
+ * hashes. All multi-byte values are stored little endian. */
+#define PEANUT_MOVIE_MAGIC		0x4D424750 /* "PGBM" */
+#define PEANUT_MOVIE_VERSION		1
+#define PEANUT_MOVIE_HDR_SIZE		28
+#define PEANUT_MOVIE_RUN_SIZE		3
+#define PEANUT_MOVIE_MAX_RUN		0xFFFF
+#define PEANUT_MOVIE_GLOBAL_CHECKSUM_LOC	0x014E
+
+/* FNV-1a 32-bit offset basis and prime. */
+#define PEANUT_MOVIE_FNV_BASIS		0x811C9DC5u
+#define PEANUT_MOVIE_FNV_PRIME		0x01000193u
+
+static void __peanut_movie_put32(uint8_t *p, uint_fast32_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
+}
+
+static uint_fast32_t __peanut_movie_get32(const uint8_t *p)
+{
+	return (uint_fast32_t)p[0] | (uint_fast32_t)p[1] << 8 |
+		(uint_fast32_t)p[2] << 16 | (uint_fast32_t)p[3] << 24;
+}
+
+/**
+ * Reads the key that identifies the ROM of a context from its header.
+ */
+static void __peanut_movie_key(struct gb_s *gb, uint8_t key[4])
+{
+	key[0] = gb->gb_rom_read(gb, ROM_HEADER_CHECKSUM_LOC);
+	key[1] = gb->gb_rom_read(gb, PEANUT_MOVIE_GLOBAL_CHECKSUM_LOC);
+	key[2] = gb->gb_rom_read(gb, PEANUT_MOVIE_GLOBAL_CHECKSUM_LOC + 1);
+	key[3] = 0;
+}
+
+/**
+ * Starts hashing the next frame if it is one of the hashed frames, and makes
+ * sure that it is drawn.
+ */
+static void __peanut_movie_start_frame(struct peanut_movie_s *m,
+		struct gb_s *gb)
+{
+	m->hashing = m->hash_interval != 0 &&
+		m->frame % m->hash_interval == m->hash_interval - 1;
+	m->hash = PEANUT_MOVIE_FNV_BASIS;
+
+#if ENABLE_LCD
+	if(m->hashing)
+		gb_request_frame(gb);
+#else
+	(void)gb;
+#endif
+}
+
+/**
+ * Starts recording a movie.
+ *
+ * \param m	Movie to initialise.
+ * \param gb	Emulator context that is recorded, initialised with the ROM.
+ * \param hash_interval	Hash one frame out of every hash_interval frames,
+ *			or no frames if 0.
+ */
+void peanut_movie_init(struct peanut_movie_s *m, struct gb_s *gb,
+		uint32_t hash_interval)
+{
+	memset(m, 0, sizeof(*m));
+	m->hash_interval = hash_interval;
+	m->mismatch_frame = UINT32_MAX;
+	__peanut_movie_key(gb, m->key);
+}
+
+/**
+ * Frees the memory of a movie.
+ */
+void peanut_movie_free(struct peanut_movie_s *m)
+{
+	free(m->runs);
+	free(m->hashes);
+	memset(m, 0, sizeof(*m));
+}
+
+/**
+ * Adds a line to the hash of the frame being drawn. Must be called by the
+ * lcd_draw_line function of the front-end, with the same arguments.
+ */
+void peanut_movie_hash_line(struct peanut_movie_s *m, const uint8_t *pixels,
+		uint_fast8_t line)
+{
+	uint32_t hash = m->hash;
+
+	if(!m->hashing)
+		return;
+
+	/* The line number is included so that a missing line changes the
+	 * hash. */
+	hash = (hash ^ line) * PEANUT_MOVIE_FNV_PRIME;
+	for(uint_fast16_t x = 0; x < LCD_WIDTH; x++)
+		hash = (hash ^ pixels[x]) * PEANUT_MOVIE_FNV_PRIME;
+
+	m->hash = hash;
+}
+
+/**
+ * Records the current joypad state of the context for the next frame, and
+ * then runs the frame with gb_run_frame().
+ *
+ * \returns	0 on success, or -1 if memory could not be allocated, in which
+ *		case the frame is not run.
+ */
+int peanut_movie_record_frame(struct peanut_movie_s *m, struct gb_s *gb)
+{
+	const uint8_t joypad = gb->direct.joypad;
+	uint8_t *last = NULL;
+
+	if(m->hash_count == m->hash_cap && m->hash_interval != 0)
+	{
+		size_t cap = m->hash_cap ? m->hash_cap * 2 : 64;
+		uint32_t *hashes = realloc(m->hashes, cap * sizeof(*hashes));
+
+		if(hashes == NULL)
+			return -1;
+
+		m->hashes = hashes;
+		m->hash_cap = cap;
+	}
+
+	if(m->runs_len != 0)
+		last = m->runs + m->runs_len - PEANUT_MOVIE_RUN_SIZE;
+
+	if(last != NULL && last[0] == joypad &&
+			(last[1] | last[2] << 8) < PEANUT_MOVIE_MAX_RUN)
+	{
+		const uint_fast16_t n = (last[1] | last[2] << 8) + 1;
+		last[1] = n;
+		last[2] = n >> 8;
+	}
+	else
+	{
+		if(m->runs_len == m->runs_cap)
+		{
+			size_t cap = m->runs_cap ? m->runs_cap * 2 :
+				64 * PEANUT_MOVIE_RUN_SIZE;
+			uint8_t *runs = realloc(m->runs, cap);
+
+			if(runs == NULL)
+				return -1;
+
+			m->runs = runs;
+			m->runs_cap = cap;
+		}
+
+		last = m->runs + m->runs_len;
+		last[0] = joypad;
+		last[1] = 1;
+		last[2] = 0;
+		m->runs_len += PEANUT_MOVIE_RUN_SIZE;
+	}
+
+	__peanut_movie_start_frame(m, gb);
+	gb_run_frame(gb);
+
+	if(m->hashing)
+	{
+		m->hashes[m->hash_count++] = m->hash;
+		m->hashing = false;
+	}
+
+	m->frame++;
+	m->frames++;
+	return 0;
+}
+
+/**
+ * Writes a recorded movie to a file.
+ *
+ * \returns	0 on success, or -1 if the file could not be written.
+ */
+int peanut_movie_save(const struct peanut_movie_s *m, const char *file_name)
+{
+	uint8_t hdr[PEANUT_MOVIE_HDR_SIZE];
+	FILE *f;
+	int ok;
+
+	__peanut_movie_put32(hdr, PEANUT_MOVIE_MAGIC);
+	__peanut_movie_put32(hdr + 4, PEANUT_MOVIE_VERSION);
+	memcpy(hdr + 8, m->key, sizeof(m->key));
+	__peanut_movie_put32(hdr + 12, m->frames);
+	__peanut_movie_put32(hdr + 16, m->hash_interval);
+	__peanut_movie_put32(hdr + 20, m->runs_len / PEANUT_MOVIE_RUN_SIZE);
+	__peanut_movie_put32(hdr + 24, m->hash_count);
+
+	f = fopen(file_name, "wb");
+	if(f == NULL)
+		return -1;
+
+	ok = fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr) &&
+		(m->runs_len == 0 ||
+		 fwrite(m->runs, 1, m->runs_len, f) == m->runs_len);
+
+	for(size_t i = 0; ok && i < m->hash_count; i++)
+	{
+		uint8_t h[4];
+		__peanut_movie_put32(h, m->hashes[i]);
+		ok = fwrite(h, 1, sizeof(h), f) == sizeof(h);
+	}
+
+	ok = (fclose(f) == 0) && ok;
+	return ok ? 0 : -1;
+}
+
+/**
+ * Reads a movie from a file to be replayed from the start.
+ *
+ * \param m	Movie to initialise.
+ * \param gb	Emulator context that will replay the movie, initialised
+ *		with the ROM it was recorded with.
+ * \param file_name	Path of a file written by peanut_movie_save().
+ * \returns	0 on success, or -1 if the file could not be read, is not a
+ *		movie, or was recorded with a different ROM. Nothing needs to
+ *		be freed on failure.
+ */
+int peanut_movie_load(struct peanut_movie_s *m, struct gb_s *gb,
+		const char *file_name)
+{
+	uint8_t hdr[PEANUT_MOVIE_HDR_SIZE];
+	uint8_t key[4];
+	uint_fast32_t run_count, frames = 0;
+	FILE *f;
+	int ok;
+
+	memset(m, 0, sizeof(*m));
+	m->mismatch_frame = UINT32_MAX;
+
+	f = fopen(file_name, "rb");
+	if(f == NULL)
+		return -1;
+
+	__peanut_movie_key(gb, key);
+	ok = fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr) &&
+		__peanut_movie_get32(hdr) == PEANUT_MOVIE_MAGIC &&
+		__peanut_movie_get32(hdr + 4) == PEANUT_MOVIE_VERSION &&
+		memcmp(hdr + 8, key, sizeof(key)) == 0;
+
+	if(ok)
+	{
+		m->frames = __peanut_movie_get32(hdr + 12);
+		m->hash_interval = __peanut_movie_get32(hdr + 16);
+		run_count = __peanut_movie_get32(hdr + 20);
+		m->hash_count = __peanut_movie_get32(hdr + 24);
+		memcpy(m->key, key, sizeof(key));
+
+		/* The counts are checked before they are used to allocate
+		 * memory, so that their sizes cannot overflow. Each run is
+		 * at least one frame long. */
+		ok = run_count <= m->frames &&
+			run_count <= (SIZE_MAX - 1) / PEANUT_MOVIE_RUN_SIZE &&
+			m->hash_count <= (SIZE_MAX - 1) / sizeof(*m->hashes) &&
+			m->hash_count == (m->hash_interval ?
+				m->frames / m->hash_interval : 0);
+	}
+
+	if(ok)
+	{
+		m->runs_len = run_count * PEANUT_MOVIE_RUN_SIZE;
+		m->runs_cap = m->runs_len;
+		m->hash_cap = m->hash_count;
+		m->runs = malloc(m->runs_len + 1);
+		m->hashes = malloc(m->hash_count * sizeof(*m->hashes) + 1);
+
+		ok = m->runs != NULL && m->hashes != NULL &&
+			fread(m->runs, 1, m->runs_len, f) == m->runs_len;
+	}
+
+	for(size_t i = 0; ok && i < m->hash_count; i++)
+	{
+		uint8_t h[4];
+		ok = fread(h, 1, sizeof(h), f) == sizeof(h);
+		m->hashes[i] = __peanut_movie_get32(h);
+	}
+
+	fclose(f);
+
+	/* The runs must cover every frame. */
+	for(size_t i = 0; ok && i < m->runs_len; i += PEANUT_MOVIE_RUN_SIZE)
+	{
+		const uint_fast16_t n = m->runs[i + 1] | m->runs[i + 2] << 8;
+
+		ok = n != 0;
+		frames += n;
+	}
+
+	if(ok && frames != m->frames)
+		ok = 0;
+
+	if(!ok)
+	{
+		peanut_movie_free(m);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Replays the next frame of a movie: the recorded joypad state is set, and
+ * the frame is run with gb_run_frame(). If the frame was hashed when it was
+ * recorded, its hash is compared with the recorded hash.
+ *
+ * \returns	0 if the frame was run, 1 if the movie has ended and no frame
+ *		was run, or -1 if the frame was run but did not match the
+ *		recording. The first frame that did not match is kept in
+ *		m->mismatch_frame.
+ */
+int peanut_movie_play_frame(struct peanut_movie_s *m, struct gb_s *gb)
+{
+	const uint8_t *run;
+	int ret = 0;
+
+	if(m->frame >= m->frames)
+		return 1;
+
+	run = m->runs + m->run;
+	gb->direct.joypad = run[0];
+
+	if(++m->run_frame == (uint_fast16_t)(run[1] | run[2] << 8))
+	{
+		m->run += PEANUT_MOVIE_RUN_SIZE;
+		m->run_frame = 0;
+	}
+
+	__peanut_movie_start_frame(m, gb);
+	gb_run_frame(gb);
+
+	if(m->hashing)
+	{
+		const size_t i = m->frame / m->hash_interval;
+
+		if(m->hash != m->hashes[i])
+		{
+			if(m->mismatch_frame == UINT32_MAX)
+				m->mismatch_frame = m->frame;
+
+			ret = -1;
+		}
+
+		m->hashing = false;
+	}
+
+	m->frame++;
+	return ret;
+}
+
+#undef PEANUT_MOVIE_MAGIC
+#undef PEANUT_MOVIE_VERSION
+#undef PEANUT_MOVIE_HDR_SIZE
+#undef PEANUT_MOVIE_RUN_SIZE
+#undef PEANUT_MOVIE_MAX_RUN
+#undef PEANUT_MOVIE_GLOBAL_CHECKSUM_LOC
+#undef PEANUT_MOVIE_FNV_BASIS
+#undef PEANUT_MOVIE_FNV_PRIME
+
+#else
+
+void peanut_movie_init(struct peanut_movie_s *m, struct gb_s *gb,
+		uint32_t hash_interval);
+void peanut_movie_free(struct peanut_movie_s *m);
+void peanut_movie_hash_line(struct peanut_movie_s *m, const uint8_t *pixels,
+		uint_fast8_t line);
+int peanut_movie_record_frame(struct peanut_movie_s *m, struct gb_s *gb);
+int peanut_movie_save(const struct peanut_movie_s *m, const char *file_name);
+int peanut_movie_load(struct peanut_movie_s *m, struct gb_s *gb,
+		const char *file_name);
+int peanut_movie_play_frame(struct peanut_movie_s *m, struct gb_s *gb);
+
+#endif // PEANUT_MOVIE_HEADER_ONLY
+#endif // PEANUT_MOVIE_H
@@ -0,0 +1,458 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * Rewind support for Peanut-GB, built on gb_state_save() and gb_state_load().
+ *
+ * States are pushed into a ring buffer of a fixed size, usually once per
+ * frame. Each entry holds the state that came before it, either as an XOR
+ * delta against the newer state or, every keyframe_interval entries, in full.
+ * Both are compressed with a simple zero run length encoding, so a typical
+ * entry is a few hundred bytes rather than the ~16 KiB of a full state.
+ * Stepping back decodes only the newest entry, so it takes the same time
+ * however much history is held. The oldest entries are dropped when the ring
+ * is full.
+ *
+ * peanut_gb.h must be included before this file.
+ */
+
+#ifndef PEANUT_REWIND_H
+#define PEANUT_REWIND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct peanut_rewind_s
+{
+	/* Ring buffer holding the entries. */
+	uint8_t *ring;
+	size_t ring_size;
+
+	/* Offset of the oldest entry, and of where the next entry is written.
+	 * When the ring has wrapped, the entries between tail and end are older
+	 * than those between the start of the ring and head. */
+	size_t tail;
+	size_t head;
+	size_t end;
+
+	/* Number of entries in the ring. */
+	size_t count;
+
+	/* Store the older state in full every keyframe_interval entries. */
+	unsigned keyframe_interval;
+	unsigned since_keyframe;
+
+	/* Most recently pushed state, and scratch buffers used to save the
+	 * next state and to encode entries. */
+	size_t state_size;
+	uint8_t *cur;
+	uint8_t *next;
+	uint8_t *enc;
+	uint8_t *enc_key;
+	bool have_cur;
+};
+
+#ifndef PEANUT_REWIND_HEADER_ONLY
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Every entry starts and ends with its length, so that the ring may be walked
+ * from either end. The type byte follows the leading length. */
+#define PEANUT_REWIND_ENTRY_OVERHEAD	9
+#define PEANUT_REWIND_ENTRY_DELTA	0
+#define PEANUT_REWIND_ENTRY_KEY		1
+
+/* Zero runs shorter than this are stored as literals, as a new run costs four
+ * bytes. This also guarantees that the encoded size is never much larger than
+ * the input. */
+#define PEANUT_REWIND_MIN_ZERO_RUN	5
+#define PEANUT_REWIND_MAX_RUN		0xFFFF
+
+/* Worst case size of an encoded state, excluding the entry overhead. */
+#define PEANUT_REWIND_ENC_SIZE(n)	\
+	((n) + 4 * ((n) / PEANUT_REWIND_MAX_RUN + 2))
+
+static void __peanut_rewind_put32(uint8_t *p, uint_fast32_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
+}
+
+static uint_fast32_t __peanut_rewind_get32(const uint8_t *p)
+{
+	return (uint_fast32_t)p[0] | (uint_fast32_t)p[1] << 8 |
+		(uint_fast32_t)p[2] << 16 | (uint_fast32_t)p[3] << 24;
+}
+
+/**
+ * Encodes a ^ b, or only a if b is NULL, as a sequence of tokens. Each token
+ * is a little endian 16-bit count of zero bytes, then a 16-bit count of
+ * literal bytes followed by the literals themselves.
+ *
+ * \returns	number of bytes written to out.
+ */
+static size_t __peanut_rewind_encode(uint8_t *out, const uint8_t *a,
+		const uint8_t *b, size_t len)
+{
+	uint8_t *o = out;
+	size_t i = 0;
+
+	while(i < len)
+	{
+		size_t zeros = 0, lits = 0;
+		uint8_t *lit_len;
+
+		while(i < len && zeros < PEANUT_REWIND_MAX_RUN &&
+				(a[i] ^ (b ? b[i] : 0)) == 0)
+		{
+			zeros++;
+			i++;
+		}
+
+		*o++ = zeros;
+		*o++ = zeros >> 8;
+		lit_len = o;
+		o += 2;
+
+		while(i < len && lits < PEANUT_REWIND_MAX_RUN)
+		{
+			size_t run = 0;
+
+			/* Stop at the start of a long enough zero run. */
+			while(i + run < len &&
+					run < PEANUT_REWIND_MIN_ZERO_RUN &&
+					(a[i + run] ^ (b ? b[i + run] : 0)) == 0)
+				run++;
+
+			if(run == PEANUT_REWIND_MIN_ZERO_RUN || i + run == len)
+				break;
+
+			*o++ = a[i] ^ (b ? b[i] : 0);
+			lits++;
+			i++;
+		}
+
+		lit_len[0] = lits;
+		lit_len[1] = lits >> 8;
+	}
+
+	return o - out;
+}
+
+/**
+ * Decodes tokens written by __peanut_rewind_encode() into state. If
+ * apply_xor is true, the decoded bytes are XORed into state instead of
+ * replacing it.
+ */
+static void __peanut_rewind_decode(uint8_t *state, const uint8_t *in,
+		size_t in_len, bool apply_xor)
+{
+	const uint8_t *end = in + in_len;
+	uint8_t *s = state;
+
+	while(in < end)
+	{
+		size_t zeros = in[0] | (size_t)in[1] << 8;
+		size_t lits = in[2] | (size_t)in[3] << 8;
+		in += 4;
+
+		if(!apply_xor)
+			memset(s, 0, zeros);
+
+		s += zeros;
+
+		if(apply_xor)
+		{
+			for(size_t i = 0; i < lits; i++)
+				s[i] ^= in[i];
+		}
+		else
+			memcpy(s, in, lits);
+
+		s += lits;
+		in += lits;
+	}
+}
+
+/* Drops the oldest entry. */
+static void __peanut_rewind_drop_oldest(struct peanut_rewind_s *r)
+{
+	r->tail += __peanut_rewind_get32(r->ring + r->tail);
+	r->count--;
+
+	if(r->tail == r->end)
+	{
+		r->tail = 0;
+		r->end = r->ring_size;
+	}
+}
+
+/**
+ * Reserves len bytes at head, dropping the oldest entries that are in the way.
+ *
+ * \returns	pointer to the reserved space, or NULL if len is larger than
+ *		the ring.
+ */
+static uint8_t *__peanut_rewind_reserve(struct peanut_rewind_s *r, size_t len)
+{
+	if(len > r->ring_size)
+		return NULL;
+
+	if(r->count == 0)
+	{
+		r->head = 0;
+		r->tail = 0;
+		r->end = r->ring_size;
+	}
+
+	if(r->head + len > r->ring_size)
+	{
+		/* Entries above head are the oldest, and are overwritten
+		 * first. Drop them before wrapping back to the start. */
+		while(r->count > 0 && r->tail >= r->head)
+			__peanut_rewind_drop_oldest(r);
+
+		r->end = r->head;
+		r->head = 0;
+	}
+
+	while(r->count > 0 && r->tail >= r->head &&
+			r->tail < r->head + len)
+		__peanut_rewind_drop_oldest(r);
+
+	return r->ring + r->head;
+}
+
+/**
+ * Initialises a rewind buffer.
+ *
+ * \param r	Rewind buffer to initialise.
+ * \param budget	Size of the ring buffer in bytes. Around 64 KiB of
+ *			further memory is allocated for working buffers.
+ * \param keyframe_interval	Store a full state every keyframe_interval
+ *			entries. 0 only stores full states when they are
+ *			smaller than the delta.
+ * \returns	0 on success, or -1 if memory could not be allocated.
+ */
+int peanut_rewind_init(struct peanut_rewind_s *r, size_t budget,
+		unsigned keyframe_interval)
+{
+	size_t enc_size;
+
+	memset(r, 0, sizeof(*r));
+	r->state_size = gb_state_size();
+	enc_size = PEANUT_REWIND_ENC_SIZE(r->state_size) +
+		PEANUT_REWIND_ENTRY_OVERHEAD;
+
+	r->ring = malloc(budget);
+	r->cur = malloc(r->state_size);
+	r->next = malloc(r->state_size);
+	r->enc = malloc(enc_size);
+	r->enc_key = malloc(enc_size);
+
+	if(r->ring == NULL || r->cur == NULL || r->next == NULL ||
+			r->enc == NULL || r->enc_key == NULL)
+	{
+		free(r->ring);
+		free(r->cur);
+		free(r->next);
+		free(r->enc);
+		free(r->enc_key);
+		memset(r, 0, sizeof(*r));
+		return -1;
+	}
+
+	r->ring_size = budget;
+	r->end = budget;
+	r->keyframe_interval = keyframe_interval;
+	return 0;
+}
+
+/**
+ * Frees the memory allocated by peanut_rewind_init().
+ */
+void peanut_rewind_free(struct peanut_rewind_s *r)
+{
+	free(r->ring);
+	free(r->cur);
+	free(r->next);
+	free(r->enc);
+	free(r->enc_key);
+	memset(r, 0, sizeof(*r));
+}
+
+/**
+ * Removes all entries, for instance after the game is reset or another state
+ * is loaded.
+ */
+void peanut_rewind_clear(struct peanut_rewind_s *r)
+{
+	r->count = 0;
+	r->head = 0;
+	r->tail = 0;
+	r->end = r->ring_size;
+	r->since_keyframe = 0;
+	r->have_cur = false;
+}
+
+/**
+ * Returns the number of times that peanut_rewind_step_back() may be called.
+ */
+size_t peanut_rewind_count(const struct peanut_rewind_s *r)
+{
+	return r->count;
+}
+
+/**
+ * Saves the current state of the emulator. Usually called once per frame.
+ *
+ * \returns	0 on success, or -1 if the ring is too small for the entry.
+ */
+int peanut_rewind_push(struct peanut_rewind_s *r, const struct gb_s *gb)
+{
+	uint8_t *entry, *swap, *best;
+	size_t len, key_len;
+	uint8_t type = PEANUT_REWIND_ENTRY_DELTA;
+	bool key_due;
+
+	gb_state_save(gb, r->next);
+
+	if(!r->have_cur)
+	{
+		swap = r->cur;
+		r->cur = r->next;
+		r->next = swap;
+		r->have_cur = true;
+		return 0;
+	}
+
+	/* Encode the previous state, which is restored when stepping back. */
+	best = r->enc;
+	len = __peanut_rewind_encode(r->enc, r->cur, r->next, r->state_size);
+	r->since_keyframe++;
+	key_due = r->keyframe_interval != 0 &&
+		r->since_keyframe >= r->keyframe_interval;
+
+	/* Large deltas, such as after a scene change, may be smaller when the
+	 * state is stored in full. */
+	if(key_due || len > r->state_size / 2)
+	{
+		key_len = __peanut_rewind_encode(r->enc_key, r->cur, NULL,
+				r->state_size);
+
+		if(key_due || key_len <= len)
+		{
+			best = r->enc_key;
+			len = key_len;
+			type = PEANUT_REWIND_ENTRY_KEY;
+			r->since_keyframe = 0;
+		}
+	}
+
+	len += PEANUT_REWIND_ENTRY_OVERHEAD;
+	entry = __peanut_rewind_reserve(r, len);
+	if(entry == NULL)
+	{
+		/* Start again from the new state, so that later entries are
+		 * still consistent with each other. */
+		peanut_rewind_clear(r);
+		swap = r->cur;
+		r->cur = r->next;
+		r->next = swap;
+		r->have_cur = true;
+		return -1;
+	}
+
+	__peanut_rewind_put32(entry, len);
+	entry[4] = type;
+	memcpy(entry + 5, best, len - PEANUT_REWIND_ENTRY_OVERHEAD);
+	__peanut_rewind_put32(entry + len - 4, len);
+	r->head += len;
+	r->count++;
+
+	swap = r->cur;
+	r->cur = r->next;
+	r->next = swap;
+	return 0;
+}
+
+/**
+ * Restores the state that was saved before the most recent one, and removes
+ * the most recent one from the buffer.
+ *
+ * \returns	0 on success, or -1 if there is no more history. The emulator
+ *		is not modified on failure.
+ */
+int peanut_rewind_step_back(struct peanut_rewind_s *r, struct gb_s *gb)
+{
+	const uint8_t *entry;
+	size_t len;
+
+	if(r->count == 0)
+		return -1;
+
+	/* The newest entry is in the upper part of the ring once everything
+	 * before head has been used. */
+	if(r->head == 0)
+	{
+		r->head = r->end;
+		r->end = r->ring_size;
+	}
+
+	len = __peanut_rewind_get32(r->ring + r->head - 4);
+	entry = r->ring + r->head - len;
+
+	__peanut_rewind_decode(r->cur, entry + 5,
+			len - PEANUT_REWIND_ENTRY_OVERHEAD,
+			entry[4] == PEANUT_REWIND_ENTRY_DELTA);
+
+	r->head -= len;
+	r->count--;
+
+	return gb_state_load(gb, r->cur);
+}
+
+#undef PEANUT_REWIND_ENTRY_OVERHEAD
+#undef PEANUT_REWIND_ENTRY_DELTA
+#undef PEANUT_REWIND_ENTRY_KEY
+#undef PEANUT_REWIND_MIN_ZERO_RUN
+#undef PEANUT_REWIND_MAX_RUN
+#undef PEANUT_REWIND_ENC_SIZE
+
+#else
+
+int peanut_rewind_init(struct peanut_rewind_s *r, size_t budget,
+		unsigned keyframe_interval);
+void peanut_rewind_free(struct peanut_rewind_s *r);
+void peanut_rewind_clear(struct peanut_rewind_s *r);
+size_t peanut_rewind_count(const struct peanut_rewind_s *r);
+int peanut_rewind_push(struct peanut_rewind_s *r, const struct gb_s *gb);
+int peanut_rewind_step_back(struct peanut_rewind_s *r, struct gb_s *gb);
+
+#endif // PEANUT_REWIND_HEADER_ONLY
+#endif // PEANUT_REWIND_H
@@ -0,0 +1,580 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * ROM file loader for Peanut-GB front-ends.
+ *
+ * The ROM file is mapped into memory read-only, with mmap() on POSIX systems
+ * and MapViewOfFile() on Windows, instead of being read into an allocated
+ * buffer. Each page is then only loaded when it is first used, and every
+ * emulator context and process that opens the same file shares the copy held
+ * by the operating system's page cache. The file is read into allocated
+ * memory on other platforms.
+ *
+ * The mapped image is given to emulator contexts with peanut_rom_attach(),
+ * which uses gb_init_rom_direct(). The file must not be modified whilst it is
+ * open.
+ *
+ * A save state taken at a useful point after boot, such as the title screen,
+ * may be kept as a warm state with peanut_rom_store_warm(). It is stored in a
+ * cache directory under a name derived from the header and global checksums of
+ * the ROM, together with a tag chosen by the front-end. New sessions map it
+ * with peanut_rom_open_warm() and load it with peanut_rom_apply_warm(), instead
+ * of emulating the boot sequence and the intro of the game again. A mapped
+ * warm state may be applied to any number of contexts.
+ *
+ * peanut_gb.h must be included before this file.
+ */
+
+#ifndef PEANUT_ROM_H
+#define PEANUT_ROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum peanut_rom_error_e
+{
+	PEANUT_ROM_NO_ERROR = 0,
+	/* The file could not be opened or read. errno is set on POSIX
+	 * systems. */
+	PEANUT_ROM_ERROR_OPEN,
+	/* The file is too small to hold a cartridge header. */
+	PEANUT_ROM_ERROR_TOO_SMALL,
+	/* The header checksum does not match, as would be reported by
+	 * gb_init(). */
+	PEANUT_ROM_ERROR_INVALID_CHECKSUM,
+	/* The warm state was stored for a different ROM, or by an
+	 * incompatible version of Peanut-GB. */
+	PEANUT_ROM_ERROR_INVALID_STATE,
+	/* The warm state could not be written. */
+	PEANUT_ROM_ERROR_WRITE
+};
+
+struct peanut_rom_s
+{
+	const uint8_t *data;
+	size_t size;
+
+	/* Handles of the file mapping. Only used on Windows. */
+	void *file;
+	void *mapping;
+
+	/* Not zero if data was allocated instead of mapped. */
+	int allocated;
+};
+
+#ifndef PEANUT_ROM_HEADER_ONLY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+# define WIN32_LEAN_AND_MEAN
+# include <windows.h>
+# define PEANUT_ROM_MMAP_WIN32	1
+#elif defined(__unix__) || defined(__APPLE__)
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+# define PEANUT_ROM_MMAP_POSIX	1
+#endif
+
+/* Cartridge header is between 0x0100 and 0x014F. */
+#define PEANUT_ROM_HEADER_END		0x0150
+
+/* Warm state file layout. The header is followed by the save state and then
+ * by the cart RAM. All multi-byte values are stored little endian. */
+#define PEANUT_ROM_WARM_MAGIC		0x57424750 /* "PGBW" */
+#define PEANUT_ROM_WARM_HDR_SIZE	16
+#define PEANUT_ROM_WARM_HDR_CHK		4
+#define PEANUT_ROM_WARM_STATE_SIZE	8
+#define PEANUT_ROM_WARM_CART_RAM_SIZE	12
+#define PEANUT_ROM_GLOBAL_CHECKSUM_LOC	0x014E
+
+/**
+ * Checks the header checksum in the same way as gb_init().
+ */
+static enum peanut_rom_error_e __peanut_rom_validate(const uint8_t *rom,
+		size_t size)
+{
+	uint8_t x = 0;
+
+	if(size < PEANUT_ROM_HEADER_END)
+		return PEANUT_ROM_ERROR_TOO_SMALL;
+
+	for(uint_fast16_t i = 0x0134; i <= 0x014C; i++)
+		x = x - rom[i] - 1;
+
+	if(x != rom[ROM_HEADER_CHECKSUM_LOC])
+		return PEANUT_ROM_ERROR_INVALID_CHECKSUM;
+
+	return PEANUT_ROM_NO_ERROR;
+}
+
+#if !defined(PEANUT_ROM_MMAP_WIN32) && !defined(PEANUT_ROM_MMAP_POSIX)
+static enum peanut_rom_error_e __peanut_rom_read(struct peanut_rom_s *r,
+		const char *file_name, size_t min_size)
+{
+	FILE *f = fopen(file_name, "rb");
+	long len;
+	uint8_t *buf;
+
+	if(f == NULL)
+		return PEANUT_ROM_ERROR_OPEN;
+
+	if(fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0)
+	{
+		fclose(f);
+		return PEANUT_ROM_ERROR_OPEN;
+	}
+
+	if((size_t)len < min_size)
+	{
+		fclose(f);
+		return PEANUT_ROM_ERROR_TOO_SMALL;
+	}
+
+	rewind(f);
+	buf = malloc(len);
+	if(buf == NULL || fread(buf, 1, len, f) != (size_t)len)
+	{
+		free(buf);
+		fclose(f);
+		return PEANUT_ROM_ERROR_OPEN;
+	}
+
+	fclose(f);
+	r->data = buf;
+	r->size = len;
+	r->allocated = 1;
+	return PEANUT_ROM_NO_ERROR;
+}
+#endif
+
+/**
+ * Closes a ROM opened with peanut_rom_open(). Emulator contexts that the ROM
+ * was attached to must not be used afterwards.
+ */
+void peanut_rom_close(struct peanut_rom_s *r)
+{
+	if(r->data == NULL)
+		return;
+
+	if(r->allocated)
+		free((void *)r->data);
+#if defined(PEANUT_ROM_MMAP_WIN32)
+	else
+	{
+		UnmapViewOfFile(r->data);
+		CloseHandle(r->mapping);
+		CloseHandle(r->file);
+	}
+#elif defined(PEANUT_ROM_MMAP_POSIX)
+	else
+		munmap((void *)r->data, r->size);
+#endif
+
+	memset(r, 0, sizeof(*r));
+}
+
+/**
+ * Maps a file into memory read-only. Files smaller than min_size are
+ * rejected.
+ */
+static enum peanut_rom_error_e __peanut_rom_map(struct peanut_rom_s *r,
+		const char *file_name, size_t min_size)
+{
+	memset(r, 0, sizeof(*r));
+
+#if defined(PEANUT_ROM_MMAP_WIN32)
+	{
+		HANDLE file, mapping;
+		LARGE_INTEGER len;
+		const void *view;
+
+		file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ,
+				NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(file == INVALID_HANDLE_VALUE)
+			return PEANUT_ROM_ERROR_OPEN;
+
+		if(!GetFileSizeEx(file, &len))
+		{
+			CloseHandle(file);
+			return PEANUT_ROM_ERROR_OPEN;
+		}
+
+		if(len.QuadPart < (LONGLONG)min_size)
+		{
+			CloseHandle(file);
+			return PEANUT_ROM_ERROR_TOO_SMALL;
+		}
+
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0,
+				NULL);
+		if(mapping == NULL)
+		{
+			CloseHandle(file);
+			return PEANUT_ROM_ERROR_OPEN;
+		}
+
+		view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if(view == NULL)
+		{
+			CloseHandle(mapping);
+			CloseHandle(file);
+			return PEANUT_ROM_ERROR_OPEN;
+		}
+
+		r->data = view;
+		r->size = (size_t)len.QuadPart;
+		r->file = file;
+		r->mapping = mapping;
+	}
+#elif defined(PEANUT_ROM_MMAP_POSIX)
+	{
+		struct stat st;
+		void *map;
+		int fd = open(file_name, O_RDONLY);
+
+		if(fd < 0)
+			return PEANUT_ROM_ERROR_OPEN;
+
+		if(fstat(fd, &st) != 0)
+		{
+			close(fd);
+			return PEANUT_ROM_ERROR_OPEN;
+		}
+
+		if((size_t)st.st_size < min_size)
+		{
+			close(fd);
+			return PEANUT_ROM_ERROR_TOO_SMALL;
+		}
+
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED,
+				fd, 0);
+		/* The mapping remains valid after the file is closed. */
+		close(fd);
+
+		if(map == MAP_FAILED)
+			return PEANUT_ROM_ERROR_OPEN;
+
+		r->data = map;
+		r->size = (size_t)st.st_size;
+	}
+#else
+	return __peanut_rom_read(r, file_name, min_size);
+#endif
+
+	return PEANUT_ROM_NO_ERROR;
+}
+
+/**
+ * Maps a ROM file into memory, and checks that it has a valid cartridge
+ * header.
+ *
+ * \param r	ROM to initialise. Must not be NULL.
+ * \param file_name	Path of the ROM file.
+ * \returns	PEANUT_ROM_NO_ERROR on success. Nothing needs to be closed on
+ *		failure.
+ */
+enum peanut_rom_error_e peanut_rom_open(struct peanut_rom_s *r,
+		const char *file_name)
+{
+	enum peanut_rom_error_e ret;
+
+	ret = __peanut_rom_map(r, file_name, PEANUT_ROM_HEADER_END);
+	if(ret != PEANUT_ROM_NO_ERROR)
+		return ret;
+
+	ret = __peanut_rom_validate(r->data, r->size);
+	if(ret != PEANUT_ROM_NO_ERROR)
+		peanut_rom_close(r);
+
+	return ret;
+}
+
+/**
+ * Lets an emulator context read the ROM directly, using
+ * gb_init_rom_direct(). Any number of contexts may share the same ROM.
+ *
+ * \param gb	Emulator context initialised with gb_init().
+ * \param cart_ram	Cart RAM of this context, or NULL to use the cart RAM
+ *			callbacks.
+ * \param cart_ram_size	Size of cart_ram in bytes.
+ */
+void peanut_rom_attach(const struct peanut_rom_s *r, struct gb_s *gb,
+		uint8_t *cart_ram, size_t cart_ram_size)
+{
+	gb_init_rom_direct(gb, r->data, r->size, cart_ram, cart_ram_size);
+}
+
+static void __peanut_rom_put32(uint8_t *p, uint_fast32_t x)
+{
+	p[0] = (uint8_t)x;
+	p[1] = (uint8_t)(x >> 8);
+	p[2] = (uint8_t)(x >> 16);
+	p[3] = (uint8_t)(x >> 24);
+}
+
+static uint_fast32_t __peanut_rom_get32(const uint8_t *p)
+{
+	return (uint_fast32_t)p[0] | (uint_fast32_t)p[1] << 8 |
+		(uint_fast32_t)p[2] << 16 | (uint_fast32_t)p[3] << 24;
+}
+
+/**
+ * Reads the key that identifies the ROM of a context from its header. The
+ * header checksum is verified by gb_init(), and the global checksum covers the
+ * whole ROM.
+ */
+static void __peanut_rom_warm_key(struct gb_s *gb, uint8_t key[4])
+{
+	key[0] = gb->gb_rom_read(gb, ROM_HEADER_CHECKSUM_LOC);
+	key[1] = gb->gb_rom_read(gb, PEANUT_ROM_GLOBAL_CHECKSUM_LOC);
+	key[2] = gb->gb_rom_read(gb, PEANUT_ROM_GLOBAL_CHECKSUM_LOC + 1);
+	key[3] = 0;
+}
+
+/**
+ * Writes the path of the warm state of a ROM to path.
+ *
+ * \returns	0 on success, or -1 if the path does not fit.
+ */
+static int __peanut_rom_warm_path(struct gb_s *gb, const char *dir,
+		const char *tag, char *path, size_t len)
+{
+	uint8_t key[4];
+	int n;
+
+	__peanut_rom_warm_key(gb, key);
+	n = snprintf(path, len, "%s/%02X%02X%02X-%s.pgbw", dir,
+			key[0], key[1], key[2], tag);
+
+	return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+/**
+ * Stores the current state of an emulator context as the warm state of its
+ * ROM. The file is written under a temporary name and then renamed, so
+ * sessions that open the warm state at the same time see either the previous
+ * file or the complete new one. On Windows, a warm state that is still open
+ * cannot be replaced.
+ *
+ * \param gb	Emulator context with the state to store.
+ * \param dir	Cache directory. Must already exist.
+ * \param tag	Name of the checkpoint, such as "title". Must be valid within
+ *		a file name.
+ * \param cart_ram	Cart RAM to store with the state, or NULL.
+ * \param cart_ram_size	Size of cart_ram in bytes.
+ * \returns	PEANUT_ROM_NO_ERROR on success.
+ */
+enum peanut_rom_error_e peanut_rom_store_warm(struct gb_s *gb,
+		const char *dir, const char *tag,
+		const uint8_t *cart_ram, size_t cart_ram_size)
+{
+	char path[FILENAME_MAX];
+	char tmp[FILENAME_MAX];
+	uint8_t hdr[PEANUT_ROM_WARM_HDR_SIZE];
+	const size_t state_size = gb_state_size();
+	unsigned long pid = 0;
+	uint8_t *state;
+	FILE *f;
+	int n, ok;
+
+	if(cart_ram == NULL)
+		cart_ram_size = 0;
+
+#if defined(PEANUT_ROM_MMAP_WIN32)
+	pid = GetCurrentProcessId();
+#elif defined(PEANUT_ROM_MMAP_POSIX)
+	pid = (unsigned long)getpid();
+#endif
+
+	if(__peanut_rom_warm_path(gb, dir, tag, path, sizeof(path)) != 0)
+		return PEANUT_ROM_ERROR_WRITE;
+
+	/* The temporary name is unique to this process, so that other
+	 * processes storing the same warm state do not write into it. */
+	n = snprintf(tmp, sizeof(tmp), "%s.%lu.tmp", path, pid);
+	if(n < 0 || (size_t)n >= sizeof(tmp))
+		return PEANUT_ROM_ERROR_WRITE;
+
+	state = malloc(state_size);
+	if(state == NULL)
+		return PEANUT_ROM_ERROR_WRITE;
+
+	gb_state_save(gb, state);
+	__peanut_rom_put32(hdr, PEANUT_ROM_WARM_MAGIC);
+	__peanut_rom_warm_key(gb, hdr + PEANUT_ROM_WARM_HDR_CHK);
+	__peanut_rom_put32(hdr + PEANUT_ROM_WARM_STATE_SIZE, state_size);
+	__peanut_rom_put32(hdr + PEANUT_ROM_WARM_CART_RAM_SIZE,
+			cart_ram_size);
+
+	f = fopen(tmp, "wb");
+	if(f == NULL)
+	{
+		free(state);
+		return PEANUT_ROM_ERROR_WRITE;
+	}
+
+	ok = fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr) &&
+		fwrite(state, 1, state_size, f) == state_size &&
+		(cart_ram_size == 0 ||
+		 fwrite(cart_ram, 1, cart_ram_size, f) == cart_ram_size);
+	ok = (fclose(f) == 0) && ok;
+	free(state);
+
+#if defined(PEANUT_ROM_MMAP_WIN32)
+	ok = ok && MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING);
+#else
+	ok = ok && rename(tmp, path) == 0;
+#endif
+
+	if(!ok)
+	{
+		remove(tmp);
+		return PEANUT_ROM_ERROR_WRITE;
+	}
+
+	return PEANUT_ROM_NO_ERROR;
+}
+
+/**
+ * Maps the warm state of the ROM used by an emulator context, as stored by
+ * peanut_rom_store_warm(). It is closed with peanut_rom_close().
+ *
+ * \param w	Warm state to initialise. Must not be NULL.
+ * \param gb	Emulator context initialised with the ROM.
+ * \param dir	Cache directory.
+ * \param tag	Name of the checkpoint.
+ * \returns	PEANUT_ROM_NO_ERROR on success, PEANUT_ROM_ERROR_OPEN if no
+ *		warm state was stored, or PEANUT_ROM_ERROR_INVALID_STATE if it
+ *		does not belong to this ROM. Nothing needs to be closed on
+ *		failure.
+ */
+enum peanut_rom_error_e peanut_rom_open_warm(struct peanut_rom_s *w,
+		struct gb_s *gb, const char *dir, const char *tag)
+{
+	char path[FILENAME_MAX];
+	uint8_t key[4];
+	size_t state_size, cart_ram_size;
+	enum peanut_rom_error_e ret;
+
+	memset(w, 0, sizeof(*w));
+
+	if(__peanut_rom_warm_path(gb, dir, tag, path, sizeof(path)) != 0)
+		return PEANUT_ROM_ERROR_OPEN;
+
+	ret = __peanut_rom_map(w, path, PEANUT_ROM_WARM_HDR_SIZE);
+	if(ret != PEANUT_ROM_NO_ERROR)
+		return ret;
+
+	__peanut_rom_warm_key(gb, key);
+	state_size = __peanut_rom_get32(w->data + PEANUT_ROM_WARM_STATE_SIZE);
+	cart_ram_size = __peanut_rom_get32(w->data +
+			PEANUT_ROM_WARM_CART_RAM_SIZE);
+
+	if(__peanut_rom_get32(w->data) != PEANUT_ROM_WARM_MAGIC ||
+			memcmp(w->data + PEANUT_ROM_WARM_HDR_CHK, key,
+				sizeof(key)) != 0 ||
+			state_size != gb_state_size() ||
+			w->size != PEANUT_ROM_WARM_HDR_SIZE + state_size +
+				cart_ram_size)
+	{
+		peanut_rom_close(w);
+		return PEANUT_ROM_ERROR_INVALID_STATE;
+	}
+
+	return PEANUT_ROM_NO_ERROR;
+}
+
+/**
+ * Loads a warm state into an emulator context, in place of running the boot
+ * sequence. The state is read directly from the mapped file, and the stored
+ * cart RAM, if any, is copied to cart_ram.
+ *
+ * \param w	Warm state opened with peanut_rom_open_warm().
+ * \param gb	Emulator context initialised with the same ROM.
+ * \param cart_ram	Cart RAM of this context. Left unchanged if the warm
+ *			state was stored without cart RAM.
+ * \param cart_ram_size	Size of cart_ram in bytes.
+ * \returns	0 on success, or -1 if the warm state does not belong to this
+ *		ROM, its cart RAM is of a different size, or the state was
+ *		saved by an incompatible version of Peanut-GB. The context is
+ *		unchanged on failure.
+ */
+int peanut_rom_apply_warm(const struct peanut_rom_s *w, struct gb_s *gb,
+		uint8_t *cart_ram, size_t cart_ram_size)
+{
+	const uint8_t *state = w->data + PEANUT_ROM_WARM_HDR_SIZE;
+	size_t stored = __peanut_rom_get32(w->data +
+			PEANUT_ROM_WARM_CART_RAM_SIZE);
+	uint8_t key[4];
+
+	__peanut_rom_warm_key(gb, key);
+	if(memcmp(w->data + PEANUT_ROM_WARM_HDR_CHK, key, sizeof(key)) != 0)
+		return -1;
+
+	if(stored != 0 && (cart_ram == NULL || stored != cart_ram_size))
+		return -1;
+
+	if(gb_state_load(gb, state) != 0)
+		return -1;
+
+	if(stored != 0)
+		memcpy(cart_ram, state + gb_state_size(), stored);
+
+	return 0;
+}
+
+#undef PEANUT_ROM_HEADER_END
+#undef PEANUT_ROM_WARM_MAGIC
+#undef PEANUT_ROM_WARM_HDR_SIZE
+#undef PEANUT_ROM_WARM_HDR_CHK
+#undef PEANUT_ROM_WARM_STATE_SIZE
+#undef PEANUT_ROM_WARM_CART_RAM_SIZE
+#undef PEANUT_ROM_GLOBAL_CHECKSUM_LOC
+#undef PEANUT_ROM_MMAP_WIN32
+#undef PEANUT_ROM_MMAP_POSIX
+
+#else
+
+enum peanut_rom_error_e peanut_rom_open(struct peanut_rom_s *r,
+		const char *file_name);
+void peanut_rom_close(struct peanut_rom_s *r);
+void peanut_rom_attach(const struct peanut_rom_s *r, struct gb_s *gb,
+		uint8_t *cart_ram, size_t cart_ram_size);
+enum peanut_rom_error_e peanut_rom_store_warm(struct gb_s *gb,
+		const char *dir, const char *tag,
+		const uint8_t *cart_ram, size_t cart_ram_size);
+enum peanut_rom_error_e peanut_rom_open_warm(struct peanut_rom_s *w,
+		struct gb_s *gb, const char *dir, const char *tag);
+int peanut_rom_apply_warm(const struct peanut_rom_s *w, struct gb_s *gb,
+		uint8_t *cart_ram, size_t cart_ram_size);
+
+#endif // PEANUT_ROM_HEADER_ONLY
+#endif // PEANUT_ROM_H
@@ -0,0 +1,338 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * Battery save persistence for Peanut-GB front-ends.
+ *
+ * The save file itself is used as the cart RAM of an emulator context. It is
+ * mapped into memory with mmap() on POSIX systems and MapViewOfFile() on
+ * Windows, so the cart RAM written by the game is held in the page cache of
+ * the operating system, and is not lost if the process is killed.
+ * peanut_save_flush() then writes only the pages reported by
+ * gb_get_cart_ram_dirty() to storage, with msync() or FlushViewOfFile(). On
+ * other platforms, the save is read into allocated memory, and the dirty pages
+ * are written back with fwrite().
+ *
+ * peanut_save_flush() returns immediately if no cart RAM was written, so it
+ * may be called after every frame or on a timer.
+ *
+ * peanut_gb.h must be included before this file, with
+ * PEANUT_GB_CART_RAM_DIRTY enabled.
+ */
+
+#ifndef PEANUT_SAVE_H
+#define PEANUT_SAVE_H
+
+#if !PEANUT_GB_CART_RAM_DIRTY
+# error "peanut_save.h requires PEANUT_GB_CART_RAM_DIRTY"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct peanut_save_s
+{
+	/* Cart RAM of size bytes, given to gb_init_rom_direct() or used by the
+	 * cart RAM callbacks. */
+	uint8_t *data;
+	size_t size;
+
+	/* Handles of the file mapping. Only used on Windows. */
+	void *file;
+	void *mapping;
+
+	/* Open save file, if data was allocated instead of mapped. */
+	void *stream;
+};
+
+#ifndef PEANUT_SAVE_HEADER_ONLY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+# define WIN32_LEAN_AND_MEAN
+# include <windows.h>
+# define PEANUT_SAVE_MMAP_WIN32	1
+#elif defined(__unix__) || defined(__APPLE__)
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+# define PEANUT_SAVE_MMAP_POSIX	1
+#endif
+
+/* Number of pages in the bitmap returned by gb_get_cart_ram_dirty(). */
+#define PEANUT_SAVE_DIRTY_PAGES	32
+
+#if !defined(PEANUT_SAVE_MMAP_WIN32) && !defined(PEANUT_SAVE_MMAP_POSIX)
+static int __peanut_save_read(struct peanut_save_s *s, const char *file_name)
+{
+	FILE *f = fopen(file_name, "r+b");
+
+	if(f == NULL)
+		f = fopen(file_name, "w+b");
+
+	if(f == NULL)
+		return -1;
+
+	s->data = calloc(1, s->size);
+	if(s->data == NULL)
+	{
+		fclose(f);
+		return -1;
+	}
+
+	/* A save file that is shorter than the cart RAM is padded with
+	 * zeros, as it would be by ftruncate(). */
+	if(fread(s->data, 1, s->size, f) != s->size && ferror(f))
+	{
+		free(s->data);
+		fclose(f);
+		return -1;
+	}
+
+	s->stream = f;
+	return 0;
+}
+#endif
+
+/**
+ * Writes a range of the cart RAM to storage.
+ */
+static int __peanut_save_write(struct peanut_save_s *s, size_t offset,
+		size_t len)
+{
+#if defined(PEANUT_SAVE_MMAP_WIN32)
+	return FlushViewOfFile(s->data + offset, len) ? 0 : -1;
+#elif defined(PEANUT_SAVE_MMAP_POSIX)
+	/* msync() must be given an address aligned to the host page size,
+	 * which may be larger than the pages of the bitmap. */
+	const size_t align = offset % (size_t)sysconf(_SC_PAGESIZE);
+
+	return msync(s->data + offset - align, len + align, MS_SYNC);
+#else
+	FILE *f = s->stream;
+
+	if(fseek(f, (long)offset, SEEK_SET) != 0 ||
+			fwrite(s->data + offset, 1, len, f) != len)
+		return -1;
+
+	return 0;
+#endif
+}
+
+/**
+ * Closes a save opened with peanut_save_open(). Emulator contexts that use the
+ * save must not be run afterwards. Call peanut_save_flush() first to make sure
+ * that the save is written.
+ */
+void peanut_save_close(struct peanut_save_s *s)
+{
+	if(s->data == NULL)
+	{
+		memset(s, 0, sizeof(*s));
+		return;
+	}
+
+#if defined(PEANUT_SAVE_MMAP_WIN32)
+	UnmapViewOfFile(s->data);
+	CloseHandle(s->mapping);
+	CloseHandle(s->file);
+#elif defined(PEANUT_SAVE_MMAP_POSIX)
+	munmap(s->data, s->size);
+#else
+	free(s->data);
+	fclose(s->stream);
+#endif
+
+	memset(s, 0, sizeof(*s));
+}
+
+/**
+ * Opens a save file as cart RAM, creating it if it does not exist. A file
+ * shorter than the cart RAM is extended with zeros.
+ *
+ * \param s	Save to initialise. Must not be NULL.
+ * \param file_name	Path of the save file.
+ * \param size	Size of the cart RAM in bytes, as returned by
+ *		gb_get_save_size_s(). If 0, the file is not opened and
+ *		s->data is NULL.
+ * \returns	0 on success, or -1 if the file could not be opened. Nothing
+ *		needs to be closed on failure.
+ */
+int peanut_save_open(struct peanut_save_s *s, const char *file_name,
+		size_t size)
+{
+	memset(s, 0, sizeof(*s));
+
+	if(size == 0)
+		return 0;
+
+	s->size = size;
+
+#if defined(PEANUT_SAVE_MMAP_WIN32)
+	{
+		HANDLE file, mapping;
+		void *view;
+
+		file = CreateFileA(file_name, GENERIC_READ | GENERIC_WRITE,
+				FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+				FILE_ATTRIBUTE_NORMAL, NULL);
+		if(file == INVALID_HANDLE_VALUE)
+			return -1;
+
+		/* The file is extended to the size of the mapping. */
+		mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE,
+				(DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+		if(mapping == NULL)
+		{
+			CloseHandle(file);
+			return -1;
+		}
+
+		view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+		if(view == NULL)
+		{
+			CloseHandle(mapping);
+			CloseHandle(file);
+			return -1;
+		}
+
+		s->data = view;
+		s->file = file;
+		s->mapping = mapping;
+	}
+#elif defined(PEANUT_SAVE_MMAP_POSIX)
+	{
+		struct stat st;
+		void *map;
+		int fd = open(file_name, O_RDWR | O_CREAT, 0666);
+
+		if(fd < 0)
+			return -1;
+
+		if(fstat(fd, &st) != 0 ||
+				((size_t)st.st_size < size &&
+				 ftruncate(fd, (off_t)size) != 0))
+		{
+			close(fd);
+			return -1;
+		}
+
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fd, 0);
+		/* The mapping remains valid after the file is closed. */
+		close(fd);
+
+		if(map == MAP_FAILED)
+			return -1;
+
+		s->data = map;
+	}
+#else
+	if(__peanut_save_read(s, file_name) != 0)
+	{
+		memset(s, 0, sizeof(*s));
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+/**
+ * Writes the pages of cart RAM written by an emulator context since the last
+ * flush to the save file, and marks them as clean.
+ *
+ * \param s	Save used as the cart RAM of gb.
+ * \param gb	Emulator context. Must not be NULL.
+ * \returns	0 on success, or -1 if the save could not be written, in which
+ *		case the pages remain dirty so that the next flush tries again.
+ */
+int peanut_save_flush(struct peanut_save_s *s, struct gb_s *gb)
+{
+	const uint_fast32_t dirty = gb_get_cart_ram_dirty(gb);
+	uint_fast8_t i = 0;
+
+	if(dirty == 0)
+		return 0;
+
+	/* Each run of consecutive dirty pages is written at once. */
+	while(i < PEANUT_SAVE_DIRTY_PAGES)
+	{
+		uint_fast8_t end = i;
+		size_t offset, len;
+
+		if(!(dirty & ((uint_fast32_t)1 << i)))
+		{
+			i++;
+			continue;
+		}
+
+		while(end < PEANUT_SAVE_DIRTY_PAGES &&
+				(dirty & ((uint_fast32_t)1 << end)))
+			end++;
+
+		offset = (size_t)i * CART_RAM_DIRTY_PAGE_SIZE;
+		if(offset >= s->size)
+			break;
+
+		len = (size_t)(end - i) * CART_RAM_DIRTY_PAGE_SIZE;
+		if(len > s->size - offset)
+			len = s->size - offset;
+
+		if(__peanut_save_write(s, offset, len) != 0)
+			return -1;
+
+		i = end;
+	}
+
+#if defined(PEANUT_SAVE_MMAP_WIN32)
+	/* FlushViewOfFile() does not wait for the data to reach storage. */
+	if(!FlushFileBuffers(s->file))
+		return -1;
+#elif !defined(PEANUT_SAVE_MMAP_POSIX)
+	if(fflush(s->stream) != 0)
+		return -1;
+#endif
+
+	gb_clear_cart_ram_dirty(gb, dirty);
+	return 0;
+}
+
+#undef PEANUT_SAVE_DIRTY_PAGES
+#undef PEANUT_SAVE_MMAP_WIN32
+#undef PEANUT_SAVE_MMAP_POSIX
+
+#else
+
+int peanut_save_open(struct peanut_save_s *s, const char *file_name,
+		size_t size);
+void peanut_save_close(struct peanut_save_s *s);
+int peanut_save_flush(struct peanut_save_s *s, struct gb_s *gb);
+
+#endif // PEANUT_SAVE_HEADER_ONLY
+#endif // PEANUT_SAVE_H
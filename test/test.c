@@ -3,16 +3,59 @@
 #define ENABLE_SOUND 0
 #define ENABLE_LCD 1
 #include "../peanut_gb.h"
+#include "../peanut_rewind.h"
+#include "../peanut_lockstep.h"
+#include "../peanut_link.h"
+#include "../peanut_rom.h"
+#if PEANUT_GB_CART_RAM_DIRTY
+# include "../peanut_save.h"
+#endif
+#include "../peanut_movie.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "dmg-acid2.gb.h" /* Generated via `xxd -i` */
+
+#if PEANUT_GB_LCD_QUEUE
+# include <pthread.h>
+#endif
+
+#include "cpu_instrs.h" /* Generated via `xxd -i` */
+#include "instr_timing.h"
+#include "dmg-acid2.gb.h"
 
 /* Hash of correct LCD output for DMG-Acid2 Test. */
 #define DMG_ACID2_HASH 0xF91DF416u
 
+#if PEANUT_GB_EXTERNAL_MEMORY
+/* Memory given to contexts before they are initialised or forked, so that
+ * every test is run with memory held outside of struct gb_s. No test uses
+ * more contexts at once than there are slots. */
+#define TEST_MEMORY_SLOTS 16
+
+static struct test_memory
+{
+	uint8_t wram[WRAM_SIZE];
+	uint8_t vram[VRAM_SIZE];
+	uint8_t oam[OAM_SIZE];
+} test_memory[TEST_MEMORY_SLOTS];
+
+static void test_init_memory(struct gb_s *gb)
+{
+	static unsigned int next = 0;
+	struct test_memory *m = &test_memory[next++ % TEST_MEMORY_SLOTS];
+
+	/* Tests that compare contexts clear them before initialising them. */
+	memset(m, 0, sizeof(*m));
+	gb_init_memory(gb, m->wram, m->vram, m->oam);
+}
+
+# define gb_init(gb, ...) (test_init_memory(gb), gb_init(gb, __VA_ARGS__))
+# define gb_fork(parent, child, ...) \
+	(test_init_memory(child), gb_fork(parent, child, __VA_ARGS__))
+#endif
+
 struct priv
 {
 	char str[1024];
@@ -48,7 +91,6 @@ static uint32_t fnv1a_hash(const void *data, size_t len)
  */
 uint8_t gb_rom_read_cpu_instrs(struct gb_s *gb, const uint_fast32_t addr)
 {
-#include "cpu_instrs.h"
 	assert(addr < cpu_instrs_gb_len);
 	return cpu_instrs_gb[addr];
 }
@@ -58,7 +100,6 @@ uint8_t gb_rom_read_cpu_instrs(struct gb_s *gb, const uint_fast32_t addr)
  */
 uint8_t gb_rom_read_instr_timing(struct gb_s *gb, const uint_fast32_t addr)
 {
-#include "instr_timing.h"
         assert(addr < instr_timing_gb_len);
         return instr_timing_gb[addr];
 }
@@ -150,6 +191,37 @@ void test_cpu_inst(void)
 	return;
 }
 
+void test_cpu_inst_direct(void)
+{
+	struct gb_s gb;
+	const unsigned short pc_end = 0x06F1; /* Test ends when PC is this value. */
+	struct priv p = { .count = 0 };
+	enum gb_init_error_e gb_err;
+
+	/* Run ROM test with the ROM read directly from memory. */
+	gb_err = gb_init(&gb, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	gb_init_rom_direct(&gb, cpu_instrs_gb, cpu_instrs_gb_len, NULL, 0);
+	gb_init_serial(&gb, &gb_serial_tx, NULL);
+
+	printf("Serial: ");
+
+	/* Step CPU until test is complete. */
+	while(gb.cpu_reg.pc.reg != pc_end)
+		__gb_step_cpu(&gb);
+
+	p.str[p.count++] = '\0';
+
+	/* Check test results. */
+	lok(strstr(p.str, "Passed all tests") != NULL);
+
+	return;
+}
+
 void test_instr_timing(void)
 {
 	struct gb_s gb;
@@ -180,6 +252,733 @@ void test_instr_timing(void)
 	return;
 }
 
+static bool instr_timing_done(struct gb_s *gb)
+{
+	/* Test ends when PC is this value. */
+	return gb->cpu_reg.pc.reg == 0xC8B0;
+}
+
+void test_run_cycles(void)
+{
+	struct gb_s gb;
+	struct priv p = { .count = 0 };
+	enum gb_init_error_e gb_err;
+	uint_fast32_t cycles;
+
+	gb_err = gb_init(&gb, &gb_rom_read_instr_timing, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	gb_init_serial(&gb, &gb_serial_tx, NULL);
+
+	/* At most one instruction more than requested is executed. */
+	cycles = gb_run_cycles(&gb, 1000);
+	lok(cycles >= 1000 && cycles < 1000 + 24);
+
+	printf("Serial: ");
+
+	/* Run the rest of the test with the predicate. */
+	cycles = gb_run_until(&gb, instr_timing_done);
+	lok(cycles > 0);
+
+	p.str[p.count++] = '\0';
+	lok(strstr(p.str, "Passed") != NULL);
+}
+
+void test_frame_cycles(void)
+{
+	struct gb_s gb;
+	struct priv p = { .count = 0 };
+	enum gb_init_error_e gb_err;
+	uint_fast32_t start, cycles, total = 0;
+
+	gb_err = gb_init(&gb, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	/* A frame ends within an instruction of VBLANK starting. */
+	gb_run_frame(&gb);
+	start = gb_get_frame_cycles(&gb);
+	lok(start < 24);
+
+	/* The count follows the cycles run within the frame. */
+	cycles = gb_run_cycles(&gb, 1000);
+	lequal((int)gb_get_frame_cycles(&gb), (int)(start + cycles));
+
+	while(total < LCD_FRAME_CYCLES - 2000)
+		total += gb_run_cycles(&gb, 1000);
+
+	lequal((int)gb_get_frame_cycles(&gb), (int)(start + cycles + total));
+	lok(gb_get_frame_cycles(&gb) < LCD_FRAME_CYCLES);
+
+	/* It starts again from 0 on the next frame. */
+	gb_run_frame(&gb);
+	lok(gb_get_frame_cycles(&gb) < 24);
+}
+
+#if PEANUT_GB_IDLE_SKIP
+/* Run a loop from HRAM that polls an I/O register until it changes, and check
+ * that the iterations up to each event are skipped instead of being run one
+ * instruction at a time. */
+static void run_idle_loop(const uint8_t *code, size_t len,
+		bool (*done)(struct gb_s *gb))
+{
+	struct gb_s gb;
+	struct priv p = { .count = 0 };
+	enum gb_init_error_e gb_err;
+	uint_fast32_t total = 0;
+	unsigned int steps = 0;
+
+	gb_err = gb_init(&gb, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	/* Start from the beginning of a frame, with no interrupts. */
+	gb_run_frame(&gb);
+	gb.hram_io[0xFF] = 0x00;	/* IE */
+	gb.hram_io[0x0F] = 0xE0;	/* IF */
+	memcpy(&gb.hram_io[0x80], code, len);
+	gb.cpu_reg.pc.reg = 0xFF80;
+
+	while(gb.cpu_reg.pc.reg < 0xFF80 + len && total < 2 * LCD_FRAME_CYCLES)
+	{
+		total += __gb_step_cpu(&gb);
+		steps++;
+	}
+
+	/* Each iteration is three instructions taking 32 cycles. Only the
+	 * iterations around each LCD mode change are run. */
+	lok(steps * 2 < total / 32 * 3);
+	lok(done(&gb));
+}
+
+static bool idle_ly_done(struct gb_s *gb)
+{
+	/* The loop ends within an iteration of LY reaching 0x40. Frames
+	 * start on line 144. */
+	return gb->hram_io[0x44] == 0x40 &&
+		gb_get_frame_cycles(gb) - (154 - 144 + 0x40) * LCD_LINE_CYCLES <
+		32 + 12;
+}
+
+static bool idle_if_done(struct gb_s *gb)
+{
+	/* The loop ends within an iteration of VBLANK starting. */
+	return (gb->hram_io[0x0F] & 0x01) != 0 &&
+		gb_get_frame_cycles(gb) < 32 + 12;
+}
+
+void test_idle_skip(void)
+{
+	/* LDH A,(LY); CP 0x40; JR NZ,-6 */
+	const uint8_t ly_loop[] = { 0xF0, 0x44, 0xFE, 0x40, 0x20, 0xFA };
+	/* LDH A,(IF); AND 0x01; JR Z,-6 */
+	const uint8_t if_loop[] = { 0xF0, 0x0F, 0xE6, 0x01, 0x28, 0xFA };
+
+	run_idle_loop(ly_loop, sizeof(ly_loop), idle_ly_done);
+	run_idle_loop(if_loop, sizeof(if_loop), idle_if_done);
+}
+#endif
+
+#if PEANUT_GB_PROFILE
+void test_profile(void)
+{
+	/* LDH A,(LY); CP 0x40; JR NZ,-6 */
+	const uint8_t ly_loop[] = { 0xF0, 0x44, 0xFE, 0x40, 0x20, 0xFA };
+	struct gb_s gb;
+	struct acid_priv p = {0};
+	const struct gb_profile_s *prof;
+	uint64_t executed;
+
+	lequal(gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p), GB_INIT_NO_ERROR);
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+	prof = gb_get_profile(&gb);
+	lok(prof != NULL);
+
+	/* Every line of each frame is drawn once the test has turned the LCD
+	 * on. */
+	for(unsigned int i = 0; i < 100; i++)
+		gb_run_frame(&gb);
+	gb_reset_profile(&gb);
+	for(unsigned int i = 0; i < 10; i++)
+		gb_run_frame(&gb);
+
+	lequal((int)prof->lines_drawn, 10 * LCD_HEIGHT);
+	lequal((int)prof->lines_skipped, 0);
+	lok(prof->cycles >= 10 * LCD_FRAME_CYCLES &&
+			prof->cycles < 10 * LCD_FRAME_CYCLES + 24);
+	lok(prof->halt_cycles <= prof->cycles);
+
+	/* Poll LY from HRAM until it reaches 0x40. Each instruction of the
+	 * loop that is executed reads two bytes of HRAM, apart from the last
+	 * JR which is not taken, and LDH reads LY. Looking ahead at the loop
+	 * to skip it is not counted as reads. */
+	gb.hram_io[0xFF] = 0x00;	/* IE */
+	memcpy(&gb.hram_io[0x80], ly_loop, sizeof(ly_loop));
+	gb.cpu_reg.pc.reg = 0xFF80;
+	gb_reset_profile(&gb);
+
+	while(gb.cpu_reg.pc.reg < 0xFF80 + sizeof(ly_loop))
+		__gb_step_cpu(&gb);
+
+	lok(prof->opcode[0xF0] == prof->opcode[0xFE] &&
+			prof->opcode[0xF0] == prof->opcode[0x20]);
+#if PEANUT_GB_IDLE_SKIP
+	lok(prof->idle_iterations > 0);
+#else
+	lok(prof->idle_iterations == 0);
+#endif
+	executed = prof->opcode[0xF0] - prof->idle_iterations;
+	lok(prof->read[GB_PROFILE_REGION_HRAM] == 6 * executed - 1);
+	lok(prof->read[GB_PROFILE_REGION_IO] == executed);
+	lok(prof->cycles == 32 * prof->opcode[0xF0] - 4);
+}
+#endif
+
+void test_state(void)
+{
+	struct gb_s gb;
+	struct priv p = { .count = 0 };
+	enum gb_init_error_e gb_err;
+	uint8_t *start, *expected, *actual;
+	size_t size = gb_state_size();
+
+	gb_err = gb_init(&gb, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	start = malloc(size);
+	expected = malloc(size);
+	actual = malloc(size);
+	assert(start != NULL && expected != NULL && actual != NULL);
+
+	/* Save part way through a frame so that pending cycles are saved. */
+	for(unsigned int i = 0; i < 200; i++)
+		gb_run_frame(&gb);
+	gb_run_cycles(&gb, 12345);
+	gb_state_save(&gb, start);
+
+	for(unsigned int i = 0; i < 100; i++)
+		gb_run_frame(&gb);
+	gb_state_save(&gb, expected);
+
+	/* Running again from the loaded state must give the same result. */
+	lok(gb_state_load(&gb, start) == 0);
+	for(unsigned int i = 0; i < 100; i++)
+		gb_run_frame(&gb);
+	gb_state_save(&gb, actual);
+	lok(memcmp(expected, actual, size) == 0);
+
+	/* States holding values that this cartridge or the emulator cannot
+	 * reach are rejected, without changing the emulator. */
+	memcpy(actual, start, size);
+	actual[21] = 0xFF;		/* ROM bank */
+	actual[22] = 0xFF;
+	lok(gb_state_load(&gb, actual) == -1);
+	memcpy(actual, start, size);
+	actual[23] = 0x10;		/* Cart RAM bank */
+	lok(gb_state_load(&gb, actual) == -1);
+	memcpy(actual, start, size);
+	actual[36] = 0xFF;		/* LCD line cycles */
+	actual[37] = 0xFF;
+	lok(gb_state_load(&gb, actual) == -1);
+	memcpy(actual, start, size);
+	actual[size - 0x100 + 0x44] = 154;	/* LY */
+	lok(gb_state_load(&gb, actual) == -1);
+	gb_state_save(&gb, actual);
+	lok(memcmp(expected, actual, size) == 0);
+
+	/* Buffers that are not save states are rejected. */
+	memset(actual, 0, size);
+	lok(gb_state_load(&gb, actual) == -1);
+
+	free(start);
+	free(expected);
+	free(actual);
+}
+
+void test_fork(void)
+{
+	struct gb_s parent, child, grandchild;
+	struct acid_priv p = {0}, pc = {0}, pgc = {0};
+	enum gb_init_error_e gb_err;
+	uint8_t *start, *actual;
+	size_t size = gb_state_size();
+
+	gb_err = gb_init(&parent, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	start = malloc(size);
+	actual = malloc(size);
+	assert(start != NULL && actual != NULL);
+
+	gb_init_lcd(&parent, acid_lcd_draw_line);
+	for(unsigned int i = 0; i < 20; i++)
+		gb_run_frame(&parent);
+	gb_run_cycles(&parent, 12345);
+	gb_state_save(&parent, start);
+
+	/* A fork of a fork must draw the same frames as the parent would. */
+	lok(gb_fork(&parent, &child, NULL) == 0);
+	child.direct.priv = &pc;
+	for(unsigned int i = 0; i < 40; i++)
+		gb_run_frame(&child);
+
+	lok(gb_fork(&child, &grandchild, NULL) == 0);
+	grandchild.direct.priv = &pgc;
+	memcpy(pgc.fb, pc.fb, sizeof(pgc.fb));
+	for(unsigned int i = 0; i < 40; i++)
+		gb_run_frame(&grandchild);
+	lok(fnv1a_hash(pgc.fb, sizeof(pgc.fb)) == DMG_ACID2_HASH);
+
+	/* Writes by the forks must not change the parent. */
+	gb_state_save(&parent, actual);
+	lok(memcmp(start, actual, size) == 0);
+
+	/* The parent may run again once its forks stop sharing memory. */
+	gb_unshare(&grandchild);
+	gb_unshare(&child);
+	gb_state_save(&grandchild, start);
+	for(unsigned int i = 0; i < 80; i++)
+		gb_run_frame(&parent);
+	gb_state_save(&parent, actual);
+	lok(memcmp(start, actual, size) == 0);
+
+	free(start);
+	free(actual);
+}
+
+void test_rewind(void)
+{
+	struct gb_s gb;
+	struct priv p = { .count = 0 };
+	struct peanut_rewind_s rw;
+	enum gb_init_error_e gb_err;
+	uint8_t *expected, *actual;
+	size_t size = gb_state_size();
+
+	gb_err = gb_init(&gb, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	/* Small enough that the oldest entries are dropped. */
+	lok(peanut_rewind_init(&rw, 64 * 1024, 16) == 0);
+	expected = malloc(size);
+	actual = malloc(size);
+	assert(expected != NULL && actual != NULL);
+
+	for(unsigned int i = 0; i < 300; i++)
+	{
+		gb_run_frame(&gb);
+		lok(peanut_rewind_push(&rw, &gb) == 0);
+
+		if(i == 280)
+			gb_state_save(&gb, expected);
+	}
+
+	lok(peanut_rewind_count(&rw) < 299);
+
+	/* Step back to the state at frame 280. */
+	for(unsigned int i = 0; i < 19; i++)
+		lok(peanut_rewind_step_back(&rw, &gb) == 0);
+
+	gb_state_save(&gb, actual);
+	lok(memcmp(expected, actual, size) == 0);
+
+	while(peanut_rewind_count(&rw) > 0)
+		lok(peanut_rewind_step_back(&rw, &gb) == 0);
+
+	lok(peanut_rewind_step_back(&rw, &gb) == -1);
+
+	peanut_rewind_free(&rw);
+	free(expected);
+	free(actual);
+}
+
+void test_lockstep(void)
+{
+	struct gb_s gb[4], ref, ref_input;
+	struct gb_s *group[4];
+	struct priv p = { .count = 0 };
+	struct peanut_lockstep_s ls;
+	uint8_t *expected, *actual;
+	size_t size = gb_state_size();
+
+	expected = malloc(size);
+	actual = malloc(size);
+	assert(expected != NULL && actual != NULL);
+
+	/* WRAM is not cleared by gb_init(). */
+	memset(gb, 0, sizeof(gb));
+	memset(&ref, 0, sizeof(ref));
+	memset(&ref_input, 0, sizeof(ref_input));
+
+	for(unsigned int i = 0; i < 4; i++)
+	{
+		lok(gb_init(&gb[i], &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+				&gb_cart_ram_write, &gb_error, &p) ==
+				GB_INIT_NO_ERROR);
+		group[i] = &gb[i];
+	}
+
+	lok(gb_init(&ref, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p) == GB_INIT_NO_ERROR);
+	lok(gb_init(&ref_input, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p) == GB_INIT_NO_ERROR);
+
+	/* Contexts that start in the same state are only run once. */
+	lok(peanut_lockstep_init(&ls, group, 4, 1) == 0);
+	lequal((int)peanut_lockstep_groups(&ls), 1);
+
+	for(unsigned int i = 0; i < 100; i++)
+	{
+		peanut_lockstep_run_frame(&ls);
+		gb_run_frame(&ref);
+		gb_run_frame(&ref_input);
+	}
+
+	lequal((int)ls.frames_run, 100);
+	lequal((int)ls.frames_total, 400);
+
+	/* A context given a different input is split off. */
+	gb[2].direct.joypad = 0xFE;
+	ref_input.direct.joypad = 0xFE;
+	peanut_lockstep_run_frame(&ls);
+	gb_run_frame(&ref);
+	gb_run_frame(&ref_input);
+	lequal((int)ls.frames_run, 102);
+
+	/* Each context matches a context run on its own. */
+	gb_state_save(&ref_input, expected);
+	gb_state_save(peanut_lockstep_get(&ls, 2), actual);
+	lok(memcmp(expected, actual, size) == 0);
+
+	peanut_lockstep_detach(&ls, 3);
+	gb_state_save(&ref, expected);
+	gb_state_save(&gb[3], actual);
+	lok(memcmp(expected, actual, size) == 0);
+
+	peanut_lockstep_free(&ls);
+	free(expected);
+	free(actual);
+}
+
+/* ROMs used by test_link, which each start one transfer and wait. */
+static uint8_t link_rom[2][0x8000];
+
+uint8_t gb_rom_read_link(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const uint8_t *rom = gb->direct.priv;
+	return rom[addr];
+}
+
+static void make_link_rom(uint8_t *rom, uint8_t sb, uint8_t sc)
+{
+	const uint8_t prog[] = {
+		0x3E, sb,	/* LD A, sb */
+		0xE0, 0x01,	/* LDH (SB), A */
+		0x3E, sc,	/* LD A, sc */
+		0xE0, 0x02,	/* LDH (SC), A */
+		0x18, 0xFE	/* JR -2 */
+	};
+	uint8_t x = 0;
+
+	memset(rom, 0, 0x8000);
+	memcpy(rom + 0x100, prog, sizeof(prog));
+
+	for(unsigned int i = 0x134; i <= 0x14C; i++)
+		x = x - rom[i] - 1;
+
+	rom[0x14D] = x;
+}
+
+void test_link(void)
+{
+	struct gb_s gb[2];
+	struct peanut_link_s link;
+
+	/* The first context waits with the external clock, and the second
+	 * sends with the internal clock. */
+	make_link_rom(link_rom[0], 0x42, 0x80);
+	make_link_rom(link_rom[1], 0x17, 0x81);
+
+	for(unsigned int i = 0; i < 2; i++)
+	{
+		lok(gb_init(&gb[i], &gb_rom_read_link, &gb_cart_ram_read,
+				&gb_cart_ram_write, &gb_error, link_rom[i]) ==
+				GB_INIT_NO_ERROR);
+	}
+
+	peanut_link_init(&link, &gb[0], &gb[1], 1024);
+
+	for(unsigned int i = 0; i < 4; i++)
+		peanut_link_run_frame(&link);
+
+	/* Both sides received the byte of the other, and completed the
+	 * transfer. */
+	lequal(gb[0].hram_io[0x01], 0x17);
+	lequal(gb[1].hram_io[0x01], 0x42);
+	lequal(gb[0].hram_io[0x02] & 0x80, 0);
+	lequal(gb[1].hram_io[0x02] & 0x80, 0);
+}
+
+void test_rom_file(void)
+{
+	const char *file_name = "peanut_rom_test.gb";
+	struct peanut_rom_s rom;
+	uint8_t *bad;
+	FILE *f;
+
+	f = fopen(file_name, "wb");
+	lok(f != NULL);
+	if(f == NULL)
+		return;
+
+	fwrite(dmg_acid2_gb, 1, dmg_acid2_gb_len, f);
+	fclose(f);
+
+	lequal(peanut_rom_open(&rom, file_name), PEANUT_ROM_NO_ERROR);
+	lequal((int)rom.size, (int)dmg_acid2_gb_len);
+	lok(memcmp(rom.data, dmg_acid2_gb, dmg_acid2_gb_len) == 0);
+	peanut_rom_close(&rom);
+
+	/* A corrupted header is rejected before gb_init() is called. */
+	bad = malloc(dmg_acid2_gb_len);
+	assert(bad != NULL);
+	memcpy(bad, dmg_acid2_gb, dmg_acid2_gb_len);
+	bad[0x0134] ^= 0xFF;
+	f = fopen(file_name, "wb");
+	fwrite(bad, 1, dmg_acid2_gb_len, f);
+	fclose(f);
+	free(bad);
+
+	lequal(peanut_rom_open(&rom, file_name),
+			PEANUT_ROM_ERROR_INVALID_CHECKSUM);
+	remove(file_name);
+
+	lequal(peanut_rom_open(&rom, file_name), PEANUT_ROM_ERROR_OPEN);
+}
+
+/* Emulator context with its own APU registers for the audio hook test. */
+struct audio_gb
+{
+	struct gb_s gb;
+	uint8_t regs[0x30];
+	unsigned int writes;
+};
+
+void test_warm_state(void)
+{
+	struct gb_s cold, warm;
+	struct priv p = { .count = 0 };
+	struct peanut_rom_s w;
+	uint8_t ram[16], warm_ram[16];
+	uint8_t *expected, *actual;
+	size_t size = gb_state_size();
+
+	lequal(gb_init(&cold, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p), GB_INIT_NO_ERROR);
+	lequal(gb_init(&warm, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p), GB_INIT_NO_ERROR);
+
+	expected = malloc(size);
+	actual = malloc(size);
+	assert(expected != NULL && actual != NULL);
+
+	for(unsigned int i = 0; i < 100; i++)
+		gb_run_frame(&cold);
+
+	for(unsigned int i = 0; i < sizeof(ram); i++)
+		ram[i] = (uint8_t)(i * 7);
+
+	lequal(peanut_rom_store_warm(&cold, ".", "test", ram, sizeof(ram)),
+			PEANUT_ROM_NO_ERROR);
+	lequal(peanut_rom_open_warm(&w, &warm, ".", "test"),
+			PEANUT_ROM_NO_ERROR);
+
+	/* A context started from the warm state continues as the cold one. */
+	memset(warm_ram, 0, sizeof(warm_ram));
+	lequal(peanut_rom_apply_warm(&w, &warm, warm_ram, sizeof(warm_ram)), 0);
+	lok(memcmp(ram, warm_ram, sizeof(ram)) == 0);
+	lequal(peanut_rom_apply_warm(&w, &warm, warm_ram, 8), -1);
+	peanut_rom_close(&w);
+
+	for(unsigned int i = 0; i < 100; i++)
+	{
+		gb_run_frame(&cold);
+		gb_run_frame(&warm);
+	}
+
+	gb_state_save(&cold, expected);
+	gb_state_save(&warm, actual);
+	lok(memcmp(expected, actual, size) == 0);
+
+	/* Named after the header and global checksums of cpu_instrs.gb. */
+	lequal(remove("./3BF530-test.pgbw"), 0);
+	lequal(peanut_rom_open_warm(&w, &warm, ".", "missing"),
+			PEANUT_ROM_ERROR_OPEN);
+
+	free(expected);
+	free(actual);
+}
+
+#if PEANUT_GB_CART_RAM_DIRTY
+void test_save_file(void)
+{
+	/* Writes a byte to each page of an 8 KiB cart RAM, then waits. */
+	static const uint8_t prog[] = {
+		0x3E, 0x0A,		/* LD A, 0x0A */
+		0xEA, 0x00, 0x00,	/* LD (0x0000), A */
+		0x3E, 0x42,		/* LD A, 0x42 */
+		0xEA, 0x23, 0xA1,	/* LD (0xA123), A */
+		0x3E, 0x43,		/* LD A, 0x43 */
+		0xEA, 0x56, 0xB4,	/* LD (0xB456), A */
+		0x18, 0xFE		/* JR -2 */
+	};
+	const char *file_name = "peanut_save_test.sav";
+	static uint8_t rom[0x8000];
+	struct peanut_save_s save;
+	struct gb_s gb;
+	size_t save_size;
+	uint8_t buf[0x2000];
+	uint8_t x = 0;
+	FILE *f;
+
+	memset(rom, 0, sizeof(rom));
+	memcpy(rom + 0x100, prog, sizeof(prog));
+	rom[0x147] = 0x03; /* MBC1+RAM+BATTERY */
+	rom[0x149] = 0x02; /* 8 KiB */
+	for(unsigned int i = 0x134; i <= 0x14C; i++)
+		x = x - rom[i] - 1;
+	rom[0x14D] = x;
+
+	remove(file_name);
+	lequal(gb_init(&gb, &gb_rom_read_link, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, rom), GB_INIT_NO_ERROR);
+	lequal(gb_get_save_size_s(&gb, &save_size), 0);
+	lequal((int)save_size, (int)sizeof(buf));
+
+	lequal(peanut_save_open(&save, file_name, save_size), 0);
+	gb_init_rom_direct(&gb, rom, sizeof(rom), save.data, save.size);
+
+	gb_run_frame(&gb);
+	lequal((int)gb_get_cart_ram_dirty(&gb), 0x3);
+	lequal(peanut_save_flush(&save, &gb), 0);
+	lequal((int)gb_get_cart_ram_dirty(&gb), 0);
+	peanut_save_close(&save);
+
+	f = fopen(file_name, "rb");
+	lok(f != NULL);
+	if(f == NULL)
+		return;
+
+	lequal((int)fread(buf, 1, sizeof(buf), f), (int)sizeof(buf));
+	fclose(f);
+	lequal(buf[0x0123], 0x42);
+	lequal(buf[0x1456], 0x43);
+	remove(file_name);
+}
+#endif
+
+static uint8_t audio_hook_read(struct gb_s *gb, const uint_fast16_t addr)
+{
+	struct audio_gb *a = (struct audio_gb *)gb;
+	return a->regs[addr - 0xFF10];
+}
+
+static void audio_hook_write(struct gb_s *gb, const uint_fast16_t addr,
+		const uint8_t val)
+{
+	struct audio_gb *a = (struct audio_gb *)gb;
+	a->regs[addr - 0xFF10] = val;
+	a->writes++;
+}
+
+void test_audio_hooks(void)
+{
+	struct audio_gb a[2];
+	struct priv p = { .count = 0 };
+
+	for(unsigned int i = 0; i < 2; i++)
+	{
+		enum gb_init_error_e gb_err;
+
+		memset(a[i].regs, 0, sizeof(a[i].regs));
+		a[i].writes = 0;
+		gb_err = gb_init(&a[i].gb, &gb_rom_read_cpu_instrs,
+				&gb_cart_ram_read, &gb_cart_ram_write,
+				&gb_error, &p);
+		lok(gb_err == GB_INIT_NO_ERROR);
+		if(gb_err != GB_INIT_NO_ERROR)
+			return;
+	}
+
+	gb_init_audio(&a[0].gb, &audio_hook_read, &audio_hook_write);
+	gb_init_audio(&a[1].gb, &audio_hook_read, &audio_hook_write);
+
+	/* The test ROM enables the APU on start. Only the context that is run
+	 * may see those writes. */
+	for(unsigned int i = 0; i < 10; i++)
+		gb_run_frame(&a[0].gb);
+
+	lok(a[0].writes > 0);
+	lequal(a[0].regs[0xFF26 - 0xFF10], 0x80);
+	lequal(a[0].regs[0xFF24 - 0xFF10], 0x77);
+	lequal(a[1].writes, 0);
+}
+
+/* Read an I/O register by executing LDH A,(reg) from HRAM. */
+static uint8_t cpu_read_io(struct gb_s *gb, uint8_t reg)
+{
+	gb->hram_io[0x80] = 0xF0;
+	gb->hram_io[0x81] = reg;
+	gb->cpu_reg.pc.reg = 0xFF80;
+	__gb_step_cpu(gb);
+	return gb->cpu_reg.a;
+}
+
+void test_apu_read_mask(void)
+{
+	struct gb_s gb;
+	struct priv p = { .count = 0 };
+	enum gb_init_error_e gb_err;
+
+	gb_err = gb_init(&gb, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	/* Unused bits of the APU registers read as 1. */
+	gb.hram_io[0x10] = 0x00;
+	lequal(cpu_read_io(&gb, 0x10), 0x80);
+	gb.hram_io[0x11] = 0x00;
+	lequal(cpu_read_io(&gb, 0x11), 0x3F);
+	gb.hram_io[0x26] = 0x80;
+	lequal(cpu_read_io(&gb, 0x26), 0xF0);
+
+	/* Wave RAM is read back unchanged. */
+	for(unsigned int i = 0x30; i <= 0x3F; i++)
+	{
+		gb.hram_io[i] = (uint8_t)(i * 7);
+		lequal(cpu_read_io(&gb, i), (uint8_t)(i * 7));
+	}
+}
+
 void test_dmg_acid2(void)
 {
         struct gb_s gb;
@@ -206,10 +1005,622 @@ void test_dmg_acid2(void)
 	}
 }
 
+#if PEANUT_GB_EXTERNAL_MEMORY
+void test_external_memory(void)
+{
+	static uint8_t wram[WRAM_SIZE], vram[VRAM_SIZE], oam[OAM_SIZE];
+	struct gb_s gb;
+	struct acid_priv p = {0};
+
+	/* The macro giving memory to each context is bypassed, so that this
+	 * test may check the memory it gives. */
+	gb_init_memory(&gb, wram, vram, oam);
+	lequal((gb_init)(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p), GB_INIT_NO_ERROR);
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+
+	for(unsigned int i = 0; i < 100; i++)
+		gb_run_frame(&gb);
+
+	lok(fnv1a_hash(p.fb, sizeof(p.fb)) == DMG_ACID2_HASH);
+	lok(gb.wram == wram && gb.vram == vram && gb.oam == oam);
+
+	/* The sprites and tiles were drawn from the given OAM and VRAM. */
+	{
+		unsigned int oam_set = 0, vram_set = 0;
+
+		for(unsigned int i = 0; i < sizeof(oam); i++)
+			oam_set |= oam[i];
+		for(unsigned int i = 0; i < sizeof(vram); i++)
+			vram_set |= vram[i];
+
+		lok(oam_set != 0 && vram_set != 0);
+	}
+}
+#endif
+
+#if PEANUT_GB_OAM_DMA_TIMING
+void test_oam_dma_timing(void)
+{
+	/* LD A,0xC0; LDH (DMA),A; LD A,(0xC000); LD B,A; LDH A,(0x90);
+	 * LD C,A; JR -2 */
+	const uint8_t code[] = {
+		0x3E, 0xC0, 0xE0, 0x46, 0xFA, 0x00, 0xC0, 0x47,
+		0xF0, 0x90, 0x4F, 0x18, 0xFE
+	};
+	struct gb_s gb;
+	struct priv p = { .count = 0 };
+	uint8_t src[OAM_SIZE];
+	uint_fast32_t cycles = 0;
+
+	lequal(gb_init(&gb, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p), GB_INIT_NO_ERROR);
+
+	for(unsigned int i = 0; i < OAM_SIZE; i++)
+	{
+		src[i] = (uint8_t)(i ^ 0x5A);
+		gb.wram[i] = src[i];
+	}
+	memset(gb.oam, 0, OAM_SIZE);
+	memcpy(&gb.hram_io[0x80], code, sizeof(code));
+	gb.hram_io[0x90] = 0x42;
+	gb.hram_io[0xFF] = 0x00;	/* IE */
+	gb.cpu_reg.pc.reg = 0xFF80;
+
+	/* Start the transfer. */
+	__gb_step_cpu(&gb);
+	__gb_step_cpu(&gb);
+
+	/* Only HRAM is readable during the transfer. */
+	cycles += __gb_step_cpu(&gb);
+	cycles += __gb_step_cpu(&gb);
+	lequal(gb.cpu_reg.bc.bytes.b, 0xFF);
+	cycles += __gb_step_cpu(&gb);
+	cycles += __gb_step_cpu(&gb);
+	lequal(gb.cpu_reg.bc.bytes.c, 0x42);
+
+	/* One byte is copied every 4 cycles. */
+	while(cycles < OAM_DMA_CYCLES - 24)
+		cycles += __gb_step_cpu(&gb);
+
+	__gb_sync_counters(&gb);
+	lequal(gb.oam[0], src[0]);
+	lequal(gb.oam[OAM_SIZE - 1], 0x00);
+
+	while(cycles < OAM_DMA_CYCLES)
+		cycles += __gb_step_cpu(&gb);
+
+	__gb_sync_counters(&gb);
+	lok(memcmp(gb.oam, src, OAM_SIZE) == 0);
+
+	/* WRAM is readable again once the transfer is complete. */
+	gb.cpu_reg.pc.reg = 0xFF84;
+	__gb_step_cpu(&gb);
+	__gb_step_cpu(&gb);
+	lequal(gb.cpu_reg.bc.bytes.b, src[0]);
+}
+#endif
+
+/* Number of lines drawn by policy_lcd_draw_line. */
+static unsigned int policy_lines;
+
+static void policy_lcd_draw_line(struct gb_s *gb, const uint8_t *pixels,
+		const uint_fast8_t line)
+{
+	policy_lines++;
+	acid_lcd_draw_line(gb, pixels, line);
+}
+
+void test_render_policy(void)
+{
+	struct gb_s gb;
+	struct acid_priv p = {0};
+
+	lequal(gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p), GB_INIT_NO_ERROR);
+	gb_init_lcd(&gb, policy_lcd_draw_line);
+
+	/* Nothing is drawn after the current frame until a frame is
+	 * requested. The lines drawn are counted, as with
+	 * PEANUT_GB_SKIP_UNCHANGED_LINES only the changed lines of a drawn
+	 * frame are given to lcd_draw_line. */
+	gb_set_render_policy(&gb, 0);
+	gb_run_frame(&gb);
+	policy_lines = 0;
+	for(unsigned int i = 0; i < 98; i++)
+		gb_run_frame(&gb);
+	lequal((int)policy_lines, 0);
+
+	gb_request_frame(&gb);
+	gb_run_frame(&gb);
+#if !PEANUT_GB_SKIP_UNCHANGED_LINES
+	lequal((int)policy_lines, LCD_HEIGHT);
+#endif
+	lequal((int)fnv1a_hash(&p.fb[0][0], LCD_WIDTH * LCD_HEIGHT),
+			(int)DMG_ACID2_HASH);
+
+	/* One frame out of four is drawn. */
+	gb_set_render_policy(&gb, 4);
+	policy_lines = 0;
+	for(unsigned int i = 0; i < 3; i++)
+		gb_run_frame(&gb);
+	lequal((int)policy_lines, 0);
+	gb_run_frame(&gb);
+#if !PEANUT_GB_SKIP_UNCHANGED_LINES
+	lequal((int)policy_lines, LCD_HEIGHT);
+#endif
+	lequal((int)fnv1a_hash(&p.fb[0][0], LCD_WIDTH * LCD_HEIGHT),
+			(int)DMG_ACID2_HASH);
+}
+
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+/* Number of lines drawn by skip_lcd_draw_line, and the first of them. */
+static unsigned int skip_lines;
+static unsigned int skip_first_line;
+
+static void skip_lcd_draw_line(struct gb_s *gb, const uint8_t *pixels,
+		const uint_fast8_t line)
+{
+	if(skip_lines++ == 0)
+		skip_first_line = line;
+	acid_lcd_draw_line(gb, pixels, line);
+}
+
+/* Run a frame and return the number of lines drawn. */
+static unsigned int skip_run_frame(struct gb_s *gb)
+{
+	skip_lines = 0;
+	gb_run_frame(gb);
+	return skip_lines;
+}
+
+void test_skip_unchanged_lines(void)
+{
+	struct gb_s gb;
+	struct acid_priv p = {0};
+	unsigned int line, lines;
+	uint8_t old;
+
+	lequal(gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p), GB_INIT_NO_ERROR);
+	gb_init_lcd(&gb, skip_lcd_draw_line);
+
+	for(unsigned int i = 0; i < 100; i++)
+		gb_run_frame(&gb);
+	lok(fnv1a_hash(p.fb, sizeof(p.fb)) == DMG_ACID2_HASH);
+
+	/* The test draws the same frame each time. */
+	lequal((int)skip_run_frame(&gb), 0);
+
+	/* The palette is used by every line. */
+	old = gb.hram_io[0x47];
+	__gb_write(&gb, 0xFF47, 0x00);		/* BGP */
+	lequal((int)skip_run_frame(&gb), LCD_HEIGHT);
+	lok(fnv1a_hash(p.fb, sizeof(p.fb)) != DMG_ACID2_HASH);
+	lequal((int)skip_run_frame(&gb), 0);
+	__gb_write(&gb, 0xFF47, old);
+	lequal((int)skip_run_frame(&gb), LCD_HEIGHT);
+	lok(fnv1a_hash(p.fb, sizeof(p.fb)) == DMG_ACID2_HASH);
+
+	/* Changing SCX part way through the frame redraws the lines from the
+	 * current line, until the test sets SCX again. The same lines are
+	 * drawn again on the next frame with the test's SCX. */
+	gb_run_cycles(&gb, LCD_FRAME_CYCLES / 2);
+	line = gb.hram_io[0x44];		/* LY */
+	skip_lines = 0;
+	__gb_write(&gb, 0xFF43, gb.hram_io[0x43] ^ 0x08);	/* SCX */
+	gb_run_frame(&gb);
+	lines = skip_lines;
+	lok(lines > 0 && lines < LCD_HEIGHT);
+	lequal((int)skip_first_line, (int)line);
+	lequal((int)skip_run_frame(&gb), (int)lines);
+	lok(fnv1a_hash(p.fb, sizeof(p.fb)) == DMG_ACID2_HASH);
+	lequal((int)skip_run_frame(&gb), 0);
+
+	/* Any change to VRAM redraws every line. */
+	old = gb.vram[0x10];
+	__gb_write(&gb, 0x8010, old ^ 0xFF);
+	lequal((int)skip_run_frame(&gb), LCD_HEIGHT);
+	lequal((int)skip_run_frame(&gb), 0);
+	__gb_write(&gb, 0x8010, old);
+	lequal((int)skip_run_frame(&gb), LCD_HEIGHT);
+	lok(fnv1a_hash(p.fb, sizeof(p.fb)) == DMG_ACID2_HASH);
+
+	/* Writing the value a register already holds changes nothing. */
+	__gb_write(&gb, 0xFF47, gb.hram_io[0x47]);
+	lequal((int)skip_run_frame(&gb), 0);
+}
+#endif
+
+#if PEANUT_GB_TILE_CACHE
+/* Invert the tiles at 0x8000 to 0x8FFF, which dmg-acid2 draws from. */
+static void invert_tiles(struct gb_s *gb)
+{
+	for(uint_fast16_t addr = 0x8000; addr < 0x9000; addr++)
+		__gb_write(gb, addr, gb->vram[addr - 0x8000] ^ 0xFF);
+}
+
+void test_tile_cache(void)
+{
+	static struct acid_priv before, after;
+	struct gb_s gb, ref;
+	struct acid_priv p = {0}, p_ref = {0};
+	unsigned int line;
+
+	lequal(gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p), GB_INIT_NO_ERROR);
+	lequal(gb_init(&ref, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p_ref), GB_INIT_NO_ERROR);
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+	gb_init_lcd(&ref, acid_lcd_draw_line);
+
+	for(unsigned int i = 0; i < 100; i++)
+	{
+		gb_run_frame(&gb);
+		gb_run_frame(&ref);
+	}
+	lok(fnv1a_hash(p.fb, sizeof(p.fb)) == DMG_ACID2_HASH);
+	before = p;
+
+	/* The frame drawn with the tiles changed before it starts. Every tile
+	 * of the reference is decoded again, so that it does not depend on
+	 * the tracking of VRAM writes. */
+	invert_tiles(&ref);
+	memset(ref.display.tile_dirty, true, sizeof(ref.display.tile_dirty));
+	gb_run_frame(&ref);
+	after = p_ref;
+	lok(memcmp(before.fb, after.fb, sizeof(before.fb)) != 0);
+
+	/* Tiles changed part way through a frame are decoded again for the
+	 * following lines. The line being drawn may use either. */
+	gb_run_cycles(&gb, LCD_FRAME_CYCLES / 2);
+	line = gb.hram_io[0x44];		/* LY */
+	invert_tiles(&gb);
+	gb_run_frame(&gb);
+
+	lok(line > 0 && line < LCD_HEIGHT - 1);
+	lok(memcmp(p.fb, before.fb, line * LCD_WIDTH) == 0);
+	lok(memcmp(p.fb[line + 1], after.fb[line + 1],
+			(LCD_HEIGHT - line - 1) * LCD_WIDTH) == 0);
+	lok(memcmp(p.fb[line + 1], before.fb[line + 1],
+			(LCD_HEIGHT - line - 1) * LCD_WIDTH) != 0);
+}
+#endif
+
+void test_dmg_acid2_framebuffer(void)
+{
+	struct gb_s gb;
+	struct acid_priv p = {0};
+	static uint32_t fb32[LCD_HEIGHT][LCD_WIDTH];
+	enum gb_init_error_e gb_err;
+	/* The shade of each pixel in the low byte, and the layer in the
+	 * second byte. */
+	const uint32_t palette[3][4] = {
+		{ 0x000, 0x001, 0x002, 0x003 },
+		{ 0x100, 0x101, 0x102, 0x103 },
+		{ 0x200, 0x201, 0x202, 0x203 }
+	};
+	unsigned int first_line;
+	bool match = true;
+
+	gb_err = gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+	                &gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+	        return;
+
+	/* Indexed pixels are the same as those given to lcd_draw_line. */
+	gb_init_lcd_framebuffer(&gb, p.fb, LCD_WIDTH,
+			GB_PIXEL_FORMAT_INDEXED8, NULL);
+
+	for(unsigned int i = 0; i < 100; i++)
+	        gb_run_frame(&gb);
+
+	lok(fnv1a_hash(&p.fb[0][0], LCD_WIDTH * LCD_HEIGHT) == DMG_ACID2_HASH);
+
+	/* Change the frame buffer in the middle of a frame. The lines that
+	 * follow are drawn from the same LCD state, including the window. */
+	gb_run_cycles(&gb, LCD_FRAME_CYCLES / 2);
+	first_line = gb.hram_io[0x44] + 1; /* LY */
+	gb_init_lcd_framebuffer(&gb, fb32, sizeof(fb32[0]),
+			GB_PIXEL_FORMAT_RGBA8888, palette);
+	gb_run_frame(&gb);
+
+	for(unsigned int y = first_line; y < LCD_HEIGHT; y++)
+	{
+		for(unsigned int x = 0; x < LCD_WIDTH; x++)
+		{
+			uint8_t px = p.fb[y][x];
+			if(fb32[y][x] != palette[(px >> 4) & 3][px & 3])
+				match = false;
+		}
+	}
+
+	lok(match);
+}
+
+#if PEANUT_GB_LCD_QUEUE
+/* Lines queued by test_lcd_queue are rendered by a worker thread. The queue
+ * has a single producer, the emulation thread, and a single consumer. */
+#define LCD_QUEUE_SIZE 16
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct gb_s *gb;
+	struct gb_lcd_line_s lines[LCD_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	unsigned int rendered;
+	bool quit;
+} lcd_queue;
+
+static void *lcd_queue_worker(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&lcd_queue.lock);
+
+	while(1)
+	{
+		struct gb_lcd_line_s line;
+
+		while(lcd_queue.tail == lcd_queue.head && !lcd_queue.quit)
+			pthread_cond_wait(&lcd_queue.cond, &lcd_queue.lock);
+
+		if(lcd_queue.tail == lcd_queue.head)
+			break;
+
+		line = lcd_queue.lines[lcd_queue.tail % LCD_QUEUE_SIZE];
+
+		/* Render without holding the lock, so that the emulation thread
+		 * may queue the next line. */
+		pthread_mutex_unlock(&lcd_queue.lock);
+		gb_render_line(lcd_queue.gb, &line);
+		pthread_mutex_lock(&lcd_queue.lock);
+
+		lcd_queue.tail++;
+		lcd_queue.rendered++;
+		pthread_cond_broadcast(&lcd_queue.cond);
+	}
+
+	pthread_mutex_unlock(&lcd_queue.lock);
+	return NULL;
+}
+
+static void queue_lcd_line(struct gb_s *gb, const struct gb_lcd_line_s *line)
+{
+	(void)gb;
+	pthread_mutex_lock(&lcd_queue.lock);
+
+	while(lcd_queue.head - lcd_queue.tail == LCD_QUEUE_SIZE)
+		pthread_cond_wait(&lcd_queue.cond, &lcd_queue.lock);
+
+	lcd_queue.lines[lcd_queue.head++ % LCD_QUEUE_SIZE] = *line;
+	pthread_cond_broadcast(&lcd_queue.cond);
+	pthread_mutex_unlock(&lcd_queue.lock);
+}
+
+/* Wait until the worker has rendered every queued line. */
+static void queue_lcd_sync(struct gb_s *gb)
+{
+	(void)gb;
+	pthread_mutex_lock(&lcd_queue.lock);
+
+	while(lcd_queue.tail != lcd_queue.head)
+		pthread_cond_wait(&lcd_queue.cond, &lcd_queue.lock);
+
+	pthread_mutex_unlock(&lcd_queue.lock);
+}
+
+void test_lcd_queue(void)
+{
+	struct gb_s gb;
+	struct acid_priv p = {0};
+	enum gb_init_error_e gb_err;
+	pthread_t worker;
+
+	gb_err = gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+	                &gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+	        return;
+
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+	gb_init_lcd_queue(&gb, queue_lcd_line, queue_lcd_sync);
+
+	pthread_mutex_init(&lcd_queue.lock, NULL);
+	pthread_cond_init(&lcd_queue.cond, NULL);
+	lcd_queue.gb = &gb;
+	lcd_queue.head = lcd_queue.tail = lcd_queue.rendered = 0;
+	lcd_queue.quit = false;
+	lok(pthread_create(&worker, NULL, lcd_queue_worker, NULL) == 0);
+
+	for(unsigned int i = 0; i < 100; i++)
+	{
+		gb_run_frame(&gb);
+		queue_lcd_sync(&gb);
+	}
+
+	pthread_mutex_lock(&lcd_queue.lock);
+	lcd_queue.quit = true;
+	pthread_cond_broadcast(&lcd_queue.cond);
+	pthread_mutex_unlock(&lcd_queue.lock);
+	pthread_join(worker, NULL);
+
+	pthread_cond_destroy(&lcd_queue.cond);
+	pthread_mutex_destroy(&lcd_queue.lock);
+
+	/* Every line of the last frames was drawn by the worker. */
+	lok(lcd_queue.rendered >= LCD_HEIGHT);
+	lok(fnv1a_hash(&p.fb[0][0], LCD_WIDTH * LCD_HEIGHT) == DMG_ACID2_HASH);
+}
+#endif
+
+static void movie_lcd_draw_line(struct gb_s *gb, const uint8_t *pixels,
+		const uint_fast8_t line)
+{
+	peanut_movie_hash_line(gb->direct.priv, pixels, line);
+}
+
+void test_movie(void)
+{
+	const char *file_name = "peanut_movie_test.pgbm";
+	struct peanut_movie_s movie;
+	struct gb_s gb;
+	int ret = 0;
+
+	lequal(gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &movie), GB_INIT_NO_ERROR);
+	gb_init_lcd(&gb, movie_lcd_draw_line);
+
+	peanut_movie_init(&movie, &gb, 10);
+	for(unsigned int i = 0; i < 125; i++)
+	{
+		gb.direct.joypad = 0xFF ^ (uint8_t)(1 << (i / 16 % 8));
+		ret |= peanut_movie_record_frame(&movie, &gb);
+	}
+	lequal(ret, 0);
+	lequal((int)movie.hash_count, 12);
+	/* The joypad changed every 16 frames. */
+	lequal((int)movie.runs_len, 8 * 3);
+	lequal(peanut_movie_save(&movie, file_name), 0);
+	peanut_movie_free(&movie);
+
+	/* Only the hashed frames are drawn during the replay. */
+	lequal(gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &movie), GB_INIT_NO_ERROR);
+	gb_init_lcd(&gb, movie_lcd_draw_line);
+	gb_set_render_policy(&gb, 0);
+	lequal(peanut_movie_load(&movie, &gb, file_name), 0);
+	while((ret = peanut_movie_play_frame(&movie, &gb)) == 0)
+		continue;
+	lequal(ret, 1);
+	lequal((int)movie.frame, 125);
+	lok(movie.mismatch_frame == UINT32_MAX);
+
+	/* A frame that differs from the recording is reported. */
+	movie.hashes[3] ^= 1;
+	movie.frame = 0;
+	movie.run = 0;
+	movie.run_frame = 0;
+	lequal(gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &movie), GB_INIT_NO_ERROR);
+	gb_init_lcd(&gb, movie_lcd_draw_line);
+	gb_set_render_policy(&gb, 0);
+	while((ret = peanut_movie_play_frame(&movie, &gb)) == 0)
+		continue;
+	lequal(ret, -1);
+	lequal((int)movie.mismatch_frame, 39);
+	peanut_movie_free(&movie);
+
+	remove(file_name);
+}
+
+#if PEANUT_GB_DECODE_CACHE
+static unsigned long decode_cache_rom_reads;
+
+static uint8_t gb_rom_read_count(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const uint8_t *rom = gb->direct.priv;
+	decode_cache_rom_reads++;
+	return rom[addr];
+}
+
+void test_decode_cache(void)
+{
+	/* Calls 0x4000 in bank 1, bank 2 and bank 1 again, then loops. */
+	static const uint8_t prog[] = {
+		0x3E, 0x01,		/* LD A, 0x01 */
+		0xEA, 0x00, 0x20,	/* LD (0x2000), A */
+		0xCD, 0x00, 0x40,	/* CALL 0x4000 */
+		0x3E, 0x02,		/* LD A, 0x02 */
+		0xEA, 0x00, 0x20,	/* LD (0x2000), A */
+		0xCD, 0x00, 0x40,	/* CALL 0x4000 */
+		0x3E, 0x01,		/* LD A, 0x01 */
+		0xEA, 0x00, 0x20,	/* LD (0x2000), A */
+		0xCD, 0x00, 0x40,	/* CALL 0x4000 */
+		0x3C,			/* INC A */
+		0x18, 0xFD		/* JR -3 */
+	};
+	static uint8_t rom[0x10000];
+	struct gb_s gb;
+	uint8_t x = 0;
+
+	memset(rom, 0, sizeof(rom));
+	memcpy(rom + 0x100, prog, sizeof(prog));
+	rom[0x4000] = 0x04;	/* Bank 1: INC B */
+	rom[0x4001] = 0xC9;	/* RET */
+	rom[0x8000] = 0x0C;	/* Bank 2: INC C */
+	rom[0x8001] = 0xC9;	/* RET */
+	rom[0x147] = 0x01;	/* MBC1 */
+	rom[0x148] = 0x01;	/* 64 KiB */
+	for(unsigned int i = 0x134; i <= 0x14C; i++)
+		x = x - rom[i] - 1;
+	rom[0x14D] = x;
+
+	lequal(gb_init(&gb, &gb_rom_read_count, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, rom), GB_INIT_NO_ERROR);
+	gb.cpu_reg.bc.reg = 0;
+	gb_run_frame(&gb);
+
+	/* Each bank ran its own code at the same address. */
+	lequal(gb.cpu_reg.bc.bytes.b, 2);
+	lequal(gb.cpu_reg.bc.bytes.c, 1);
+
+	/* The loop is fetched from the cache without any callbacks. */
+	decode_cache_rom_reads = 0;
+	gb_run_frame(&gb);
+	lequal((int)decode_cache_rom_reads, 0);
+}
+#endif
+
 int main(void)
 {
 	lrun("cpu_inst blarrg tests    ", test_cpu_inst);
+	lrun("cpu_inst direct ROM      ", test_cpu_inst_direct);
 	lrun("instr_timing blarrg tests", test_instr_timing);
+	lrun("gb_run_cycles/gb_run_until", test_run_cycles);
+	lrun("gb_get_frame_cycles     ", test_frame_cycles);
+#if PEANUT_GB_IDLE_SKIP
+	lrun("idle loop skipping      ", test_idle_skip);
+#endif
+#if PEANUT_GB_PROFILE
+	lrun("profiling counters      ", test_profile);
+#endif
+	lrun("save state round trip   ", test_state);
+	lrun("forked contexts         ", test_fork);
+	lrun("rewind ring buffer      ", test_rewind);
+	lrun("lockstep execution      ", test_lockstep);
+	lrun("link cable              ", test_link);
+	lrun("memory mapped ROM file  ", test_rom_file);
+	lrun("warm state cache        ", test_warm_state);
+#if PEANUT_GB_CART_RAM_DIRTY
+	lrun("battery save file       ", test_save_file);
+#endif
+	lrun("audio hooks             ", test_audio_hooks);
+	lrun("APU register read mask  ", test_apu_read_mask);
 	lrun("dmg-acid2 lcd test     ", test_dmg_acid2);
+	lrun("dmg-acid2 frame buffer ", test_dmg_acid2_framebuffer);
+#if PEANUT_GB_EXTERNAL_MEMORY
+	lrun("dmg-acid2 external memory", test_external_memory);
+#endif
+#if PEANUT_GB_OAM_DMA_TIMING
+	lrun("OAM DMA timing          ", test_oam_dma_timing);
+#endif
+	lrun("dmg-acid2 render policy", test_render_policy);
+#if PEANUT_GB_SKIP_UNCHANGED_LINES
+	lrun("dmg-acid2 unchanged lines", test_skip_unchanged_lines);
+#endif
+#if PEANUT_GB_TILE_CACHE
+	lrun("dmg-acid2 tile cache    ", test_tile_cache);
+#endif
+#if PEANUT_GB_LCD_QUEUE
+	lrun("dmg-acid2 queued lines ", test_lcd_queue);
+#endif
+	lrun("input movie replay     ", test_movie);
+#if PEANUT_GB_DECODE_CACHE
+	lrun("decode cache           ", test_decode_cache);
+#endif
 	return lfails != 0;
 }